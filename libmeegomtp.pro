@@ -7,6 +7,10 @@ test.subdir = test
 test.target = sub-test
 test.depends = sub-mts
 
+test_initiator.file = test/initiator.pro
+test_initiator.target = sub-test-initiator
+test_initiator.depends = sub-mts
+
 mtpserver.subdir = mtpserver
 mtpserver.target = sub-mtpserver
 mtpserver.depends = sub-mts
@@ -30,6 +34,10 @@ mts_protocol_tests.subdir = mts/protocol/unittests
 mts_protocol_tests.target = sub-mts-protocol-tests
 mts_protocol_tests.depends = sub-mts
 
+mts_transport_usb_tests.subdir = mts/transport/usb/unittests
+mts_transport_usb_tests.target = sub-mts-transport-usb-tests
+mts_transport_usb_tests.depends = sub-mts
+
 service.subdir = service
 service.target = sub-service
 service.depends = sub-mts
@@ -40,12 +48,14 @@ systemd.target = sub-systemd
 SUBDIRS += \
     mts \
     test \
+    test_initiator \
     mtpserver \
     mts_storage_tests \
     mts_fsstorage_plugin \
     mts_fsstorage_tests \
     mts_deviceinfo_tests \
     mts_protocol_tests \
+    mts_transport_usb_tests \
     service \
     systemd
 
@@ -0,0 +1,256 @@
+#include "mtpstats.h"
+#include "mtptypes.h"
+#include "trace.h"
+
+#include <QCoreApplication>
+#include <QSaveFile>
+#include <QSocketNotifier>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+// Operation codes are 0x10xx (PTP), 0x98xx (MTP) or vendor specific;
+// each range gets a table, the vendor specific ones share a slot
+static const int OP_SLOTS = 2 * 256 + 1;
+// Latency buckets: below 128us, 256us, ... the last one is open ended
+static const int LATENCY_BUCKETS = 16;
+static const qint64 FIRST_BUCKET_US = 128;
+
+namespace {
+struct OpStats
+{
+    quint64 count;
+    quint64 errors;      // responses other than OK
+    quint64 totalUs;
+    quint64 maxUs;
+    quint64 bytes;       // data phase
+    quint64 dataUs;      // from the first data moved to the response
+    quint32 latency[LATENCY_BUCKETS];
+};
+
+struct Transaction
+{
+    bool active;
+    quint16 opCode;
+    qint64 start;
+    qint64 dataStart;
+    quint64 bytes;
+};
+}
+
+bool MTPStats::s_enabled = false;
+QAtomicInteger<qint64> MTPStats::s_counters[MTPStats::COUNTER_COUNT];
+
+static OpStats s_ops[OP_SLOTS];
+static Transaction s_current;
+static qint64 s_startTime;
+static QByteArray s_fileName;
+static int s_signalPipe[2] = { -1, -1 };
+
+static const char *const counterNames[MTPStats::COUNTER_COUNT] = {
+    "reader_buffer_full",
+    "reader_retries",
+    "writer_retries",
+    "writer_backoffs",
+    "interrupt_waits",
+    "interrupt_wait_us",
+    "event_timeouts",
+    "events_coalesced",
+    "event_refreshes"
+};
+
+static int opSlot(quint16 opCode)
+{
+    switch( opCode & 0xff00 )
+    {
+    case 0x1000:
+        return opCode & 0xff;
+    case 0x9800:
+        return 256 + (opCode & 0xff);
+    default:
+        return OP_SLOTS - 1;
+    }
+}
+
+static quint16 slotOpCode(int slot)
+{
+    return slot < 256 ? 0x1000 + slot : 0x9800 + (slot - 256);
+}
+
+static void dumpSignalHandler(int /*signum*/)
+{
+    char c = 0;
+    // If the pipe is full, a dump is pending anyway
+    ssize_t rc = write(s_signalPipe[1], &c, 1);
+    Q_UNUSED(rc);
+}
+
+MTPStats::MTPStats(QObject *parent) : QObject(parent)
+{
+    QSocketNotifier *notifier = new QSocketNotifier(s_signalPipe[0], QSocketNotifier::Read, this);
+    connect(notifier, SIGNAL(activated(int)), this, SLOT(dumpRequested(int)));
+}
+
+void MTPStats::dumpRequested(int fd)
+{
+    char buffer[16];
+    while( read(fd, buffer, sizeof buffer) > 0 )
+    {
+    }
+    writeSnapshot();
+}
+
+void MTPStats::init()
+{
+    s_fileName = qgetenv("MTP_STATS_FILE");
+    if( s_enabled || s_fileName.isEmpty() )
+    {
+        return;
+    }
+
+    s_startTime = now();
+    s_enabled = true;
+    MTP_LOG_INFO("collecting statistics into" << s_fileName);
+
+    // The snapshot is written in the main thread, the signal handler
+    // only wakes it up
+    if( -1 == pipe2(s_signalPipe, O_CLOEXEC | O_NONBLOCK) )
+    {
+        MTP_LOG_WARNING("Could not create pipe for SIGUSR2");
+        return;
+    }
+    new MTPStats(QCoreApplication::instance());
+
+    struct sigaction action;
+    action.sa_handler = dumpSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if( sigaction(SIGUSR2, &action, NULL) < 0 )
+    {
+        MTP_LOG_WARNING("Could not establish SIGUSR2 signal handler");
+    }
+}
+
+qint64 MTPStats::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void MTPStats::begin(quint16 opCode)
+{
+    s_current.active = true;
+    s_current.opCode = opCode;
+    s_current.start = now();
+    s_current.dataStart = 0;
+    s_current.bytes = 0;
+}
+
+void MTPStats::moved(quint64 bytes)
+{
+    if( !s_current.active )
+    {
+        return;
+    }
+    if( 0 == s_current.bytes )
+    {
+        s_current.dataStart = now();
+    }
+    s_current.bytes += bytes;
+}
+
+void MTPStats::end(quint16 respCode)
+{
+    if( !s_current.active )
+    {
+        return;
+    }
+    s_current.active = false;
+
+    qint64 finished = now();
+    quint64 elapsed = finished - s_current.start;
+    OpStats &op = s_ops[opSlot(s_current.opCode)];
+
+    op.count++;
+    if( MTP_RESP_OK != respCode )
+    {
+        op.errors++;
+    }
+    op.totalUs += elapsed;
+    op.maxUs = qMax(op.maxUs, elapsed);
+    if( s_current.bytes )
+    {
+        op.bytes += s_current.bytes;
+        op.dataUs += finished - s_current.dataStart;
+    }
+
+    int bucket = 0;
+    while( bucket < LATENCY_BUCKETS - 1 && elapsed >= quint64(FIRST_BUCKET_US << bucket) )
+    {
+        bucket++;
+    }
+    op.latency[bucket]++;
+}
+
+QByteArray MTPStats::snapshot()
+{
+    QByteArray text;
+
+    text += "uptime_s " + QByteArray::number((now() - s_startTime) / 1000000) + '\n';
+    for( int i = 0; i < COUNTER_COUNT; i++ )
+    {
+        text += QByteArray(counterNames[i]) + ' ' +
+                QByteArray::number(s_counters[i].load()) + '\n';
+    }
+
+    // op <code> count <n> errors <n> avg_us <n> max_us <n> bytes <n> mb_s <x> latency_us <bound>:<n> ...
+    for( int slot = 0; slot < OP_SLOTS; slot++ )
+    {
+        const OpStats &op = s_ops[slot];
+        if( 0 == op.count )
+        {
+            continue;
+        }
+        text += "op " + (slot == OP_SLOTS - 1 ? QByteArray("other") :
+                         "0x" + QByteArray::number(slotOpCode(slot), 16));
+        text += " count " + QByteArray::number(op.count);
+        text += " errors " + QByteArray::number(op.errors);
+        text += " avg_us " + QByteArray::number(op.totalUs / op.count);
+        text += " max_us " + QByteArray::number(op.maxUs);
+        text += " bytes " + QByteArray::number(op.bytes);
+        text += " mb_s " + QByteArray::number(op.dataUs ? op.bytes / (op.dataUs / 1e6) / (1 << 20) : 0.0, 'f', 1);
+        text += " latency_us";
+        for( int i = 0; i < LATENCY_BUCKETS; i++ )
+        {
+            if( op.latency[i] )
+            {
+                text += ' ';
+                text += i < LATENCY_BUCKETS - 1 ? "<" + QByteArray::number(FIRST_BUCKET_US << i) : QByteArray("more");
+                text += ':' + QByteArray::number(op.latency[i]);
+            }
+        }
+        text += '\n';
+    }
+    return text;
+}
+
+bool MTPStats::writeSnapshot()
+{
+    if( !s_enabled )
+    {
+        return false;
+    }
+
+    // Readers never see a partially written file
+    QSaveFile file(QString::fromLocal8Bit(s_fileName));
+    if( !file.open(QIODevice::WriteOnly) || -1 == file.write(snapshot()) || !file.commit() )
+    {
+        MTP_LOG_WARNING("Could not write statistics to" << s_fileName);
+        return false;
+    }
+    return true;
+}
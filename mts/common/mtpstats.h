@@ -0,0 +1,102 @@
+#ifndef MTPSTATS_H
+#define MTPSTATS_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QByteArray>
+
+namespace meegomtp1dot0
+{
+/// \brief MTPStats collects per operation timings and transport stall counts.
+///
+/// Collecting is enabled by setting MTP_STATS_FILE to the file the snapshots are written to, for
+/// example /run/mtp/stats. A snapshot is written there when the process receives SIGUSR2 and when the
+/// session ends with a reset or the loss of the transport. While disabled, each of the recording functions only tests a flag.
+///
+/// The transaction functions are called by the responder in the main thread; the counters can be
+/// updated from any thread.
+class MTPStats : public QObject
+{
+    Q_OBJECT
+public:
+    enum Counter {
+        READER_BUFFER_FULL,     ///< The bulk reader waited for the main thread to release data
+        READER_RETRIES,         ///< Bulk reads retried after EAGAIN or ESHUTDOWN
+        WRITER_RETRIES,         ///< Bulk writes retried after EAGAIN
+        WRITER_BACKOFFS,        ///< Bulk write size halved after EIO
+        INTERRUPT_WAITS,        ///< Bulk writes that waited for the interrupt writer
+        INTERRUPT_WAIT_USECS,   ///< Time spent in those waits
+        EVENT_TIMEOUTS,         ///< Event writes interrupted after a timeout
+        EVENTS_COALESCED,       ///< Events dropped because a queued event covers them
+        EVENT_REFRESHES,        ///< Full event queues replaced by UnreportedStatus
+        COUNTER_COUNT
+    };
+
+    /// Enables collecting if MTP_STATS_FILE is set, and dumps the statistics on SIGUSR2.
+    /// Called once the application object exists.
+    static void init();
+
+    static bool enabled() { return s_enabled; }
+
+    static void count(Counter counter, qint64 amount = 1)
+    {
+        if( s_enabled )
+        {
+            s_counters[counter].fetchAndAddRelaxed(amount);
+        }
+    }
+
+    /// Starts timing an operation, when its request has been received.
+    static void beginTransaction(quint16 opCode)
+    {
+        if( s_enabled )
+        {
+            begin(opCode);
+        }
+    }
+
+    /// Accounts the payload bytes sent or received in the data phase of the current operation.
+    static void dataMoved(quint64 bytes)
+    {
+        if( s_enabled )
+        {
+            moved(bytes);
+        }
+    }
+
+    /// Ends the current operation, when its response is sent.
+    static void endTransaction(quint16 respCode)
+    {
+        if( s_enabled )
+        {
+            end(respCode);
+        }
+    }
+
+    /// Returns the statistics collected so far as text, one line per item.
+    static QByteArray snapshot();
+
+    /// Writes a snapshot to the stats file.
+    /// \return false if collecting is disabled or the file could not be written.
+    static bool writeSnapshot();
+
+    /// Returns the current time in microseconds, from a monotonic clock.
+    static qint64 now();
+
+private Q_SLOTS:
+    /// Writes a snapshot after SIGUSR2
+    void dumpRequested(int fd);
+
+private:
+    explicit MTPStats(QObject *parent);
+
+    static void begin(quint16 opCode);
+    static void moved(quint64 bytes);
+    static void end(quint16 respCode);
+
+    static bool s_enabled;
+    static QAtomicInteger<qint64> s_counters[COUNTER_COUNT];
+};
+}
+
+#endif
@@ -49,7 +49,9 @@ enum TransportType
 {
     INVALID = 0,
     USB = 1,
-    DUMMY = 2
+    DUMMY = 2,
+    USB_AIO = 3,
+    LOOPBACK = 4
 };
 
 typedef quint32 ObjHandle;
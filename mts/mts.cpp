@@ -31,6 +31,7 @@
 
 #include "mts.h"
 #include "mtpresponder.h"
+#include "mtptransporterloopback.h"
 
 using namespace meegomtp1dot0;
 
@@ -54,7 +55,14 @@ bool Mts::activate()
 {
     bool ok;
     m_MTPResponder = MTPResponder::instance();
-    ok = m_MTPResponder->initTransport(USB);
+    // Setting MTP_USB_AIO=1 in the environment serves the bulk endpoints
+    // with kernel AIO instead of blocking I/O threads
+    TransportType transport = qgetenv("MTP_USB_AIO").toInt() ? USB_AIO : USB;
+    // An initiator running the device without USB hardware passes the
+    // sockets standing in for the endpoints in MTP_LOOPBACK_FDS
+    if (MTPTransporterLoopback::configured())
+        transport = LOOPBACK;
+    ok = m_MTPResponder->initTransport(transport);
     if (ok)
         ok = m_MTPResponder->initStorages();
     return ok;
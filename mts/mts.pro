@@ -17,6 +17,7 @@ DEPENDPATH += . \
               transport \
               transport/usb \
               transport/dummy \
+              transport/loopback \
               platform/storage \
               platform/deviceinfo
 
@@ -29,6 +30,7 @@ INCLUDEPATH += . \
                platform/deviceinfo \
                transport \
                transport/dummy \
+               transport/loopback \
                transport/usb \
                ../include
 
@@ -40,6 +42,8 @@ HEADERS += mts.h \
            protocol/mtpresponder.h \
            protocol/propertypod.h \
            protocol/objectpropertycache.h \
+           protocol/objectprefetcher.h \
+           common/mtpstats.h \
            protocol/mtpextensionmanager.h \
            protocol/mtpcontainer.h \
            protocol/mtpcontainerwrapper.h \
@@ -52,7 +56,9 @@ HEADERS += mts.h \
            transport/mtptransporter.h \
            transport/usb/mtptransporterusb.h \
            transport/usb/threadio.h \
+           transport/usb/aiothreadio.h \
            transport/dummy/mtptransporterdummy.h \
+           transport/loopback/mtptransporterloopback.h \
            platform/storage/storagefactory.h \
            platform/storage/storageplugin.h
 
@@ -60,6 +66,8 @@ SOURCES += mts.cpp \
            protocol/mtpresponder.cpp \
            protocol/propertypod.cpp \
            protocol/objectpropertycache.cpp \
+           protocol/objectprefetcher.cpp \
+           common/mtpstats.cpp \
            protocol/mtpextensionmanager.cpp \
            protocol/mtpcontainer.cpp \
            protocol/mtpcontainerwrapper.cpp \
@@ -67,13 +75,15 @@ SOURCES += mts.cpp \
            protocol/mtptxcontainer.cpp \
            transport/usb/mtptransporterusb.cpp \
            transport/dummy/mtptransporterdummy.cpp \
+           transport/loopback/mtptransporterloopback.cpp \
            platform/deviceinfo/deviceinfo.cpp \
            platform/deviceinfo/deviceinfoprovider.cpp \
            platform/deviceinfo/xmlhandler.cpp \
            platform/storage/storagefactory.cpp \
            platform/storage/storageplugin.cpp \
            transport/usb/descriptor.c \
-           transport/usb/threadio.cpp
+           transport/usb/threadio.cpp \
+           transport/usb/aiothreadio.cpp
 
 target.path = /usr/lib/
 INSTALLS += target
@@ -238,7 +238,8 @@ quint16 DeviceInfo::m_eventsSupportedTable[] = {
     MTP_EV_ObjectInfoChanged,
     MTP_EV_DeviceInfoChanged,
     MTP_EV_DevicePropChanged,
-    MTP_EV_ObjectPropChanged
+    MTP_EV_ObjectPropChanged,
+    MTP_EV_UnreportedStatus
 };
 
 quint16 DeviceInfo::m_devPropsSupportedTable[] = {
@@ -30,17 +30,46 @@
 */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/fanotify.h>
 #include "fsinotify.h"
+#include "trace.h"
 #include <QSocketNotifier>
+#include <QMutexLocker>
 
 using namespace meegomtp1dot0;
 
+#ifdef FAN_REPORT_DFID_NAME
+/* fanotify reports changes with the inotify bit values */
+static const uint32_t FANOTIFY_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE;
+
+static QByteArray handleKey(const struct file_handle *handle)
+{
+    QByteArray key(reinterpret_cast<const char*>(&handle->handle_type), sizeof handle->handle_type);
+    key.append(reinterpret_cast<const char*>(handle->f_handle), handle->handle_bytes);
+    return key;
+}
+#endif
+
 /**************************************************
  * FSInotify::FSInotify
  *************************************************/
-FSInotify::FSInotify( uint32_t mask) : m_mask(mask)
+FSInotify::FSInotify( uint32_t mask, const QString &filesystemRoot ) : m_mask(mask), m_readSocket(0),
+    m_fanotifyFd(-1), m_mountFd(-1), m_nextWatch(1), m_cookie(0)
 {
-    m_readSocket = new QSocketNotifier( inotify_init(), QSocketNotifier::Read );
+    if( !filesystemRoot.isEmpty() && watchFilesystem( filesystemRoot ) )
+    {
+        m_readSocket = new QSocketNotifier( m_fanotifyFd, QSocketNotifier::Read );
+        QObject::connect( m_readSocket, SIGNAL(activated(int)), this, SLOT(fanotifyEventSlot(int)) );
+        return;
+    }
+
+    m_readSocket = new QSocketNotifier( inotify_init1( IN_NONBLOCK ), QSocketNotifier::Read );
     if( m_readSocket )
     {
         QObject::connect( m_readSocket, SIGNAL(activated(int)), this, SLOT(inotifyEventSlot(int)) );
@@ -54,10 +83,68 @@ FSInotify::~FSInotify()
 {
     if( m_readSocket )
     {
+        int fd = m_readSocket->socket();
         delete m_readSocket;
+        close( fd );
+    }
+    if( -1 != m_mountFd )
+    {
+        close( m_mountFd );
     }
 }
 
+/**************************************************
+ * bool FSInotify::watchFilesystem
+ *************************************************/
+bool FSInotify::watchFilesystem( const QString &root )
+{
+#ifdef FAN_REPORT_DFID_NAME
+    // Events name the directory by file handle, see addWatch()
+    QByteArray path = root.toUtf8();
+    struct statfs st;
+    if( -1 == statfs( path.constData(), &st ) )
+    {
+        return false;
+    }
+    int fd = fanotify_init( FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+                            O_RDONLY | O_CLOEXEC );
+    if( -1 == fd )
+    {
+        MTP_LOG_INFO("fanotify not available, using inotify:" << strerror(errno));
+        return false;
+    }
+    uint32_t mask = ( m_mask & FANOTIFY_EVENTS ) | FAN_ONDIR;
+    int marked = -1;
+#ifdef FAN_RENAME
+    if( mask & IN_MOVE )
+    {
+        // Both halves of a move in one event, where the kernel has it
+        marked = fanotify_mark( fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, ( mask & ~IN_MOVE ) | FAN_RENAME,
+                                AT_FDCWD, path.constData() );
+    }
+#endif
+    if( -1 == marked )
+    {
+        marked = fanotify_mark( fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, path.constData() );
+    }
+    if( -1 == marked )
+    {
+        // Marking a filesystem takes CAP_SYS_ADMIN
+        MTP_LOG_INFO("Could not watch the filesystem of" << root << ", using inotify:" << strerror(errno));
+        close( fd );
+        return false;
+    }
+    m_fanotifyFd = fd;
+    m_mountFd = open( path.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    m_fsid = QByteArray( reinterpret_cast<const char*>( &st.f_fsid ), sizeof st.f_fsid );
+    MTP_LOG_INFO("Watching the filesystem of" << root << "with fanotify");
+    return true;
+#else
+    Q_UNUSED(root);
+    return false;
+#endif
+}
+
 /**************************************************
  * int FSInotify::addWatch
  *************************************************/
@@ -68,6 +155,35 @@ int FSInotify::addWatch( const QString& pathName ) const
         return -1;
     }
     QByteArray ba = pathName.toUtf8();
+#ifdef FAN_REPORT_DFID_NAME
+    if( -1 != m_fanotifyFd )
+    {
+        // The filesystem is watched already, just remember the directory
+        union
+        {
+            struct file_handle handle;
+            char buffer[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+        } fh;
+        int mountId;
+        fh.handle.handle_bytes = MAX_HANDLE_SZ;
+        if( -1 == name_to_handle_at( AT_FDCWD, ba.constData(), &fh.handle, &mountId, 0 ) )
+        {
+            return -1;
+        }
+        QByteArray key = handleKey( &fh.handle );
+
+        // Like inotify, the same directory gets the same watch
+        QMutexLocker locker( &m_lock );
+        int wd = m_watchesByHandle.value( key, -1 );
+        if( -1 == wd )
+        {
+            wd = m_nextWatch++;
+            m_watchesByHandle.insert( key, wd );
+            m_watches.insert( wd, key );
+        }
+        return wd;
+    }
+#endif
     return inotify_add_watch( m_readSocket->socket(), ba.constData(), m_mask );
 }
 
@@ -80,6 +196,18 @@ int FSInotify::removeWatch( const int& wd ) const
     {
         return -1;
     }
+    if( -1 != m_fanotifyFd )
+    {
+        QMutexLocker locker( &m_lock );
+        QHash<int, QByteArray>::iterator i = m_watches.find( wd );
+        if( i == m_watches.end() )
+        {
+            return -1;
+        }
+        m_watchesByHandle.remove( i.value() );
+        m_watches.erase( i );
+        return 0;
+    }
     return inotify_rm_watch( m_readSocket->socket(), wd );
 }
 
@@ -88,22 +216,238 @@ int FSInotify::removeWatch( const int& wd ) const
  *************************************************/
 void FSInotify::inotifyEventSlot(int)
 {
-    char tmp[512], *ptr;
+    char tmp[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char *ptr;
     int bytes_read = -1;
 
-    bytes_read = read( m_readSocket->socket(), tmp, sizeof(tmp) );
+    // Drain the queue, a burst of changes is handled as one batch
+    while( ( bytes_read = read( m_readSocket->socket(), tmp, sizeof(tmp) ) ) > 0 )
+    {
+        ptr = tmp;
+        while (ptr < tmp + bytes_read) {
+            struct inotify_event *event = (struct inotify_event *) ptr;
+            emit inotifyEventSignal( event );
+            ptr += sizeof *event + event->len;
+        }
+    }
+    emit inotifyEventsReadSignal();
+}
 
-    if(-1 == bytes_read)
+/**************************************************
+ * void FSInotify::fanotifyEventSlot
+ *************************************************/
+void FSInotify::fanotifyEventSlot(int)
+{
+#ifdef FAN_REPORT_DFID_NAME
+    // A file handle and a name for each event, two for a FAN_RENAME
+    char buffer[16 * 1024] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    ssize_t len;
+    while( ( len = read( m_fanotifyFd, buffer, sizeof buffer ) ) > 0 )
     {
-       return;
+        // An IN_MOVED_FROM waiting for the IN_MOVED_TO right after it
+        struct file_handle *fromHandle = 0;
+        const char *fromName = 0;
+        uint32_t fromMask = 0;
+
+        for( struct fanotify_event_metadata *metadata = (struct fanotify_event_metadata *)buffer;
+             FAN_EVENT_OK( metadata, len ); metadata = FAN_EVENT_NEXT( metadata, len ) )
+        {
+            if( metadata->fd >= 0 )
+            {
+                close( metadata->fd );
+            }
+            if( metadata->mask & FAN_Q_OVERFLOW )
+            {
+                MTP_LOG_WARNING("fanotify queue overflow, changes were missed");
+                continue;
+            }
+
+            struct file_handle *handle = 0;
+            const char *name = 0;
+#ifdef FAN_RENAME
+            struct file_handle *toHandle = 0;
+            const char *toName = 0;
+#endif
+            char *info = (char *)metadata + metadata->metadata_len;
+            char *end = (char *)metadata + metadata->event_len;
+            while( info + sizeof(struct fanotify_event_info_fid) <= end )
+            {
+                struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)info;
+                if( fid->hdr.len < sizeof *fid || info + fid->hdr.len > end )
+                {
+                    break;
+                }
+                info += fid->hdr.len;
+                if( memcmp( &fid->fsid, m_fsid.constData(), m_fsid.size() ) )
+                {
+                    continue;
+                }
+                struct file_handle *fidHandle = (struct file_handle *)fid->handle;
+                const char *fidName = (const char *)fidHandle->f_handle + fidHandle->handle_bytes;
+                if( FAN_EVENT_INFO_TYPE_DFID_NAME == fid->hdr.info_type )
+                {
+                    handle = fidHandle;
+                    name = fidName;
+                }
+#ifdef FAN_RENAME
+                else if( FAN_EVENT_INFO_TYPE_OLD_DFID_NAME == fid->hdr.info_type )
+                {
+                    handle = fidHandle;
+                    name = fidName;
+                }
+                else if( FAN_EVENT_INFO_TYPE_NEW_DFID_NAME == fid->hdr.info_type )
+                {
+                    toHandle = fidHandle;
+                    toName = fidName;
+                }
+#endif
+            }
+
+            uint32_t mask = metadata->mask;
+            uint32_t events = mask & FANOTIFY_EVENTS;
+            if( fromHandle && IN_MOVED_TO == events && handle )
+            {
+                // The other half of the move
+                deliverFanotifyMove( fromMask, fromHandle, fromName, mask, handle, name );
+                fromHandle = 0;
+                continue;
+            }
+            if( fromHandle )
+            {
+                deliverFanotifyEvent( fromMask, fromHandle, fromName );
+                fromHandle = 0;
+            }
+#ifdef FAN_RENAME
+            if( mask & FAN_RENAME )
+            {
+                // Both names in one event, never merged with others
+                uint32_t isDir = mask & FAN_ONDIR;
+                deliverFanotifyMove( IN_MOVED_FROM | isDir, handle, name, IN_MOVED_TO | isDir, toHandle, toName );
+                continue;
+            }
+#endif
+            if( !handle )
+            {
+                continue;
+            }
+            if( IN_MOVED_FROM == events )
+            {
+                fromHandle = handle;
+                fromName = name;
+                fromMask = mask;
+                continue;
+            }
+            // Events on the same name are merged while queued, so a move
+            // merged with other events can't be told apart from them
+            deliverFanotifyEvent( mask, handle, name );
+        }
+        if( fromHandle )
+        {
+            deliverFanotifyEvent( fromMask, fromHandle, fromName );
+        }
+    }
+    emit inotifyEventsReadSignal();
+#endif
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+/**************************************************
+ * int FSInotify::fanotifyWatch
+ *************************************************/
+int FSInotify::fanotifyWatch( struct file_handle *handle ) const
+{
+    if( !handle )
+    {
+        return -1;
     }
+    QMutexLocker locker( &m_lock );
+    return m_watchesByHandle.value( handleKey( handle ), -1 );
+}
 
-    ptr = tmp;
-    while (ptr < tmp + bytes_read) {
-        struct inotify_event *event = (struct inotify_event *) ptr;
-        // FIXME: would it be better to pass all events or one at a time?
-        emit inotifyEventSignal( event );
-        ptr += sizeof *event + event->len;
+/**************************************************
+ * void FSInotify::deliverFanotifyMove
+ *************************************************/
+void FSInotify::deliverFanotifyMove( uint32_t fromMask, struct file_handle *fromHandle, const char *fromName,
+                                     uint32_t toMask, struct file_handle *toHandle, const char *toName )
+{
+    if( -1 == fanotifyWatch( fromHandle ) || -1 == fanotifyWatch( toHandle ) )
+    {
+        // Into or out of the storage
+        deliverFanotifyEvent( fromMask, fromHandle, fromName );
+        deliverFanotifyEvent( toMask, toHandle, toName );
+        return;
     }
+
+    // fanotify has no cookies, make one up for the pair; 0 is no move
+    if( !++m_cookie )
+    {
+        ++m_cookie;
+    }
+    deliverFanotifyEvent( fromMask, fromHandle, fromName, m_cookie );
+    deliverFanotifyEvent( toMask, toHandle, toName, m_cookie );
 }
 
+/**************************************************
+ * void FSInotify::deliverFanotifyEvent
+ *************************************************/
+void FSInotify::deliverFanotifyEvent( uint32_t mask, struct file_handle *handle, const char *name, uint32_t cookie )
+{
+    // Most events on the filesystem are outside of the storage
+    int wd = fanotifyWatch( handle );
+    if( -1 == wd )
+    {
+        return;
+    }
+
+    union
+    {
+        struct inotify_event event;
+        char buffer[sizeof(struct inotify_event) + NAME_MAX + 1];
+    } e;
+    size_t nameLen = strnlen( name, NAME_MAX );
+    memset( &e.event, 0, sizeof e.event );
+    memcpy( e.event.name, name, nameLen );
+    e.event.name[nameLen] = 0;
+    e.event.wd = wd;
+    e.event.len = nameLen + 1;
+    e.event.cookie = cookie;
+
+    // Without a pair the halves of a move are a delete and a create
+    if( !cookie && ( mask & IN_MOVED_FROM ) )
+    {
+        mask = ( mask & ~IN_MOVED_FROM ) | IN_DELETE;
+    }
+    if( !cookie && ( mask & IN_MOVED_TO ) )
+    {
+        mask = ( mask & ~IN_MOVED_TO ) | IN_CREATE;
+    }
+
+    uint32_t isDir = ( mask & FAN_ONDIR ) ? IN_ISDIR : 0;
+    mask &= m_mask;
+
+    // Events on the same name are merged while queued, but like inotify
+    // each event delivered carries one change. A delete merged with other
+    // changes came first if the name exists now, otherwise last.
+    bool deleteFirst = false;
+    if( ( mask & IN_DELETE ) && ( mask & ~IN_DELETE ) )
+    {
+        struct stat st;
+        int dirFd = open_by_handle_at( m_mountFd, handle, O_PATH | O_CLOEXEC );
+        deleteFirst = -1 != dirFd && 0 == fstatat( dirFd, name, &st, AT_SYMLINK_NOFOLLOW );
+        if( -1 != dirFd )
+        {
+            close( dirFd );
+        }
+    }
+    static const uint32_t order[] = { IN_DELETE, IN_MOVED_FROM, IN_CREATE, IN_MOVED_TO, IN_CLOSE_WRITE, IN_DELETE };
+    for( size_t i = 0; i < sizeof order / sizeof order[0]; ++i )
+    {
+        if( ( mask & order[i] ) && ( i > 0 || deleteFirst ) )
+        {
+            e.event.mask = order[i] | isDir;
+            emit inotifyEventSignal( &e.event );
+            mask &= ~order[i];
+        }
+    }
+}
+#endif
@@ -33,13 +33,27 @@
 #define FSINOTIFY_H
 
 #include <QObject>
+#include <QHash>
+#include <QMutex>
 #include "sys/inotify.h"
 class QSocketNotifier;
+struct file_handle;
 
 /// FSInotify is a wrapper class for the inotify library.
 
 /// FSInotify notifies the filesystem storage plug-in about changes in the file system
 /// so that the storage can take appropriate action.
+///
+/// Given a filesystem root, it watches the whole filesystem with a single fanotify mark instead,
+/// where the kernel supports reporting the directory and name of an event and the process may
+/// mark a filesystem. addWatch() then only registers a directory by its file handle, so that its
+/// events are reported with the watch descriptor it returned; the watch stays valid when the
+/// directory is moved. The events are delivered as inotify events either way. Otherwise there is
+/// an inotify watch per directory, as before.
+///
+/// fanotify merges the events queued on a name, so a move is only reported as one if it can be
+/// told apart: as a FAN_RENAME event, or as lone halves read right after each other. Otherwise
+/// its halves are reported as a delete and a create.
 namespace meegomtp1dot0
 {
 class FSInotify : public QObject
@@ -49,12 +63,14 @@ class FSInotify : public QObject
 public:
     /// Constructor.
     /// \param mask [in] indicates what to watch for.
-    FSInotify( uint32_t theMask = IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE );
+    /// \param filesystemRoot [in] a directory on the filesystem to watch with fanotify, if any.
+    FSInotify( uint32_t theMask = IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE,
+               const QString &filesystemRoot = QString() );
 
     /// Desctructor.
     ~FSInotify();
 
-    /// Adds a new watch to the file whose pathname is provided.
+    /// Adds a new watch to the file whose pathname is provided. Can be called from any thread.
     /// \param pathName [in] the file's pathname.
     /// \return watch descriptor on success, -1 on failure.
     int addWatch( const QString &pathName ) const;
@@ -64,18 +80,43 @@ public:
     /// \return 0 on success -1 on failure.
     int removeWatch( const int &wd ) const;
 
+    /// \return true if the filesystem is watched with fanotify.
+    bool isFilesystemWatch() const { return -1 != m_fanotifyFd; }
+
 public slots:
     /// This slot is for reading the inotify event, when one is generated.
     void inotifyEventSlot(int);
 
+    /// This slot reads fanotify events and delivers them as inotify events.
+    void fanotifyEventSlot(int);
+
 signals:
     /// This signal is emitted corresponding to an inotify event.
-    /// \param event [in] the structure holding inotify event details.
+    /// \param event [in] the structure holding inotify event details. Its mask has a single
+    ///                   event bit, plus IN_ISDIR for a directory.
     void inotifyEventSignal( struct inotify_event *event );
 
+    /// This signal is emitted after the events that were queued have been read and signalled,
+    /// so that they can be handled as a batch.
+    void inotifyEventsReadSignal();
+
 private:
+    bool watchFilesystem( const QString &root );
+    int fanotifyWatch( struct file_handle *handle ) const;
+    void deliverFanotifyMove( uint32_t fromMask, struct file_handle *fromHandle, const char *fromName,
+                              uint32_t toMask, struct file_handle *toHandle, const char *toName );
+    void deliverFanotifyEvent( uint32_t mask, struct file_handle *handle, const char *name, uint32_t cookie = 0 );
+
     uint32_t m_mask; ///< indicates what to watch for on a file.
     QSocketNotifier *m_readSocket; ///< inotify events will be written to this socket.
+    int m_fanotifyFd; ///< the fanotify group, -1 if using inotify
+    int m_mountFd; ///< the filesystem watched with fanotify, to open directories by handle
+    QByteArray m_fsid; ///< the filesystem watched with fanotify
+    mutable QMutex m_lock; ///< Protects the watches
+    mutable QHash<QByteArray, int> m_watchesByHandle; ///< the file handles of the directories added
+    mutable QHash<int, QByteArray> m_watches;
+    mutable int m_nextWatch;
+    uint32_t m_cookie; ///< the cookie of the last move
 };
 }
 
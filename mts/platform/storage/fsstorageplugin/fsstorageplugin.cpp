@@ -33,13 +33,19 @@
 #include "fsinotify.h"
 #include "storagetracker.h"
 #include "storageitem.h"
+#include "writebehindthread.h"
 #include "trace.h"
 
 #include <sys/statvfs.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <algorithm>
 
 #include <QDebug>
 #include <QFile>
@@ -49,6 +55,11 @@
 #include <QDateTime>
 #include <QMetaObject>
 #include <QLocale>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QSaveFile>
+#include <QTimer>
+#include <QRunnable>
 
 #ifndef UT_ON
 #include <blkid/blkid.h>
@@ -61,6 +72,22 @@ const quint32 THUMB_MAX_SIZE  =    (1024 * 48);/* max thumbnailsize */
 // Default width and height for thumbnails
 const quint32 THUMB_WIDTH     =    100;
 const quint32 THUMB_HEIGHT    =    100;
+// Default limit of the SendObject data waiting to be written to the file
+const qint64 WRITE_BEHIND_MAX_LEN = (8 * 1024 * 1024);
+// How often a changed object tree is saved to the tree snapshot
+const int TREE_SNAPSHOT_INTERVAL = (5 * 60 * 1000);
+// Directories checked against the tree snapshot per event loop iteration
+const int TREE_SNAPSHOT_CHECKS = 32;
+// Directories listed by the lazy enumeration crawler per event loop iteration
+const int CRAWL_DIRECTORIES = 8;
+// Files kept open for readData()
+const int READ_FD_CACHE_SIZE = 8;
+// Reads in a row that continue the previous one, after which a file is read ahead
+const int SEQUENTIAL_READS = 2;
+// How far a file being read sequentially is read ahead of the reader
+const quint64 READ_AHEAD_WINDOW = (2 * 1024 * 1024);
+// Time spent on queued inotify events before serving the initiator again
+const int INOTIFY_BATCH_MSECS = 20;
 
 static quint32 fourcc_wmv3 = 0x574D5633;
 static const QString FILENAMES_FILTER_REGEX("[<>:\\\"\\/\\\\\\|\\?\\*\\x0000-\\x001F]");
@@ -372,6 +399,263 @@ static void file_set_mtime(const QString &path, time_t t)
     }
 }
 
+/* ========================================================================= *
+ * Directory listing
+ * ========================================================================= */
+
+struct dir_entry
+{
+    QString     name;
+    struct stat st;
+};
+
+struct linux_dirent64
+{
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+static bool dir_entry_less(const dir_entry &a, const dir_entry &b)
+{
+    /* Same order as QDir::Name | QDir::IgnoreCase */
+    int r = a.name.compare(b.name, Qt::CaseInsensitive);
+    return r ? r < 0 : a.name < b.name;
+}
+
+/* Lists the files and directories like QDir::entryInfoList() with
+ * QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot | QDir::Hidden, but
+ * with one fstatat() per entry, and none for the entries d_type tells
+ * are something else. Symbolic links are followed. If dirst is
+ * given, it gets the status of the directory from before it was read. */
+static bool dir_list(const QString &path, QVector<dir_entry> &entries,
+                     struct stat *dirst = 0)
+{
+    QByteArray utf8 = path.toUtf8();
+    int dirfd = open(utf8.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if( dirst )
+        memset(dirst, 0, sizeof *dirst);
+    if( dirfd == -1 ) {
+        MTP_LOG_WARNING(path << "could not open directory");
+        return false;
+    }
+    if( dirst && fstat(dirfd, dirst) == -1 )
+        memset(dirst, 0, sizeof *dirst);
+
+    char buf[16 * 1024];
+    for( ;; ) {
+        long n = syscall(SYS_getdents64, dirfd, buf, sizeof buf);
+        if( n == -1 )
+            MTP_LOG_WARNING(path << "could not read directory");
+        if( n <= 0 )
+            break;
+
+        for( long pos = 0; pos < n; ) {
+            const struct linux_dirent64 *d = (const struct linux_dirent64 *)(buf + pos);
+            const char *name = d->d_name;
+            pos += d->d_reclen;
+
+            if( name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])) )
+                continue;
+
+            switch( d->d_type ) {
+            case DT_REG:
+            case DT_DIR:
+            case DT_LNK:
+            case DT_UNKNOWN:
+                break;
+            default:
+                continue;
+            }
+
+            /* Dangling links are skipped, like QDir does */
+            dir_entry entry;
+            if( fstatat(dirfd, name, &entry.st, 0) == -1 )
+                continue;
+            if( !S_ISREG(entry.st.st_mode) && !S_ISDIR(entry.st.st_mode) )
+                continue;
+
+            entry.name = QFile::decodeName(name);
+            entries.append(entry);
+        }
+    }
+
+    close(dirfd);
+    std::sort(entries.begin(), entries.end(), dir_entry_less);
+    return true;
+}
+
+/* ========================================================================= *
+ * Tree snapshot
+ * ========================================================================= */
+
+/* The snapshot is a header, a record per object and the names of the
+ * objects. The records are in preorder, the children of a directory in
+ * the order of their handles, so that loading them assigns the handles
+ * in the same order as scanning would. The name of the root is the
+ * path of the storage, the other names are relative to the parent. */
+
+static const char TREE_MAGIC[8] = { 'M', 'T', 'P', 'T', 'R', 'E', 'E', '1' };
+static const quint32 TREE_NO_PARENT = 0xFFFFFFFF;
+
+struct tree_header
+{
+    char    magic[8];
+    quint32 count;       /* records */
+    quint32 stringsSize; /* bytes of names after the records */
+};
+
+struct tree_record
+{
+    quint32 parent;      /* index of the parent's record */
+    quint32 nameOffset;
+    quint32 nameLength;
+    quint32 mode;        /* S_IFDIR or S_IFREG */
+    quint64 size;
+    qint64  mtime;       /* nanoseconds */
+    quint64 ino;         /* directories only, see DirectoryStamp */
+};
+
+/* ========================================================================= *
+ * Journals
+ * ========================================================================= */
+
+/* The PUOID and object reference databases are a header followed by a
+ * record per change. Records are appended as the changes happen; a
+ * later record supersedes the earlier ones it overlaps. Compaction
+ * rewrites a file with a record per live entry. A record that does not
+ * match its checksum ends the journal, such as one torn by a crash. */
+
+// Journal records buffered before they are written
+static const int JOURNAL_BUFFER = (64 * 1024);
+// Superseded journal records tolerated before compacting
+static const int JOURNAL_COMPACT_MIN = 1024;
+
+/* FNV-1a */
+static quint32 journal_checksum(quint32 hash, const char *data, size_t size)
+{
+    for( size_t i = 0; i < size; ++i ) {
+        hash ^= (uchar)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool journal_write(int fd, const char *data, qint64 len)
+{
+    while( len > 0 ) {
+        ssize_t written = write(fd, data, len);
+        if( -1 == written ) {
+            if( EINTR == errno )
+                continue;
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+/* A PUOID record says a path got a PUOID, because the object there is
+ * new or moved there. It supersedes the records for the PUOID and for
+ * the path. */
+
+static const char PUOIDS_MAGIC[8] = { 'M', 'T', 'P', 'P', 'U', 'I', 'D', '2' };
+
+struct puoids_header
+{
+    char    magic[8];
+    char    largest[16]; /* largest PUOID handed out when compacted */
+};
+
+struct puoids_record
+{
+    quint32 pathLength;  /* bytes of the UTF-8 path after the record */
+    quint32 checksum;    /* of the rest of the record and the path */
+    char    puoid[16];
+};
+
+static quint32 puoids_checksum(const puoids_record *record, const char *path)
+{
+    quint32 hash = 2166136261u ^ record->pathLength;
+    hash = journal_checksum(hash, record->puoid, sizeof record->puoid);
+    return journal_checksum(hash, path, record->pathLength);
+}
+
+static void puoids_append(QByteArray &data, const QString &path, const MtpInt128 &puoid)
+{
+    QByteArray utf8 = path.toUtf8();
+    puoids_record record;
+    record.pathLength = utf8.size();
+    memcpy(record.puoid, puoid.val, sizeof record.puoid);
+    record.checksum = puoids_checksum(&record, utf8.constData());
+    data.append(reinterpret_cast<const char*>(&record), sizeof record);
+    data.append(utf8);
+}
+
+/* A reference record gives the objects an object refers to, by PUOID.
+ * It supersedes the records for the object; no references remove it. */
+
+static const char REFERENCES_MAGIC[8] = { 'M', 'T', 'P', 'R', 'E', 'F', 'S', '2' };
+
+struct references_record
+{
+    quint32 count;       /* PUOIDs of referred objects after the record */
+    quint32 checksum;    /* of the rest of the record and the references */
+    char    puoid[16];
+};
+
+static quint32 references_checksum(const references_record *record, const char *references)
+{
+    quint32 hash = 2166136261u ^ record->count;
+    hash = journal_checksum(hash, record->puoid, sizeof record->puoid);
+    return journal_checksum(hash, references, record->count * sizeof(MtpInt128));
+}
+
+static void references_append(QByteArray &data, const MtpInt128 &puoid, const QVector<MtpInt128> &references)
+{
+    const char *puoids = reinterpret_cast<const char*>(references.constData());
+    references_record record;
+    record.count = references.size();
+    memcpy(record.puoid, puoid.val, sizeof record.puoid);
+    record.checksum = references_checksum(&record, puoids);
+    data.append(reinterpret_cast<const char*>(&record), sizeof record);
+    data.append(puoids, references.size() * sizeof(MtpInt128));
+}
+
+/* Writes a compacted journal off the main thread */
+class JournalWriter : public QRunnable
+{
+    public:
+        JournalWriter(QObject *owner, const char *done, const QString &path, const QByteArray &data) :
+            m_owner(owner), m_done(done), m_path(path), m_data(data)
+        {
+        }
+
+        void run()
+        {
+            // The journal is either the old one or the new one
+            QSaveFile file(m_path);
+            bool ok = file.open(QIODevice::WriteOnly) && -1 != file.write(m_data) && file.commit();
+            if( !ok )
+                MTP_LOG_WARNING("ERROR writing" << m_path);
+            QMetaObject::invokeMethod(m_owner, m_done, Qt::QueuedConnection, Q_ARG(bool, ok));
+        }
+
+    private:
+        QObject *m_owner;
+        const char *m_done;
+        QString m_path;
+        QByteArray m_data;
+};
+
+static qint64 stat_mtime_ns(const struct stat &st)
+{
+    return qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
 /************************************************************
  * FSStoragePlugin::FSStoragePlugin
  ***********************************************************/
@@ -382,9 +666,43 @@ FSStoragePlugin::FSStoragePlugin( quint32 storageId, MTPStorageType storageType,
   m_root(0),
   m_writeObjectHandle(0),
   m_largestPuoid(0),
+  m_puoidsJournalFd(-1),
+  m_puoidsJournalRecords(0),
+  m_referencesJournalFd(-1),
+  m_referencesJournalRecords(0),
+  m_referencesCompacting(false),
+  m_inotifyEventsApplied(0),
+  m_storageInfoChangeDeferred(false),
+  m_storageInfoChangePending(false),
   m_reportedFreeSpace(0),
-  m_dataFile(0)
+  m_dataFile(0),
+  m_readAdvice(READ_ADVICE_AUTO),
+  m_dropBehind(true),
+  m_syncOnClose(false),
+  m_syncInterval(0),
+  m_scanner(0),
+  m_treeSnapshotDirty(false),
+  m_lazyListing(false),
+  m_crawling(false)
 {
+    // Number of bytes of a SendObject data phase that may wait to be
+    // written to the file system, 0 writes them synchronously
+    bool ok = false;
+    qint64 writeBehindLen = qgetenv("MTP_WRITE_BEHIND_SIZE").toLongLong(&ok);
+    if( !ok || writeBehindLen < 0 )
+    {
+        writeBehindLen = WRITE_BEHIND_MAX_LEN;
+    }
+    m_writeBehind = new WriteBehindThread( writeBehindLen, this );
+
+    // Number of threads listing directories while the storage is
+    // enumerated, 0 lists them all on the main thread
+    m_scanThreads = qgetenv("MTP_SCAN_THREADS").toInt(&ok);
+    if( !ok || m_scanThreads < 0 )
+    {
+        m_scanThreads = QThread::idealThreadCount();
+    }
+
     m_storageInfo.storageType = storageType;
     m_storageInfo.accessCapability = MTP_STORAGE_ACCESS_ReadWrite;
     m_storageInfo.filesystemType = MTP_FILE_SYSTEM_TYPE_GenHier;
@@ -420,12 +738,39 @@ FSStoragePlugin::FSStoragePlugin( quint32 storageId, MTPStorageType storageType,
     QFile::remove(m_puoidsDbPath);
     m_puoidsDbPath += '-' + volumeLabel + '-' + filesystemUuid();
 
+    // The object tree is loaded from the snapshot at start up and
+    // checked against the file system after the storage is ready
+    if( qgetenv("MTP_TREE_SNAPSHOT") != "0" )
+    {
+        m_treeSnapshotPath = m_mtpPersistentDBPath + "/mtptree-" + volumeLabel + '-' + filesystemUuid();
+    }
+    // Only the root is listed at start up, the other directories when
+    // the initiator first looks into them or the crawler gets to them
+    m_lazyEnumeration = qgetenv("MTP_LAZY_ENUMERATION") == "1";
+
+    m_treeSnapshotTimer = new QTimer( this );
+    m_treeSnapshotTimer->setInterval( TREE_SNAPSHOT_INTERVAL );
+    QObject::connect( m_treeSnapshotTimer, SIGNAL(timeout()), this, SLOT(storeTreeSnapshot()) );
+
     m_objectReferencesDbPath = m_mtpPersistentDBPath + "/mtpreferences";
     m_internalPlaylistPath = m_mtpPersistentDBPath + "/Playlists";
     m_playlistPath = storagePath + "/Playlists";
 
     buildSupportedFormatsList();
 
+    // Writes the PUOIDs journaled during an event loop iteration
+    m_puoidsFlushTimer = new QTimer( this );
+    m_puoidsFlushTimer->setSingleShot( true );
+    m_puoidsFlushTimer->setInterval( 0 );
+    QObject::connect( m_puoidsFlushTimer, SIGNAL(timeout()), this, SLOT(flushPuoids()) );
+
+    // Writes the references journaled during an event loop iteration
+    m_referencesFlushTimer = new QTimer( this );
+    m_referencesFlushTimer->setSingleShot( true );
+    m_referencesFlushTimer->setInterval( 0 );
+    QObject::connect( m_referencesFlushTimer, SIGNAL(timeout()), this, SLOT(flushObjectReferences()) );
+    m_journalWriterPool.setMaxThreadCount( 1 );
+
     // Populate puoids stored persistently and store them in the puoids map.
     populatePuoids();
 
@@ -436,8 +781,15 @@ FSStoragePlugin::FSStoragePlugin( quint32 storageId, MTPStorageType storageType,
     //m_thumbnailer = new Thumbnailer();
     //QObject::connect( m_thumbnailer, SIGNAL( thumbnailReady( const QString& ) ), this, SLOT( receiveThumbnail( const QString& ) ) );
     clearCachedInotifyEvent(); // initialize
-    m_inotify = new FSInotify( IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE );
-    QObject::connect( m_inotify, SIGNAL(inotifyEventSignal( struct inotify_event* )), this, SLOT(inotifyEventSlot( struct inotify_event* )) );
+    // One fanotify mark can cover the whole storage instead of a watch per directory
+    QString filesystemRoot = qgetenv("MTP_FANOTIFY") == "1" ? m_storagePath : QString();
+    m_inotify = new FSInotify( IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE, filesystemRoot );
+    QObject::connect( m_inotify, SIGNAL(inotifyEventSignal( struct inotify_event* )), this, SLOT(queueInotifyEvent( struct inotify_event* )) );
+    QObject::connect( m_inotify, SIGNAL(inotifyEventsReadSignal()), this, SLOT(processInotifyEvents()) );
+    m_inotifyTimer = new QTimer( this );
+    m_inotifyTimer->setSingleShot( true );
+    m_inotifyTimer->setInterval( 0 );
+    QObject::connect( m_inotifyTimer, SIGNAL(timeout()), this, SLOT(processInotifyEvents()) );
 
     MTP_LOG_INFO(storagePath << "exported as FS storage" << volumeLabel << '('
             << storageDescription << ')');
@@ -471,10 +823,76 @@ void FSStoragePlugin::enumerateStorage_worker()
     m_tracker->getPlaylists(m_existingPlaylists.playlistPaths, m_existingPlaylists.playlistEntries, true);
     m_tracker->getPlaylists(m_newPlaylists.playlistNames, m_newPlaylists.playlistEntries, false);
 
-    // Add the root folder to storage
-    addToStorage(m_storagePath, &m_root);
+    QElapsedTimer timer;
+    timer.start();
 
+    if( loadTreeSnapshot() )
+    {
+        MTP_LOG_INFO("storage" << m_storageId << "loaded" << m_objectHandlesMap.size()
+                     << "objects from" << m_treeSnapshotPath << "in" << timer.elapsed() << "ms");
+    }
+    else
+    {
+        // Add the root folder to storage. The directories are listed on
+        // other threads, the tree is still built on this one.
+        if( m_lazyEnumeration )
+        {
+            m_lazyListing = true;
+            addToStorage(m_storagePath, &m_root);
+            m_lazyListing = false;
+        }
+        else if( m_scanThreads > 0 )
+        {
+            StorageScanner scanner( this, m_scanThreads );
+            scanner.queue( m_storagePath );
+            m_scanner = &scanner;
+            addToStorage(m_storagePath, &m_root);
+            m_scanner = 0;
+        }
+        else
+        {
+            addToStorage(m_storagePath, &m_root);
+        }
+        MTP_LOG_INFO("storage" << m_storageId << "scanned" << m_objectHandlesMap.size()
+                     << "objects in" << timer.elapsed() << "ms");
+    }
+
+    // With lazy enumeration, that waits for the crawler
+    m_crawling = !m_crawlQueue.isEmpty();
+    if( m_crawling )
+    {
+        QTimer::singleShot( 0, this, SLOT(crawlStorage()) );
+    }
+    else
+    {
+        completeEnumeration();
+    }
+
+    /* Delay from waiting for "storage ready" is known cause
+     * of issues. To ease debugging log when it is finished. */
+    MTP_LOG_WARNING("storage" << m_storageId << "is ready");
+
+    emit storagePluginReady(m_storageId);
+
+    // Whatever changed while we were not running is found out now
+    if( !m_treeChecks.isEmpty() )
+    {
+        m_treeCheckTimer.start();
+        QTimer::singleShot( 0, this, SLOT(verifyTreeSnapshot()) );
+    }
+    m_treeSnapshotTimer->start();
+
+    // enable thumbnailer after fs scan is finished
+    //m_thumbnailer->enableThumbnailing();
+}
+
+/************************************************************
+ * void FSStoragePlugin::completeEnumeration
+ ***********************************************************/
+void FSStoragePlugin::completeEnumeration()
+{
     removeUnusedPuoids();
+    compactPuoids();
 
     // Populate object references stored persistently and add them to the storage.
     populateObjectReferences();
@@ -484,15 +902,67 @@ void FSStoragePlugin::enumerateStorage_worker()
     // objects.
     // Create playlist folders and sync .pla files with real playlists.
     assignPlaylistReferences();
+}
 
-    /* Delay from waiting for "storage ready" is known cause
-     * of issues. To ease debugging log when it is finished. */
-    MTP_LOG_WARNING("storage" << m_storageId << "is ready");
+/************************************************************
+ * void FSStoragePlugin::crawlStorage
+ ***********************************************************/
+void FSStoragePlugin::crawlStorage()
+{
+    if( !m_crawling )
+    {
+        // Finished on demand
+        return;
+    }
 
-    emit storagePluginReady(m_storageId);
+    // A few at a time, so that the initiator is served meanwhile
+    for( int i = 0; i < CRAWL_DIRECTORIES && !m_crawlQueue.isEmpty(); ++i )
+    {
+        listDirectory( m_objectHandlesMap.value( m_crawlQueue.takeFirst() ) );
+    }
 
-    // enable thumbnailer after fs scan is finished
-    //m_thumbnailer->enableThumbnailing();
+    if( !m_crawlQueue.isEmpty() )
+    {
+        QTimer::singleShot( 0, this, SLOT(crawlStorage()) );
+        return;
+    }
+    finishCrawl();
+}
+
+/************************************************************
+ * void FSStoragePlugin::finishCrawl
+ ***********************************************************/
+void FSStoragePlugin::finishCrawl()
+{
+    if( !m_crawling )
+    {
+        return;
+    }
+
+    while( !m_crawlQueue.isEmpty() )
+    {
+        listDirectory( m_objectHandlesMap.value( m_crawlQueue.takeFirst() ) );
+    }
+    m_crawling = false;
+
+    MTP_LOG_INFO("storage" << m_storageId << "crawled," << m_objectHandlesMap.size() << "objects");
+    completeEnumeration();
+}
+
+/************************************************************
+ * void FSStoragePlugin::listDirectory
+ ***********************************************************/
+void FSStoragePlugin::listDirectory( StorageItem *directory )
+{
+    if( !directory || !m_unlistedDirectories.remove( directory->m_handle ) )
+    {
+        return;
+    }
+
+    bool lazyListing = m_lazyListing;
+    m_lazyListing = true;
+    addScannedDirectory( directory );
+    m_lazyListing = lazyListing;
 }
 
 /************************************************************
@@ -500,16 +970,41 @@ void FSStoragePlugin::enumerateStorage_worker()
  ***********************************************************/
 FSStoragePlugin::~FSStoragePlugin()
 {
-    storePuoids();
-    storeObjectReferences();
-
-    for( QHash<ObjHandle, StorageItem*>::iterator i = m_objectHandlesMap.begin() ; i != m_objectHandlesMap.end(); ++i )
+    compactPuoids();
+    if( -1 != m_puoidsJournalFd )
     {
-        if( i.value() )
+        close( m_puoidsJournalFd );
+    }
+    // A rewrite in progress is redone with the changes since
+    m_journalWriterPool.waitForDone();
+    // Not read yet if the crawler did not finish
+    if( !m_crawling )
+    {
+        if( m_referencesCompacting || -1 == m_referencesJournalFd ||
+            m_referencesJournalRecords > 2 * m_objectReferencesMap.size() + JOURNAL_COMPACT_MIN )
+        {
+            storeObjectReferences( false );
+        }
+        else
         {
-            delete i.value();
+            flushObjectReferences();
         }
     }
+    if( -1 != m_referencesJournalFd )
+    {
+        close( m_referencesJournalFd );
+    }
+    storeTreeSnapshot();
+
+    foreach( const CachedFd &cached, m_readFds )
+    {
+        close( cached.fd );
+    }
+
+    for( ObjectTable::const_iterator i = m_objectHandlesMap.constBegin() ; i != m_objectHandlesMap.constEnd(); ++i )
+    {
+        delete i.value();
+    }
 
     delete m_tracker;
     m_tracker = 0;
@@ -517,16 +1012,15 @@ FSStoragePlugin::~FSStoragePlugin()
     //m_thumbnailer = 0;
     delete m_inotify;
     m_inotify = 0;
+    delete m_writeBehind;
+    m_writeBehind = 0;
 }
 
 void FSStoragePlugin::disableObjectEvents()
 {
-    for( QHash<ObjHandle, StorageItem*>::iterator i = m_objectHandlesMap.begin() ; i != m_objectHandlesMap.end(); ++i )
+    for( ObjectTable::const_iterator i = m_objectHandlesMap.constBegin() ; i != m_objectHandlesMap.constEnd(); ++i )
     {
-        if( i.value() )
-        {
-            i.value()->setEventsEnabled(false);
-        }
+        i.value()->setEventsEnabled(false);
     }
 }
 
@@ -602,7 +1096,8 @@ void FSStoragePlugin::syncPlaylists()
 void FSStoragePlugin::assignPlaylistReferences()
 {
     // Get the handle for the playlist path
-    ObjHandle playlistDirHandle = m_pathNamesMap[m_playlistPath];
+    StorageItem *playlistDir = findStorageItemByPath(m_playlistPath);
+    ObjHandle playlistDirHandle = playlistDir ? playlistDir->m_handle : 0;
     if(0 == playlistDirHandle)
     {
         MTP_LOG_CRITICAL("No handle found for playlists directory!, playlists will be unavailable!");
@@ -617,16 +1112,18 @@ void FSStoragePlugin::assignPlaylistReferences()
         references.clear();
         QString playlistPath = m_existingPlaylists.playlistPaths[i];
         // Iterate over all entries, get their object handles, and assign references
-        if(m_pathNamesMap.contains(playlistPath))
+        StorageItem *playlist = findStorageItemByPath(playlistPath);
+        if(playlist)
         {
-            refHandle = m_pathNamesMap[playlistPath];
+            refHandle = playlist->m_handle;
             // Iterate entries now
             QStringList entries = m_existingPlaylists.playlistEntries[i];
             foreach(QString entry, entries)
             {
-                if(m_pathNamesMap.contains(entry))
+                StorageItem *reference = findStorageItemByPath(entry);
+                if(reference)
                 {
-                    references.append(m_pathNamesMap[entry]);
+                    references.append(reference->m_handle);
                 }
             }
             m_objectReferencesMap[refHandle] = references;
@@ -653,9 +1150,10 @@ void FSStoragePlugin::assignPlaylistReferences()
             QStringList entries = m_newPlaylists.playlistEntries[i];
             foreach(QString entry, entries)
             {
-                if(m_pathNamesMap.contains(entry))
+                StorageItem *reference = findStorageItemByPath(entry);
+                if(reference)
                 {
-                    references.append(m_pathNamesMap[entry]);
+                    references.append(reference->m_handle);
                 }
             }
             m_objectReferencesMap[newHandle] = references;
@@ -677,7 +1175,7 @@ QVector<ObjHandle> FSStoragePlugin::readInternalAbstractPlaylist( StorageItem *i
         return playlistRefs;
     }
     char filePath[256]; // the max path length // FIXME
-    QFile file( item->m_path );
+    QFile file( item->path() );
     if( file.open( QIODevice::ReadOnly ) )
     {
         while( !file.atEnd() )
@@ -688,9 +1186,10 @@ QVector<ObjHandle> FSStoragePlugin::readInternalAbstractPlaylist( StorageItem *i
                 continue;
             }
             filePath[bytesRead -1] = '\0';
-            if( m_pathNamesMap.contains( QString( filePath ) ) )
+            StorageItem *reference = findStorageItemByPath( QString( filePath ) );
+            if( reference )
             {
-                playlistRefs.append( m_pathNamesMap.value( QString( filePath ) ) );
+                playlistRefs.append( reference->m_handle );
             }
         }
     }
@@ -713,158 +1212,553 @@ void FSStoragePlugin::removePlaylist(const QString &path)
 void FSStoragePlugin::populatePuoids()
 {
     QFile file( m_puoidsDbPath );
-    if( !file.open( QIODevice::ReadOnly ) || !file.size() )
+    qint64 size = file.open( QIODevice::ReadOnly ) ? file.size() : 0;
+    const uchar *data = size ? file.map( 0, size ) : 0;
+    qint64 valid = 0;
+
+    if( data && size >= (qint64)sizeof(puoids_header) && !memcmp( data, PUOIDS_MAGIC, sizeof PUOIDS_MAGIC ) )
+    {
+        const puoids_header *header = reinterpret_cast<const puoids_header*>( data );
+        memcpy( m_largestPuoid.val, header->largest, sizeof header->largest );
+
+        // Replay the journal, keeping a path per PUOID and a PUOID per path
+        QHash<MtpInt128, QString> paths;
+        qint64 offset = sizeof(puoids_header);
+        while( offset + (qint64)sizeof(puoids_record) <= size )
+        {
+            puoids_record record;
+            memcpy( &record, data + offset, sizeof record );
+            const char *path = reinterpret_cast<const char*>( data + offset + sizeof record );
+            if( record.pathLength > size - offset - sizeof record ||
+                record.checksum != puoids_checksum( &record, path ) )
+            {
+                break;
+            }
+            offset += sizeof record + record.pathLength;
+
+            MtpInt128 puoid;
+            memcpy( puoid.val, record.puoid, sizeof record.puoid );
+            QString name = QString::fromUtf8( path, record.pathLength );
+            QHash<QString, MtpInt128>::iterator owner = m_puoidsMap.find( name );
+            if( owner != m_puoidsMap.end() && !( owner.value() == puoid ) )
+            {
+                // The path was given to another object
+                paths.remove( owner.value() );
+            }
+            QHash<MtpInt128, QString>::iterator previous = paths.find( puoid );
+            if( previous != paths.end() && previous.value() != name )
+            {
+                // The object moved away from there
+                m_puoidsMap.remove( previous.value() );
+            }
+            m_puoidsMap.insert( name, puoid );
+            paths.insert( puoid, name );
+            if( puoid > m_largestPuoid )
+            {
+                m_largestPuoid = puoid;
+            }
+            ++m_puoidsJournalRecords;
+        }
+        valid = offset;
+    }
+    else if( data && size >= (qint64)( sizeof(MtpInt128) + sizeof(quint32) ) )
+    {
+        // Written whole by an older version: the last used PUOID, the
+        // number of PUOIDs and a path length, path and PUOID for each
+        const uchar *end = data + size;
+        const uchar *pos = data;
+        quint32 noOfPuoids = 0;
+        memcpy( m_largestPuoid.val, pos, sizeof(MtpInt128) );
+        pos += sizeof(MtpInt128);
+        memcpy( &noOfPuoids, pos, sizeof(quint32) );
+        pos += sizeof(quint32);
+        for( quint32 i = 0; i < noOfPuoids && end - pos >= (qint64)sizeof(quint32); ++i )
+        {
+            quint32 pathnameLen = 0;
+            memcpy( &pathnameLen, pos, sizeof(quint32) );
+            pos += sizeof(quint32);
+            if( pathnameLen > end - pos || end - pos - pathnameLen < (qint64)sizeof(MtpInt128) )
+            {
+                break;
+            }
+            MtpInt128 puoid;
+            memcpy( puoid.val, pos + pathnameLen, sizeof(MtpInt128) );
+            m_puoidsMap.insert( QString::fromUtf8( reinterpret_cast<const char*>( pos ), pathnameLen ), puoid );
+            pos += pathnameLen + sizeof(MtpInt128);
+        }
+    }
+    file.close();
+
+    if( !valid )
     {
+        // Start the journal from what was read, if anything
+        storePuoids();
         return;
     }
+    if( valid < size )
+    {
+        MTP_LOG_WARNING(m_puoidsDbPath << "ends in a broken record, dropping" << size - valid << "bytes");
+        if( -1 == truncate( m_puoidsDbPath.toUtf8().constData(), valid ) )
+        {
+            storePuoids();
+            return;
+        }
+    }
+    m_puoidsJournalFd = open( m_puoidsDbPath.toUtf8().constData(), O_WRONLY | O_APPEND | O_CLOEXEC );
+    if( -1 == m_puoidsJournalFd )
+    {
+        MTP_LOG_WARNING("Could not open" << m_puoidsDbPath << ":" << strerror(errno));
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::removeUnusedPuoids
+ ***********************************************************/
+void FSStoragePlugin::removeUnusedPuoids()
+{
+    // The items in the tree took theirs out of the map
+    m_puoidsMap.clear();
+}
+
+/************************************************************
+ * void FSStoragePlugin::journalPuoid
+ ***********************************************************/
+void FSStoragePlugin::journalPuoid( const QString &path, const MtpInt128 &puoid )
+{
+    puoids_append( m_puoidsJournal, path, puoid );
+    ++m_puoidsJournalRecords;
+
+    // A burst of changes goes in one write
+    if( m_puoidsJournal.size() >= JOURNAL_BUFFER )
+    {
+        flushPuoids();
+    }
+    else if( !m_puoidsFlushTimer->isActive() )
+    {
+        m_puoidsFlushTimer->start();
+    }
+}
 
-    qint32 bytesRead = 0;
-    char *name = 0;
-    quint32 noOfPuoids = 0, pathnameLen = 0;
-    MtpInt128 puoid;
+/************************************************************
+ * void FSStoragePlugin::journalPuoids
+ ***********************************************************/
+void FSStoragePlugin::journalPuoids( const StorageItem *item, const QString &path )
+{
+    journalPuoid( path, item->m_puoid );
+    for( const StorageItem *child = item->m_firstChild; child; child = child->m_nextSibling )
+    {
+        journalPuoids( child, path + '/' + child->m_name );
+    }
+}
 
-    // Read the last used puoid
-    bytesRead = file.read( reinterpret_cast<char*>(&m_largestPuoid), sizeof(MtpInt128) );
-    if( 0 >= bytesRead )
+/************************************************************
+ * void FSStoragePlugin::flushPuoids
+ ***********************************************************/
+void FSStoragePlugin::flushPuoids()
+{
+    m_puoidsFlushTimer->stop();
+    if( m_puoidsJournal.isEmpty() || -1 == m_puoidsJournalFd )
     {
         return;
     }
 
-    // Read the no. of puoids
-    bytesRead = file.read( reinterpret_cast<char*>(&noOfPuoids), sizeof(quint32) );
-    if( 0 >= bytesRead )
+    if( !journal_write( m_puoidsJournalFd, m_puoidsJournal.constData(), m_puoidsJournal.size() ) )
+    {
+        // Rewritten whole when compacting
+        MTP_LOG_WARNING("ERROR writing" << m_puoidsDbPath << ":" << strerror(errno));
+        close( m_puoidsJournalFd );
+        m_puoidsJournalFd = -1;
+    }
+    m_puoidsJournal.clear();
+}
+
+/************************************************************
+ * void FSStoragePlugin::compactPuoids
+ ***********************************************************/
+void FSStoragePlugin::compactPuoids()
+{
+    flushPuoids();
+    qint64 live = m_objectHandlesMap.size() + m_puoidsMap.size();
+    if( -1 == m_puoidsJournalFd || m_puoidsJournalRecords > 2 * live + JOURNAL_COMPACT_MIN )
+    {
+        storePuoids();
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::storePuoids
+ ***********************************************************/
+void FSStoragePlugin::storePuoids()
+{
+    // A record for each PUOID: the items' and the ones kept for paths with no item
+    QByteArray data;
+    puoids_header header;
+    memcpy( header.magic, PUOIDS_MAGIC, sizeof header.magic );
+    memcpy( header.largest, m_largestPuoid.val, sizeof header.largest );
+    data.append( reinterpret_cast<const char*>( &header ), sizeof header );
+    for( ObjectTable::const_iterator item = m_objectHandlesMap.constBegin(); item != m_objectHandlesMap.constEnd(); ++item )
+    {
+        puoids_append( data, item.value()->path(), item.value()->m_puoid );
+    }
+    for( QHash<QString,MtpInt128>::const_iterator i = m_puoidsMap.constBegin(); i != m_puoidsMap.constEnd(); ++i )
+    {
+        puoids_append( data, i.key(), i.value() );
+    }
+
+    if( -1 != m_puoidsJournalFd )
+    {
+        close( m_puoidsJournalFd );
+        m_puoidsJournalFd = -1;
+    }
+    m_puoidsJournal.clear();
+
+    // The database is either the old one or the new one
+    QSaveFile file( m_puoidsDbPath );
+    if( !file.open( QIODevice::WriteOnly ) || -1 == file.write( data ) || !file.commit() )
     {
+        MTP_LOG_WARNING("ERROR writing" << m_puoidsDbPath);
         return;
     }
+    m_puoidsJournalRecords = m_objectHandlesMap.size() + m_puoidsMap.size();
+
+    m_puoidsJournalFd = open( m_puoidsDbPath.toUtf8().constData(), O_WRONLY | O_APPEND | O_CLOEXEC );
+    if( -1 == m_puoidsJournalFd )
+    {
+        MTP_LOG_WARNING("Could not open" << m_puoidsDbPath << ":" << strerror(errno));
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::setDirectoryStamp
+ ***********************************************************/
+void FSStoragePlugin::setDirectoryStamp( ObjHandle handle, const struct stat &st )
+{
+    DirectoryStamp stamp;
+    stamp.ino = st.st_ino;
+    stamp.mtime = stat_mtime_ns( st );
+
+    // A change made in the same tick of a coarse file system clock
+    // would not show in the modification time
+    if( st.st_mtime + 2 >= time( 0 ) )
+    {
+        stamp.ino = 0;
+    }
+    m_directoryStamps[handle] = stamp;
+}
+
+/************************************************************
+ * bool FSStoragePlugin::loadTreeSnapshot
+ ***********************************************************/
+bool FSStoragePlugin::loadTreeSnapshot()
+{
+    if( m_treeSnapshotPath.isEmpty() )
+    {
+        return false;
+    }
+
+    QFile file( m_treeSnapshotPath );
+    if( !file.open( QIODevice::ReadOnly ) )
+    {
+        return false;
+    }
 
-    for( quint32 i = 0 ; i < noOfPuoids; ++i )
+    qint64 size = file.size();
+    const uchar *data = 0;
+    if( size >= (qint64)sizeof(tree_header) )
     {
-        // read pathname len
-        bytesRead = file.read( reinterpret_cast<char*>(&pathnameLen), sizeof(quint32) );
-        if( 0 >= bytesRead )
+        data = file.map( 0, size );
+    }
+    if( !data )
+    {
+        MTP_LOG_WARNING("Could not map" << m_treeSnapshotPath);
+        return false;
+    }
+
+    // Validate everything before building anything
+    const tree_header *header = reinterpret_cast<const tree_header*>( data );
+    bool valid = !memcmp( header->magic, TREE_MAGIC, sizeof header->magic ) && header->count &&
+            size == (qint64)sizeof(tree_header) + (qint64)header->count * (qint64)sizeof(tree_record) + header->stringsSize;
+    const tree_record *records = reinterpret_cast<const tree_record*>( header + 1 );
+    for( quint32 i = 0; valid && i < header->count; ++i )
+    {
+        const tree_record &record = records[i];
+        valid = ( i ? record.parent < i && S_IFDIR == records[record.parent].mode : TREE_NO_PARENT == record.parent ) &&
+                ( S_IFDIR == record.mode || S_IFREG == record.mode ) &&
+                record.nameOffset <= header->stringsSize &&
+                record.nameLength <= header->stringsSize - record.nameOffset;
+    }
+    const char *strings = valid ? reinterpret_cast<const char*>( records + header->count ) : 0;
+    if( !valid || S_IFDIR != records[0].mode ||
+        QString::fromUtf8( strings + records[0].nameOffset, records[0].nameLength ) != m_storagePath )
+    {
+        MTP_LOG_WARNING(m_treeSnapshotPath << "is not a tree snapshot of" << m_storagePath);
+        return false;
+    }
+
+    QVector<StorageItem*> items( header->count );
+    for( quint32 i = 0; i < header->count; ++i )
+    {
+        const tree_record &record = records[i];
+        StorageItem *parent = i ? items[record.parent] : 0;
+        if( i && !parent )
         {
-            return;
+            // Under an excluded path
+            continue;
         }
 
-        // read the pathname
-        name = new char[pathnameLen + 1];
-        bytesRead = file.read( name, pathnameLen );
-        if( 0 >= bytesRead )
+        QString name = QString::fromUtf8( strings + record.nameOffset, record.nameLength );
+        if( !m_excludePaths.isEmpty() && m_excludePaths.contains( parent ? parent->path() + '/' + name : name ) )
         {
-            delete [] name;
-            return;
+            continue;
         }
-        name[pathnameLen] = '\0';
 
-        // read the puoid
-        bytesRead = file.read( reinterpret_cast<char*>(&puoid), sizeof(MtpInt128) );
-        if( 0 >= bytesRead )
+        StorageItem *item = new StorageItem;
+        item->m_name = name;
+        linkChildStorageItem( item, parent );
+        // Root of the storage should have handle of 0.
+        item->m_handle = parent ? requestNewObjectHandle() : 0;
+
+        // The object info is made of the same bits a stat() would give
+        struct stat st;
+        memset( &st, 0, sizeof st );
+        st.st_mode = record.mode;
+        st.st_size = record.size;
+        st.st_mtime = record.mtime / 1000000000;
+        populateObjectInfo( item, st );
+        items[i] = item;
+
+        if( S_IFDIR == record.mode )
         {
-            delete [] name;
-            return;
+            addWatchDescriptor( item );
+            addItemToMaps( item );
+            DirectoryStamp stamp;
+            stamp.ino = record.ino;
+            stamp.mtime = record.mtime;
+            m_directoryStamps[item->m_handle] = stamp;
+            m_treeChecks.append( item->m_handle );
+        }
+        else
+        {
+            addItemToMaps( item );
+            // Add this PUOID to the PUOID->Object Handles map
+            m_puoidToHandleMap[item->m_puoid] = item->m_handle;
         }
-
-        // Store this in puoids map
-        m_puoidsMap[name] = puoid;
-
-        delete [] name;
     }
+    m_root = items[0];
+
+    // Nothing to write until something changes
+    m_treeSnapshotDirty = false;
+    return true;
 }
 
 /************************************************************
- * void FSStoragePlugin::removeUnusedPuoids
+ * void FSStoragePlugin::storeTreeSnapshot
  ***********************************************************/
-void FSStoragePlugin::removeUnusedPuoids()
+void FSStoragePlugin::storeTreeSnapshot()
 {
-    QHash<QString, MtpInt128>::iterator i = m_puoidsMap.begin();
-    while( i != m_puoidsMap.end() )
+    // An incomplete tree would be taken for the whole storage
+    if( m_treeSnapshotPath.isEmpty() || !m_root || !m_treeSnapshotDirty || m_crawling )
     {
-        if( !m_pathNamesMap.contains( i.key() ) )
+        return;
+    }
+
+    QVector<tree_record> records;
+    QByteArray strings;
+    records.reserve( m_objectHandlesMap.size() );
+
+    // Preorder, children in the order of their handles
+    QVector<QPair<const StorageItem*, quint32> > stack;
+    QVector<QPair<ObjHandle, const StorageItem*> > children;
+    stack.append( qMakePair( (const StorageItem*)m_root, TREE_NO_PARENT ) );
+    while( !stack.isEmpty() )
+    {
+        const StorageItem *item = stack.last().first;
+        tree_record record;
+        record.parent = stack.last().second;
+        stack.removeLast();
+
+        QByteArray name = item->m_name.toUtf8();
+        record.nameOffset = strings.size();
+        record.nameLength = name.size();
+        strings += name;
+
+        const MTPObjectInfo *info = item->m_objectInfo;
+        bool directory = MTP_OBF_FORMAT_Association == info->mtpObjectFormat;
+        record.mode = directory ? S_IFDIR : S_IFREG;
+        record.size = info->mtpObjectCompressedSize;
+        record.mtime = (qint64)datetime_to_time_t( info->mtpModificationDate ) * 1000000000;
+        record.ino = 0;
+        if( directory && m_directoryStamps.contains( item->m_handle ) )
         {
-            i = m_puoidsMap.erase(i);
+            const DirectoryStamp &stamp = m_directoryStamps[item->m_handle];
+            record.mtime = stamp.mtime;
+            record.ino = stamp.ino;
         }
-        else
+
+        quint32 index = records.size();
+        records.append( record );
+
+        children.clear();
+        for( const StorageItem *child = item->m_firstChild; child; child = child->m_nextSibling )
         {
-            ++i;
+            children.append( qMakePair( child->m_handle, child ) );
+        }
+        std::sort( children.begin(), children.end() );
+        for( int i = children.size() - 1; i >= 0; --i )
+        {
+            stack.append( qMakePair( children[i].second, index ) );
         }
     }
+
+    tree_header header;
+    memcpy( header.magic, TREE_MAGIC, sizeof header.magic );
+    header.count = records.size();
+    header.stringsSize = strings.size();
+
+    // A snapshot is either complete or not there
+    QSaveFile file( m_treeSnapshotPath );
+    if( !file.open( QIODevice::WriteOnly ) ||
+        -1 == file.write( reinterpret_cast<const char*>( &header ), sizeof header ) ||
+        -1 == file.write( reinterpret_cast<const char*>( records.constData() ), records.size() * sizeof(tree_record) ) ||
+        -1 == file.write( strings ) ||
+        !file.commit() )
+    {
+        MTP_LOG_WARNING("Could not write" << m_treeSnapshotPath);
+        return;
+    }
+    m_treeSnapshotDirty = false;
 }
 
 /************************************************************
- * void FSStoragePlugin::storePuoids
+ * void FSStoragePlugin::verifyTreeSnapshot
  ***********************************************************/
-void FSStoragePlugin::storePuoids()
+void FSStoragePlugin::verifyTreeSnapshot()
 {
-    // Store in the following order
-    // Last used PUOID (128 bits)
-    // No. Of puoids ( 4 bytes )
-    // length of object's pathname : pathname : puoid ( for each puoid )
-    qint32 bytesWritten = -1;
-    QFile file( m_puoidsDbPath );
-    if( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+    // A few at a time, so that the initiator is served meanwhile
+    for( int i = 0; i < TREE_SNAPSHOT_CHECKS && !m_treeChecks.isEmpty(); ++i )
     {
-        return;
+        checkTreeDirectory( m_treeChecks.takeFirst() );
     }
 
-    // Write the last used puoid.
-    bytesWritten = file.write( reinterpret_cast<const char*>(&m_largestPuoid), sizeof(MtpInt128) );
-    if( -1 == bytesWritten )
+    if( !m_treeChecks.isEmpty() )
     {
-        MTP_LOG_WARNING("ERROR writing last used puoid to db!!");
-        file.resize(0);
-        file.close();
+        QTimer::singleShot( 0, this, SLOT(verifyTreeSnapshot()) );
         return;
     }
 
-    // Write the no of puoids
-    quint32 noOfPuoids = m_puoidsMap.size();
-    bytesWritten = file.write( reinterpret_cast<const char*>(&noOfPuoids), sizeof(quint32) );
-    if( -1 == bytesWritten )
+    MTP_LOG_INFO("storage" << m_storageId << "checked against its tree snapshot in"
+                 << m_treeCheckTimer.elapsed() << "ms");
+    sendStorageInfoChanged();
+}
+
+/************************************************************
+ * void FSStoragePlugin::checkTreeDirectory
+ ***********************************************************/
+void FSStoragePlugin::checkTreeDirectory( ObjHandle handle )
+{
+    // Removed since it was loaded
+    StorageItem *directory = m_objectHandlesMap.value( handle );
+    if( !directory )
     {
-        MTP_LOG_WARNING("ERROR writing no of puoids to db!!");
-        file.resize(0);
-        file.close();
         return;
     }
 
-    // Write info for each puoid
-    for( QHash<QString,MtpInt128>::const_iterator i = m_puoidsMap.constBegin() ; i != m_puoidsMap.constEnd(); ++i )
+    struct stat st;
+    QString directoryPath = directory->path();
+    QByteArray path = QFile::encodeName( directoryPath );
+    int rc = stat( path.constData(), &st );
+    if( -1 == rc || !S_ISDIR( st.st_mode ) )
     {
-        quint32 pathnameLen = i.key().size();
-        QString pathname = i.key();
-        MtpInt128 puoid = i.value();
-
-        // Write length of path name
-        bytesWritten = file.write( reinterpret_cast<const char*>(&pathnameLen), sizeof(quint32) );
-        if( -1 == bytesWritten )
+        if( directory != m_root )
         {
-            MTP_LOG_WARNING("ERROR writing pathname len to db!!");
-            file.resize(0);
-            file.close();
-            return;
+            QString itemPath = directoryPath;
+            deleteItemHelper( handle, false, true );
+            if( 0 == rc && S_ISREG( st.st_mode ) )
+            {
+                // Replaced by a file
+                addToStorage( itemPath, 0, 0, true );
+            }
         }
+        return;
+    }
 
-        // Write path name
-        QByteArray ba = pathname.toUtf8();
-        bytesWritten = file.write( reinterpret_cast<const char*>(ba.constData()), pathnameLen );
-        if( -1 == bytesWritten )
+    DirectoryStamp stamp = m_directoryStamps.value( handle );
+    if( stamp.ino && stamp.ino == (quint64)st.st_ino && stamp.mtime == stat_mtime_ns( st ) )
+    {
+        // Same entries as when it was listed, only the files may have changed
+        for( StorageItem *child = directory->m_firstChild; child; child = child->m_nextSibling )
         {
-            MTP_LOG_WARNING("ERROR writing pathname to db!!");
-            file.resize(0);
-            file.close();
-            return;
+            QByteArray childPath = QFile::encodeName( directoryPath + '/' + child->m_name );
+            if( MTP_OBF_FORMAT_Association != child->m_objectInfo->mtpObjectFormat &&
+                stat( childPath.constData(), &st ) == 0 )
+            {
+                checkTreeFile( child, st );
+            }
         }
+        return;
+    }
+
+    QVector<dir_entry> entries;
+    if( !dir_list( directoryPath, entries, &st ) )
+    {
+        return;
+    }
+    setDirectoryStamp( handle, st );
 
-        // Write puoid
-        bytesWritten = file.write( reinterpret_cast<const char*>(&puoid), sizeof(MtpInt128) );
-        if( -1 == bytesWritten )
+    QHash<QString, int> index;
+    for( int i = 0; i < entries.size(); ++i )
+    {
+        index.insert( entries[i].name, i );
+    }
+
+    QList<ObjHandle> removed;
+    for( StorageItem *child = directory->m_firstChild; child; child = child->m_nextSibling )
+    {
+        int i = index.value( child->m_name, -1 );
+        bool isDirectory = MTP_OBF_FORMAT_Association == child->m_objectInfo->mtpObjectFormat;
+        if( -1 == i || isDirectory != S_ISDIR( entries[i].st.st_mode ) )
         {
-            MTP_LOG_WARNING("ERROR writing puoid to db!!");
-            file.resize(0);
-            file.close();
-            return;
+            removed.append( child->m_handle );
+        }
+        else if( !isDirectory )
+        {
+            checkTreeFile( child, entries[i].st );
         }
     }
+    foreach( ObjHandle child, removed )
+    {
+        deleteItemHelper( child, false, true );
+    }
+
+    // Only the new ones are added
+    foreach( const dir_entry &entry, entries )
+    {
+        addToStorage( directoryPath + '/' + entry.name, 0, 0, true );
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::checkTreeFile
+ ***********************************************************/
+void FSStoragePlugin::checkTreeFile( StorageItem *item, const struct stat &st )
+{
+    if( item->m_handle == m_writeObjectHandle ||
+        ( item->m_objectInfo->mtpObjectCompressedSize == getObjectSize( st ) &&
+          item->m_objectInfo->mtpModificationDate == datetime_from_time_t( st.st_mtime ) ) )
+    {
+        return;
+    }
+
+    unindexObjectFormat( item );
+    delete item->m_objectInfo;
+    item->m_objectInfo = 0;
+    populateObjectInfo( item, st );
+    indexObjectFormat( item );
+    m_treeSnapshotDirty = true;
+
+    QVector<quint32> eventParams;
+    eventParams.append( item->m_handle );
+    emit eventGenerated(MTP_EV_ObjectInfoChanged, eventParams);
 }
 
 /************************************************************
@@ -1024,9 +1918,16 @@ MTPResponseCode FSStoragePlugin::createFile( const QString &path, MTPObjectInfo
         }
     }
 
-    /* Resize to expected content length */
+    /* Reserve the expected content length in one go, so that
+     * the file is not fragmented by growing a write at a time.
+     * FAT can only allocate beyond the end of file. */
     quint64 size = info ? info->mtpObjectCompressedSize : 0;
+    if( size && fallocate(file.handle(), 0, 0, size) == -1 &&
+        fallocate(file.handle(), FALLOC_FL_KEEP_SIZE, 0, size) == -1 ) {
+        MTP_LOG_TRACE("could not preallocate file:" << path << ":" << strerror(errno));
+    }
 
+    /* Resize to expected content length */
     if( !file.resize(size) ) {
         MTP_LOG_WARNING("failed to set file:" << path << " to size:" << size);
     }
@@ -1077,6 +1978,8 @@ void FSStoragePlugin::linkChildStorageItem( StorageItem *childStorageItem, Stora
         return;
     }
     childStorageItem->m_parent = parentStorageItem;
+    StorageItemName key = { parentStorageItem, childStorageItem->m_name };
+    m_itemNamesMap.insert( key, childStorageItem );
 
     // Parent has no children
     if( !parentStorageItem->m_firstChild )
@@ -1102,41 +2005,83 @@ void FSStoragePlugin::unlinkChildStorageItem( StorageItem *childStorageItem )
     {
         return;
     }
+    StorageItemName key = { childStorageItem->m_parent, childStorageItem->m_name };
+    if( m_itemNamesMap.value( key ) == childStorageItem )
+    {
+        m_itemNamesMap.remove( key );
+    }
 
     // If this is the first child.
     if( childStorageItem->m_parent->m_firstChild == childStorageItem)
     {
         childStorageItem->m_parent->m_firstChild = childStorageItem->m_nextSibling;
     }
-    // not the first child
-    else
+    // not the first child
+    else
+    {
+        StorageItem *itr = childStorageItem->m_parent->m_firstChild;
+        while(itr && itr->m_nextSibling != childStorageItem)
+        {
+            itr = itr->m_nextSibling;
+        }
+        if(itr)
+        {
+            itr->m_nextSibling = childStorageItem->m_nextSibling;
+        }
+    }
+    childStorageItem->m_nextSibling = 0;
+}
+
+/************************************************************
+ * StorageItem* FSStoragePlugin::findStorageItemByPath
+ ***********************************************************/
+StorageItem* FSStoragePlugin::findStorageItemByPath( const QString &path ) const
+{
+    // The root is in the maps before its children are added, m_root only after
+    StorageItem *storageItem = m_objectHandlesMap.value( 0 );
+    if( !storageItem || !path.startsWith( storageItem->m_name ) )
+    {
+        return 0;
+    }
+
+    // Walk down from the root, a name at a time
+    StorageItemName key;
+    int start = storageItem->m_name.size();
+    while( storageItem && start < path.size() )
     {
-        StorageItem *itr = childStorageItem->m_parent->m_firstChild;
-        while(itr && itr->m_nextSibling != childStorageItem)
+        if( '/' != path.at( start ) )
         {
-            itr = itr->m_nextSibling;
+            return 0;
         }
-        if(itr)
+        int end = path.indexOf( '/', start + 1 );
+        if( -1 == end )
         {
-            itr->m_nextSibling = childStorageItem->m_nextSibling;
+            end = path.size();
         }
+        key.parent = storageItem;
+        key.name = path.mid( start + 1, end - start - 1 );
+        storageItem = m_itemNamesMap.value( key );
+        start = end;
     }
-    childStorageItem->m_nextSibling = 0;
+    return storageItem;
 }
 
 /************************************************************
- * StorageItem* FSStoragePlugin::findStorageItemByPath
+ * void FSStoragePlugin::renameStorageItem
  ***********************************************************/
-StorageItem* FSStoragePlugin::findStorageItemByPath( const QString &path )
+void FSStoragePlugin::renameStorageItem( StorageItem *storageItem, const QString &name )
 {
-    StorageItem *storageItem = 0;
-    ObjHandle handle;
-    if( m_pathNamesMap.contains( path ) )
+    StorageItemName key = { storageItem->m_parent, storageItem->m_name };
+    if( m_itemNamesMap.value( key ) == storageItem )
     {
-        handle = m_pathNamesMap.value( path );
-        storageItem = m_objectHandlesMap.value( handle );
+        m_itemNamesMap.remove( key );
     }
-    return storageItem;
+    storageItem->m_name = name;
+    storageItem->m_objectInfo->mtpFileName = name;
+    key.name = name;
+    m_itemNamesMap.insert( key, storageItem );
+    m_treeSnapshotDirty = true;
+    journalPuoids( storageItem, storageItem->path() );
 }
 
 /************************************************************
@@ -1152,18 +2097,20 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
     }
 
     // If we already have StorageItem for given path...
-    if( m_pathNamesMap.contains( path ) )
+    StorageItem *existingItem = findStorageItemByPath( path );
+    if( existingItem )
     {
         if (storageItem) {
-            *storageItem = findStorageItemByPath(path);
+            *storageItem = existingItem;
         }
         return MTP_RESP_OK;
     }
 
     QScopedPointer<StorageItem> item(new StorageItem);
-    item->m_path = path;
+    int slash = path.lastIndexOf('/');
+    item->m_name = path == m_storagePath ? path : path.mid(slash + 1);
 
-    QString parentPath(item->m_path.left(item->m_path.lastIndexOf('/')));
+    QString parentPath(path.left(slash));
     StorageItem *parentItem = findStorageItemByPath(parentPath);
     linkChildStorageItem( item.data(), parentItem ? parentItem : m_root );
 
@@ -1171,6 +2118,7 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
     {
         item->m_objectInfo = new MTPObjectInfo( *info );
         item->m_objectInfo->mtpStorageId = storageId();
+        item->m_objectInfo->mtpFileName = item->m_name;
     }
     else
     {
@@ -1197,7 +2145,7 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
         {
             if (createIfNotExist)
             {
-                result = createDirectory( item->m_path );
+                result = createDirectory( path );
                 if ( result != MTP_RESP_OK )
                 {
                     unlinkChildStorageItem( item.data() );
@@ -1205,22 +2153,30 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
                 }
             }
 
+            if( m_scanner || m_lazyListing )
+            {
+                // Listed and watched already, or listed lazily
+                addScannedDirectory( item.data() );
+                break;
+            }
+
             addWatchDescriptor( item.data() );
 
             addItemToMaps( item.data() );
 
             // Recursively add StorageItems for the contents of the directory.
-            QDir dir( item->m_path );
-            dir.setFilter( QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot | QDir::Hidden );
-            QFileInfoList dirContents = dir.entryInfoList();
+            QVector<dir_entry> dirContents;
+            struct stat dirst;
+            dir_list( path, dirContents, &dirst );
+            setDirectoryStamp( item->m_handle, dirst );
             int work = 0;
-            foreach ( const QFileInfo &info, dirContents )
+            foreach ( const dir_entry &entry, dirContents )
             {
                 if (work++ % 16 == 0) {
                    // QCoreApplication::sendPostedEvents();
                    // QCoreApplication::processEvents();
                 }
-                addToStorage(info.absoluteFilePath(), 0, 0, createIfNotExist, sendEvent);
+                addToStorage(path + '/' + entry.name, 0, 0, createIfNotExist, sendEvent);
             }
             break;
         }
@@ -1228,7 +2184,7 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
         default:
             if (createIfNotExist)
             {
-                result = createFile( item->m_path, info );
+                result = createFile( path, info );
                 if ( result != MTP_RESP_OK )
                 {
                     unlinkChildStorageItem( item.data() );
@@ -1249,9 +2205,13 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
         emit eventGenerated(MTP_EV_ObjectAdded, eventParams);
     }
 
-    // Dates from our device
-    item->m_objectInfo->mtpCaptureDate = getCreatedDate( item.data() );
-    item->m_objectInfo->mtpModificationDate = getModifiedDate( item.data() );
+    // Dates from our device, populateObjectInfo() has them unless
+    // the item was described by the initiator or just created
+    if( info || createIfNotExist )
+    {
+        item->m_objectInfo->mtpModificationDate = getModifiedDate( item.data() );
+        item->m_objectInfo->mtpCaptureDate = item->m_objectInfo->mtpModificationDate;
+    }
 
     if ( storageItem )
     {
@@ -1265,25 +2225,140 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
     return MTP_RESP_OK;
 }
 
+void FSStoragePlugin::scanDirectory( const QString &path, StorageScanner::Listing &listing )
+{
+    // Watch before listing, so that no change goes unnoticed
+    listing.wd = m_inotify->addWatch( path );
+
+    QVector<dir_entry> dirContents;
+    dir_list( path, dirContents, &listing.st );
+    foreach ( const dir_entry &entry, dirContents )
+    {
+        QString itemPath = path + '/' + entry.name;
+        if ( m_excludePaths.contains(itemPath) )
+        {
+            continue;
+        }
+
+        StorageItem *item = new StorageItem;
+        item->m_name = entry.name;
+        populateObjectInfo( item, entry.st );
+        if( MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat )
+        {
+            listing.directories.append( itemPath );
+        }
+        listing.items.append( item );
+    }
+}
+
+void FSStoragePlugin::addScannedDirectory( StorageItem *directory )
+{
+    StorageScanner::Listing listing;
+    QString path = directory->path();
+    if( !m_scanner )
+    {
+        scanDirectory( path, listing );
+    }
+    else if( !m_scanner->take( path, listing ) )
+    {
+        MTP_LOG_WARNING("directory was not scanned:" << path);
+        scanDirectory( path, listing );
+    }
+
+    directory->m_wd = listing.wd;
+    if( -1 != directory->m_wd )
+    {
+        m_watchDescriptorMap[ directory->m_wd ] = directory->m_handle;
+    }
+    setDirectoryStamp( directory->m_handle, listing.st );
+    addItemToMaps( directory );
+
+    foreach ( StorageItem *item, listing.items )
+    {
+        StorageItemName key = { directory, item->m_name };
+        if( m_itemNamesMap.contains( key ) )
+        {
+            delete item;
+            continue;
+        }
+
+        item->m_handle = requestNewObjectHandle();
+        linkChildStorageItem( item, directory );
+        item->m_objectInfo->mtpParentObject = directory->m_handle;
+
+        if( MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat && m_lazyListing )
+        {
+            // Listed when needed, see listDirectory()
+            addItemToMaps( item );
+            m_unlistedDirectories.insert( item->m_handle );
+            m_crawlQueue.append( item->m_handle );
+        }
+        else if( MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat )
+        {
+            addScannedDirectory( item );
+        }
+        else
+        {
+            addItemToMaps( item );
+            m_puoidToHandleMap[item->m_puoid] = item->m_handle;
+        }
+    }
+}
+
 void FSStoragePlugin::addItemToMaps( StorageItem *item )
 {
-    // Path names map.
-    m_pathNamesMap[ item->m_path ] = item->m_handle;
+    m_treeSnapshotDirty = true;
 
     // Object handles map.
-    m_objectHandlesMap[ item->m_handle ] = item;
+    m_objectHandlesMap.insert( item->m_handle, item );
+    indexObjectFormat( item );
 
-    if( !m_puoidsMap.contains( item->m_path ) )
+    // The item keeps its PUOID from now on, see storePuoids()
+    QHash<QString, MtpInt128>::iterator i = m_puoidsMap.isEmpty() ? m_puoidsMap.end() : m_puoidsMap.find( item->path() );
+    if( i == m_puoidsMap.end() )
     {
         // Assign a new puoid
         requestNewPuoid( item->m_puoid );
-        // Add the puoid to the map.
-        m_puoidsMap[item->m_path] = item->m_puoid;
+        journalPuoid( item->path(), item->m_puoid );
     }
     else
     {
         // Use the persistent puoid.
-        item->m_puoid = m_puoidsMap[item->m_path];
+        item->m_puoid = i.value();
+        m_puoidsMap.erase( i );
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::indexObjectFormat
+ ***********************************************************/
+void FSStoragePlugin::indexObjectFormat( StorageItem *item )
+{
+    // The root is never listed
+    if( item->m_handle && item->m_objectInfo )
+    {
+        m_formatIndex[item->m_objectInfo->mtpObjectFormat].insert( item->m_handle );
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::unindexObjectFormat
+ ***********************************************************/
+void FSStoragePlugin::unindexObjectFormat( StorageItem *item )
+{
+    if( !item->m_handle || !item->m_objectInfo )
+    {
+        return;
+    }
+
+    QHash<MTPObjFormatCode, QSet<ObjHandle> >::iterator format = m_formatIndex.find( item->m_objectInfo->mtpObjectFormat );
+    if( format != m_formatIndex.end() )
+    {
+        format->remove( item->m_handle );
+        if( format->isEmpty() )
+        {
+            m_formatIndex.erase( format );
+        }
     }
 }
 
@@ -1312,7 +2387,10 @@ MTPResponseCode FSStoragePlugin::addItem( ObjHandle &parentHandle, ObjHandle &ha
         return MTP_RESP_InvalidParentObject;
     }
 
-    QString path = m_objectHandlesMap[info->mtpParentObject]->m_path + "/"
+    // Existing entries must not be taken for new ones
+    listDirectory( m_objectHandlesMap[info->mtpParentObject] );
+
+    QString path = m_objectHandlesMap[info->mtpParentObject]->path() + "/"
             + info->mtpFileName;
 
     // Add the object ( file/dir ) to the filesystem storage.
@@ -1344,6 +2422,7 @@ MTPResponseCode FSStoragePlugin::copyHandle( StoragePlugin *sourceStorage,
     {
         return MTP_RESP_InvalidParentObject;
     }
+    listDirectory( m_objectHandlesMap[parent] );
 
     const MTPObjectInfo *info;
     MTPResponseCode result = sourceStorage->getObjectInfo( source, info );
@@ -1355,7 +2434,7 @@ MTPResponseCode FSStoragePlugin::copyHandle( StoragePlugin *sourceStorage,
     MTPObjectInfo newInfo( *info );
     newInfo.mtpParentObject = parent;
 
-    QString path = m_objectHandlesMap[newInfo.mtpParentObject]->m_path + "/"
+    QString path = m_objectHandlesMap[newInfo.mtpParentObject]->path() + "/"
             + newInfo.mtpFileName;
 
     result = addToStorage( path, 0, &newInfo, false, true, source );
@@ -1401,21 +2480,27 @@ MTPResponseCode FSStoragePlugin::deleteItem( const ObjHandle& handle, const MTPO
 
     if( 0xFFFFFFFF == handle )
     {
-        // deleteItemHelper modifies m_objectHandlesMap so loop over a copy
-        QHash<ObjHandle,StorageItem*> objectHandles = m_objectHandlesMap;
-        for( QHash<ObjHandle,StorageItem*>::const_iterator i = objectHandles.constBegin() ; i != objectHandles.constEnd(); ++i )
+        finishCrawl();
+
+        // deleteItemHelper modifies m_objectHandlesMap so loop over the handles
+        foreach( ObjHandle objectHandle, m_objectHandlesMap.keys() )
         {
+            // Gone with its directory
+            storageItem = m_objectHandlesMap.value( objectHandle );
+            if( !storageItem )
+            {
+                continue;
+            }
             if( formatCode && MTP_OBF_FORMAT_Undefined != formatCode )
             {
-                storageItem = i.value();
                 if( storageItem->m_objectInfo && storageItem->m_objectInfo->mtpObjectFormat == formatCode )
                 {
-                    response = deleteItemHelper( i.key() );
+                    response = deleteItemHelper( objectHandle );
                 }
             }
             else
             {
-                response = deleteItemHelper( i.key() );
+                response = deleteItemHelper( objectHandle );
             }
             if( MTP_RESP_OK == response)
             {
@@ -1474,20 +2559,32 @@ MTPResponseCode FSStoragePlugin::deleteItemHelper( ObjHandle handle, bool remove
         return MTP_RESP_ObjectWriteProtected;
     }
 
+    if( handle == m_writeObjectHandle && m_dataFile )
+    {
+        // No point in writing the rest of a cancelled transfer
+        m_writeBehind->discard();
+    }
+
+    // Directories are removed from the bottom up
+    if( removePhysically )
+    {
+        listDirectory( storageItem );
+    }
+
     // If this is a file or an empty dir, just delete this item.
     if( !storageItem->m_firstChild )
     {
         if( removePhysically && MTP_OBF_FORMAT_Association == storageItem->m_objectInfo->mtpObjectFormat && 0 != storageItem->m_handle )
         {
-            QDir dir(storageItem->m_parent->m_path);
-            if( !dir.rmdir(storageItem->m_path) )
+            QDir dir(storageItem->m_parent->path());
+            if( !dir.rmdir(storageItem->m_name) )
             {
                 return MTP_RESP_GeneralError;
             }
         }
         else if( removePhysically )
         {
-            QFile file( storageItem->m_path );
+            QFile file( storageItem->path() );
             if( !file.remove() )
             {
                 return MTP_RESP_GeneralError;
@@ -1496,7 +2593,7 @@ MTPResponseCode FSStoragePlugin::deleteItemHelper( ObjHandle handle, bool remove
         // If this an abstract playlist, also remove the internal playlist.
         if(MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == storageItem->m_objectInfo->mtpObjectFormat)
         {
-            removePlaylist(storageItem->m_path);
+            removePlaylist(storageItem->path());
         }
 
         removeFromStorage( handle, sendEvent );
@@ -1519,7 +2616,7 @@ MTPResponseCode FSStoragePlugin::deleteItemHelper( ObjHandle handle, bool remove
         // Now delete the empty directory ( if empty! ).
         if( !itemNotDeleted )
         {
-            response = deleteItemHelper( handle );
+            response = deleteItemHelper( handle, removePhysically, sendEvent );
         }
         else
         {
@@ -1545,10 +2642,22 @@ MTPResponseCode FSStoragePlugin::removeFromStorage( ObjHandle handle, bool sendE
             // Remove watch on the path and then remove the wd from the map
             removeWatchDescriptor( storageItem );
         }
+        unindexObjectFormat( storageItem );
+        closeCachedReadFd( handle );
+        // Should the path come back, so does the PUOID, but not the
+        // references of this object: journal them empty while the
+        // PUOID can still be found
+        if( m_objectReferencesMap.remove( handle ) )
+        {
+            journalObjectReferences( handle );
+        }
         m_objectHandlesMap.remove( handle );
-        m_pathNamesMap.remove( storageItem->m_path );
+        m_puoidsMap.insert( storageItem->path(), storageItem->m_puoid );
+        m_directoryStamps.remove( handle );
+        m_unlistedDirectories.remove( handle );
         unlinkChildStorageItem( storageItem );
         delete storageItem;
+        m_treeSnapshotDirty = true;
     }
 
     if( sendEvent )
@@ -1568,13 +2677,17 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
                                                    QVector<ObjHandle> &objectHandles ) const
 {
 
+    // The handles are listed in ascending order
+    int first = objectHandles.size();
     switch( associationHandle )
     {
         // Count of all objects in this storage.
         case 0x00000000:
+            // Listing changes the tree, but not the storage it stands for
+            const_cast<FSStoragePlugin*>( this )->finishCrawl();
             if( !formatCode )
             {
-                for( QHash<ObjHandle,StorageItem*>::const_iterator i = m_objectHandlesMap.constBegin() ; i != m_objectHandlesMap.constEnd(); ++i )
+                for( ObjectTable::const_iterator i = m_objectHandlesMap.constBegin() ; i != m_objectHandlesMap.constEnd(); ++i )
                 {
                     // Don't enumerate the root.
                     if( 0 == i.key() )
@@ -1586,17 +2699,15 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
             }
             else
             {
-                for( QHash<ObjHandle,StorageItem*>::const_iterator i = m_objectHandlesMap.constBegin() ; i != m_objectHandlesMap.constEnd(); ++i )
+                QHash<MTPObjFormatCode, QSet<ObjHandle> >::const_iterator format = m_formatIndex.constFind( formatCode );
+                if( format != m_formatIndex.constEnd() )
                 {
-                    // Don't enumerate the root.
-                    if( 0 == i.key() )
+                    objectHandles.reserve( first + format->size() );
+                    foreach( ObjHandle objectHandle, *format )
                     {
-                        continue;
-                    }
-                    if( i.value()->m_objectInfo && formatCode == i.value()->m_objectInfo->mtpObjectFormat )
-                    {
-                        objectHandles.append( i.key() );
+                        objectHandles.append( objectHandle );
                     }
+                    std::sort( objectHandles.begin() + first, objectHandles.end() );
                 }
             }
             break;
@@ -1615,6 +2726,7 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
                     }
                     storageItem = storageItem->m_nextSibling;
                 }
+                std::sort( objectHandles.begin() + first, objectHandles.end() );
             }
             else
             {
@@ -1625,11 +2737,7 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
        // Count of all objects that are children of an object whose handle = associationHandle;
        default:
            //Check if the association handle is valid.
-           if( !m_objectHandlesMap.contains( associationHandle ) )
-           {
-                return MTP_RESP_InvalidParentObject;
-           }
-           StorageItem *parentItem = m_objectHandlesMap[ associationHandle ];
+           StorageItem *parentItem = m_objectHandlesMap.value( associationHandle );
            if( parentItem )
            {
                //Check if this is an association
@@ -1637,6 +2745,7 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
                {
                    return MTP_RESP_InvalidParentObject;
                }
+               const_cast<FSStoragePlugin*>( this )->listDirectory( parentItem );
                StorageItem *storageItem = parentItem->m_firstChild;
                while( storageItem )
                {
@@ -1648,6 +2757,7 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
                    }
                    storageItem = storageItem->m_nextSibling;
                }
+               std::sort( objectHandles.begin() + first, objectHandles.end() );
            }
            else
            {
@@ -1658,6 +2768,34 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
     return MTP_RESP_OK;
 }
 
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::getObjectCount
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::getObjectCount( const MTPObjFormatCode& formatCode, const quint32& associationHandle,
+                                                 quint32 &count ) const
+{
+    // Only the whole storage has its counts at hand
+    if( 0x00000000 != associationHandle )
+    {
+        QVector<ObjHandle> objectHandles;
+        MTPResponseCode response = getObjectHandles( formatCode, associationHandle, objectHandles );
+        count = objectHandles.size();
+        return response;
+    }
+
+    const_cast<FSStoragePlugin*>( this )->finishCrawl();
+    if( !formatCode )
+    {
+        // Don't count the root.
+        count = m_objectHandlesMap.size() - ( m_objectHandlesMap.contains( 0 ) ? 1 : 0 );
+    }
+    else
+    {
+        count = m_formatIndex.value( formatCode ).size();
+    }
+    return MTP_RESP_OK;
+}
+
 /************************************************************
  * bool FSStoragePlugin::checkHandle
  ***********************************************************/
@@ -1720,6 +2858,7 @@ MTPResponseCode FSStoragePlugin::copyObject( const ObjHandle &handle,
 
     // Get the source object's objectinfo dataset.
     MTPObjectInfo objectInfo  = *m_objectHandlesMap[handle]->m_objectInfo;
+    listDirectory( storageItem );
 
     MTPStorageInfo storageInfo;
     if( destinationStorage->storageInfo(storageInfo) != MTP_RESP_OK )
@@ -1779,7 +2918,7 @@ MTPResponseCode FSStoragePlugin::copyObject( const ObjHandle &handle,
     MTPResponseCode response = MTP_RESP_OK;
 
     // Apply metadata for the destination path
-    m_tracker->copy(storageItem->m_path, destinationPath);
+    m_tracker->copy(storageItem->path(), destinationPath);
 
     // Create the new item.
     ObjHandle ignoredHandle;
@@ -1827,34 +2966,24 @@ MTPResponseCode FSStoragePlugin::copyObject( const ObjHandle &handle,
 }
 
 /************************************************************
- * void FSStoragePlugin::adjustMovedItemsPath
+ * void FSStoragePlugin::moveChildrenInTracker
  ***********************************************************/
-void FSStoragePlugin::adjustMovedItemsPath( QString newAncestorPath, StorageItem* movedItem, bool updateInTracker /*= false*/ )
+void FSStoragePlugin::moveChildrenInTracker( const QString &oldPath, StorageItem *directory )
 {
-    if( !movedItem )
-    {
-        return;
-    }
-
-    m_pathNamesMap.remove( movedItem->m_path );
-    QString destinationPath = newAncestorPath + "/" + movedItem->m_objectInfo->mtpFileName;
-    if(true == updateInTracker)
+    StorageItem *itr = directory->m_firstChild;
+    while( itr )
     {
         // Move the URI in tracker too
-        m_tracker->move(movedItem->m_path, destinationPath);
+        QString sourcePath = oldPath + "/" + itr->m_name;
+        QString destinationPath = itr->path();
+        m_tracker->move(sourcePath, destinationPath);
 
-        if( MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == movedItem->m_objectInfo->mtpObjectFormat )
+        if( MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == itr->m_objectInfo->mtpObjectFormat )
         {
             // If this is a playlist, also need to update the playlist URL
-            m_tracker->movePlaylist(movedItem->m_path, destinationPath);
+            m_tracker->movePlaylist(sourcePath, destinationPath);
         }
-    }
-    movedItem->m_path = destinationPath;
-    m_pathNamesMap[movedItem->m_path] = movedItem->m_handle;
-    StorageItem *itr = movedItem->m_firstChild;
-    while( itr )
-    {
-        adjustMovedItemsPath( movedItem->m_path, itr, updateInTracker );
+        moveChildrenInTracker( sourcePath, itr );
         itr = itr->m_nextSibling;
     }
 }
@@ -1894,18 +3023,20 @@ MTPResponseCode FSStoragePlugin::moveObject( const ObjHandle &handle,
         return MTP_RESP_GeneralError;
     }
 
-    if( storageItem->m_path == m_playlistPath )
+    QString sourcePath = storageItem->path();
+    if( sourcePath == m_playlistPath )
     {
         MTP_LOG_WARNING("Don't play around with the Playlists directory!");
         return MTP_RESP_AccessDenied;
     }
 
-    QString destinationPath = parentItem->m_path + "/" + storageItem->m_objectInfo->mtpFileName;
+    QString destinationPath = parentItem->path() + "/" + storageItem->m_name;
+    listDirectory( parentItem );
 
     // If this is a directory already exists, don't overwrite it.
     if( MTP_OBF_FORMAT_Association == storageItem->m_objectInfo->mtpObjectFormat )
     {
-        if( m_pathNamesMap.contains( destinationPath ) )
+        if( findStorageItemByPath( destinationPath ) )
         {
             return MTP_RESP_InvalidParentObject;
         }
@@ -1918,41 +3049,36 @@ MTPResponseCode FSStoragePlugin::moveObject( const ObjHandle &handle,
     if( movePhysically )
     {
         QDir dir;
-        if ( !dir.rename( storageItem->m_path, destinationPath ) )
+        if ( !dir.rename( sourcePath, destinationPath ) )
         {
             // Move failed; restore original watch descriptors.
             addWatchDescriptorRecursively( storageItem );
             return MTP_RESP_InvalidParentObject;
         }
     }
-    m_pathNamesMap.remove( storageItem->m_path );
-    m_pathNamesMap[destinationPath] = handle;
 
     // Unlink this item from its current parent.
     unlinkChildStorageItem( storageItem );
 
-    StorageItem *itr = storageItem->m_firstChild;
-    while( itr )
-    {
-        adjustMovedItemsPath( destinationPath, itr, true );
-        itr = itr->m_nextSibling;
-    }
-
-    // link it to the new parent
+    // link it to the new parent, which gives it and its children their new paths
     linkChildStorageItem( storageItem, parentItem );
+    m_puoidsMap.remove( destinationPath );
+    journalPuoids( storageItem, destinationPath );
+    m_treeSnapshotDirty = true;
+    moveChildrenInTracker( sourcePath, storageItem );
+
     //storageItem->m_nextSibling = 0;
     // Reset URI in tracker and ask it to ignore
-    m_tracker->move(storageItem->m_path, destinationPath);
+    m_tracker->move(sourcePath, destinationPath);
 
     if(storageItem->m_objectInfo &&
             MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == storageItem->m_objectInfo->mtpObjectFormat)
     {
         // If this is a playlist, also need to update the playlist URL
-        m_tracker->movePlaylist(storageItem->m_path, destinationPath);
+        m_tracker->movePlaylist(sourcePath, destinationPath);
     }
 
-    // update it's path and parent object.
-    storageItem->m_path = destinationPath;
+    // update it's parent object.
     storageItem->m_objectInfo->mtpParentObject = parentHandle;
     // create new watch descriptors for the moved item.
     addWatchDescriptorRecursively( storageItem );
@@ -1970,7 +3096,7 @@ void FSStoragePlugin::getFileListRecursively(const StorageItem *storageItem, con
         return;
     }
     // Add this iri to the list
-    fileList.append(m_tracker->generateIri(storageItem->m_path));
+    fileList.append(m_tracker->generateIri(storageItem->path()));
     // Add the destination iri to the list
     fileList.append(m_tracker->generateIri(destinationPath));
     StorageItem *itr = storageItem->m_firstChild;
@@ -2012,6 +3138,27 @@ MTPResponseCode FSStoragePlugin::getObjectInfo( const ObjHandle &handle, const M
  * MTPResponseCode FSStoragePlugin::populateObjectInfo
  ***********************************************************/
 void FSStoragePlugin::populateObjectInfo( StorageItem *storageItem )
+{
+    if( !storageItem || storageItem->m_objectInfo )
+    {
+        return;
+    }
+
+    struct stat st;
+    QByteArray utf8 = storageItem->path().toUtf8();
+    if( stat( utf8.constData(), &st ) == -1 )
+    {
+        MTP_LOG_WARNING(utf8 << "could not stat");
+        memset( &st, 0, sizeof st );
+        st.st_mtime = -1;
+    }
+    populateObjectInfo( storageItem, st );
+}
+
+/************************************************************
+ * void FSStoragePlugin::populateObjectInfo
+ ***********************************************************/
+void FSStoragePlugin::populateObjectInfo( StorageItem *storageItem, const struct stat &st )
 {
     if( !storageItem )
     {
@@ -2028,16 +3175,16 @@ void FSStoragePlugin::populateObjectInfo( StorageItem *storageItem )
 
     // storage id.
     storageItem->m_objectInfo->mtpStorageId = m_storageId;
-    // file name
-    QString name = storageItem->m_path;
-    name = name.remove(0,storageItem->m_path.lastIndexOf("/") + 1);
-    storageItem->m_objectInfo->mtpFileName = name;
+    // file name, shares the item's name unless this is the root
+    const QString &name = storageItem->m_name;
+    int slash = name.lastIndexOf('/');
+    storageItem->m_objectInfo->mtpFileName = -1 == slash ? name : name.mid(slash + 1);
     // object format.
-    storageItem->m_objectInfo->mtpObjectFormat = getObjectFormatByExtension( storageItem );
+    storageItem->m_objectInfo->mtpObjectFormat = getObjectFormatByExtension( storageItem, st );
     // protection status.
     storageItem->m_objectInfo->mtpProtectionStatus = getMTPProtectionStatus( storageItem );
     // object size.
-    storageItem->m_objectInfo->mtpObjectCompressedSize = getObjectSize( storageItem );
+    storageItem->m_objectInfo->mtpObjectCompressedSize = getObjectSize( st );
     // thumb size
     storageItem->m_objectInfo->mtpThumbCompressedSize = getThumbCompressedSize( storageItem );
     // thumb format
@@ -2055,15 +3202,14 @@ void FSStoragePlugin::populateObjectInfo( StorageItem *storageItem )
     // parent object.
     storageItem->m_objectInfo->mtpParentObject = storageItem->m_parent ? storageItem->m_parent->m_handle : 0x00000000;
     // association type
-    storageItem->m_objectInfo->mtpAssociationType = getAssociationType( storageItem );
+    storageItem->m_objectInfo->mtpAssociationType = getAssociationType( st );
     // association description
     storageItem->m_objectInfo->mtpAssociationDescription = getAssociationDescription( storageItem );
     // sequence number
     storageItem->m_objectInfo->mtpSequenceNumber = getSequenceNumber( storageItem );
-    // date created
-    storageItem->m_objectInfo->mtpCaptureDate = getCreatedDate( storageItem );
-    // date modified
-    storageItem->m_objectInfo->mtpModificationDate = getModifiedDate( storageItem );
+    // date modified, also used as date created, see getCreatedDate()
+    storageItem->m_objectInfo->mtpModificationDate = datetime_from_time_t( st.st_mtime );
+    storageItem->m_objectInfo->mtpCaptureDate = storageItem->m_objectInfo->mtpModificationDate;
 
     // keywords.
     storageItem->m_objectInfo->mtpKeywords = getKeywords( storageItem );
@@ -2074,22 +3220,23 @@ void FSStoragePlugin::populateObjectInfo( StorageItem *storageItem )
 /************************************************************
  * quint16 FSStoragePlugin::getObjectFormatByExtension
  ***********************************************************/
-quint16 FSStoragePlugin::getObjectFormatByExtension( StorageItem *storageItem )
+quint16 FSStoragePlugin::getObjectFormatByExtension( StorageItem *storageItem, const struct stat &st )
 {
     // TODO Fetch from tracker or determine from the file.
     quint16 format = MTP_OBF_FORMAT_Undefined;
 
-    QFileInfo item(storageItem->m_path);
-    if( item.isDir() )
+    if( S_ISDIR( st.st_mode ) )
     {
         format = MTP_OBF_FORMAT_Association;
     }
     else //file
     {
-        QString ext = storageItem->m_path.section('.',-1).toLower();
-        if( m_formatByExtTable.contains( ext ) )
+        // Called from the scanner threads too, use const lookups only
+        int dot = storageItem->m_name.lastIndexOf('.');
+        if( -1 != dot )
         {
-            format = m_formatByExtTable[ext];
+            QString ext = storageItem->m_name.mid(dot + 1).toLower();
+            format = m_formatByExtTable.value( ext, format );
         }
     }
     return format;
@@ -2107,16 +3254,11 @@ quint16 FSStoragePlugin::getMTPProtectionStatus( StorageItem* /*storageItem*/ )
 /************************************************************
  * quint64 FSStoragePlugin::getObjectSize
  ***********************************************************/
-quint64 FSStoragePlugin::getObjectSize( StorageItem *storageItem )
+quint64 FSStoragePlugin::getObjectSize( const struct stat &st )
 {
-    if( !storageItem )
-    {
-        return 0;
-    }
-    QFileInfo item( storageItem->m_path );
-    if( item.isFile() )
+    if( S_ISREG( st.st_mode ) )
     {
-        return item.size();
+        return st.st_size;
     }
     return 0;
 }
@@ -2141,7 +3283,7 @@ bool FSStoragePlugin::isThumbnailableImage( StorageItem *storageItem )
 
     if( storageItem ) {
         for( size_t i = 0; extension[i]; ++i ) {
-            if( storageItem->m_path.endsWith(extension[i]) )
+            if( storageItem->m_name.endsWith(extension[i]) )
                 return true;
         }
     }
@@ -2218,10 +3360,9 @@ quint32 FSStoragePlugin::getImagePixelHeight( StorageItem * /*storageItem*/ )
 /************************************************************
  * quint16 FSStoragePlugin::getAssociationType
  ***********************************************************/
-quint16 FSStoragePlugin::getAssociationType( StorageItem *storageItem )
+quint16 FSStoragePlugin::getAssociationType( const struct stat &st )
 {
-    QFileInfo item(storageItem->m_path);
-    if( item.isDir() )
+    if( S_ISDIR( st.st_mode ) )
     {
         // GenFolder is the only type used in MTP.
         // The others may be used for PTP compatibility but are not required.
@@ -2278,7 +3419,7 @@ QString FSStoragePlugin::getCreatedDate( StorageItem *storageItem )
  ***********************************************************/
 QString FSStoragePlugin::getModifiedDate( StorageItem *storageItem )
 {
-    time_t t = file_get_mtime(storageItem->m_path);
+    time_t t = file_get_mtime(storageItem->path());
     return datetime_from_time_t(t);
 }
 
@@ -2296,7 +3437,9 @@ char* FSStoragePlugin::getKeywords( StorageItem * /*storageItem*/ )
  ***********************************************************/
 MTPResponseCode FSStoragePlugin::readData( const ObjHandle &handle, char *readBuffer, qint32 &readBufferLen, quint32 readOffset )
 {
-    if( !checkHandle( handle ) )
+    // Get the corresponding storage item.
+    StorageItem *storageItem = m_objectHandlesMap.value( handle );
+    if( !storageItem )
     {
         return MTP_RESP_InvalidObjectHandle;
     }
@@ -2306,46 +3449,199 @@ MTPResponseCode FSStoragePlugin::readData( const ObjHandle &handle, char *readBu
         return MTP_RESP_GeneralError;
     }
 
-    // Get the corresponding storage item.
-    StorageItem *storageItem = m_objectHandlesMap[handle];
-    if( !storageItem )
+    // Segmented reads of the same file share an open descriptor
+    CachedFd *cached = cachedReadFd( storageItem );
+    if( !cached )
     {
         return MTP_RESP_GeneralError;
     }
 
-    // Open the file and read from it.
     qint32 bytesToRead = readBufferLen;
-    QFile file( storageItem->m_path );
-    if( !file.open( QIODevice::ReadOnly ) )
+    readBufferLen = 0;
+    while( bytesToRead > 0 )
     {
-        return MTP_RESP_GeneralError;
+        ssize_t bytesRead = pread( cached->fd, readBuffer + readBufferLen, bytesToRead, (off_t)readOffset + readBufferLen );
+        if( -1 == bytesRead )
+        {
+            if( EINTR == errno )
+            {
+                continue;
+            }
+            MTP_LOG_WARNING("ERROR reading" << storageItem->path() << ":" << strerror(errno));
+            return MTP_RESP_GeneralError;
+        }
+        // The range asked for goes past the end of the file
+        if( 0 == bytesRead )
+        {
+            return MTP_RESP_GeneralError;
+        }
+        readBufferLen += bytesRead;
+        bytesToRead -= bytesRead;
     }
-    qint64 fileSize = file.size();
-    if(fileSize < (readOffset + bytesToRead))
+
+    if( storageItem->m_objectInfo )
     {
-        return MTP_RESP_GeneralError;
+        adviseRead( cached, readOffset, (quint64)readOffset + readBufferLen, storageItem->m_objectInfo->mtpObjectCompressedSize );
+    }
+    return MTP_RESP_OK;
+}
+
+/************************************************************
+ * FSStoragePlugin::CachedFd *FSStoragePlugin::cachedReadFd
+ ***********************************************************/
+FSStoragePlugin::CachedFd *FSStoragePlugin::cachedReadFd( StorageItem *item )
+{
+    for( int i = 0; i < m_readFds.size(); ++i )
+    {
+        if( m_readFds.at(i).handle == item->m_handle )
+        {
+            // Most recently used first
+            m_readFds.move( i, 0 );
+            return &m_readFds.first();
+        }
     }
-    if( !file.seek(readOffset) )
+
+    int fd = open( item->path().toUtf8().constData(), O_RDONLY | O_CLOEXEC );
+    if( -1 == fd )
     {
-        MTP_LOG_WARNING("ERROR seeking file");
-        return MTP_RESP_GeneralError;
+        MTP_LOG_WARNING("Could not open" << item->path() << ":" << strerror(errno));
+        return 0;
     }
-    // TODO: Read this in a loop?
-    readBufferLen = 0;
-    do{
-        readBufferLen = file.read( readBuffer, bytesToRead );
-        if( -1 == readBufferLen )
+
+    if( m_readFds.size() >= READ_FD_CACHE_SIZE )
+    {
+        close( m_readFds.takeLast().fd );
+    }
+    CachedFd cached;
+    cached.handle = item->m_handle;
+    cached.fd = fd;
+    cached.advice = -1;
+    cached.sequentialReads = 0;
+    cached.next = 0;
+    cached.readAhead = 0;
+    cached.dropped = 0;
+    m_readFds.prepend( cached );
+    return &m_readFds.first();
+}
+
+/************************************************************
+ * void FSStoragePlugin::adviseRead
+ ***********************************************************/
+void FSStoragePlugin::adviseRead( CachedFd *cached, quint64 offset, quint64 end, quint64 size )
+{
+    if( READ_ADVICE_NONE == m_readAdvice )
+    {
+        return;
+    }
+
+    bool sequential = READ_ADVICE_SEQUENTIAL == m_readAdvice;
+    if( READ_ADVICE_AUTO == m_readAdvice )
+    {
+        cached->sequentialReads = offset == cached->next ? cached->sequentialReads + 1 : 0;
+        sequential = cached->sequentialReads >= SEQUENTIAL_READS;
+    }
+    cached->next = end;
+
+    int advice = sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM;
+    if( advice != cached->advice )
+    {
+        posix_fadvise( cached->fd, 0, 0, advice );
+        cached->advice = advice;
+    }
+
+    if( !sequential )
+    {
+        // A stream starting here is read ahead and dropped from here on
+        cached->readAhead = end;
+        cached->dropped = end;
+        return;
+    }
+
+    // Keep a window ahead of the reader on its way into the page cache,
+    // asking for the next half window as soon as the first one is used
+    if( cached->readAhead < end + READ_AHEAD_WINDOW / 2 && cached->readAhead < size )
+    {
+        quint64 from = qMax( cached->readAhead, end );
+        quint64 to = qMin( from + READ_AHEAD_WINDOW, size );
+        if( from < to )
         {
-            return MTP_RESP_GeneralError;
+            posix_fadvise( cached->fd, from, to - from, POSIX_FADV_WILLNEED );
         }
-        bytesToRead -= readBufferLen;
-    }while(bytesToRead);
-    // FIXME: Repeated opening and closing of the file will happen when we do segmented reads.
-    // This must be avoided
-    file.close();
+        cached->readAhead = to;
+    }
+
+    if( m_dropBehind )
+    {
+        if( end >= size )
+        {
+            // The whole file has been sent
+            posix_fadvise( cached->fd, 0, 0, POSIX_FADV_DONTNEED );
+            cached->dropped = end;
+        }
+        else if( end >= cached->dropped + READ_AHEAD_WINDOW )
+        {
+            // The data sent is not read again
+            posix_fadvise( cached->fd, cached->dropped, end - cached->dropped, POSIX_FADV_DONTNEED );
+            cached->dropped = end;
+        }
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::closeCachedReadFd
+ ***********************************************************/
+void FSStoragePlugin::closeCachedReadFd( ObjHandle handle )
+{
+    for( int i = 0; i < m_readFds.size(); ++i )
+    {
+        if( m_readFds.at(i).handle == handle )
+        {
+            close( m_readFds.takeAt(i).fd );
+            return;
+        }
+    }
+}
+
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::openData
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::openData( const ObjHandle &handle, int &fd )
+{
+    StorageItem *storageItem = m_objectHandlesMap.value( handle );
+    if( !storageItem )
+    {
+        return MTP_RESP_InvalidObjectHandle;
+    }
+
+    fd = open( storageItem->path().toUtf8().constData(), O_RDONLY | O_CLOEXEC );
+    if( -1 == fd )
+    {
+        MTP_LOG_WARNING("Could not open" << storageItem->path() << ":" << strerror(errno));
+        return MTP_RESP_GeneralError;
+    }
+
+    // The data is sent from start to end
+    if( READ_ADVICE_NONE != m_readAdvice )
+    {
+        posix_fadvise( fd, 0, 0, READ_ADVICE_RANDOM == m_readAdvice ? POSIX_FADV_RANDOM : POSIX_FADV_SEQUENTIAL );
+    }
     return MTP_RESP_OK;
 }
 
+/************************************************************
+ * void FSStoragePlugin::closeData
+ ***********************************************************/
+void FSStoragePlugin::closeData( const ObjHandle &handle, int fd )
+{
+    Q_UNUSED(handle);
+
+    if( m_dropBehind )
+    {
+        posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+    }
+    close( fd );
+}
+
 /************************************************************
  * MTPResponseCode FSStoragePlugin::truncateItem
  ***********************************************************/
@@ -2360,10 +3656,16 @@ MTPResponseCode FSStoragePlugin::truncateItem( const ObjHandle &handle, const qu
     StorageItem *storageItem = m_objectHandlesMap[handle];
     if( !storageItem || !storageItem->m_objectInfo || MTP_OBF_FORMAT_Association == storageItem->m_objectInfo->mtpObjectFormat )
     {
-        return MTP_RESP_GeneralError;
+        return MTP_RESP_GeneralError;
+    }
+
+    if( handle == m_writeObjectHandle && m_dataFile )
+    {
+        // Don't let queued data be written past the new end
+        m_writeBehind->discard();
     }
 
-    QFile file( storageItem->m_path );
+    QFile file( storageItem->path() );
     if( !file.resize( size ) )
     {
         return MTP_RESP_GeneralError;
@@ -2377,26 +3679,35 @@ MTPResponseCode FSStoragePlugin::truncateItem( const ObjHandle &handle, const qu
  ***********************************************************/
 MTPResponseCode FSStoragePlugin::writeData( const ObjHandle &handle, char *writeBuffer, quint32 bufferLen, bool isFirstSegment, bool isLastSegment )
 {
-    if( !checkHandle( handle ) )
-    {
-        return MTP_RESP_InvalidObjectHandle;
-    }
-
     // Get the corresponding storage item.
-    StorageItem *storageItem = m_objectHandlesMap[handle];
+    StorageItem *storageItem = m_objectHandlesMap.value( handle );
     if( !storageItem )
     {
-        return MTP_RESP_GeneralError;
+        return MTP_RESP_InvalidObjectHandle;
     }
 
+    MTPResponseCode result = MTP_RESP_OK;
     if( ( true == isLastSegment ) && ( 0 == writeBuffer ) )
     {
         m_writeObjectHandle = 0;
         if( m_dataFile )
         {
+            /* Wait for the data still queued */
+            quint64 written = 0;
+            if( !m_writeBehind->finish( &written ) )
+            {
+                MTP_LOG_WARNING("ERROR writing data to" << storageItem->path());
+                result = MTP_RESP_GeneralError;
+            }
+
             /* Truncate at current write offset */
-            m_dataFile->flush();
-            m_dataFile->resize(m_dataFile->pos());
+            m_dataFile->resize(written);
+
+            if( m_syncOnClose && fsync(m_dataFile->handle()) == -1 )
+            {
+                MTP_LOG_WARNING("ERROR syncing" << storageItem->path() << ":" << strerror(errno));
+                result = MTP_RESP_GeneralError;
+            }
 
             /* Close the file */
             m_dataFile->close();
@@ -2408,7 +3719,7 @@ MTPResponseCode FSStoragePlugin::writeData( const ObjHandle &handle, char *write
              * value. */
             MTPObjectInfo *info = storageItem->m_objectInfo;
             time_t t = datetime_to_time_t(info->mtpModificationDate);
-            file_set_mtime(storageItem->m_path, t);
+            file_set_mtime(storageItem->path(), t);
 
             /* In any case update the cached values according to
              * what is actually used by thefilesystem. */
@@ -2419,12 +3730,14 @@ MTPResponseCode FSStoragePlugin::writeData( const ObjHandle &handle, char *write
     else
     {
         m_writeObjectHandle = handle;
-        qint32 bytesRemaining = bufferLen;
         // Resize file to zero, if first segment
         if(isFirstSegment)
         {
+            // The contents are about to be replaced
+            closeCachedReadFd( handle );
+
             // Open the file and write to it.
-            m_dataFile = new QFile( storageItem->m_path );
+            m_dataFile = new QFile( storageItem->path() );
 
             bool already_exists = m_dataFile->exists();
 
@@ -2440,48 +3753,43 @@ MTPResponseCode FSStoragePlugin::writeData( const ObjHandle &handle, char *write
                  * (= "nemo") over the effective gid (= "privileged"). */
                 if( fchown(m_dataFile->handle(), getuid(), getgid()) == -1 ) {
                     MTP_LOG_WARNING("failed to set file:"
-				    << storageItem->m_path << " ownership");
+				    << storageItem->path() << " ownership");
                 }
             }
 
             /* In all likelihood we've already created the file
              * via createFile() method and it should  have correct
              * target size -> start overwriting from offset zero. */
-            m_dataFile->seek(0);
-
+            m_writeBehind->begin( m_dataFile->handle() );
 
             /* Opening the file changes modify time, put it back
              * to expected/cached value */
             MTPObjectInfo *info = storageItem->m_objectInfo;
             time_t t = datetime_to_time_t(info->mtpModificationDate);
-            file_set_mtime(storageItem->m_path, t);
+            file_set_mtime(storageItem->path(), t);
         }
 
-        while( bytesRemaining && m_dataFile )
+        // The data is copied and written on m_writeBehind's thread, a
+        // failure is reported by one of the following calls
+        if( bufferLen && m_dataFile && !m_writeBehind->write( writeBuffer, bufferLen ) )
         {
-            qint32 bytesWritten = m_dataFile->write( writeBuffer, bytesRemaining );
-            if( -1 == bytesWritten )
+            MTP_LOG_WARNING("ERROR writing data to" << storageItem->path());
+            //Send a store full event if there's no space.
+            /*MTPResponseCode resp;
+            MTPObjectInfo objectInfo;
+            resp = getObjectInfo( handle, &objectInfo );
+            quint64 freeSpaceRemaining = 0;
+            resp = freeSpace( freeSpaceRemaining );
+            if( freeSpaceRemaining < objectInfo.mtpObjectCompressedSize )
             {
-                MTP_LOG_WARNING("ERROR writing data to" << storageItem->m_path);
-                //Send a store full event if there's no space.
-                /*MTPResponseCode resp;
-                MTPObjectInfo objectInfo;
-                resp = getObjectInfo( handle, &objectInfo );
-                quint64 freeSpaceRemaining = 0;
-                resp = freeSpace( freeSpaceRemaining );
-                if( freeSpaceRemaining < objectInfo.mtpObjectCompressedSize )
-                {
-                    QVector<quint32> params;
-                    params.append(m_storageId);
-                    emit eventGenerated(MTP_EV_StoreFull, params, QString());
-                }*///TODO Fixme eventGenerated not working.
-                return MTP_RESP_GeneralError;
-            }
-            bytesRemaining -= bytesWritten;
-            writeBuffer += bytesWritten;
+                QVector<quint32> params;
+                params.append(m_storageId);
+                emit eventGenerated(MTP_EV_StoreFull, params, QString());
+            }*///TODO Fixme eventGenerated not working.
+            return MTP_RESP_GeneralError;
         }
     }
-    return MTP_RESP_OK;
+    return result;
 }
 
 /************************************************************
@@ -2500,7 +3808,7 @@ MTPResponseCode FSStoragePlugin::getPath( const quint32 &handle, QString &path )
         return MTP_RESP_GeneralError;
     }
 
-    path = storageItem->m_path;
+    path = storageItem->path();
     return MTP_RESP_OK;
 }
 
@@ -2510,7 +3818,7 @@ MTPResponseCode FSStoragePlugin::getPath( const quint32 &handle, QString &path )
 MTPResponseCode FSStoragePlugin::getEventsEnabled( const quint32 &handle, bool &eventsEnabled ) const
 {
     MTPResponseCode result = MTP_RESP_OK;
-    StorageItem *storageItem = m_objectHandlesMap.value(handle, 0);
+    StorageItem *storageItem = m_objectHandlesMap.value(handle);
     if( storageItem )
         eventsEnabled = storageItem->eventsAreEnabled();
     else
@@ -2530,8 +3838,8 @@ void FSStoragePlugin::dumpStorageItem( StorageItem *storageItem, bool recurse )
     }
 
     ObjHandle parentHandle = storageItem->m_parent ? storageItem->m_parent->m_handle : 0;
-    QString parentPath = storageItem->m_parent ? storageItem->m_parent->m_path : "";
-    MTP_LOG_INFO("\n<" << storageItem->m_handle << "," << storageItem->m_path
+    QString parentPath = storageItem->m_parent ? storageItem->m_parent->path() : "";
+    MTP_LOG_INFO("\n<" << storageItem->m_handle << "," << storageItem->path()
                       << "," << parentHandle << "," << parentPath << ">");
 
     if( recurse )
@@ -2557,6 +3865,9 @@ void FSStoragePlugin::inotifyEventSlot( struct inotify_event *event )
     getCachedInotifyEvent( &fromEvent, fromNameString );
     QByteArray ba = fromNameString.toUtf8();
 
+    // Object info may change without the tree changing
+    m_treeSnapshotDirty = true;
+
     // Trick to handle the last non-paired IN_MOVED_FROM
     if (!event)
     {
@@ -2627,11 +3938,156 @@ void FSStoragePlugin::inotifyEventSlot( struct inotify_event *event )
     }
 }
 
+/************************************************************
+ * void FSStoragePlugin::queueInotifyEvent
+ ***********************************************************/
+void FSStoragePlugin::queueInotifyEvent( struct inotify_event *event )
+{
+    if( !event->len )
+    {
+        return;
+    }
+
+    // FSInotify delivers one change per event, so the coalescing below
+    // sees each of them in order
+    QueuedInotifyEvent queued;
+    queued.wd = event->wd;
+    queued.mask = event->mask;
+    queued.cookie = event->cookie;
+    queued.moveTo = -1;
+    queued.name = QByteArray( event->name );
+    InotifyName key( queued.wd, queued.name );
+    int index = m_inotifyEvents.size();
+
+    // Coalesced with the events still queued for the same name
+    if( queued.mask & IN_CLOSE_WRITE )
+    {
+        // Added with what was written, or already queued for update
+        if( m_inotifyCreated.value( key, -1 ) >= m_inotifyEventsApplied ||
+            m_inotifyModified.value( key, -1 ) >= m_inotifyEventsApplied )
+        {
+            queued.mask &= ~IN_CLOSE_WRITE;
+        }
+        else
+        {
+            m_inotifyModified.insert( key, index );
+        }
+    }
+    if( queued.mask & ( IN_DELETE | IN_MOVED_FROM ) )
+    {
+        int created = m_inotifyCreated.value( key, -1 );
+        if( ( queued.mask & IN_DELETE ) && created >= m_inotifyEventsApplied &&
+            !( m_inotifyEvents[created].mask & ~( IN_CREATE | IN_ISDIR ) ) )
+        {
+            // Created and deleted before it was added
+            m_inotifyEvents[created].mask = 0;
+            queued.mask &= ~IN_DELETE;
+        }
+        m_inotifyCreated.remove( key );
+        m_inotifyModified.remove( key );
+    }
+    if( queued.mask & IN_MOVED_FROM )
+    {
+        m_inotifyMovesFrom.insert( queued.cookie, index );
+    }
+    if( queued.mask & IN_MOVED_TO )
+    {
+        // The other half of the move, however far apart they were queued
+        int from = m_inotifyMovesFrom.value( queued.cookie, -1 );
+        if( from >= m_inotifyEventsApplied )
+        {
+            m_inotifyEvents[from].moveTo = index;
+            m_inotifyMovesFrom.remove( queued.cookie );
+        }
+    }
+    if( queued.mask & IN_CREATE )
+    {
+        // Not if the name is in the tree already, as after addItem()
+        StorageItem *parent = m_objectHandlesMap.value( m_watchDescriptorMap.value( queued.wd ) );
+        StorageItemName name = { parent, QString( queued.name ) };
+        if( parent && parent->m_wd == queued.wd && !m_itemNamesMap.contains( name ) )
+        {
+            m_inotifyCreated.insert( key, index );
+        }
+    }
+
+    if( queued.mask & ~IN_ISDIR )
+    {
+        m_inotifyEvents.append( queued );
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::processInotifyEvents
+ ***********************************************************/
+void FSStoragePlugin::processInotifyEvents()
+{
+    QElapsedTimer elapsed;
+    elapsed.start();
+
+    // Once at the end, not after every object
+    m_storageInfoChangeDeferred = true;
+
+    union
+    {
+        struct inotify_event event;
+        char buffer[sizeof(struct inotify_event) + NAME_MAX + 1];
+    } e;
+    while( m_inotifyEventsApplied < m_inotifyEvents.size() && elapsed.elapsed() < INOTIFY_BATCH_MSECS )
+    {
+        int index = m_inotifyEventsApplied++;
+        const QueuedInotifyEvent &queued = m_inotifyEvents.at( index );
+        if( !queued.mask )
+        {
+            // Coalesced
+            continue;
+        }
+        int moveTo = queued.moveTo;
+        for( int i = 0; i < 2 && -1 != index; ++i )
+        {
+            // A move is handled as one, with its IN_MOVED_TO right after the IN_MOVED_FROM
+            QueuedInotifyEvent &half = m_inotifyEvents[index];
+            int nameLen = qMin( half.name.size(), NAME_MAX );
+            e.event.wd = half.wd;
+            e.event.mask = half.mask;
+            e.event.cookie = half.cookie;
+            e.event.len = nameLen + 1;
+            memcpy( e.event.name, half.name.constData(), nameLen );
+            e.event.name[nameLen] = 0;
+            half.mask = 0;
+            inotifyEventSlot( &e.event );
+            index = moveTo;
+        }
+    }
+
+    m_storageInfoChangeDeferred = false;
+    if( m_storageInfoChangePending )
+    {
+        m_storageInfoChangePending = false;
+        sendStorageInfoChanged();
+    }
+
+    if( m_inotifyEventsApplied < m_inotifyEvents.size() )
+    {
+        // The rest after the initiator has been served
+        m_inotifyTimer->start();
+        return;
+    }
+    m_inotifyEvents.clear();
+    m_inotifyEventsApplied = 0;
+    m_inotifyCreated.clear();
+    m_inotifyModified.clear();
+    m_inotifyMovesFrom.clear();
+}
+
 /************************************************************
  * MTPResponseCode FSStoragePlugin::getReferences
  ***********************************************************/
 MTPResponseCode FSStoragePlugin::getReferences( const ObjHandle &handle , QVector<ObjHandle> &references )
 {
+    // The references are read once all objects are there
+    finishCrawl();
+
     if( !m_objectHandlesMap.contains( handle ) )
     {
         removeInvalidObjectReferences( handle );
@@ -2665,6 +4121,8 @@ MTPResponseCode FSStoragePlugin::getReferences( const ObjHandle &handle , QVecto
 //TODO Do we have cases where we need to set our own references (ie not due to initiator's request)
 MTPResponseCode FSStoragePlugin::setReferences( const ObjHandle &handle , const QVector<ObjHandle> &references )
 {
+    finishCrawl();
+
     StorageItem *playlist = m_objectHandlesMap.value(handle);
     StorageItem *reference = 0;
     if( 0 == playlist || 0 == playlist->m_objectInfo )
@@ -2683,14 +4141,15 @@ MTPResponseCode FSStoragePlugin::setReferences( const ObjHandle &handle , const
         if(true == savePlaylist)
         {
             // Append the path to the entries list
-            entries.append(reference->m_path);
+            entries.append(reference->path());
         }
     }
     m_objectReferencesMap[handle] = references;
+    journalObjectReferences( handle );
     // Trigger a save of playlists into tracker
     if(true == savePlaylist)
     {
-        QString playlistId = m_tracker->savePlaylist(playlist->m_path, entries);
+        QString playlistId = m_tracker->savePlaylist(playlist->path(), entries);
     }
     return MTP_RESP_OK;
 }
@@ -2700,29 +4159,18 @@ MTPResponseCode FSStoragePlugin::setReferences( const ObjHandle &handle , const
  ***********************************************************/
 void FSStoragePlugin::removeInvalidObjectReferences( const ObjHandle &handle )
 {
+    // The own references of the object were journaled empty when it was
+    // removed from the storage
+    m_objectReferencesMap.remove( handle );
+
     QHash<ObjHandle, QVector<ObjHandle> >::iterator i = m_objectReferencesMap.begin();
     while( i != m_objectReferencesMap.end() )
     {
-        QVector<ObjHandle>::iterator j = i.value().begin();
-        while( j != i.value().end() )
-        {
-            if( handle == *j )
-            {
-                j = i.value().erase( j );
-            }
-            else
-            {
-                ++j;
-            }
-        }
-        if( handle == i.key() )
+        if( i.value().removeAll( handle ) )
         {
-            i = m_objectReferencesMap.erase( i );
-        }
-        else
-        {
-            ++i;
+            journalObjectReferences( i.key() );
         }
+        ++i;
     }
 }
 
@@ -2737,7 +4185,7 @@ void FSStoragePlugin::setPlaylistReferences( const ObjHandle &handle , const QVe
         return;
     }
     StorageItem *storageItem = m_objectHandlesMap.value( handle );
-    if( !storageItem || "" == storageItem->m_path || !storageItem->m_objectInfo || !storageItem->m_path.endsWith( ".pla" ) )
+    if( !storageItem || storageItem->m_name.isEmpty() || !storageItem->m_objectInfo || !storageItem->m_name.endsWith( ".pla" ) )
     {
         return;
     }
@@ -2763,7 +4211,7 @@ void FSStoragePlugin::setPlaylistReferences( const ObjHandle &handle , const QVe
             {
                 continue;
             }
-            QString refItemName = storageItem->m_path;
+            QString refItemName = storageItem->path();
             if( refItemName[refItemName.size() -1] == '\0' )
             {
                 refItemName[refItemName.size() -1] = '\n';
@@ -2781,181 +4229,262 @@ void FSStoragePlugin::setPlaylistReferences( const ObjHandle &handle , const QVe
 #endif
 
 /************************************************************
- * void FSStoragePlugin::storeObjectReferences
+ * bool FSStoragePlugin::objectReferencesRecord
  ***********************************************************/
-void FSStoragePlugin::storeObjectReferences()
+bool FSStoragePlugin::objectReferencesRecord( QByteArray &data, ObjHandle handle, const QVector<ObjHandle> &references ) const
 {
-    // Write as follows
-    // 1. No. of objects that have references.
-    // 2a. Object PUOID
-    // 2b. No. of references for this object.
-    // 2c. PUOIDs of the referred objects.
+    StorageItem *item = m_objectHandlesMap.value( handle );
+    if( 0 == item || 0 == item->m_objectInfo ||
+        MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == item->m_objectInfo->mtpObjectFormat )
+    {
+        // 1) Possibly, the handle was removed from the objectHandles map, but
+        // still lingers in the object references map (It is cleared lazily
+        // in getObjectReferences). Ignore this handle.
+        // 2) This object is an abstract playlist, which is stored only in tracker.
+        // Ignore this too.
+        return false;
+    }
 
-    qint32 bytesWritten = -1;
-    QFile file( m_objectReferencesDbPath );
-    StorageItem *item = 0;
+    // Stored by PUOID, as handles are not persistent
+    QVector<MtpInt128> puoids;
+    puoids.reserve( references.size() );
+    foreach( ObjHandle reference, references )
+    {
+        StorageItem *referenceItem = m_objectHandlesMap.value( reference );
+        if( referenceItem )
+        {
+            puoids.append( referenceItem->m_puoid );
+        }
+    }
+    references_append( data, item->m_puoid, puoids );
+    return true;
+}
 
-    if( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+/************************************************************
+ * void FSStoragePlugin::journalObjectReferences
+ ***********************************************************/
+void FSStoragePlugin::journalObjectReferences( ObjHandle handle )
+{
+    if( !objectReferencesRecord( m_referencesJournal, handle, m_objectReferencesMap.value( handle ) ) )
     {
         return;
     }
-    quint32 noOfHandles = m_objectReferencesMap.count();
-    // Recored the position to store the number of object handles at...
-    qint64 posNoOfHandles = file.pos();
-    bytesWritten = file.write( reinterpret_cast<const char*>(&noOfHandles), sizeof(quint32) );
-    if( -1 == bytesWritten )
+    ++m_referencesJournalRecords;
+
+    if( m_referencesJournal.size() >= JOURNAL_BUFFER )
     {
-        MTP_LOG_WARNING("ERROR writing count to persistent objrefs db!!");
-        file.resize(0);
-        return;
+        flushObjectReferences();
     }
-    for( QHash<ObjHandle , QVector<ObjHandle> >::iterator i = m_objectReferencesMap.begin(); i != m_objectReferencesMap.end(); ++i )
+    else if( !m_referencesFlushTimer->isActive() )
     {
-        ObjHandle handle = i.key();
-        // Get the object PUOID from the object handle (we need to store PUOIDs
-        // in the ref DB as it is persistent, not object handles)
-        item = m_objectHandlesMap.value(handle);
-        if(0 == item || (MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == item->m_objectInfo->mtpObjectFormat))
-        {
-            // 1) Possibly, the handle was removed from the objectHandles map, but
-            // still lingers in the object references map (It is cleared lazily
-            // in getObjectReferences). Ignore this handle.
-            // 2) This object is an abstract playlist, which is stored only in tracker.
-            // Ignore this too.
-            noOfHandles--;
-            continue;
-        }
-        // No NULL check for the item here, as it can safely be assumed that it
-        // will exist in the object handles map.
-        bytesWritten = file.write( reinterpret_cast<const char*>(&item->m_puoid), sizeof(MtpInt128) );
-        if( -1 == bytesWritten )
-        {
-            MTP_LOG_WARNING("ERROR writing a handle to persistent objrefs db!!");
-            file.resize(0);
-            return;
-        }
-        quint32 noOfRefs = i.value().size();
-        // Record the position to write the number of object references into...
-        qint64 posNoOfReferences = file.pos();
-        bytesWritten = file.write( reinterpret_cast<const char*>(&noOfRefs), sizeof(quint32) );
-        if( -1 == bytesWritten )
-        {
-            MTP_LOG_WARNING("ERROR writing a handle's ref count to persistent objrefs db!!");
-            file.resize(0);
-            return;
-        }
-        for( int j = 0; j < i.value().size(); ++j )
-        {
-            ObjHandle reference = (i.value())[j];
-            // Get PUOID from the reference
-            item = m_objectHandlesMap.value(reference);
-            if(0 == item)
-            {
-                // Ignore this handle...
-                noOfRefs--;
-                continue;
-            }
-            bytesWritten = file.write( reinterpret_cast<const char*>(&item->m_puoid), sizeof(MtpInt128) );
-            if( -1 == bytesWritten )
-            {
-                MTP_LOG_WARNING("ERROR writing a handle's reference to persistent objrefs db!!");
-                file.resize(0);
-                return;
-            }
-        }
-        // Backup current position
-        qint64 curPos = file.pos();
-        // Seek back to write the number of references
-        if(false == file.seek(posNoOfReferences))
-        {
-            MTP_LOG_WARNING("File seek failed!!");
-            file.resize(0);
-            return;
-        }
-        bytesWritten = file.write( reinterpret_cast<const char*>(&noOfRefs), sizeof(quint32) );
-        if( -1 == bytesWritten )
-        {
-            MTP_LOG_WARNING("ERROR writing a handle's ref count to persistent objrefs db!!");
-            file.resize(0);
-            return;
-        }
-        // Seek forward again
-        if(false == file.seek(curPos))
-        {
-            MTP_LOG_WARNING("File seek failed!!");
-            file.resize(0);
-            return;
-        }
+        m_referencesFlushTimer->start();
+    }
+}
 
+/************************************************************
+ * void FSStoragePlugin::flushObjectReferences
+ ***********************************************************/
+void FSStoragePlugin::flushObjectReferences()
+{
+    m_referencesFlushTimer->stop();
+    if( m_referencesCompacting )
+    {
+        // Appended to the compacted file once it is in place
+        return;
     }
-    // Seek backwards to write the number of object handles
-    if(false == file.seek(posNoOfHandles))
+    if( -1 == m_referencesJournalFd )
     {
-        MTP_LOG_WARNING("File seek failed!!");
-        file.resize(0);
+        // Not read yet, or rewritten whole at exit after a failed write
+        m_referencesJournal.clear();
         return;
     }
-    bytesWritten = file.write( reinterpret_cast<const char*>(&noOfHandles), sizeof(quint32) );
-    if( -1 == bytesWritten )
+
+    if( !journal_write( m_referencesJournalFd, m_referencesJournal.constData(), m_referencesJournal.size() ) )
+    {
+        MTP_LOG_WARNING("ERROR writing" << m_objectReferencesDbPath << ":" << strerror(errno));
+        close( m_referencesJournalFd );
+        m_referencesJournalFd = -1;
+    }
+    m_referencesJournal.clear();
+
+    if( m_referencesJournalRecords > 2 * m_objectReferencesMap.size() + JOURNAL_COMPACT_MIN )
     {
-        MTP_LOG_WARNING("ERROR writing count to persistent objrefs db!!");
-        file.resize(0);
+        storeObjectReferences( true );
     }
-    // No file.close() needed, handled in QFile's d'tor
 }
 
 /************************************************************
- * void FSStoragePlugin::populateObjectReferences
+ * void FSStoragePlugin::storeObjectReferences
  ***********************************************************/
-void FSStoragePlugin::populateObjectReferences()
+void FSStoragePlugin::storeObjectReferences( bool background )
 {
-    QFile file( m_objectReferencesDbPath );
-    if( !file.open( QIODevice::ReadOnly ) )
+    // A record for each object that has references
+    QByteArray data( REFERENCES_MAGIC, sizeof REFERENCES_MAGIC );
+    qint64 records = 0;
+    for( QHash<ObjHandle, QVector<ObjHandle> >::const_iterator i = m_objectReferencesMap.constBegin(); i != m_objectReferencesMap.constEnd(); ++i )
     {
-        return;
+        if( !i.value().isEmpty() && objectReferencesRecord( data, i.key(), i.value() ) )
+        {
+            ++records;
+        }
     }
 
-    qint32 bytesRead = 0;
-    quint32 noOfHandles = 0, noOfRefs = 0;
-    MtpInt128 objPuoid, referencePuoid;
-    QVector<ObjHandle> references;
+    if( -1 != m_referencesJournalFd )
+    {
+        close( m_referencesJournalFd );
+        m_referencesJournalFd = -1;
+    }
+    // Whatever changes were journaled are in data now
+    m_referencesJournal.clear();
+    m_referencesJournalRecords = records;
+    m_referencesCompacting = true;
+
+    JournalWriter *writer = new JournalWriter( this, "objectReferencesStored", m_objectReferencesDbPath, data );
+    if( background )
+    {
+        m_journalWriterPool.start( writer );
+    }
+    else
+    {
+        writer->run();
+        delete writer;
+        // Queued by the writer, handled right away instead
+        m_referencesCompacting = false;
+        m_referencesJournalFd = open( m_objectReferencesDbPath.toUtf8().constData(), O_WRONLY | O_APPEND | O_CLOEXEC );
+    }
+}
 
-    bytesRead = file.read( reinterpret_cast<char*>(&noOfHandles), sizeof(quint32) );
-    if( 0 >= bytesRead )
+/************************************************************
+ * void FSStoragePlugin::objectReferencesStored
+ ***********************************************************/
+void FSStoragePlugin::objectReferencesStored( bool ok )
+{
+    if( !m_referencesCompacting )
     {
+        // Already rewritten synchronously
         return;
     }
-    for( quint32 i = 0; i < noOfHandles; ++i )
+    m_referencesCompacting = false;
+    if( ok )
     {
-        bytesRead = file.read( reinterpret_cast<char*>(&objPuoid), sizeof(objPuoid) );
-        if( 0 >= bytesRead )
-        {
-            return;
-        }
-        bytesRead = file.read( reinterpret_cast<char*>(&noOfRefs), sizeof(quint32) );
-        if( 0 >= bytesRead )
+        m_referencesJournalFd = open( m_objectReferencesDbPath.toUtf8().constData(), O_WRONLY | O_APPEND | O_CLOEXEC );
+    }
+    flushObjectReferences();
+}
+
+/************************************************************
+ * void FSStoragePlugin::populateObjectReferences
+ ***********************************************************/
+void FSStoragePlugin::populateObjectReferences()
+{
+    QFile file( m_objectReferencesDbPath );
+    qint64 size = file.open( QIODevice::ReadOnly ) ? file.size() : 0;
+    const uchar *data = size ? file.map( 0, size ) : 0;
+    qint64 valid = 0;
+
+    // Replay the whole journal first, so that each object left is looked up once
+    QHash<MtpInt128, QVector<MtpInt128> > references;
+    if( data && size >= (qint64)sizeof REFERENCES_MAGIC && !memcmp( data, REFERENCES_MAGIC, sizeof REFERENCES_MAGIC ) )
+    {
+        qint64 offset = sizeof REFERENCES_MAGIC;
+        while( offset + (qint64)sizeof(references_record) <= size )
         {
-            return;
+            references_record record;
+            memcpy( &record, data + offset, sizeof record );
+            const char *puoids = reinterpret_cast<const char*>( data + offset + sizeof record );
+            if( record.count > ( size - offset - sizeof record ) / sizeof(MtpInt128) ||
+                record.checksum != references_checksum( &record, puoids ) )
+            {
+                break;
+            }
+            offset += sizeof record + record.count * sizeof(MtpInt128);
+
+            MtpInt128 puoid;
+            memcpy( puoid.val, record.puoid, sizeof record.puoid );
+            if( record.count )
+            {
+                QVector<MtpInt128> &entry = references[puoid];
+                entry.resize( record.count );
+                memcpy( entry.data(), puoids, record.count * sizeof(MtpInt128) );
+            }
+            else
+            {
+                references.remove( puoid );
+            }
+            ++m_referencesJournalRecords;
         }
-        references.clear();
-        for( quint32 j = 0; j < noOfRefs; ++j )
+        valid = offset;
+    }
+    else if( data && size >= (qint64)sizeof(quint32) )
+    {
+        // Written whole by an older version: the number of objects, and the
+        // PUOID, the number of references and their PUOIDs for each
+        const uchar *end = data + size;
+        const uchar *pos = data;
+        quint32 noOfHandles = 0;
+        memcpy( &noOfHandles, pos, sizeof(quint32) );
+        pos += sizeof(quint32);
+        for( quint32 i = 0; i < noOfHandles && end - pos >= (qint64)( sizeof(MtpInt128) + sizeof(quint32) ); ++i )
         {
-            bytesRead = file.read( reinterpret_cast<char*>(&referencePuoid), sizeof(referencePuoid) );
-            if( 0 >= bytesRead )
+            MtpInt128 puoid;
+            quint32 noOfRefs = 0;
+            memcpy( puoid.val, pos, sizeof(MtpInt128) );
+            memcpy( &noOfRefs, pos + sizeof(MtpInt128), sizeof(quint32) );
+            pos += sizeof(MtpInt128) + sizeof(quint32);
+            if( noOfRefs > ( end - pos ) / sizeof(MtpInt128) )
             {
-                return;
+                break;
             }
+            QVector<MtpInt128> &entry = references[puoid];
+            entry.resize( noOfRefs );
+            memcpy( entry.data(), pos, noOfRefs * sizeof(MtpInt128) );
+            pos += noOfRefs * sizeof(MtpInt128);
+        }
+    }
+    file.close();
+
+    m_objectReferencesMap.reserve( references.size() );
+    for( QHash<MtpInt128, QVector<MtpInt128> >::const_iterator i = references.constBegin(); i != references.constEnd(); ++i )
+    {
+        QHash<MtpInt128, ObjHandle>::const_iterator object = m_puoidToHandleMap.constFind( i.key() );
+        if( object == m_puoidToHandleMap.constEnd() )
+        {
+            continue;
+        }
+        QVector<ObjHandle> &handles = m_objectReferencesMap[object.value()];
+        handles.reserve( i.value().size() );
+        foreach( const MtpInt128 &puoid, i.value() )
+        {
             // Get object handle from the PUOID
-            if(m_puoidToHandleMap.contains(referencePuoid))
+            QHash<MtpInt128, ObjHandle>::const_iterator reference = m_puoidToHandleMap.constFind( puoid );
+            if( reference != m_puoidToHandleMap.constEnd() )
             {
-                references.append( m_puoidToHandleMap[referencePuoid] );
+                handles.append( reference.value() );
             }
         }
-        if(m_puoidToHandleMap.contains(objPuoid))
+    }
+
+    if( !valid )
+    {
+        // Start the journal from what was read, if anything
+        storeObjectReferences( true );
+        return;
+    }
+    if( valid < size )
+    {
+        MTP_LOG_WARNING(m_objectReferencesDbPath << "ends in a broken record, dropping" << size - valid << "bytes");
+        if( -1 == truncate( m_objectReferencesDbPath.toUtf8().constData(), valid ) )
         {
-            m_objectReferencesMap[m_puoidToHandleMap[objPuoid]] = references;
+            storeObjectReferences( true );
+            return;
         }
     }
+    m_referencesJournalFd = open( m_objectReferencesDbPath.toUtf8().constData(), O_WRONLY | O_APPEND | O_CLOEXEC );
+    if( -1 == m_referencesJournalFd ||
+        m_referencesJournalRecords > 2 * m_objectReferencesMap.size() + JOURNAL_COMPACT_MIN )
+    {
+        storeObjectReferences( true );
+    }
 }
 
 MTPResponseCode FSStoragePlugin:: getObjectPropertyValueFromStorage( const ObjHandle &handle,
@@ -3148,13 +4677,13 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValueFromTracker( const ObjHan
 {
     MTPResponseCode code = MTP_RESP_ObjectProp_Not_Supported;
     StorageItem *storageItem = m_objectHandlesMap.value( handle );
-    if( !storageItem || storageItem->m_path.isEmpty() )
+    if( !storageItem || storageItem->m_name.isEmpty() )
     {
         code = MTP_RESP_GeneralError;
     }
     else
     {
-        code = m_tracker->getObjectProperty( storageItem->m_path, propCode, type, value ) ?
+        code = m_tracker->getObjectProperty( storageItem->path(), propCode, type, value ) ?
                MTP_RESP_OK : code;
     }
     return code;
@@ -3164,7 +4693,7 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValue(const ObjHandle &handle,
         QList<MTPObjPropDescVal> &propValList)
 {
     StorageItem *storageItem = m_objectHandlesMap.value( handle );
-    if( !storageItem || storageItem->m_path.isEmpty() )
+    if( !storageItem || storageItem->m_name.isEmpty() )
     {
         return MTP_RESP_GeneralError;
     }
@@ -3185,7 +4714,7 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValue(const ObjHandle &handle,
         }
 
         // Fetch whatever else remains from Tracker.
-        m_tracker->getPropVals(storageItem->m_path, propValList);
+        m_tracker->getPropVals(storageItem->path(), propValList);
     }
     return MTP_RESP_OK;
 }
@@ -3204,6 +4733,7 @@ MTPResponseCode FSStoragePlugin::getChildPropertyValues(ObjHandle handle,
         // Not an association.
         return MTP_RESP_InvalidObjectHandle;
     }
+    listDirectory(item);
 
     StorageItem *child = item->m_firstChild;
     for (; child; child = child->m_nextSibling) {
@@ -3216,45 +4746,58 @@ MTPResponseCode FSStoragePlugin::getChildPropertyValues(ObjHandle handle,
         }
     }
 
-    QList<const MtpObjPropDesc *> trackerSupportedProperties;
-    foreach (const MtpObjPropDesc *desc, properties) {
-        if (m_tracker->supportsProperty(desc->uPropCode)) {
-            trackerSupportedProperties.append(desc);
+    // Only the properties some child still lacks are asked from Tracker
+    QList<const MtpObjPropDesc *> trackerProperties;
+    QList<int> trackerIndexes;
+    QMap<ObjHandle, QList<QVariant> >::iterator it;
+    for (int i = 0; i != properties.size(); ++i) {
+        if (!m_tracker->supportsProperty(properties[i]->uPropCode)) {
+            continue;
+        }
+        for (it = values.begin(); it != values.end(); ++it) {
+            if (it.value().at(i).isNull()) {
+                trackerProperties.append(properties[i]);
+                trackerIndexes.append(i);
+                break;
+            }
         }
     }
-
-    QMap<QString, QList<QVariant> > trackerValues;
-    m_tracker->getChildPropVals(item->m_path, trackerSupportedProperties,
-            trackerValues);
-    if (trackerValues.isEmpty()) {
-        // Nothing more in Tracker, return immediately.
+    if (trackerProperties.isEmpty()) {
         return MTP_RESP_OK;
     }
 
+    QMap<QString, QList<QVariant> > trackerValues;
+    QString itemPath = item->path();
+    m_tracker->getChildPropVals(itemPath, trackerProperties, trackerValues);
+
     // Merge the results.
-    QMap<ObjHandle, QList<QVariant> >::iterator it;
-    for (it = values.begin(); it != values.end(); ++it) {
+    it = values.begin();
+    while (it != values.end()) {
         StorageItem *child = m_objectHandlesMap[it.key()];
         QList<QVariant> &childValues = it.value();
-        if (!trackerValues.contains(child->m_path)) {
-            MTP_LOG_INFO("Object" << child->m_path << "not found in tracker "
-                    "result set.");
-            continue;
-        }
-
-        QList<QVariant>::iterator trackerValuesIt =
-                trackerValues[child->m_path].begin();
-        for (int i = 0; i != properties.size(); ++i) {
-            if (!m_tracker->supportsProperty(properties[i]->uPropCode)) {
-                // Not in Tracker result set.
+        QString childPath = itemPath + '/' + child->m_name;
+        QMap<QString, QList<QVariant> >::const_iterator trackerChild =
+                trackerValues.constFind(childPath);
+        bool missing = false;
+        for (int i = 0; i != trackerIndexes.size(); ++i) {
+            QVariant &value = childValues[trackerIndexes.at(i)];
+            if (!value.isNull()) {
                 continue;
             }
-
-            QVariant &value = childValues[i];
-            if (value.isNull()) {
-                value = *trackerValuesIt;
+            if (trackerChild == trackerValues.constEnd()) {
+                missing = true;
+                break;
             }
-            ++trackerValuesIt;
+            value = trackerChild.value().at(i);
+        }
+
+        // A file Tracker has not extracted yet is left out, so that it is
+        // queried on its own later instead of getting empty values cached
+        if (missing && child->m_objectInfo &&
+                child->m_objectInfo->mtpObjectFormat != MTP_OBF_FORMAT_Association) {
+            it = values.erase(it);
+        } else {
+            ++it;
         }
     }
 
@@ -3279,7 +4822,8 @@ MTPResponseCode FSStoragePlugin::setObjectPropertyValue( const ObjHandle &handle
         if( MTP_OBJ_PROP_Obj_File_Name == propDesc->uPropCode )
         {
             QDir dir;
-            QString path = storageItem->m_path;
+            QString oldPath = storageItem->path();
+            QString path = oldPath;
             path.truncate( path.lastIndexOf("/") + 1 );
             QString newName = QString( value.value<QString>() );
             // Check if the file name is valid
@@ -3290,51 +4834,42 @@ MTPResponseCode FSStoragePlugin::setObjectPropertyValue( const ObjHandle &handle
                 return MTP_RESP_Invalid_ObjectProp_Value;
             }
             path += newName;
-            if( dir.rename( storageItem->m_path, path ) )
+            if( dir.rename( oldPath, path ) )
             {
-                m_pathNamesMap.remove(storageItem->m_path);
-                m_puoidsMap.remove(storageItem->m_path);
+                m_puoidsMap.remove(path);
                 // Adjust path in tracker
-                m_tracker->move(storageItem->m_path, path);
+                m_tracker->move(oldPath, path);
 
                 if( MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == storageItem->m_objectInfo->mtpObjectFormat )
                 {
                     // If this is a playlist, also need to update the playlist URL
-                    m_tracker->movePlaylist(storageItem->m_path, path);
+                    m_tracker->movePlaylist(oldPath, path);
                 }
 
-                storageItem->m_path = path;
-                storageItem->m_objectInfo->mtpFileName = newName;
-                m_pathNamesMap[storageItem->m_path] = handle;
-                m_puoidsMap[storageItem->m_path] = storageItem->m_puoid;
+                renameStorageItem( storageItem, newName );
                 removeWatchDescriptorRecursively( storageItem );
                 addWatchDescriptorRecursively( storageItem );
-                StorageItem *itr = storageItem->m_firstChild;
-                while( itr )
-                {
-                    adjustMovedItemsPath( path, itr, true );
-                    itr = itr->m_nextSibling;
-                }
+                moveChildrenInTracker( oldPath, storageItem );
                 code = MTP_RESP_OK;
             }
         }
-        else if((false == sendObjectPropList) && (false == storageItem->m_path.isEmpty()))
+        else if((false == sendObjectPropList) && (false == storageItem->m_name.isEmpty()))
         {
             // go to tracker
-            if( !storageItem->m_path.isEmpty() )
+            if( !storageItem->m_name.isEmpty() )
             {
-                code = m_tracker->setObjectProperty( storageItem->m_path, propDesc->uPropCode, propDesc->uDataType, value ) ?
+                code = m_tracker->setObjectProperty( storageItem->path(), propDesc->uPropCode, propDesc->uDataType, value ) ?
                     MTP_RESP_OK : code;
             }
         }
     }
     if(true == sendObjectPropList)
     {
-        m_tracker->setPropVals(storageItem->m_path, propValList);
+        m_tracker->setPropVals(storageItem->path(), propValList);
 #if 0
         // Ask tracker to ignore the current file, this is because we already have
         // all required metadata from the initiator.
-        m_tracker->ignoreNextUpdate(QStringList(m_tracker->generateIri(storageItem->m_path)));
+        m_tracker->ignoreNextUpdate(QStringList(m_tracker->generateIri(storageItem->path())));
 #endif
     }
     return code;
@@ -3343,10 +4878,10 @@ MTPResponseCode FSStoragePlugin::setObjectPropertyValue( const ObjHandle &handle
 void FSStoragePlugin::receiveThumbnail(const QString &path)
 {
     // Thumbnail for the file "path" is ready
-    ObjHandle handle = m_pathNamesMap.value(path);
+    StorageItem *storageItem = findStorageItemByPath(path);
+    ObjHandle handle = storageItem ? storageItem->m_handle : 0;
     if(0 != handle)
     {
-        StorageItem *storageItem = m_objectHandlesMap[handle];
         storageItem->m_objectInfo->mtpThumbCompressedSize =
                 getThumbCompressedSize( storageItem );
 
@@ -3372,11 +4907,11 @@ void FSStoragePlugin::handleFSDelete(const struct inotify_event *event, const ch
 
             if(0 != parentNode)
             {
-                QString fullPath = parentNode->m_path + QString("/") + QString(name);
-                if(m_pathNamesMap.contains(fullPath))
+                StorageItemName key = { parentNode, QString(name) };
+                if(m_itemNamesMap.contains(key))
                 {
                     MTP_LOG_INFO("Handle FS Delete, deleting file::" << name);
-                    ObjHandle toBeDeleted = m_pathNamesMap[fullPath];
+                    ObjHandle toBeDeleted = m_itemNamesMap[key]->m_handle;
                     deleteItemHelper( toBeDeleted, false, true );
                 }
                 // Emit storageinfo changed events, free space may be different from before now
@@ -3397,15 +4932,21 @@ void FSStoragePlugin::handleFSCreate(const struct inotify_event *event, const ch
         // The above QHash::value() may return a default constructed value of 0... so we double check the wd's here
         if(parentNode && (parentNode->m_wd == event->wd))
         {
-            QString addedPath = parentNode->m_path + QString("/") + QString(name);
-            if( !m_pathNamesMap.contains(addedPath) )
+            StorageItemName key = { parentNode, QString(name) };
+            StorageItem *existingNode = m_itemNamesMap.value(key);
+            if( !existingNode )
             {
                 MTP_LOG_INFO("Handle FS create, adding file::" << name);
-                addToStorage(addedPath, 0, 0, true);
+                addToStorage(parentNode->path() + QString("/") + key.name, 0, 0, true);
 
                 // Emit storageinfo changed events, free space may be different from before now
                 sendStorageInfoChanged();
             }
+            else
+            {
+                // Another file was moved over it
+                closeCachedReadFd(existingNode->m_handle);
+            }
         }
     }
 }
@@ -3429,41 +4970,33 @@ void FSStoragePlugin::handleFSMove(const struct inotify_event *fromEvent, const
         if((0 != fromNode) && (0 != toNode) && (fromNode->m_wd == fromEvent->wd) && (toNode->m_wd == toEvent->wd))
         {
             MTP_LOG_INFO("Handle FS Move, moving file::" << fromName << toName);
-            QString oldPath = fromNode->m_path + QString("/") + QString(fromName);
-            ObjHandle movedHandle = m_pathNamesMap.value(oldPath);
+            StorageItemName oldKey = { fromNode, QString(fromName) };
+            StorageItem *movedNode = m_itemNamesMap.value(oldKey);
+            ObjHandle movedHandle = movedNode ? movedNode->m_handle : 0;
 
             if(0 == movedHandle)
             {
                 // Already handled
                 return;
             }
-            StorageItem *movedNode = m_objectHandlesMap.value(movedHandle);
             if(movedNode)
             {
-                QString newPath = toNode->m_path + QString("/") + toName;
-                if( m_pathNamesMap.contains( newPath ) ) // Already Handled
+                StorageItemName newKey = { toNode, QString(toName) };
+                if( m_itemNamesMap.contains( newKey ) ) // Already Handled
                 {
                     // As the destination path is already present in our tree,
                     // we only need to delete the fromNode
                     MTP_LOG_INFO("The path to rename to is already present in our tree, hence, delete the moved node from our tree");
-                    deleteItemHelper( m_pathNamesMap[oldPath], false, true );
+                    deleteItemHelper( movedHandle, false, true );
                     return;
                 }
                 MTP_LOG_INFO("Handle FS Move, moving file, found!");
                 if( fromHandle == toHandle ) // Rename
                 {
                     MTP_LOG_INFO("Handle FS Move, renaming file::" << fromName << toName);
-                    // Remove the old path from the path names map
-                    m_pathNamesMap.remove(oldPath);
-                    movedNode->m_path = newPath;
-                    movedNode->m_objectInfo->mtpFileName = QString(toName);
-                    m_pathNamesMap[movedNode->m_path] = movedHandle;
-                    StorageItem *itr = movedNode->m_firstChild;
-                    while( itr )
-                    {
-                        adjustMovedItemsPath( movedNode->m_path, itr );
-                        itr = itr->m_nextSibling;
-                    }
+                    // The children's paths follow from the new name
+                    renameStorageItem( movedNode, newKey.name );
+                    m_puoidsMap.remove( movedNode->path() );
                     removeWatchDescriptorRecursively( movedNode );
                     addWatchDescriptorRecursively( movedNode );
                 }
@@ -3472,10 +5005,14 @@ void FSStoragePlugin::handleFSMove(const struct inotify_event *fromEvent, const
                     moveObject( movedHandle, toHandle, this, false );
                 }
 
+                closeCachedReadFd( movedHandle );
+
                 // object info would need to be computed again
+                unindexObjectFormat( movedNode );
                 delete movedNode->m_objectInfo;
                 movedNode->m_objectInfo = 0;
                 populateObjectInfo( movedNode );
+                indexObjectFormat( movedNode );
 
                 if( fromNode->eventsAreEnabled() )
                     toNode->setEventsEnabled(true);
@@ -3521,6 +5058,13 @@ static QString inotifyEventMaskRepr(int mask)
 
 void FSStoragePlugin::sendStorageInfoChanged(void)
 {
+    if( m_storageInfoChangeDeferred )
+    {
+        // Sent once the inotify events are processed
+        m_storageInfoChangePending = true;
+        return;
+    }
+
     MTPStorageInfo info;
     storageInfo( info );
 
@@ -3551,16 +5095,20 @@ void FSStoragePlugin::handleFSModify(const struct inotify_event *event, const ch
         //MTP_LOG_INFO("Handle FS Modify::" << name);
         if(parentNode && (parentNode->m_wd == event->wd))
         {
-            QString changedPath = parentNode->m_path + QString("/") + QString(name);
-            ObjHandle changedHandle = m_pathNamesMap.value(changedPath);
+            StorageItemName key = { parentNode, QString(name) };
+            StorageItem *changedNode = m_itemNamesMap.value(key);
+            ObjHandle changedHandle = changedNode ? changedNode->m_handle : 0;
             // Don't fire the change signal in the case when there is a transfer to the device ongoing
             if ((0 != changedHandle) && (changedHandle != m_writeObjectHandle))
             {
                 StorageItem *item = m_objectHandlesMap.value(changedHandle);
+                closeCachedReadFd(changedHandle);
                 // object info would need to be computed again
+                unindexObjectFormat( item );
                 MTPObjectInfo *prev = item->m_objectInfo;
                 item->m_objectInfo = 0;
                 populateObjectInfo( item );
+                indexObjectFormat( item );
                 bool changed = !prev || prev->differsFrom(item->m_objectInfo);
                 delete prev;
                 MTP_LOG_INFO("Handle FS Modify, file::" << name
@@ -3610,6 +5158,11 @@ void FSStoragePlugin::clearCachedInotifyEvent()
 void FSStoragePlugin::removeWatchDescriptorRecursively( StorageItem* item )
 {
     StorageItem *itr;
+    if( m_inotify->isFilesystemWatch() )
+    {
+        // Watched by file handle, which moving does not change
+        return;
+    }
     if( item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat )
     {
         removeWatchDescriptor( item );
@@ -3632,6 +5185,10 @@ void FSStoragePlugin::removeWatchDescriptor( StorageItem* item )
 void FSStoragePlugin::addWatchDescriptorRecursively( StorageItem* item )
 {
     StorageItem *itr;
+    if( m_inotify->isFilesystemWatch() )
+    {
+        return;
+    }
     if( item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat )
     {
         addWatchDescriptor( item );
@@ -3646,7 +5203,7 @@ void FSStoragePlugin::addWatchDescriptor( StorageItem* item )
 {
     if( item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat )
     {
-        item->m_wd = m_inotify->addWatch( item->m_path );
+        item->m_wd = m_inotify->addWatch( item->path() );
         if( -1 != item->m_wd )
         {
             m_watchDescriptorMap[ item->m_wd ] = item->m_handle;
@@ -3664,7 +5221,8 @@ bool FSStoragePlugin::isFileNameValid(const QString &fileName, const StorageItem
         // Illegal characters, or all .'s
         return false;
     }
-    if(m_pathNamesMap.contains(parent->m_path + "/" + fileName))
+    StorageItemName key = { parent, fileName };
+    if(m_itemNamesMap.contains(key))
     {
         // Already present
         return false;
@@ -3679,6 +5237,20 @@ void FSStoragePlugin::excludePath(const QString &path)
             << path << "from being exported via MTP.");
 }
 
+void FSStoragePlugin::setReadAdvice( ReadAdvice advice, bool dropBehind )
+{
+    m_readAdvice = advice;
+    m_dropBehind = dropBehind;
+    m_writeBehind->setSyncInterval( m_syncInterval, m_dropBehind );
+}
+
+void FSStoragePlugin::setSyncPolicy( bool onClose, quint64 interval )
+{
+    m_syncOnClose = onClose || interval;
+    m_syncInterval = interval;
+    m_writeBehind->setSyncInterval( m_syncInterval, m_dropBehind );
+}
+
 QString FSStoragePlugin::filesystemUuid() const
 {
 #if 0
@@ -33,20 +33,29 @@
 #define FSSTORAGEPLUGIN_H
 
 #include <sys/inotify.h>
+#include <sys/stat.h>
 #include "storageplugin.h"
+#include "storagescanner.h"
+#include "storageitem.h"
+#include "objecttable.h"
 #include <QVector>
 #include <QList>
 #include <QStringList>
+#include <QSet>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QPair>
 
 class QFile;
 class QDir;
+class QTimer;
 
 namespace meegomtp1dot0
 {
 class FSInotify;
 class StorageTracker;
 class Thumbnailer;
-class StorageItem;
+class WriteBehindThread;
 }
 
 /// FSStoragePlugin implements StoragePlugin for the case of a filesystem storage.
@@ -57,6 +66,15 @@ class FSStoragePlugin : public StoragePlugin
 {
     Q_OBJECT
 public:
+    /// What the kernel is told about the reads of object data
+    enum ReadAdvice
+    {
+        READ_ADVICE_NONE,       ///< nothing, the kernel's default read ahead applies
+        READ_ADVICE_AUTO,       ///< follows the access pattern of each file
+        READ_ADVICE_SEQUENTIAL, ///< files are always read from start to end
+        READ_ADVICE_RANDOM      ///< files are always read at random offsets
+    };
+
     /// Constructor.
     FSStoragePlugin( quint32 storageId = 0, MTPStorageType storageType = MTP_STORAGE_TYPE_FixedRAM,
                      QString storagePath = "", QString volumeLabel = "", QString storageDescription = "" );
@@ -77,6 +95,8 @@ public:
 
     MTPResponseCode getObjectHandles( const MTPObjFormatCode& formatCode, const quint32& associationHandle, QVector<ObjHandle> &objectHandles ) const;
 
+    MTPResponseCode getObjectCount( const MTPObjFormatCode& formatCode, const quint32& associationHandle, quint32 &count ) const;
+
     bool checkHandle( const ObjHandle &handle ) const;
 
     MTPResponseCode storageInfo( MTPStorageInfo &info );
@@ -99,6 +119,10 @@ public:
 
     MTPResponseCode readData( const ObjHandle &handle, char *readBuffer, qint32 &readBufferLen, quint32 readOffset );
 
+    MTPResponseCode openData( const ObjHandle &handle, int &fd );
+
+    void closeData( const ObjHandle &handle, int fd );
+
     MTPResponseCode truncateItem( const ObjHandle &handle, const quint32 &size );
 
     MTPResponseCode getObjectPropertyValue(const ObjHandle &handle,
@@ -114,6 +138,16 @@ public:
 
     void excludePath( const QString & path );
 
+    /// Sets the hints given to the kernel about reads of object data.
+    /// \param advice [in] how the files are expected to be read
+    /// \param dropBehind [in] drops the pages of data sent from the page cache
+    void setReadAdvice( ReadAdvice advice, bool dropBehind );
+
+    /// Sets when the data of SendObject is flushed to storage.
+    /// \param onClose [in] flushes each object once all of its data is written
+    /// \param interval [in] also flushes every time this many bytes are written, 0 for never
+    void setSyncPolicy( bool onClose, quint64 interval );
+
 public slots:
     /// This slot gets notified when an inotify event is received, and takes appropriate action.
     void inotifyEventSlot( struct inotify_event* );
@@ -138,9 +172,20 @@ private:
     /// Reads puoids from the puoids db, so that are preserved across MTP sessions.
     void populatePuoids();
 
-    /// Writes puoids to a db, so that are preserved across MTP sessions.
+    /// Rewrites the puoids db with the current PUOIDs, dropping the superseded journal records.
     void storePuoids();
 
+    /// Rewrites the puoids db if it is mostly superseded journal records, see storePuoids().
+    void compactPuoids();
+
+    /// Adds a record to the puoids db journal, written at the end of the event loop iteration.
+    /// \param path [in] the path that has the PUOID now.
+    /// \param puoid [in] the PUOID.
+    void journalPuoid( const QString &path, const MtpInt128 &puoid );
+
+    /// Journals the PUOIDs of an item and its children, after their paths changed.
+    void journalPuoids( const StorageItem *item, const QString &path );
+
     /// After reading puoids the db, this gets rid of any puoids that are no longer valid ( the corresponding object doesn't exist ).
     void removeUnusedPuoids();
 
@@ -184,7 +229,12 @@ private:
     /// Given a pathname, gives the corresponding storage item if the item exists in the filesystem.
     /// \param path [in] the pathname of the item.
     /// \return the storage item.
-    StorageItem* findStorageItemByPath( const QString &path );
+    StorageItem* findStorageItemByPath( const QString &path ) const;
+
+    /// Gives a storage item a new file name, in the tree and in its object info.
+    /// \param storageItem [in] the item.
+    /// \param name [in] the new name.
+    void renameStorageItem( StorageItem *storageItem, const QString &name );
 
     /// Creates new StorageItem representing a file or directory at \c path
     /// and creates the file or directory if asked to do so.
@@ -210,11 +260,58 @@ private:
             bool sendEvent = false, bool createIfNotExist = false,
             ObjHandle handle = 0 );
 
+    /// Lists a directory for the StorageScanner, on one of its threads. Adds an inotify watch
+    /// on the directory and creates StorageItems for its entries, like addToStorage() but
+    /// without touching the maps or the tree.
+    /// \param path [in] the directory.
+    /// \param listing [out] the watch descriptor and the items.
+    void scanDirectory( const QString &path, StorageScanner::Listing &listing );
+
+    /// Adds a directory listed by m_scanner to the storage, and recursively the directories
+    /// under it, in the same order as addToStorage() would add them. Without m_scanner the
+    /// directory is listed here; while m_lazyListing is set, its subdirectories are left unlisted.
+    /// \param directory [in] the directory's item, with its handle assigned.
+    void addScannedDirectory( StorageItem *directory );
+
+    /// Lists a directory that lazy enumeration left unlisted, leaving its subdirectories
+    /// unlisted in turn. Does nothing for other items.
+    /// \param directory [in] the directory's item, can be null.
+    void listDirectory( StorageItem *directory );
+
+    /// Lists all the directories that are still unlisted, see listDirectory().
+    void finishCrawl();
+
+    /// Does the parts of enumeration that need the whole object tree: drops the PUOIDs of
+    /// objects that are gone, and reads the object references and playlists.
+    void completeEnumeration();
+
     /// Inserts a storage item into internal data structures for faster search.
     ///
     /// \param item [in] a storage item.
     void addItemToMaps( StorageItem *item );
 
+    /// Adds a linked item to the format index, under the format of its object info.
+    void indexObjectFormat( StorageItem *item );
+
+    /// Removes a linked item from the format index, call before its object info changes.
+    void unindexObjectFormat( StorageItem *item );
+
+    struct CachedFd;
+
+    /// Returns a read only descriptor of the file of an item, kept open for further reads.
+    /// \return the descriptor, owned by the cache, 0 if the file could not be opened
+    CachedFd *cachedReadFd( StorageItem *item );
+
+    /// Closes the cached descriptor of an object's file, if any, after the file changed or went away.
+    void closeCachedReadFd( ObjHandle handle );
+
+    /// Tells the kernel how a file is read, after a read of it.
+    /// \param cached [in] the file's descriptor and access pattern so far
+    /// \param offset [in] where the read started
+    /// \param end [in] where the read ended
+    /// \param size [in] the size of the file
+    void adviseRead( CachedFd *cached, quint64 offset, quint64 end, quint64 size );
+
     /// Removes a storage item.
     /// \param handle [in] the handle of the object that needs to be removed.
     /// \sendEvent [in] indicates whether to send an ObjectRemoved event to the inititiator.
@@ -224,17 +321,21 @@ private:
     /// \param storageItem [in] the item's whose object info needs to be populated.
     void populateObjectInfo( StorageItem *storageItem );
 
-    /// This method helps recursively modify the "path" field of a StorageItem ther has been moved.
-    /// \param newAncestorPath [in] the new ancestor for the moved item and it's children.
-    /// \movedItem [in] the moved item.
-    /// \updateInTracker [in] If true, the function also updates the URIs in
-    /// tracker
-    void adjustMovedItemsPath( QString newAncestorPath, StorageItem* movedItem, bool updateInTracker = false );
+    /// Populates the object info for a storage item from the result of a stat() on it.
+    /// \param storageItem [in] the item's whose object info needs to be populated.
+    /// \param st [in] the item's status, symbolic links followed.
+    void populateObjectInfo( StorageItem *storageItem, const struct stat &st );
+
+    /// Updates the URIs in tracker of the items under a directory that has been moved or renamed.
+    /// \param oldPath [in] the directory's path before it was moved.
+    /// \param directory [in] the directory, at its new place in the tree.
+    void moveChildrenInTracker( const QString &oldPath, StorageItem *directory );
 
     /// Gets the object format of a storage item.
     /// \param storageItem [in] the storage item.
+    /// \param st [in] the item's status.
     /// \return object format code.
-    quint16 getObjectFormatByExtension( StorageItem *storageItem );
+    quint16 getObjectFormatByExtension( StorageItem *storageItem, const struct stat &st );
 
     /// Gets the protection status of a storage item.
     /// \param storageItem [in] the storage item.
@@ -242,9 +343,9 @@ private:
     quint16 getMTPProtectionStatus( StorageItem *storageItem );
 
     /// Gets the size of a storage item in bytes.
-    /// \param storageItem [in] the storage item.
+    /// \param st [in] the item's status.
     /// \return size in bytes.
-    quint64 getObjectSize( StorageItem *storageItem );
+    quint64 getObjectSize( const struct stat &st );
 
     /// Gets the format of a thumbnail item.
     /// \return the thumbnail format code.
@@ -277,9 +378,9 @@ private:
     quint32 getImagePixelHeight( StorageItem *storageItem );
 
     /// Gets the association type of a storage item.
-    /// \param storageItem [in] the storage item.
+    /// \param st [in] the item's status.
     /// \return a code specifying the association type.
-    quint16 getAssociationType( StorageItem *storageItem );
+    quint16 getAssociationType( const struct stat &st );
 
     /// Gets the association description of a storage item.
     /// \param storageItem [in] the storage item.
@@ -320,8 +421,16 @@ private:
     /// Reads object references from the references db and populates them to the references map.
     void populateObjectReferences();
 
-    /// Writes object references from the references map onto ther persistent references db.
-    void storeObjectReferences();
+    /// Rewrites the references db with the references map, dropping the superseded journal records.
+    /// \param background [in] true to write the file on another thread, see objectReferencesStored().
+    void storeObjectReferences( bool background );
+
+    /// Appends the record of the references of an object to a references db journal.
+    /// \return false if the references of the object are not stored.
+    bool objectReferencesRecord( QByteArray &data, ObjHandle handle, const QVector<ObjHandle> &references ) const;
+
+    /// Adds a record to the references db journal, after the references of an object changed.
+    void journalObjectReferences( ObjHandle handle );
 
     /// This method removes invalid object handles and invalid references from the references map.
     void removeInvalidObjectReferences( const ObjHandle &handle );
@@ -379,8 +488,53 @@ private:
     /// Adds inotify watch on a directory.
     void addWatchDescriptor( StorageItem *item );
 
+    /// Remembers the status a directory had when it was listed, see m_directoryStamps.
+    /// \param handle [in] the directory's handle.
+    /// \param st [in] the directory's status from before it was listed.
+    void setDirectoryStamp( ObjHandle handle, const struct stat &st );
+
+    /// Builds the object tree from the tree snapshot, without touching the file system.
+    /// \return false if there is no valid snapshot of this storage.
+    bool loadTreeSnapshot();
+
+    /// Checks a directory loaded from the tree snapshot against the file system, and adds,
+    /// removes or updates its entries as needed, sending events for them. The directory is
+    /// only listed again if its inode or modification time changed.
+    /// \param handle [in] the directory's handle.
+    void checkTreeDirectory( ObjHandle handle );
+
+    /// Updates the object info of a file if its size or modification time changed.
+    /// \param item [in] the file's storage item.
+    /// \param st [in] the file's current status.
+    void checkTreeFile( StorageItem *item, const struct stat &st );
+
 private slots:
     void enumerateStorage_worker();
+
+    /// Writes the object tree to the tree snapshot, if it changed since it was last written.
+    void storeTreeSnapshot();
+
+    /// Appends the journaled PUOIDs to the puoids db.
+    void flushPuoids();
+
+    /// Appends the journaled references to the references db, compacting it if needed.
+    void flushObjectReferences();
+
+    /// Called when the references db has been rewritten on another thread.
+    void objectReferencesStored( bool ok );
+
+    /// Checks the next few directories loaded from the tree snapshot, see checkTreeDirectory().
+    void verifyTreeSnapshot();
+
+    /// Lists the next few unlisted directories, see listDirectory().
+    void crawlStorage();
+
+    /// Queues an inotify event, coalescing it with the queued events on the same name.
+    void queueInotifyEvent( struct inotify_event *event );
+
+    /// Handles queued inotify events for a while, see inotifyEventSlot(), and sends a single
+    /// StorageInfoChanged for them. The rest are handled once the event loop has run again.
+    void processInotifyEvents();
     
 private:
     MTPResponseCode deleteItemHelper( ObjHandle handle, bool removePhysically = true, bool sendEvent = false );
@@ -389,12 +543,22 @@ private:
 
     QString m_storagePath;
     QHash<int,ObjHandle> m_watchDescriptorMap; ///< map from an inotify watch on an object to it's object handle.
-    QHash<QString,ObjHandle> m_pathNamesMap;
-    QHash<QString,MtpInt128> m_puoidsMap;
+    QHash<StorageItemName,StorageItem*> m_itemNamesMap; ///< finds a linked item by its parent and name
+    QHash<QString,MtpInt128> m_puoidsMap; ///< PUOIDs of the paths with no item: read from the db and not taken yet, or removed
     QHash<MtpInt128, ObjHandle> m_puoidToHandleMap; ///< Maps the PUOID to the corresponding object handle
     StorageItem *m_root; ///< the root folder
     QString m_puoidsDbPath; ///< path where puoids will be stored persistently.
+    int m_puoidsJournalFd; ///< the puoids db opened for appending, -1 if it must be rewritten
+    QByteArray m_puoidsJournal; ///< journal records not written yet
+    qint64 m_puoidsJournalRecords; ///< records in the puoids db, superseded ones included
+    QTimer *m_puoidsFlushTimer; ///< writes m_puoidsJournal
     QString m_objectReferencesDbPath; ///< path where references will be stored persistently.
+    int m_referencesJournalFd; ///< the references db opened for appending, -1 if it must be rewritten
+    QByteArray m_referencesJournal; ///< journal records not written yet
+    qint64 m_referencesJournalRecords; ///< records in the references db, superseded ones included
+    QTimer *m_referencesFlushTimer; ///< writes m_referencesJournal
+    bool m_referencesCompacting; ///< the references db is being rewritten, m_referencesJournal waits
+    QThreadPool m_journalWriterPool; ///< rewrites the references db
     QString m_playlistPath; ///< the path where playlists are stored.
     QString m_internalPlaylistPath; ///< the path where internal abstract playlists are stored.
     ObjHandle m_writeObjectHandle; ///< The obj handle for which a write operation is currently is progress. 0 means invalid handle, NOT root node!!
@@ -410,6 +574,25 @@ private:
         QString                 fromName;
     }m_iNotifyCache; ///< A cache for iNotify events
 
+    /// An inotify event waiting to be handled
+    struct QueuedInotifyEvent
+    {
+        int wd;
+        quint32 mask;           ///< 0 once handled or coalesced
+        quint32 cookie;
+        int moveTo;             ///< the IN_MOVED_TO event of an IN_MOVED_FROM, -1 if none queued
+        QByteArray name;
+    };
+    typedef QPair<int, QByteArray> InotifyName; ///< watch descriptor and name
+    QList<QueuedInotifyEvent> m_inotifyEvents; ///< the events read and not handled yet
+    int m_inotifyEventsApplied; ///< events before this one in m_inotifyEvents have been handled
+    QHash<InotifyName, int> m_inotifyCreated; ///< queued IN_CREATE of names not in the tree yet
+    QHash<InotifyName, int> m_inotifyModified; ///< queued IN_CLOSE_WRITE
+    QHash<quint32, int> m_inotifyMovesFrom; ///< queued IN_MOVED_FROM, by cookie
+    QTimer *m_inotifyTimer; ///< handles the rest of m_inotifyEvents
+    bool m_storageInfoChangeDeferred; ///< sendStorageInfoChanged() only sets m_storageInfoChangePending
+    bool m_storageInfoChangePending;
+
     struct ExistingPlaylists
     {
         QStringList             playlistPaths;
@@ -422,12 +605,56 @@ private:
         QList<QStringList>      playlistEntries;
     }m_newPlaylists;
 
-    QHash<ObjHandle, StorageItem*> m_objectHandlesMap; ///< each storage has a map of all it's object's handles to corresponding storage item.
+    ObjectTable m_objectHandlesMap; ///< each storage has a table of all it's object's handles to corresponding storage item.
+    QHash<MTPObjFormatCode, QSet<ObjHandle> > m_formatIndex; ///< handles of the objects of each format, the root excluded
     quint64 m_reportedFreeSpace;
     QFile *m_dataFile;
+    WriteBehindThread *m_writeBehind; ///< writes the data of m_dataFile
+
+    /// A file opened for readData()
+    struct CachedFd
+    {
+        ObjHandle handle;
+        int fd;
+        int advice;             ///< the POSIX_FADV_* given for the whole file, -1 if none
+        int sequentialReads;    ///< reads in a row that continued the previous one
+        quint64 next;           ///< the offset after the last read
+        quint64 readAhead;      ///< the offset up to which the file is being read ahead
+        quint64 dropped;        ///< the offset up to which the pages read are dropped
+    };
+    QList<CachedFd> m_readFds; ///< open files, the most recently read first
+    ReadAdvice m_readAdvice; ///< hints given about the reads of object data
+    bool m_dropBehind; ///< pages of data read through, or written and flushed, are dropped from the page cache
+    bool m_syncOnClose; ///< objects sent are flushed to storage when complete
+    quint64 m_syncInterval; ///< bytes of an object sent between flushes, 0 for none
 
     QStringList m_excludePaths; ///< Paths that should not be indexed
 
+    int m_scanThreads; ///< number of threads listing directories during enumeration, 0 for none
+    StorageScanner *m_scanner; ///< lists directories while the storage is enumerated, 0 otherwise
+
+    /// A directory's status when it was last listed
+    struct DirectoryStamp
+    {
+        quint64 ino;   ///< inode number, 0 if the directory must be listed again anyway
+        qint64 mtime;  ///< modification time in nanoseconds
+    };
+
+    QString m_treeSnapshotPath; ///< where the object tree is saved for the next start, empty if disabled
+    bool m_treeSnapshotDirty; ///< the tree changed since the snapshot was written
+    QTimer *m_treeSnapshotTimer; ///< writes the snapshot periodically
+    QHash<ObjHandle, DirectoryStamp> m_directoryStamps; ///< tells if a directory changed since it was listed
+    QList<ObjHandle> m_treeChecks; ///< directories loaded from the snapshot and not checked yet
+    QElapsedTimer m_treeCheckTimer; ///< time since the snapshot was loaded
+
+    bool m_lazyEnumeration; ///< only the root is listed at start up, the rest on demand or by crawlStorage()
+    bool m_lazyListing; ///< directories added now are left unlisted
+    bool m_crawling; ///< some directories are unlisted, completeEnumeration() has not run yet
+    QSet<ObjHandle> m_unlistedDirectories; ///< directories whose contents are not added yet
+    QList<ObjHandle> m_crawlQueue; ///< the unlisted directories in the order crawlStorage() lists them
+
+    friend class StorageScanner;
+
 #ifdef UT_ON
     ObjHandle m_testHandleProvider;
     friend class FSStoragePlugin_test;
@@ -30,12 +30,19 @@ HEADERS += fsstorageplugin.h \
            storagetracker.h \
            ../storageplugin.h \
            fsinotify.h \
-           storageitem.h
+           storageitem.h \
+           writebehindthread.h \
+           storagescanner.h \
+           objecttable.h \
+           metadataextractor.h
 
 SOURCES += fsstorageplugin.cpp \
            fsstoragepluginfactory.cpp \
            fsinotify.cpp \
            storageitem.cpp \
+           writebehindthread.cpp \
+           storagescanner.cpp \
+           metadataextractor.cpp \
     storagetracker.cpp
 
 LIBPATH += ../../..
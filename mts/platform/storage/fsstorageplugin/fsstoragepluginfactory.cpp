@@ -94,6 +94,40 @@ QList<StoragePlugin *>FSStoragePluginFactory::create(quint32 storageId)
         bool removable =
             !storage.attribute("removable").compare("true", Qt::CaseInsensitive);
 
+        // How the objects are expected to be read, and whether the data
+        // sent may be dropped from the page cache
+        FSStoragePlugin::ReadAdvice readAdvice = FSStoragePlugin::READ_ADVICE_AUTO;
+        QString readAhead = storage.attribute("readahead", "auto").toLower();
+        if (readAhead == "none") {
+            readAdvice = FSStoragePlugin::READ_ADVICE_NONE;
+        } else if (readAhead == "sequential") {
+            readAdvice = FSStoragePlugin::READ_ADVICE_SEQUENTIAL;
+        } else if (readAhead == "random") {
+            readAdvice = FSStoragePlugin::READ_ADVICE_RANDOM;
+        } else if (readAhead != "auto") {
+            MTP_LOG_WARNING("Storage" << fileName << "has unknown 'readahead'"
+                    " value" << readAhead << ", using auto");
+        }
+        bool dropBehind =
+            storage.attribute("dropbehind", "true").compare("false", Qt::CaseInsensitive);
+
+        // When the objects sent are flushed to storage: "none", "close"
+        // or a number of megabytes to flush after, and on close
+        bool syncOnClose = false;
+        quint64 syncInterval = 0;
+        QString fsync = storage.attribute("fsync", "none").toLower();
+        if (fsync == "close") {
+            syncOnClose = true;
+        } else if (fsync != "none") {
+            bool ok = false;
+            syncInterval = fsync.toULongLong(&ok) * 1024 * 1024;
+            if (!ok || !syncInterval) {
+                MTP_LOG_WARNING("Storage" << fileName << "has unknown 'fsync'"
+                        " value" << fsync << ", using none");
+                syncInterval = 0;
+            }
+        }
+
         QStringList blacklistPaths;
         const QDomNodeList &blacklist = storage.elementsByTagName("blacklist");
         for (int i = 0; i != blacklist.size(); ++i) {
@@ -163,6 +197,8 @@ QList<StoragePlugin *>FSStoragePluginFactory::create(quint32 storageId)
             foreach (QString line, blacklistPaths) {
                 plugin->excludePath(line);
             }
+            plugin->setReadAdvice(readAdvice, dropBehind);
+            plugin->setSyncPolicy(syncOnClose, syncInterval);
 
             result.append(plugin);
             storageId++;
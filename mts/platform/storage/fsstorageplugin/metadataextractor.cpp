@@ -0,0 +1,1393 @@
+#include "metadataextractor.h"
+
+#include <QtCore/QByteArray>
+#include <QtCore/QFile>
+#include <QtCore/QRegExp>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace meegomtp1dot0;
+
+typedef MetadataExtractor::Metadata Metadata;
+
+// Largest single read, longer headers and tags are truncated to it
+static const qint64 READ_MAX = 64 * 1024;
+
+// Size of the reads small headers are served from
+static const qint64 READ_WINDOW = 16 * 1024;
+
+// Most bytes read from one file, reads past it find nothing
+static const qint64 READ_BUDGET = 256 * 1024;
+
+// Largest tag value read, longer ones are skipped or truncated
+static const qint64 VALUE_MAX = 4 * 1024;
+
+// Most frames, atoms, blocks, pages, chunks or markers looked at in a file
+static const int ITEMS_MAX = 1024;
+
+// Size of an ID3v1 tag, at the end of the file
+static const qint64 ID3V1_SIZE = 128;
+
+// WAVE format tags of MPEG audio
+static const quint32 WAVE_FORMAT_MPEG = 0x0050;
+static const quint32 WAVE_FORMAT_MPEGLAYER3 = 0x0055;
+
+static const char *const ID3V1_GENRES[] = {
+    "Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop", "Jazz",
+    "Metal", "New Age", "Oldies", "Other", "Pop", "R&B", "Rap", "Reggae", "Rock", "Techno",
+    "Industrial", "Alternative", "Ska", "Death Metal", "Pranks", "Soundtrack", "Euro-Techno",
+    "Ambient", "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance", "Classical", "Instrumental",
+    "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise", "AlternRock", "Bass", "Soul", "Punk",
+    "Space", "Meditative", "Instrumental Pop", "Instrumental Rock", "Ethnic", "Gothic", "Darkwave",
+    "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream", "Southern Rock", "Comedy",
+    "Cult", "Gangsta", "Top 40", "Christian Rap", "Pop/Funk", "Jungle", "Native American",
+    "Cabaret", "New Wave", "Psychadelic", "Rave", "Showtunes", "Trailer", "Lo-Fi", "Tribal",
+    "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll", "Hard Rock"
+};
+
+struct TagProperty
+{
+    const char *tag;
+    MTPObjPropertyCode code;
+};
+
+static const TagProperty ID3V2_FRAMES[] = {
+    { "TIT2", MTP_OBJ_PROP_Name },                  { "TT2", MTP_OBJ_PROP_Name },
+    { "TPE1", MTP_OBJ_PROP_Artist },                { "TP1", MTP_OBJ_PROP_Artist },
+    { "TALB", MTP_OBJ_PROP_Album_Name },            { "TAL", MTP_OBJ_PROP_Album_Name },
+    { "TPE2", MTP_OBJ_PROP_Album_Artist },          { "TP2", MTP_OBJ_PROP_Album_Artist },
+    { "TCON", MTP_OBJ_PROP_Genre },                 { "TCO", MTP_OBJ_PROP_Genre },
+    { "TRCK", MTP_OBJ_PROP_Track },                 { "TRK", MTP_OBJ_PROP_Track },
+    { "TCOM", MTP_OBJ_PROP_Composer },              { "TCM", MTP_OBJ_PROP_Composer },
+    { "TDRC", MTP_OBJ_PROP_Original_Release_Date }, { "TYER", MTP_OBJ_PROP_Original_Release_Date },
+    { "TYE", MTP_OBJ_PROP_Original_Release_Date },
+    { "TLEN", MTP_OBJ_PROP_Duration },              { "TLE", MTP_OBJ_PROP_Duration },
+    { "POPM", MTP_OBJ_PROP_Rating },                { "POP", MTP_OBJ_PROP_Rating }
+};
+
+static const TagProperty VORBIS_FIELDS[] = {
+    { "TITLE", MTP_OBJ_PROP_Name },
+    { "ARTIST", MTP_OBJ_PROP_Artist },
+    { "ALBUM", MTP_OBJ_PROP_Album_Name },
+    { "ALBUMARTIST", MTP_OBJ_PROP_Album_Artist },
+    { "ALBUM ARTIST", MTP_OBJ_PROP_Album_Artist },
+    { "GENRE", MTP_OBJ_PROP_Genre },
+    { "TRACKNUMBER", MTP_OBJ_PROP_Track },
+    { "COMPOSER", MTP_OBJ_PROP_Composer },
+    { "DATE", MTP_OBJ_PROP_Original_Release_Date }
+};
+
+static const TagProperty MP4_ITEMS[] = {
+    { "\xa9" "nam", MTP_OBJ_PROP_Name },
+    { "\xa9" "ART", MTP_OBJ_PROP_Artist },
+    { "\xa9" "alb", MTP_OBJ_PROP_Album_Name },
+    { "aART", MTP_OBJ_PROP_Album_Artist },
+    { "\xa9" "gen", MTP_OBJ_PROP_Genre },
+    { "gnre", MTP_OBJ_PROP_Genre },
+    { "trkn", MTP_OBJ_PROP_Track },
+    { "\xa9" "wrt", MTP_OBJ_PROP_Composer },
+    { "\xa9" "day", MTP_OBJ_PROP_Original_Release_Date }
+};
+
+static const TagProperty RIFF_INFO[] = {
+    { "INAM", MTP_OBJ_PROP_Name },
+    { "IART", MTP_OBJ_PROP_Artist },
+    { "IPRD", MTP_OBJ_PROP_Album_Name },
+    { "IGNR", MTP_OBJ_PROP_Genre },
+    { "ITRK", MTP_OBJ_PROP_Track },
+    { "IPRT", MTP_OBJ_PROP_Track },
+    { "ICRD", MTP_OBJ_PROP_Original_Release_Date }
+};
+
+// Bitrates in kbit/s: MPEG-1 layers I, II and III, then MPEG-2 and 2.5 layer I, and II and III
+static const quint16 MPEG_BITRATES[5][15] = {
+    { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+};
+
+// Sample rates of MPEG-1, halved for MPEG-2 and quartered for MPEG-2.5
+static const quint32 MPEG_SAMPLE_RATES[3] = { 44100, 48000, 32000 };
+
+/* ========================================================================= *
+ * Reading
+ * ========================================================================= */
+
+namespace
+{
+/// Serves the small reads of the parsers from a window of the file, and the
+/// large ones, up to READ_MAX, directly.
+class Reader
+{
+    public:
+        Reader(int fd, qint64 size) :
+            m_fd(fd), m_size(size), m_windowOffset(0), m_bytesRead(0)
+        {
+        }
+
+        qint64 size() const
+        {
+            return m_size;
+        }
+
+        /// \return up to length bytes at offset, short at the end of the file, empty once
+        /// READ_BUDGET bytes have been read from it
+        QByteArray read(qint64 offset, qint64 length)
+        {
+            if( offset < 0 || offset >= m_size || length <= 0 )
+            {
+                return QByteArray();
+            }
+            length = qMin(qMin(length, m_size - offset), READ_MAX);
+            if( offset < m_windowOffset || offset + length > m_windowOffset + m_window.size() )
+            {
+                if( m_bytesRead >= READ_BUDGET )
+                {
+                    return QByteArray();
+                }
+                m_windowOffset = offset;
+                m_window = pread_all(offset, qMin(qMax(length, READ_WINDOW), m_size - offset));
+                m_bytesRead += m_window.size();
+            }
+            return m_window.mid(offset - m_windowOffset, length);
+        }
+
+    private:
+        QByteArray pread_all(qint64 offset, qint64 length)
+        {
+            QByteArray data(length, '\0');
+            qint64 done = 0;
+            while( done < length )
+            {
+                ssize_t rc = pread(m_fd, data.data() + done, length - done, offset + done);
+                if( rc < 0 && EINTR == errno )
+                {
+                    continue;
+                }
+                if( rc <= 0 )
+                {
+                    break;
+                }
+                done += rc;
+            }
+            data.resize(done);
+            return data;
+        }
+
+        int m_fd;
+        qint64 m_size;
+        QByteArray m_window;
+        qint64 m_windowOffset;
+        qint64 m_bytesRead;
+};
+}
+
+static quint16 be16(const char *p)
+{
+    const uchar *u = (const uchar *)p;
+    return (u[0] << 8) | u[1];
+}
+
+static quint32 be24(const char *p)
+{
+    const uchar *u = (const uchar *)p;
+    return (u[0] << 16) | (u[1] << 8) | u[2];
+}
+
+static quint32 be32(const char *p)
+{
+    const uchar *u = (const uchar *)p;
+    return ((quint32)u[0] << 24) | (u[1] << 16) | (u[2] << 8) | u[3];
+}
+
+static quint64 be64(const char *p)
+{
+    return ((quint64)be32(p) << 32) | be32(p + 4);
+}
+
+static quint16 le16(const char *p)
+{
+    const uchar *u = (const uchar *)p;
+    return (u[1] << 8) | u[0];
+}
+
+static quint32 le32(const char *p)
+{
+    const uchar *u = (const uchar *)p;
+    return ((quint32)u[3] << 24) | (u[2] << 16) | (u[1] << 8) | u[0];
+}
+
+static quint64 le64(const char *p)
+{
+    return ((quint64)le32(p + 4) << 32) | le32(p);
+}
+
+/// Sizes in ID3v2 headers use 7 bits of each byte
+static quint32 syncsafe(const char *p)
+{
+    const uchar *u = (const uchar *)p;
+    return ((u[0] & 0x7f) << 21) | ((u[1] & 0x7f) << 14) | ((u[2] & 0x7f) << 7) | (u[3] & 0x7f);
+}
+
+static QString utf16(const char *p, int length, bool bigEndian)
+{
+    QString text;
+    text.reserve(length / 2);
+    for( int i = 0; i + 1 < length; i += 2 )
+    {
+        ushort c = bigEndian ? be16(p + i) : le16(p + i);
+        if( !c )
+        {
+            break;
+        }
+        text.append(QChar(c));
+    }
+    return text;
+}
+
+/* ========================================================================= *
+ * Values
+ * ========================================================================= */
+
+template<int N>
+static MTPObjPropertyCode tagProperty(const TagProperty (&table)[N], const QByteArray &tag)
+{
+    for( int i = 0; i < N; ++i )
+    {
+        if( tag == table[i].tag )
+        {
+            return table[i].code;
+        }
+    }
+    return 0;
+}
+
+/// "2004", "2004-05" or "2004-05-06", possibly followed by a time
+static QString releaseDate(const QString &date)
+{
+    QRegExp re("^(\\d{4})(?:-(\\d{2})(?:-(\\d{2}))?)?");
+    if( -1 == re.indexIn(date) )
+    {
+        return QString();
+    }
+    QString month = re.cap(2).isEmpty() ? QString("01") : re.cap(2);
+    QString day = re.cap(3).isEmpty() ? QString("01") : re.cap(3);
+    return re.cap(1) + month + day + "T000000";
+}
+
+/// "2004:05:06 12:34:56", from EXIF
+static QString exifDate(const QString &date)
+{
+    QRegExp re("^(\\d{4}):(\\d{2}):(\\d{2}) (\\d{2}):(\\d{2}):(\\d{2})");
+    if( -1 == re.indexIn(date) )
+    {
+        return QString();
+    }
+    return re.cap(1) + re.cap(2) + re.cap(3) + 'T' + re.cap(4) + re.cap(5) + re.cap(6);
+}
+
+static QString id3v1Genre(uint index)
+{
+    if( index < sizeof(ID3V1_GENRES) / sizeof(ID3V1_GENRES[0]) )
+    {
+        return QString::fromLatin1(ID3V1_GENRES[index]);
+    }
+    return QString();
+}
+
+/// "(17)", "(17)Rock" and "17" refer to the ID3v1 genres
+static QString id3v2Genre(const QString &genre)
+{
+    QRegExp re("^\\((\\d+)\\)(.*)$");
+    if( re.exactMatch(genre) )
+    {
+        return re.cap(2).trimmed().isEmpty() ? id3v1Genre(re.cap(1).toUInt()) : re.cap(2);
+    }
+    bool ok;
+    uint index = genre.toUInt(&ok);
+    return ok ? id3v1Genre(index) : genre;
+}
+
+/// Adds a value unless the file had one for the property already,
+/// the tags are parsed in order of preference
+static void addValue(Metadata &metadata, MTPObjPropertyCode code, QString value)
+{
+    value = value.trimmed();
+    if( value.isEmpty() || metadata.contains(code) )
+    {
+        return;
+    }
+
+    switch( code )
+    {
+        case MTP_OBJ_PROP_Track:
+            // "3" or "3/12"
+            value = QString::number(value.section('/', 0, 0).trimmed().toUInt());
+            if( "0" == value )
+            {
+                return;
+            }
+            break;
+        case MTP_OBJ_PROP_Original_Release_Date:
+            value = releaseDate(value);
+            if( value.isEmpty() )
+            {
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+    metadata.insert(code, value);
+}
+
+static void addNumber(Metadata &metadata, MTPObjPropertyCode code, quint64 value)
+{
+    if( value )
+    {
+        addValue(metadata, code, QString::number(value));
+    }
+}
+
+/// \return count units of 1/rate seconds in milliseconds, without overflowing for long streams
+static quint64 scaleToMsecs(quint64 count, quint64 rate)
+{
+    return count / rate * 1000 + count % rate * 1000 / rate;
+}
+
+/* ========================================================================= *
+ * MP3
+ * ========================================================================= */
+
+static QString id3v2Text(const QByteArray &data)
+{
+    if( data.isEmpty() )
+    {
+        return QString();
+    }
+
+    const char *text = data.constData() + 1;
+    int length = data.size() - 1;
+    switch( data.at(0) )
+    {
+        case 0:
+            return QString::fromLatin1(text, qstrnlen(text, length));
+        case 1:
+            // UTF-16 with a byte order mark
+            if( length >= 2 && 0xFE == (uchar)text[0] && 0xFF == (uchar)text[1] )
+            {
+                return utf16(text + 2, length - 2, true);
+            }
+            if( length >= 2 && 0xFF == (uchar)text[0] && 0xFE == (uchar)text[1] )
+            {
+                return utf16(text + 2, length - 2, false);
+            }
+            return utf16(text, length, false);
+        case 2:
+            return utf16(text, length, true);
+        case 3:
+            return QString::fromUtf8(text, qstrnlen(text, length));
+        default:
+            return QString();
+    }
+}
+
+static void parseId3v2Frame(const QByteArray &id, const QByteArray &data, Metadata &metadata)
+{
+    MTPObjPropertyCode code = tagProperty(ID3V2_FRAMES, id);
+    switch( code )
+    {
+        case 0:
+            break;
+        case MTP_OBJ_PROP_Rating:
+        {
+            // An email address, then the rating from 1 to 255, 0 if unknown
+            int end = data.indexOf('\0');
+            if( -1 != end && end + 1 < data.size() )
+            {
+                uint rating = (uchar)data.at(end + 1);
+                addNumber(metadata, code, rating ? qMax(1u, rating * 100 / 255) : 0);
+            }
+            break;
+        }
+        case MTP_OBJ_PROP_Duration:
+            // In milliseconds, as MTP has it
+            addNumber(metadata, code, id3v2Text(data).trimmed().toULongLong());
+            break;
+        case MTP_OBJ_PROP_Genre:
+            addValue(metadata, code, id3v2Genre(id3v2Text(data).trimmed()));
+            break;
+        default:
+            addValue(metadata, code, id3v2Text(data));
+            break;
+    }
+}
+
+/// \return the offset past the tag, 0 if there is none
+static qint64 parseId3v2(Reader &reader, Metadata &metadata)
+{
+    QByteArray header = reader.read(0, 10);
+    if( header.size() < 10 || !header.startsWith("ID3") )
+    {
+        return 0;
+    }
+
+    int version = (uchar)header.at(3);
+    int flags = (uchar)header.at(5);
+    qint64 tagEnd = 10 + syncsafe(header.constData() + 6);
+    qint64 end = tagEnd + (flags & 0x10 ? 10 : 0);
+
+    // Whole tag unsynchronisation and ID3v2.2 compression are left alone,
+    // they are next to unused
+    if( version < 2 || version > 4 || (version < 4 && (flags & 0x80)) || (2 == version && (flags & 0x40)) )
+    {
+        return end;
+    }
+
+    qint64 offset = 10;
+    if( version > 2 && (flags & 0x40) )
+    {
+        QByteArray extended = reader.read(offset, 4);
+        if( extended.size() < 4 )
+        {
+            return end;
+        }
+        offset += 3 == version ? 4 + be32(extended.constData()) : syncsafe(extended.constData());
+    }
+
+    const int idLength = 2 == version ? 3 : 4;
+    const int headerLength = 2 == version ? 6 : 10;
+    for( int items = 0; items < ITEMS_MAX && offset + headerLength <= tagEnd; ++items )
+    {
+        QByteArray frame = reader.read(offset, headerLength);
+        if( frame.size() < headerLength || !frame.at(0) )
+        {
+            // Padding
+            break;
+        }
+
+        const char *p = frame.constData();
+        quint32 size = 2 == version ? be24(p + 3) : 3 == version ? be32(p + 4) : syncsafe(p + 4);
+        quint16 frameFlags = 2 == version ? 0 : be16(p + 8);
+        offset += headerLength;
+        if( offset + size > tagEnd )
+        {
+            break;
+        }
+
+        QByteArray id = frame.left(idLength);
+        if( size <= VALUE_MAX && tagProperty(ID3V2_FRAMES, id) )
+        {
+            int skip = 0;
+            bool unsynchronised = false;
+            bool readable = true;
+            if( 3 == version )
+            {
+                readable = !(frameFlags & 0x00c0);
+                skip = frameFlags & 0x0020 ? 1 : 0;
+            }
+            else if( 4 == version )
+            {
+                readable = !(frameFlags & 0x000c);
+                skip = (frameFlags & 0x0040 ? 1 : 0) + (frameFlags & 0x0001 ? 4 : 0);
+                unsynchronised = frameFlags & 0x0002;
+            }
+
+            if( readable )
+            {
+                QByteArray data = reader.read(offset, size).mid(skip);
+                if( unsynchronised )
+                {
+                    data.replace(QByteArray("\xff\x00", 2), QByteArray("\xff", 1));
+                }
+                parseId3v2Frame(id, data, metadata);
+            }
+        }
+        offset += size;
+    }
+    return end;
+}
+
+static QString id3v1Text(const QByteArray &tag, int offset, int length)
+{
+    const char *text = tag.constData() + offset;
+    return QString::fromLatin1(text, qstrnlen(text, length));
+}
+
+/// \return false if the file has no ID3v1 tag
+static bool parseId3v1(Reader &reader, Metadata &metadata)
+{
+    QByteArray tag = reader.read(reader.size() - ID3V1_SIZE, ID3V1_SIZE);
+    if( tag.size() < ID3V1_SIZE || !tag.startsWith("TAG") )
+    {
+        return false;
+    }
+
+    addValue(metadata, MTP_OBJ_PROP_Name, id3v1Text(tag, 3, 30));
+    addValue(metadata, MTP_OBJ_PROP_Artist, id3v1Text(tag, 33, 30));
+    addValue(metadata, MTP_OBJ_PROP_Album_Name, id3v1Text(tag, 63, 30));
+    addValue(metadata, MTP_OBJ_PROP_Original_Release_Date, id3v1Text(tag, 93, 4));
+    // ID3v1.1 keeps the track in the last byte of the comment
+    if( !tag.at(125) )
+    {
+        addNumber(metadata, MTP_OBJ_PROP_Track, (uchar)tag.at(126));
+    }
+    addValue(metadata, MTP_OBJ_PROP_Genre, id3v1Genre((uchar)tag.at(127)));
+    return true;
+}
+
+struct MpegHeader
+{
+    bool mpeg1;
+    int layer;
+    quint32 bitrate;
+    quint32 sampleRate;
+    quint32 channels;
+    quint32 samples;            ///< per frame
+    quint32 frameLength;
+};
+
+static bool parseMpegHeader(quint32 header, MpegHeader &mpeg)
+{
+    // 0 is MPEG-2.5, 1 reserved, 2 MPEG-2 and 3 MPEG-1
+    quint32 version = (header >> 19) & 3;
+    // 4 is reserved
+    int layer = 4 - ((header >> 17) & 3);
+    quint32 bitrateIndex = (header >> 12) & 15;
+    quint32 rateIndex = (header >> 10) & 3;
+    if( 0xffe00000 != (header & 0xffe00000) || 1 == version || 4 == layer ||
+        0 == bitrateIndex || 15 == bitrateIndex || 3 == rateIndex )
+    {
+        return false;
+    }
+
+    mpeg.mpeg1 = 3 == version;
+    mpeg.layer = layer;
+    mpeg.bitrate = MPEG_BITRATES[mpeg.mpeg1 ? layer - 1 : (1 == layer ? 3 : 4)][bitrateIndex] * 1000;
+    mpeg.sampleRate = MPEG_SAMPLE_RATES[rateIndex] >> (mpeg.mpeg1 ? 0 : 2 == version ? 1 : 2);
+    mpeg.channels = 3 == ((header >> 6) & 3) ? 1 : 2;
+    quint32 padding = (header >> 9) & 1;
+    if( 1 == layer )
+    {
+        mpeg.samples = 384;
+        mpeg.frameLength = (12 * mpeg.bitrate / mpeg.sampleRate + padding) * 4;
+    }
+    else
+    {
+        mpeg.samples = 3 == layer && !mpeg.mpeg1 ? 576 : 1152;
+        mpeg.frameLength = mpeg.samples / 8 * mpeg.bitrate / mpeg.sampleRate + padding;
+    }
+    return true;
+}
+
+/// Reads the stream properties from the first frame found after offset
+static void parseMpegAudio(Reader &reader, qint64 offset, qint64 end, Metadata &metadata)
+{
+    QByteArray data = reader.read(offset, READ_WINDOW);
+    MpegHeader mpeg;
+    int i = 0;
+    for( ; i + 4 <= data.size(); ++i )
+    {
+        if( !parseMpegHeader(be32(data.constData() + i), mpeg) )
+        {
+            continue;
+        }
+        // A false sync is unlikely to be followed by another frame
+        MpegHeader next;
+        int nextOffset = i + mpeg.frameLength;
+        if( nextOffset + 4 > data.size() || parseMpegHeader(be32(data.constData() + nextOffset), next) )
+        {
+            break;
+        }
+    }
+    if( i + 4 > data.size() )
+    {
+        return;
+    }
+
+    // Encoders put the frame count in a Xing, Info or VBRI header in the
+    // first frame
+    const char *frame = data.constData() + i;
+    int available = data.size() - i;
+    int xing = 4 + (mpeg.mpeg1 ? (1 == mpeg.channels ? 17 : 32) : (1 == mpeg.channels ? 9 : 17));
+    quint32 frames = 0;
+    bool vbr = false;
+    if( xing + 12 <= available && (!memcmp(frame + xing, "Xing", 4) || !memcmp(frame + xing, "Info", 4)) )
+    {
+        vbr = !memcmp(frame + xing, "Xing", 4);
+        if( be32(frame + xing + 4) & 1 )
+        {
+            frames = be32(frame + xing + 8);
+        }
+    }
+    else if( 36 + 18 <= available && !memcmp(frame + 36, "VBRI", 4) )
+    {
+        vbr = true;
+        frames = be32(frame + 36 + 14);
+    }
+
+    quint64 audioBytes = qMax(end - offset - i, (qint64)0);
+    quint64 msecs;
+    quint64 bitrate = mpeg.bitrate;
+    if( frames )
+    {
+        msecs = (quint64)frames * mpeg.samples * 1000 / mpeg.sampleRate;
+        if( vbr && msecs )
+        {
+            bitrate = audioBytes * 8 * 1000 / msecs;
+        }
+    }
+    else
+    {
+        msecs = audioBytes * 8 * 1000 / mpeg.bitrate;
+    }
+
+    addNumber(metadata, MTP_OBJ_PROP_Duration, msecs);
+    addNumber(metadata, MTP_OBJ_PROP_Sample_Rate, mpeg.sampleRate);
+    addNumber(metadata, MTP_OBJ_PROP_Nbr_Of_Channels, mpeg.channels);
+    addNumber(metadata, MTP_OBJ_PROP_Audio_BitRate, bitrate);
+    addNumber(metadata, MTP_OBJ_PROP_Bitrate_Type, vbr ? 2 : 1);
+    addNumber(metadata, MTP_OBJ_PROP_Audio_WAVE_Codec,
+              3 == mpeg.layer ? WAVE_FORMAT_MPEGLAYER3 : WAVE_FORMAT_MPEG);
+}
+
+/* ========================================================================= *
+ * FLAC and Ogg
+ * ========================================================================= */
+
+/// Parses the fields of a Vorbis comment, as used by FLAC, Vorbis and Opus
+static void parseVorbisComment(const QByteArray &comment, int offset, Metadata &metadata)
+{
+    const qint64 size = comment.size();
+    const char *p = comment.constData();
+    qint64 position = offset;
+    if( position + 4 > size )
+    {
+        return;
+    }
+    // Skip the vendor string
+    position += 4 + (qint64)le32(p + position);
+    if( position + 4 > size )
+    {
+        return;
+    }
+    quint32 count = le32(p + position);
+    position += 4;
+
+    for( quint32 i = 0; i < count && i < (quint32)ITEMS_MAX && position + 4 <= size; ++i )
+    {
+        qint64 length = le32(p + position);
+        position += 4;
+        if( length > size - position )
+        {
+            // Truncated by the bounded read
+            break;
+        }
+
+        QByteArray field = QByteArray::fromRawData(p + position, length);
+        position += length;
+        int equals = field.indexOf('=');
+        if( equals <= 0 || length > VALUE_MAX )
+        {
+            continue;
+        }
+        MTPObjPropertyCode code = tagProperty(VORBIS_FIELDS, field.left(equals).toUpper());
+        if( code )
+        {
+            addValue(metadata, code, QString::fromUtf8(field.constData() + equals + 1, length - equals - 1));
+        }
+    }
+}
+
+/// \return false if there is no FLAC stream at offset
+static bool parseFlac(Reader &reader, qint64 offset, Metadata &metadata)
+{
+    if( reader.read(offset, 4) != "fLaC" )
+    {
+        return false;
+    }
+    offset += 4;
+
+    quint32 sampleRate = 0;
+    quint64 samples = 0;
+    for( int items = 0; items < ITEMS_MAX; ++items )
+    {
+        QByteArray header = reader.read(offset, 4);
+        if( header.size() < 4 )
+        {
+            break;
+        }
+        bool last = header.at(0) & 0x80;
+        int type = header.at(0) & 0x7f;
+        quint32 length = be24(header.constData() + 1);
+        offset += 4;
+
+        if( 0 == type )
+        {
+            // STREAMINFO
+            QByteArray info = reader.read(offset, 18);
+            if( info.size() == 18 )
+            {
+                const uchar *u = (const uchar *)info.constData();
+                sampleRate = (u[10] << 12) | (u[11] << 4) | (u[12] >> 4);
+                samples = ((quint64)(u[13] & 0x0f) << 32) | be32(info.constData() + 14);
+                addNumber(metadata, MTP_OBJ_PROP_Sample_Rate, sampleRate);
+                addNumber(metadata, MTP_OBJ_PROP_Nbr_Of_Channels, ((u[12] >> 1) & 7) + 1);
+                addNumber(metadata, MTP_OBJ_PROP_Audio_BitDepth, (((u[12] & 1) << 4) | (u[13] >> 4)) + 1);
+            }
+        }
+        else if( 4 == type )
+        {
+            // VORBIS_COMMENT
+            parseVorbisComment(reader.read(offset, length), 0, metadata);
+        }
+
+        offset += length;
+        if( last )
+        {
+            break;
+        }
+    }
+
+    if( sampleRate && samples )
+    {
+        addNumber(metadata, MTP_OBJ_PROP_Duration, scaleToMsecs(samples, sampleRate));
+        // The frames follow the metadata blocks
+        quint64 audioBytes = qMax(reader.size() - offset, (qint64)0);
+        addNumber(metadata, MTP_OBJ_PROP_Audio_BitRate, audioBytes * 8 * sampleRate / samples);
+        addNumber(metadata, MTP_OBJ_PROP_Bitrate_Type, 2);
+    }
+    return true;
+}
+
+static void parseOgg(Reader &reader, Metadata &metadata)
+{
+    // Reassemble the identification and comment packets of the first
+    // logical stream, from the pages at the start of the file
+    QByteArray packets[2];
+    int packet = 0;
+    quint32 serial = 0;
+    qint64 offset = 0;
+    for( int items = 0; items < ITEMS_MAX && packet < 2; ++items )
+    {
+        QByteArray header = reader.read(offset, 27);
+        if( header.size() < 27 || !header.startsWith("OggS") )
+        {
+            break;
+        }
+        quint32 pageSerial = le32(header.constData() + 14);
+        int segments = (uchar)header.at(26);
+        QByteArray table = reader.read(offset + 27, segments);
+        if( table.size() < segments )
+        {
+            break;
+        }
+        if( 0 == items )
+        {
+            serial = pageSerial;
+        }
+        offset += 27 + segments;
+
+        for( int i = 0; i < segments && packet < 2; ++i )
+        {
+            int length = (uchar)table.at(i);
+            if( pageSerial == serial )
+            {
+                // Cover art makes comment packets large, keep the start only
+                // and do not walk the pages of the rest, nothing is needed
+                // after the comment packet
+                if( packets[packet].size() >= READ_MAX )
+                {
+                    packet = 2;
+                    break;
+                }
+                packets[packet] += reader.read(offset, length);
+                if( length < 255 )
+                {
+                    ++packet;
+                }
+            }
+            offset += length;
+        }
+    }
+
+    const QByteArray &identification = packets[0];
+    const QByteArray &comment = packets[1];
+    quint32 rate = 0;
+    quint64 preSkip = 0;
+    quint64 bitrate = 0;
+    if( identification.startsWith("\x01vorbis") && identification.size() >= 24 )
+    {
+        const char *p = identification.constData();
+        rate = le32(p + 12);
+        addNumber(metadata, MTP_OBJ_PROP_Nbr_Of_Channels, (uchar)p[11]);
+        addNumber(metadata, MTP_OBJ_PROP_Sample_Rate, rate);
+        // Nominal bitrate, signed
+        qint32 nominal = le32(p + 20);
+        bitrate = nominal > 0 ? nominal : 0;
+        if( comment.startsWith("\x03vorbis") )
+        {
+            parseVorbisComment(comment, 7, metadata);
+        }
+    }
+    else if( identification.startsWith("OpusHead") && identification.size() >= 16 )
+    {
+        const char *p = identification.constData();
+        // Opus always runs at 48 kHz, the header has the rate of the input
+        rate = 48000;
+        preSkip = le16(p + 10);
+        addNumber(metadata, MTP_OBJ_PROP_Nbr_Of_Channels, (uchar)p[9]);
+        addNumber(metadata, MTP_OBJ_PROP_Sample_Rate, le32(p + 12) ? le32(p + 12) : rate);
+        if( comment.startsWith("OpusTags") )
+        {
+            parseVorbisComment(comment, 8, metadata);
+        }
+    }
+    if( !rate )
+    {
+        return;
+    }
+
+    // The granule position of the last page is the length in samples
+    qint64 tailOffset = qMax(reader.size() - READ_WINDOW, (qint64)0);
+    QByteArray tail = reader.read(tailOffset, READ_WINDOW);
+    for( int i = tail.lastIndexOf("OggS"); i >= 0; i = tail.lastIndexOf("OggS", i - 1) )
+    {
+        if( i + 27 <= tail.size() && le32(tail.constData() + i + 14) == serial )
+        {
+            quint64 granule = le64(tail.constData() + i + 6);
+            quint64 msecs = granule > preSkip ? scaleToMsecs(granule - preSkip, rate) : 0;
+            addNumber(metadata, MTP_OBJ_PROP_Duration, msecs);
+            if( !bitrate && msecs )
+            {
+                bitrate = reader.size() * 8 * 1000 / msecs;
+            }
+            break;
+        }
+        if( 0 == i )
+        {
+            break;
+        }
+    }
+    addNumber(metadata, MTP_OBJ_PROP_Audio_BitRate, bitrate);
+}
+
+/* ========================================================================= *
+ * MP4
+ * ========================================================================= */
+
+namespace
+{
+struct Atom
+{
+    QByteArray type;
+    qint64 start;               ///< offset of the payload
+    qint64 end;                 ///< offset past the atom
+};
+}
+
+/// Reads the header of the atom at offset, in a parent ending at end
+static bool mp4Atom(Reader &reader, qint64 offset, qint64 end, Atom &atom)
+{
+    if( offset + 8 > end )
+    {
+        return false;
+    }
+    QByteArray header = reader.read(offset, 16);
+    if( header.size() < 8 )
+    {
+        return false;
+    }
+
+    quint64 size = be32(header.constData());
+    atom.type = header.mid(4, 4);
+    atom.start = offset + 8;
+    if( 1 == size )
+    {
+        if( header.size() < 16 )
+        {
+            return false;
+        }
+        size = be64(header.constData() + 8);
+        atom.start += 8;
+    }
+    else if( 0 == size )
+    {
+        // Up to the end of the parent
+        size = end - offset;
+    }
+    if( size < (quint64)(atom.start - offset) || size > (quint64)(end - offset) )
+    {
+        return false;
+    }
+    atom.end = offset + size;
+    return true;
+}
+
+/// Finds the first child atom of a type, in the payload between offset and end
+static bool mp4Find(Reader &reader, qint64 offset, qint64 end, const char *type, Atom &atom)
+{
+    for( int items = 0; items < ITEMS_MAX && mp4Atom(reader, offset, end, atom); ++items )
+    {
+        if( atom.type == type )
+        {
+            return true;
+        }
+        offset = atom.end;
+    }
+    return false;
+}
+
+/// Reads the time scale and duration of an mvhd or mdhd atom
+static bool mp4Duration(Reader &reader, const Atom &atom, quint64 &timescale, quint64 &duration)
+{
+    QByteArray header = reader.read(atom.start, 32);
+    if( header.size() >= 32 && 1 == header.at(0) )
+    {
+        timescale = be32(header.constData() + 20);
+        duration = be64(header.constData() + 24);
+    }
+    else if( header.size() >= 20 && 0 == header.at(0) )
+    {
+        timescale = be32(header.constData() + 12);
+        duration = be32(header.constData() + 16);
+    }
+    else
+    {
+        return false;
+    }
+    return timescale && duration;
+}
+
+static void parseMp4Track(Reader &reader, const Atom &trak, Metadata &metadata)
+{
+    Atom mdia, hdlr, minf, stbl, stsd;
+    if( !mp4Find(reader, trak.start, trak.end, "mdia", mdia) ||
+        !mp4Find(reader, mdia.start, mdia.end, "hdlr", hdlr) ||
+        !mp4Find(reader, mdia.start, mdia.end, "minf", minf) ||
+        !mp4Find(reader, minf.start, minf.end, "stbl", stbl) ||
+        !mp4Find(reader, stbl.start, stbl.end, "stsd", stsd) )
+    {
+        return;
+    }
+
+    // The first sample description, after the version, flags and count
+    QByteArray handler = reader.read(hdlr.start + 8, 4);
+    QByteArray entry = reader.read(stsd.start + 8, 36);
+    if( entry.size() < 36 )
+    {
+        return;
+    }
+    const char *p = entry.constData();
+
+    if( "vide" == handler )
+    {
+        addNumber(metadata, MTP_OBJ_PROP_Width, be16(p + 32));
+        addNumber(metadata, MTP_OBJ_PROP_Height, be16(p + 34));
+        addNumber(metadata, MTP_OBJ_PROP_Video_FourCC_Codec, be32(p + 4));
+
+        // The frame rate, from the number of samples and the track duration
+        Atom mdhd, stsz;
+        quint64 timescale, duration;
+        if( mp4Find(reader, mdia.start, mdia.end, "mdhd", mdhd) &&
+            mp4Duration(reader, mdhd, timescale, duration) &&
+            mp4Find(reader, stbl.start, stbl.end, "stsz", stsz) )
+        {
+            QByteArray sizes = reader.read(stsz.start, 12);
+            if( sizes.size() == 12 )
+            {
+                quint64 frames = be32(sizes.constData() + 8);
+                addNumber(metadata, MTP_OBJ_PROP_Frames_Per_Thousand_Secs,
+                          frames * timescale * 1000 / duration);
+            }
+        }
+    }
+    else if( "soun" == handler )
+    {
+        addNumber(metadata, MTP_OBJ_PROP_Nbr_Of_Channels, be16(p + 24));
+        addNumber(metadata, MTP_OBJ_PROP_Audio_BitDepth, be16(p + 26));
+        // 16.16 fixed point
+        addNumber(metadata, MTP_OBJ_PROP_Sample_Rate, be32(p + 32) >> 16);
+    }
+}
+
+/// Parses the iTunes style tags of an ilst atom
+static void parseMp4Tags(Reader &reader, const Atom &ilst, Metadata &metadata)
+{
+    Atom item, data;
+    qint64 offset = ilst.start;
+    for( int items = 0; items < ITEMS_MAX && mp4Atom(reader, offset, ilst.end, item); ++items )
+    {
+        offset = item.end;
+        MTPObjPropertyCode code = tagProperty(MP4_ITEMS, item.type);
+        if( !code || !mp4Find(reader, item.start, item.end, "data", data) || data.end - data.start < 8 )
+        {
+            continue;
+        }
+
+        // After the type and locale
+        QByteArray value = reader.read(data.start + 8, qMin(data.end - data.start - 8, VALUE_MAX));
+        if( "trkn" == item.type )
+        {
+            if( value.size() >= 4 )
+            {
+                addNumber(metadata, code, be16(value.constData() + 2));
+            }
+        }
+        else if( "gnre" == item.type )
+        {
+            // ID3v1 genre plus one
+            if( value.size() >= 2 && be16(value.constData()) )
+            {
+                addValue(metadata, code, id3v1Genre(be16(value.constData()) - 1));
+            }
+        }
+        else
+        {
+            addValue(metadata, code, QString::fromUtf8(value));
+        }
+    }
+}
+
+static void parseMp4(Reader &reader, Metadata &metadata)
+{
+    // moov may well be at the end, after the media data
+    Atom moov, atom;
+    if( !mp4Find(reader, 0, reader.size(), "moov", moov) )
+    {
+        return;
+    }
+
+    quint64 timescale = 0, duration = 0;
+    if( mp4Find(reader, moov.start, moov.end, "mvhd", atom) &&
+        mp4Duration(reader, atom, timescale, duration) )
+    {
+        addNumber(metadata, MTP_OBJ_PROP_Duration, scaleToMsecs(duration, timescale));
+    }
+
+    qint64 offset = moov.start;
+    for( int items = 0; items < ITEMS_MAX && mp4Atom(reader, offset, moov.end, atom); ++items )
+    {
+        if( "trak" == atom.type )
+        {
+            parseMp4Track(reader, atom, metadata);
+        }
+        offset = atom.end;
+    }
+
+    Atom udta, meta, ilst;
+    if( mp4Find(reader, moov.start, moov.end, "udta", udta) &&
+        mp4Find(reader, udta.start, udta.end, "meta", meta) )
+    {
+        // meta is a full atom in MP4 files, and a plain one in QuickTime files
+        qint64 start = meta.start;
+        if( reader.read(start, 4) == QByteArray(4, '\0') )
+        {
+            start += 4;
+        }
+        if( mp4Find(reader, start, meta.end, "ilst", ilst) )
+        {
+            parseMp4Tags(reader, ilst, metadata);
+        }
+    }
+
+    if( duration && !metadata.contains(MTP_OBJ_PROP_Width) )
+    {
+        // Averaged over the file, for audio only files
+        addNumber(metadata, MTP_OBJ_PROP_Audio_BitRate, reader.size() * 8 * timescale / duration);
+    }
+}
+
+/* ========================================================================= *
+ * WAV
+ * ========================================================================= */
+
+static void parseWav(Reader &reader, Metadata &metadata)
+{
+    quint32 byteRate = 0;
+    qint64 dataSize = 0;
+    qint64 offset = 12;
+    for( int items = 0; items < ITEMS_MAX; ++items )
+    {
+        QByteArray header = reader.read(offset, 8);
+        if( header.size() < 8 )
+        {
+            break;
+        }
+        qint64 size = le32(header.constData() + 4);
+        qint64 start = offset + 8;
+
+        if( header.startsWith("fmt ") && size >= 16 )
+        {
+            QByteArray format = reader.read(start, 16);
+            if( format.size() == 16 )
+            {
+                const char *p = format.constData();
+                byteRate = le32(p + 8);
+                addNumber(metadata, MTP_OBJ_PROP_Audio_WAVE_Codec, le16(p));
+                addNumber(metadata, MTP_OBJ_PROP_Nbr_Of_Channels, le16(p + 2));
+                addNumber(metadata, MTP_OBJ_PROP_Sample_Rate, le32(p + 4));
+                addNumber(metadata, MTP_OBJ_PROP_Audio_BitRate, (quint64)byteRate * 8);
+                addNumber(metadata, MTP_OBJ_PROP_Audio_BitDepth, le16(p + 14));
+            }
+        }
+        else if( header.startsWith("data") )
+        {
+            dataSize = qMin(size, reader.size() - start);
+        }
+        else if( header.startsWith("LIST") && reader.read(start, 4) == "INFO" )
+        {
+            qint64 position = start + 4;
+            for( ; items < ITEMS_MAX && position + 8 <= start + size; ++items )
+            {
+                QByteArray info = reader.read(position, 8);
+                if( info.size() < 8 )
+                {
+                    break;
+                }
+                qint64 length = le32(info.constData() + 4);
+                MTPObjPropertyCode code = tagProperty(RIFF_INFO, info.left(4));
+                if( code && length <= VALUE_MAX )
+                {
+                    QByteArray text = reader.read(position + 8, length);
+                    addValue(metadata, code, QString::fromUtf8(text.constData(), qstrnlen(text.constData(), text.size())));
+                }
+                position += 8 + length + (length & 1);
+            }
+        }
+
+        // Chunks are padded to an even size
+        offset = start + size + (size & 1);
+    }
+
+    if( byteRate )
+    {
+        addNumber(metadata, MTP_OBJ_PROP_Duration, scaleToMsecs(dataSize, byteRate));
+    }
+}
+
+/* ========================================================================= *
+ * Images
+ * ========================================================================= */
+
+static quint16 exif16(const QByteArray &tiff, qint64 offset, bool littleEndian)
+{
+    if( offset < 0 || offset + 2 > tiff.size() )
+    {
+        return 0;
+    }
+    const char *p = tiff.constData() + offset;
+    return littleEndian ? le16(p) : be16(p);
+}
+
+static quint32 exif32(const QByteArray &tiff, qint64 offset, bool littleEndian)
+{
+    if( offset < 0 || offset + 4 > tiff.size() )
+    {
+        return 0;
+    }
+    const char *p = tiff.constData() + offset;
+    return littleEndian ? le32(p) : be32(p);
+}
+
+/// The ASCII value of an IFD entry, stored in the entry itself when it fits
+static QString exifString(const QByteArray &tiff, qint64 entry, bool littleEndian)
+{
+    qint64 count = exif32(tiff, entry + 4, littleEndian);
+    qint64 offset = count <= 4 ? entry + 8 : exif32(tiff, entry + 8, littleEndian);
+    if( 2 != exif16(tiff, entry + 2, littleEndian) || offset + count > tiff.size() )
+    {
+        return QString();
+    }
+    const char *text = tiff.constData() + offset;
+    return QString::fromLatin1(text, qstrnlen(text, count));
+}
+
+static void parseExif(const QByteArray &tiff, Metadata &metadata)
+{
+    bool littleEndian;
+    if( tiff.startsWith("II") )
+    {
+        littleEndian = true;
+    }
+    else if( tiff.startsWith("MM") )
+    {
+        littleEndian = false;
+    }
+    else
+    {
+        return;
+    }
+
+    // IFD0, then the Exif IFD it points to
+    qint64 ifd = exif32(tiff, 4, littleEndian);
+    qint64 exifIfd = 0;
+    QString dateTime;
+    for( int pass = 0; pass < 2 && ifd; ++pass )
+    {
+        int count = exif16(tiff, ifd, littleEndian);
+        for( int i = 0; i < count; ++i )
+        {
+            qint64 entry = ifd + 2 + i * 12;
+            if( entry + 12 > tiff.size() )
+            {
+                break;
+            }
+            switch( exif16(tiff, entry, littleEndian) )
+            {
+                case 0x013b: // Artist
+                    addValue(metadata, MTP_OBJ_PROP_Artist, exifString(tiff, entry, littleEndian));
+                    break;
+                case 0x0132: // DateTime
+                    dateTime = exifString(tiff, entry, littleEndian);
+                    break;
+                case 0x8769: // ExifIFDPointer
+                    exifIfd = exif32(tiff, entry + 8, littleEndian);
+                    break;
+                case 0x9003: // DateTimeOriginal
+                    addValue(metadata, MTP_OBJ_PROP_Date_Created, exifDate(exifString(tiff, entry, littleEndian)));
+                    break;
+                default:
+                    break;
+            }
+        }
+        ifd = 0 == pass ? exifIfd : 0;
+    }
+    addValue(metadata, MTP_OBJ_PROP_Date_Created, exifDate(dateTime));
+}
+
+static void parseJpeg(Reader &reader, Metadata &metadata)
+{
+    qint64 offset = 2;
+    for( int items = 0; items < ITEMS_MAX; ++items )
+    {
+        QByteArray marker = reader.read(offset, 9);
+        if( marker.size() < 4 || 0xff != (uchar)marker.at(0) )
+        {
+            break;
+        }
+
+        uchar type = marker.at(1);
+        if( 0xff == type )
+        {
+            // Fill byte
+            ++offset;
+            continue;
+        }
+        if( 0xd8 == type || 0x01 == type || (type >= 0xd0 && type <= 0xd7) )
+        {
+            // No payload
+            offset += 2;
+            continue;
+        }
+        if( 0xda == type || 0xd9 == type )
+        {
+            // The entropy coded data follows
+            break;
+        }
+
+        quint16 length = be16(marker.constData() + 2);
+        if( length < 2 )
+        {
+            break;
+        }
+        if( 0xe1 == type )
+        {
+            QByteArray app1 = reader.read(offset + 4, length - 2);
+            if( app1.startsWith(QByteArray("Exif\0\0", 6)) )
+            {
+                parseExif(app1.mid(6), metadata);
+            }
+        }
+        else if( type >= 0xc0 && type <= 0xcf && 0xc4 != type && 0xc8 != type && 0xcc != type &&
+                 marker.size() >= 9 )
+        {
+            // Start of frame: precision, height and width
+            addNumber(metadata, MTP_OBJ_PROP_Height, be16(marker.constData() + 5));
+            addNumber(metadata, MTP_OBJ_PROP_Width, be16(marker.constData() + 7));
+        }
+        offset += 2 + length;
+    }
+}
+
+static void parsePng(Reader &reader, Metadata &metadata)
+{
+    // The IHDR chunk comes first
+    QByteArray ihdr = reader.read(8, 16);
+    if( ihdr.size() == 16 && ihdr.mid(4, 4) == "IHDR" )
+    {
+        addNumber(metadata, MTP_OBJ_PROP_Width, be32(ihdr.constData() + 8));
+        addNumber(metadata, MTP_OBJ_PROP_Height, be32(ihdr.constData() + 12));
+    }
+}
+
+/* ========================================================================= *
+ * MetadataExtractor
+ * ========================================================================= */
+
+bool MetadataExtractor::extract(const QString &path, Metadata &metadata)
+{
+    int fd = open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if( -1 == fd )
+    {
+        return false;
+    }
+
+    struct stat st;
+    if( -1 == fstat(fd, &st) || !S_ISREG(st.st_mode) )
+    {
+        close(fd);
+        return false;
+    }
+
+    Reader reader(fd, st.st_size);
+    QByteArray magic = reader.read(0, 12);
+    const uchar *m = (const uchar *)magic.constData();
+    if( magic.size() < 12 )
+    {
+        // Too short to be anything
+    }
+    else if( 0xff == m[0] && 0xd8 == m[1] )
+    {
+        parseJpeg(reader, metadata);
+    }
+    else if( magic.startsWith("ID3") || (0xff == m[0] && 0xe0 == (m[1] & 0xe0)) )
+    {
+        // FLAC files are sometimes ID3 tagged too
+        qint64 offset = parseId3v2(reader, metadata);
+        if( !parseFlac(reader, offset, metadata) )
+        {
+            qint64 end = parseId3v1(reader, metadata) ? reader.size() - ID3V1_SIZE : reader.size();
+            parseMpegAudio(reader, offset, end, metadata);
+        }
+    }
+    else if( magic.startsWith("fLaC") )
+    {
+        parseFlac(reader, 0, metadata);
+    }
+    else if( magic.startsWith("OggS") )
+    {
+        parseOgg(reader, metadata);
+    }
+    else if( magic.mid(4, 4) == "ftyp" )
+    {
+        parseMp4(reader, metadata);
+    }
+    else if( magic.startsWith("RIFF") && magic.mid(8, 4) == "WAVE" )
+    {
+        parseWav(reader, metadata);
+    }
+    else if( magic.startsWith("\x89PNG") )
+    {
+        parsePng(reader, metadata);
+    }
+
+    close(fd);
+    return true;
+}
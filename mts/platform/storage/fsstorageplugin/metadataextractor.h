@@ -0,0 +1,34 @@
+#ifndef METADATAEXTRACTOR_H
+#define METADATAEXTRACTOR_H
+
+#include <QtCore/QHash>
+#include <QtCore/QString>
+#include "mtptypes.h"
+
+/// \brief The MetadataExtractor class reads the media metadata of a file from its headers.
+///
+/// The tags of MP3 (ID3v2 and ID3v1), MP4/M4A, FLAC, Ogg Vorbis and Opus, and WAV files are
+/// parsed, as are the EXIF and frame headers of JPEG and the header of PNG images. The file is
+/// read with a few small positioned reads: frames, atoms and blocks that are not needed, such as
+/// cover art or the media data itself, are skipped over rather than read. A well-formed file costs
+/// a few tens of kilobytes of I/O; the reads from one file are capped at 256 KB, which bounds what
+/// a corrupt one costs. extract() is reentrant, StorageTracker runs it on a pool of threads.
+namespace meegomtp1dot0
+{
+class MetadataExtractor
+{
+    public:
+        /// Property values in the string form StorageTracker converts from: numbers in decimal,
+        /// durations in milliseconds and dates as "yyyyMMddThhmmss". Properties the file does not have
+        /// are left out.
+        typedef QHash<MTPObjPropertyCode, QString> Metadata;
+
+        /// Reads the metadata of a file.
+        /// \param path [in] the file
+        /// \param metadata [out] the values found
+        /// \return false if the file could not be opened
+        static bool extract(const QString &path, Metadata &metadata);
+};
+}
+
+#endif
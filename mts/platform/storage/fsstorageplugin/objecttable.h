@@ -0,0 +1,193 @@
+#ifndef OBJECTTABLE_H
+#define OBJECTTABLE_H
+
+#include "mtptypes.h"
+#include <QHash>
+#include <QVector>
+#include <algorithm>
+
+/// \brief The ObjectTable class maps the object handles of a storage to their StorageItems.
+///
+/// The items are kept in a dense vector of slots, sorted by handle, and a hash maps each handle to
+/// its slot: a lookup is a hash probe and a load, and iterating walks the slots in ascending handle
+/// order. Handles are handed out in ascending order by StorageFactory, so a new item normally goes
+/// to the end. The slot of a removed object is left empty, and the empty slots are squeezed out
+/// once they outnumber the items, so the memory follows the number of objects of this storage and
+/// not the largest handle ever issued. Removing never moves slots, which keeps iterating safe.
+namespace meegomtp1dot0
+{
+class StorageItem;
+
+class ObjectTable
+{
+#ifdef UT_ON
+    friend class FSStoragePlugin_test;
+#endif
+    struct Slot
+    {
+        ObjHandle handle;
+        StorageItem *item;      ///< 0 once the object has been removed
+
+        bool operator<( const Slot &other ) const { return handle < other.handle; }
+    };
+
+    public:
+        class const_iterator
+        {
+            public:
+                const_iterator( const QVector<Slot> *slots, int index ) :
+                    m_slots(slots), m_index(index)
+                {
+                    skipEmpty();
+                }
+
+                ObjHandle key() const { return m_slots->at(m_index).handle; }
+                StorageItem *value() const { return m_slots->at(m_index).item; }
+                StorageItem *operator*() const { return value(); }
+
+                const_iterator &operator++()
+                {
+                    ++m_index;
+                    skipEmpty();
+                    return *this;
+                }
+
+                bool operator==( const const_iterator &other ) const { return m_index == other.m_index; }
+                bool operator!=( const const_iterator &other ) const { return m_index != other.m_index; }
+
+            private:
+                void skipEmpty()
+                {
+                    while( m_index < m_slots->size() && !m_slots->at(m_index).item )
+                    {
+                        ++m_index;
+                    }
+                }
+
+                const QVector<Slot> *m_slots;
+                int m_index;
+        };
+
+        ObjectTable() : m_sorted(true)
+        {
+        }
+
+        /// \return the item with the given handle, 0 if there is none
+        StorageItem *value( ObjHandle handle ) const
+        {
+            QHash<ObjHandle, int>::const_iterator i = m_index.constFind( handle );
+            return i != m_index.constEnd() ? m_slots.at( i.value() ).item : 0;
+        }
+
+        StorageItem *operator[]( ObjHandle handle ) const
+        {
+            return value( handle );
+        }
+
+        bool contains( ObjHandle handle ) const
+        {
+            return m_index.contains( handle );
+        }
+
+        /// Adds an item, or replaces the one with the same handle.
+        void insert( ObjHandle handle, StorageItem *item )
+        {
+            if( !item )
+            {
+                remove( handle );
+                return;
+            }
+            QHash<ObjHandle, int>::const_iterator i = m_index.constFind( handle );
+            if( i != m_index.constEnd() )
+            {
+                m_slots[i.value()].item = item;
+                return;
+            }
+
+            if( m_slots.size() - m_index.size() > qMax( m_index.size(), int( COMPACT_MIN ) ) )
+            {
+                compact();
+            }
+            if( !m_slots.isEmpty() && handle < m_slots.last().handle )
+            {
+                // Sorted before the next walk over the table
+                m_sorted = false;
+            }
+            Slot slot = { handle, item };
+            m_index.insert( handle, m_slots.size() );
+            m_slots.append( slot );
+        }
+
+        void remove( ObjHandle handle )
+        {
+            QHash<ObjHandle, int>::iterator i = m_index.find( handle );
+            if( i != m_index.end() )
+            {
+                m_slots[i.value()].item = 0;
+                m_index.erase( i );
+            }
+        }
+
+        /// \return the number of items
+        int size() const
+        {
+            return m_index.size();
+        }
+
+        /// \return the handles of all items, in ascending order
+        QVector<ObjHandle> keys() const
+        {
+            QVector<ObjHandle> handles;
+            handles.reserve( size() );
+            for( const_iterator i = constBegin(); i != constEnd(); ++i )
+            {
+                handles.append( i.key() );
+            }
+            return handles;
+        }
+
+        const_iterator constBegin() const
+        {
+            if( !m_sorted )
+            {
+                const_cast<ObjectTable*>( this )->compact();
+            }
+            return const_iterator( &m_slots, 0 );
+        }
+        const_iterator constEnd() const { return const_iterator( &m_slots, m_slots.size() ); }
+        const_iterator begin() const { return constBegin(); }
+        const_iterator end() const { return constEnd(); }
+
+    private:
+        /// Drops the empty slots, puts the others in handle order and indexes them again.
+        void compact()
+        {
+            QVector<Slot>::iterator last = std::remove_if( m_slots.begin(), m_slots.end(), isEmpty );
+            m_slots.erase( last, m_slots.end() );
+            if( !m_sorted )
+            {
+                std::sort( m_slots.begin(), m_slots.end() );
+                m_sorted = true;
+            }
+            m_slots.squeeze();
+            for( int i = 0; i < m_slots.size(); ++i )
+            {
+                m_index[m_slots.at(i).handle] = i;
+            }
+        }
+
+        static bool isEmpty( const Slot &slot )
+        {
+            return !slot.item;
+        }
+
+        /// Empty slots that are always tolerated
+        enum { COMPACT_MIN = 64 };
+
+        QVector<Slot> m_slots;
+        QHash<ObjHandle, int> m_index;
+        bool m_sorted;
+};
+}
+
+#endif
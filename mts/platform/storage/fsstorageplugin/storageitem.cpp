@@ -32,12 +32,14 @@
 #include "storageitem.h"
 #include "trace.h"
 
+#include <string.h>
+
 using namespace meegomtp1dot0;
 
 // Constructor.
 StorageItem::StorageItem() :
     m_handle(0),
-    m_path(""),
+    m_name(""),
     m_wd(-1),
     m_objectInfo(0),
     m_parent(0),
@@ -58,12 +60,35 @@ StorageItem::~StorageItem()
     }
 }
 
+QString StorageItem::path(void) const
+{
+    // Sized up front, so that the path is built in place
+    int size = m_name.size();
+    for( const StorageItem *item = m_parent; item; item = item->m_parent )
+    {
+        size += item->m_name.size() + 1;
+    }
+
+    QString path( size, Qt::Uninitialized );
+    QChar *end = path.data() + size;
+    for( const StorageItem *item = this; item; item = item->m_parent )
+    {
+        end -= item->m_name.size();
+        memcpy( end, item->m_name.constData(), item->m_name.size() * sizeof(QChar) );
+        if( item->m_parent )
+        {
+            *--end = QLatin1Char('/');
+        }
+    }
+    return path;
+}
+
 void StorageItem::setEventsEnabled(bool enabled)
 {
     if( m_eventsEnabled != enabled ) {
         m_eventsEnabled = enabled;
         if( m_eventsEnabled ) {
-            MTP_LOG_INFO("events enabled for:" << m_path);
+            MTP_LOG_INFO("events enabled for:" << path());
         }
     }
 }
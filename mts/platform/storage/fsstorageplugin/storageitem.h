@@ -33,6 +33,7 @@
 #define STORAGEITEM_H
 
 #include "mtptypes.h"
+#include <QHash>
 #include <QString>
 
 namespace meegomtp1dot0
@@ -57,14 +58,17 @@ public:
     /// Is sending of object changed notifications allowed
     bool eventsAreEnabled(void) const;
 
-     // Allow read access to item path
-    const QString &path(void) const {
-        return m_path;
+    /// Builds the item's path from its name and the names of its ancestors
+    QString path(void) const;
+
+    /// The item's file name, the path of the storage for its root
+    const QString &name(void) const {
+        return m_name;
     }
 
 private:
     ObjHandle m_handle; ///< the item's handle
-    QString m_path; ///< the pathname by which this item is identified in the storage.
+    QString m_name; ///< the item's file name, or the storage's path for its root; shared with mtpFileName
     int m_wd; ///< The item's iNotify watch descriptor. This will be -1 for non-directories
     MTPObjectInfo *m_objectInfo; ///< the objectinfo dataset for this item.
     StorageItem *m_parent; ///< this item's parent.
@@ -73,6 +77,23 @@ private:
     MtpInt128 m_puoid;
     bool m_eventsEnabled;
 };
+
+/// Identifies a linked item by its parent and file name, see FSStoragePlugin::findStorageItemByPath()
+struct StorageItemName
+{
+    const StorageItem *parent;
+    QString name;
+};
+
+inline bool operator==( const StorageItemName &a, const StorageItemName &b )
+{
+    return a.parent == b.parent && a.name == b.name;
+}
+
+inline uint qHash( const StorageItemName &key, uint seed = 0 )
+{
+    return qHash( key.name, seed ) ^ qHash( quintptr( key.parent ), seed );
+}
 }
 
 #endif
@@ -0,0 +1,122 @@
+#include "storagescanner.h"
+#include "fsstorageplugin.h"
+#include "storageitem.h"
+
+#include <QtCore/QMutexLocker>
+#include <QtCore/QRunnable>
+
+using namespace meegomtp1dot0;
+
+class StorageScanner::Task : public QRunnable
+{
+    public:
+        Task(StorageScanner *scanner, const QString &path) :
+            m_scanner(scanner), m_path(path)
+        {
+        }
+
+        void run()
+        {
+            m_scanner->run(m_path);
+        }
+
+    private:
+        StorageScanner *m_scanner;
+        QString m_path;
+};
+
+StorageScanner::StorageScanner(FSStoragePlugin *plugin, int threads) :
+    m_plugin(plugin), m_exit(false)
+{
+    m_pool.setMaxThreadCount(threads);
+}
+
+StorageScanner::~StorageScanner()
+{
+    m_lock.lock();
+    m_exit = true;
+    m_lock.unlock();
+
+    m_pool.waitForDone();
+
+    foreach( Entry *entry, m_entries )
+    {
+        qDeleteAll(entry->listing.items);
+        delete entry;
+    }
+}
+
+void StorageScanner::queue(const QString &path)
+{
+    QMutexLocker locker(&m_lock);
+    if( m_exit || m_entries.contains(path) )
+    {
+        return;
+    }
+
+    Entry *entry = new Entry;
+    entry->state = QUEUED;
+    entry->listing.wd = -1;
+    m_entries.insert(path, entry);
+
+    m_pool.start(new Task(this, path));
+}
+
+bool StorageScanner::take(const QString &path, Listing &listing)
+{
+    QMutexLocker locker(&m_lock);
+    Entry *entry = m_entries.value(path);
+    if( !entry )
+    {
+        return false;
+    }
+
+    // Rather than wait for a thread to get to it, do it here
+    if( QUEUED == entry->state )
+    {
+        entry->state = RUNNING;
+        locker.unlock();
+        list(path, entry);
+        locker.relock();
+    }
+    while( LISTED != entry->state )
+    {
+        m_listed.wait(&m_lock);
+    }
+
+    listing = entry->listing;
+    m_entries.remove(path);
+    delete entry;
+    return true;
+}
+
+void StorageScanner::run(const QString &path)
+{
+    QMutexLocker locker(&m_lock);
+    Entry *entry = m_entries.value(path);
+    if( m_exit || !entry || QUEUED != entry->state )
+    {
+        return;
+    }
+    entry->state = RUNNING;
+    locker.unlock();
+
+    list(path, entry);
+}
+
+void StorageScanner::list(const QString &path, Entry *entry)
+{
+    Listing listing;
+    m_plugin->scanDirectory(path, listing);
+
+    // Queue the subdirectories before anyone can take them
+    foreach( const QString &directory, listing.directories )
+    {
+        queue(directory);
+    }
+
+    QMutexLocker locker(&m_lock);
+    entry->listing = listing;
+    entry->state = LISTED;
+    m_listed.wakeAll();
+}
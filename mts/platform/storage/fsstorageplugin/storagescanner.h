@@ -0,0 +1,78 @@
+#ifndef STORAGESCANNER_H
+#define STORAGESCANNER_H
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QStringList>
+#include <QtCore/QThreadPool>
+#include <QtCore/QWaitCondition>
+#include <sys/stat.h>
+
+/// \brief The StorageScanner class lists the directories of a storage on a pool of threads.
+///
+/// FSStoragePlugin builds its object tree depth first on the main thread, assigning handles and
+/// PUOIDs as it goes. The scanner lists the directories ahead of it: every listed directory queues
+/// its subdirectories, so the threads spread over the whole tree, and the StorageItems of the
+/// entries are built and their object info populated on the threads. take() hands the listing of
+/// a directory over to the main thread, which merges the directories in the order it used to list
+/// them in, so the handles come out the same as with a serial scan. A directory that no thread has
+/// started on yet is listed by the caller of take() instead of waited for.
+namespace meegomtp1dot0
+{
+class FSStoragePlugin;
+class StorageItem;
+
+class StorageScanner
+{
+    public:
+        /// The contents of a directory
+        struct Listing
+        {
+            int wd;                     ///< inotify watch added before listing, -1 if none
+            struct stat st;             ///< status of the directory from before listing
+            QList<StorageItem*> items;  ///< the entries, object info populated, not linked
+            QStringList directories;    ///< the paths of the entries that are directories
+        };
+
+        /// Constructor for StorageScanner
+        /// \param plugin [in] lists the directories, see FSStoragePlugin::scanDirectory()
+        /// \param threads [in] the maximum number of threads
+        StorageScanner(FSStoragePlugin *plugin, int threads);
+
+        /// Destructor for StorageScanner, deletes the items that were not taken
+        ~StorageScanner();
+
+        /// Queues a directory to be listed.
+        void queue(const QString &path);
+
+        /// Waits until a queued directory has been listed and hands its listing over.
+        /// \param path [in] the directory
+        /// \param listing [out] the listing, the caller owns its items
+        /// \return false if the directory was not queued
+        bool take(const QString &path, Listing &listing);
+
+    private:
+        class Task;
+
+        enum State { QUEUED, RUNNING, LISTED };
+
+        struct Entry
+        {
+            State state;
+            Listing listing;
+        };
+
+        void run(const QString &path);
+        void list(const QString &path, Entry *entry);
+
+        FSStoragePlugin *m_plugin;
+        QThreadPool m_pool;
+        QMutex m_lock;                  ///< Protects the members below
+        QWaitCondition m_listed;        ///< Signals listed directories
+        QHash<QString, Entry*> m_entries; ///< Directories queued and not taken yet
+        bool m_exit;                    ///< Queued directories are no longer listed
+};
+}
+
+#endif
@@ -30,10 +30,15 @@
 */
 
 // System headers
+#include <QDir>
+#include <QFile>
+#include <QMutexLocker>
+#include <QRunnable>
 #include <QString>
 #include <QRegExp>
-#include <QUuid>
+#include <QThread>
 #include <QUrl>
+#include <QVector>
 /*
 #include <QDBusPendingReply>
 #include <QDBusConnection>
@@ -50,74 +55,107 @@ using namespace meegomtp1dot0;
 
 // Static declarations
 static const QString IRI_PREFIX = "file://";
-static const QString RDF_TYPE = "http://www.w3.org/1999/02/22-rdf-syntax-ns#type";
-static QString getDateCreated (const QString&);
-static QString getName (const QString&);
-static QString getArtist (const QString&);
-static QString getWidth (const QString&);
-static QString getHeight (const QString&);
-static QString getDuration (const QString&);
-static QString getTrack (const QString&);
-static QString getGenre (const QString&);
-static QString getUseCount (const QString&);
-static QString getAlbumName (const QString&);
-static QString getBitrateType (const QString&);
-static QString getSampleRate (const QString&);
-static QString getNbrOfChannels (const QString&);
-static QString getAudioBitDepth (const QString&);
-static QString getAudioWAVECodec (const QString&);
-static QString getAudioBitRate (const QString&);
-static QString getVideoFourCCCodec (const QString&);
-static QString getVideoBitRate (const QString&);
-static QString getFramesPerThousandSecs (const QString&);
-static QString getDRMStatus (const QString&);
-
-
-static void setDateCreated (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setName (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setArtist (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setWidth (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setHeight (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setDuration (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setDRMStatus (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setTrack (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setGenre (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setUseCount (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setAlbumName (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setBitrateType (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setSampleRate (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setNbrOfChannels (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setAudioBitDepth (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setAudioWAVECodec (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setAudioBitRate (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setVideoFourCCCodec (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setVideoBitRate (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-static void setFramesPerThousandSecs (const QString& iri, QString& val, QStringList& domains, QString &extraInserts);
-
-static void trackerQuery(const QString&, QVector<QStringList> &res);
-static void trackerUpdateQuery(const QString&);
+// Most files whose metadata is cached
+static const int METADATA_CACHE_SIZE = 4096;
+// Longest wait of a mass query for the files it has queued for extraction
+static const int EXTRACT_WAIT_MSECS = 50;
 static void convertResultByTypeAndCode(const QString&, QString&, MTPDataType, MTPObjPropertyCode, QVariant&);
-static QString getValAsString(const QVariant& propVal, MTPDataType type, MTPObjPropertyCode code);
 static QString generateIriForTracker(const QString& path);
-static void deletePlaylistByIri(const QString &iri);
 
-static const QString MINER_DEST("org.freedesktop.Tracker1.Miner.Files");
-static const QString MINER_PATH("/org/freedesktop/Tracker1/Miner/Files");
-static const QString MINER_IF("org.freedesktop.Tracker1.Miner");
+namespace
+{
+// A file of a mass query
+struct ChildFile
+{
+    QString path;
+    struct stat st;
+    bool cached;
+    MetadataExtractor::Metadata metadata;
+};
+}
+
+class StorageTracker::ExtractTask : public QRunnable
+{
+    public:
+        ExtractTask(StorageTracker *tracker, const QString &path, const struct stat &st) :
+            m_tracker(tracker), m_path(path), m_st(st)
+        {
+        }
+
+        void run()
+        {
+            MetadataExtractor::Metadata metadata;
+            MetadataExtractor::extract(m_path, metadata);
+            m_tracker->extracted(m_path, m_st, metadata);
+        }
+
+    private:
+        StorageTracker *m_tracker;
+        QString m_path;
+        struct stat m_st;
+};
+
+static qint64 modificationTime(const struct stat &st)
+{
+    return (qint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
 
-StorageTracker::StorageTracker()
+StorageTracker::StorageTracker() : m_metadataCache(METADATA_CACHE_SIZE)
 {
+    bool ok;
+    // Number of threads extracting metadata for mass queries, 0 extracts
+    // on the main thread
+    m_extractThreads = qgetenv("MTP_METADATA_THREADS").toInt(&ok);
+    if(!ok || m_extractThreads < 0)
+    {
+        m_extractThreads = QThread::idealThreadCount();
+    }
+    m_extractPool.setMaxThreadCount(qMax(m_extractThreads, 1));
+
     populateFunctionMap();
 }
 
 StorageTracker::~StorageTracker()
 {
-
+    // Nobody is going to ask for the files still queued
+    m_extractPool.clear();
+    m_extractPool.waitForDone();
 }
 
-// Populates the lookup table with functions to fetch respective Object info.
+// Populates the table of properties read from the files or set by the initiator.
 void StorageTracker::populateFunctionMap()
 {
+    static const MTPObjPropertyCode properties[] = {
+        MTP_OBJ_PROP_Date_Created,
+        MTP_OBJ_PROP_Name,
+        MTP_OBJ_PROP_Artist,
+        MTP_OBJ_PROP_Width,
+        MTP_OBJ_PROP_Height,
+        MTP_OBJ_PROP_Duration,
+        MTP_OBJ_PROP_Rating,
+        MTP_OBJ_PROP_Track,
+        MTP_OBJ_PROP_Genre,
+        MTP_OBJ_PROP_Use_Count,
+        MTP_OBJ_PROP_Composer,
+        MTP_OBJ_PROP_Original_Release_Date,
+        MTP_OBJ_PROP_Album_Name,
+        MTP_OBJ_PROP_Album_Artist,
+        MTP_OBJ_PROP_DRM_Status,
+        MTP_OBJ_PROP_Bitrate_Type,
+        MTP_OBJ_PROP_Sample_Rate,
+        MTP_OBJ_PROP_Nbr_Of_Channels,
+        MTP_OBJ_PROP_Audio_BitDepth,
+        MTP_OBJ_PROP_Audio_WAVE_Codec,
+        MTP_OBJ_PROP_Audio_BitRate,
+        MTP_OBJ_PROP_Video_FourCC_Codec,
+        MTP_OBJ_PROP_Video_BitRate,
+        MTP_OBJ_PROP_Frames_Per_Thousand_Secs
+    };
+
+    for(size_t i = 0; i < sizeof(properties) / sizeof(properties[0]); ++i)
+    {
+        m_supportedProperties.insert(properties[i]);
+    }
 }
 
 static void convertResultByTypeAndCode(const QString& filePath, QString& res, MTPDataType type, MTPObjPropertyCode code, QVariant& convertedResult)
@@ -227,174 +265,295 @@ static void convertResultByTypeAndCode(const QString& filePath, QString& res, MT
         default:
             break;
     }
+}
 
-    if(MTP_OBJ_PROP_Duration == code)
+// Fills in a property value, from the values set by the initiator or else from the metadata
+// of the file. Returns false if neither has one.
+static bool propertyValue(const QString &filePath, const MetadataExtractor::Metadata &metadata,
+        const QHash<MTPObjPropertyCode, QVariant> &overrides, MTPObjPropertyCode code,
+        MTPDataType type, QVariant &value)
+{
+    QHash<MTPObjPropertyCode, QVariant>::const_iterator i = overrides.constFind(code);
+    if(i != overrides.constEnd())
     {
-        quint32 v = convertedResult.value<quint32>();
-        v = v * 1000;
-        convertedResult = QVariant::fromValue(v);
+        value = i.value();
+        return true;
     }
+
+    // Files without a title go by their file name
+    QString res = metadata.value(code);
+    if(res.isEmpty() && MTP_OBJ_PROP_Name != code)
+    {
+        return false;
+    }
+    convertResultByTypeAndCode(filePath, res, type, code, value);
+    return true;
 }
 
-static QString getValAsString(const QVariant& propVal, MTPDataType type, MTPObjPropertyCode code)
+bool StorageTracker::cachedMetadata(const QString &path, const struct stat &st, MetadataExtractor::Metadata &metadata)
 {
-    QString ret;
-    switch(type)
+    takeExtracted();
+    CachedMetadata *cached = m_metadataCache.object(path);
+    if(!cached || cached->mtime != modificationTime(st) || cached->size != st.st_size)
     {
-        case MTP_DATA_TYPE_INT8:
-        case MTP_DATA_TYPE_UINT8:
-            {
-                // Only booleans for now!
-                quint8 num = propVal.value<quint8>();
-                if(0 == num)
-                {
-                    ret = "false";
-                }
-                else
-                {
-                    ret = "true";
-                }
-            }
-            break;
-        case MTP_DATA_TYPE_INT16:
-        case MTP_DATA_TYPE_INT32:
-            {
-               long num = propVal.value<long>();
-               ret = QString::number(num);
-            }
-            break;
-        case MTP_DATA_TYPE_UINT16:
-        case MTP_DATA_TYPE_UINT32:
-            {
-               ulong num = propVal.value<ulong>();
-               if(MTP_OBJ_PROP_Duration == code)
-               {
-                   num /= 1000;
-               }
-               ret = QString::number(num);
-               if( MTP_OBJ_PROP_DRM_Status == code )
-               {
-                   if( "1" == ret )
-                   {
-                       ret = "true";
-                   }
-                   else
-                   {
-                       ret = "false";
-                   }
-               }
-            }
-            break;
-        case MTP_DATA_TYPE_INT64:
-            {
-                qlonglong num = propVal.value<qlonglong>();
-                ret = QString::number(num);
-            }
-            break;
-        case MTP_DATA_TYPE_UINT64:
-            {
-                qulonglong num = propVal.value<qulonglong>();
-                ret = QString::number(num);
-            }
-            break;
-        case MTP_DATA_TYPE_STR:
-            {
-                ret = propVal.value<QString>();
-                if(MTP_OBJ_PROP_Date_Created == code)
-                {
-                    // Add : after +/-, for the timezone, if any
-                    int idx = ret.lastIndexOf(QRegExp("\\+|\\-"));
-                    if(-1 != idx)
-                    {
-                        ret.insert(idx + 3, ":");
-                    }
-
-                    // Covert date from MTP representation to ISO 8601
-                    // Remove any tenths of seconds first...
-                    ret.replace(QRegExp("\\.[0-9]"), "");
-                    // Add -'s and :'s
-                    ret.insert(4, "-");
-                    ret.insert(7, "-");
-                    ret.insert(13, ":");
-                    ret.insert(16, ":");
-                }
-            }
-            break;
-    // The below types are not currently supported for writing to tracker
-        case MTP_DATA_TYPE_INT128:
-        case MTP_DATA_TYPE_UINT128:
-        case MTP_DATA_TYPE_AINT8:
-        case MTP_DATA_TYPE_AUINT8:
-        case MTP_DATA_TYPE_AINT16:
-        case MTP_DATA_TYPE_AUINT16:
-        case MTP_DATA_TYPE_AINT32:
-        case MTP_DATA_TYPE_AUINT32:
-        case MTP_DATA_TYPE_AINT64:
-        case MTP_DATA_TYPE_AUINT64:
-        case MTP_DATA_TYPE_AINT128:
-        case MTP_DATA_TYPE_AUINT128:
-        default:
-            MTP_LOG_WARNING("Unsupported data type in tracker write::" << type);
-            break;
+        return false;
     }
-    // Escape any 's in the value, as the query encloses the values in single quotes
-    ret.replace(QRegExp("'"), "\\'");
-    return ret;
+    metadata = cached->values;
+    return true;
 }
 
-QString StorageTracker::buildQuery(const QString &filePath, QList<MTPObjPropDescVal> &propValList)
-{   return QString();
+void StorageTracker::cacheMetadata(const QString &path, const struct stat &st, const MetadataExtractor::Metadata &metadata)
+{
+    CachedMetadata *cached = new CachedMetadata;
+    cached->mtime = modificationTime(st);
+    cached->size = st.st_size;
+    cached->values = metadata;
+    m_metadataCache.insert(path, cached);
 }
 
-QString StorageTracker::buildMassQuery(const QString &path,
-                                       const QList<const MtpObjPropDesc *> &properties)
+// Called on the extracting threads
+void StorageTracker::extracted(const QString &path, const struct stat &st, const MetadataExtractor::Metadata &metadata)
 {
-        return QString();
+    CachedMetadata cached;
+    cached.mtime = modificationTime(st);
+    cached.size = st.st_size;
+    cached.values = metadata;
+
+    QMutexLocker locker(&m_extractedLock);
+    m_extracted.insert(path, cached);
 }
 
-bool StorageTracker::getPropVals(const QString &filePath, QList<MTPObjPropDescVal> &propValList)
+// Moves the metadata extracted in the background into the cache.
+void StorageTracker::takeExtracted()
 {
-    bool ret = false;
-    return ret;
+    QHash<QString, CachedMetadata> extracted;
+    {
+        QMutexLocker locker(&m_extractedLock);
+        if(m_extracted.isEmpty())
+        {
+            return;
+        }
+        extracted.swap(m_extracted);
+    }
+    for(QHash<QString, CachedMetadata>::const_iterator i = extracted.constBegin(); i != extracted.constEnd(); ++i)
+    {
+        m_extracting.remove(i.key());
+        m_metadataCache.insert(i.key(), new CachedMetadata(i.value()));
+    }
 }
 
-void StorageTracker::getChildPropVals(const QString& parentPath,
-        const QList<const MtpObjPropDesc *>& properties,
-        QMap<QString, QList<QVariant> > &values)
+// Gets the values the initiator set for a file, dropping them if the file has changed since.
+void StorageTracker::overriddenValues(const QString &path, const struct stat *st, PropertyValues &values)
 {
-    return;
+    QHash<QString, PropertyOverrides>::iterator i = m_overrides.find(path);
+    if(i == m_overrides.end())
+    {
+        return;
+    }
 
+    if(i->pending)
+    {
+        if(st && st->st_size)
+        {
+            // The file has been sent, the values hold until it is modified
+            i->pending = false;
+            i->mtime = modificationTime(*st);
+            i->size = st->st_size;
+        }
+    }
+    else if(!st || i->mtime != modificationTime(*st) || i->size != st->st_size)
+    {
+        m_overrides.erase(i);
+        return;
+    }
+    values = i->values;
 }
 
-// Fetch the property value for the object referenced by the iri (ex: file:///home/user/MyDocs/1.mp3).
-// Caller must free the pResult by calling storage_tracker_free_tracker_result
-bool StorageTracker::getObjectProperty(const QString& path, MTPObjPropertyCode ePropertyCode, MTPDataType type, QVariant& result)
+StorageTracker::PropertyOverrides &StorageTracker::overridesOf(const QString &path, bool pending)
 {
-    return false;
+    struct stat st;
+    bool exists = (0 == stat(QFile::encodeName(path).constData(), &st));
+
+    // Drop any stale values first
+    PropertyValues values;
+    overriddenValues(path, exists ? &st : 0, values);
+
+    PropertyOverrides &overrides = m_overrides[path];
+    overrides.pending = pending || !exists;
+    overrides.mtime = exists ? modificationTime(st) : 0;
+    overrides.size = exists ? st.st_size : 0;
+    return overrides;
 }
 
-QString StorageTracker::buildUpdateQuery(const QString &filePath, QList<MTPObjPropDescVal> &propValList)
-{   return QString();
+// Gets the metadata of a file, from the cache if the file has not changed.
+void StorageTracker::fileValues(const QString &path, MetadataExtractor::Metadata &metadata, PropertyValues &overrides)
+{
+    struct stat st;
+    if(-1 == stat(QFile::encodeName(path).constData(), &st))
+    {
+        overriddenValues(path, 0, overrides);
+        return;
+    }
+
+    overriddenValues(path, &st, overrides);
+    if(S_ISREG(st.st_mode) && !cachedMetadata(path, st, metadata))
+    {
+        MetadataExtractor::extract(path, metadata);
+        cacheMetadata(path, st, metadata);
+    }
 }
 
-void StorageTracker::setPropVals(const QString &filePath, QList<MTPObjPropDescVal> &propValList)
+bool StorageTracker::getPropVals(const QString &filePath, QList<MTPObjPropDescVal> &propValList)
 {
+    bool ret = false;
+
+    // Values from the storage take precedence, don't read the file if
+    // there is nothing left to fill in
+    bool needed = false;
+    for(QList<MTPObjPropDescVal>::const_iterator i = propValList.constBegin(); i != propValList.constEnd(); ++i)
+    {
+        if(i->propVal.isNull() && supportsProperty(i->propDesc->uPropCode))
+        {
+            needed = true;
+            break;
+        }
+    }
+    if(!needed)
+    {
+        return ret;
+    }
 
+    MetadataExtractor::Metadata metadata;
+    PropertyValues overrides;
+    fileValues(filePath, metadata, overrides);
+    for(QList<MTPObjPropDescVal>::iterator i = propValList.begin(); i != propValList.end(); ++i)
+    {
+        const MtpObjPropDesc *desc = i->propDesc;
+        if(i->propVal.isNull() && supportsProperty(desc->uPropCode) &&
+           propertyValue(filePath, metadata, overrides, desc->uPropCode, desc->uDataType, i->propVal))
+        {
+            ret = true;
+        }
+    }
+    return ret;
 }
 
-bool StorageTracker::setObjectProperty(const QString& path, MTPObjPropertyCode ePropertyCode, MTPDataType type, const QVariant& propVal)
+void StorageTracker::getChildPropVals(const QString& parentPath,
+        const QList<const MtpObjPropDesc *>& properties,
+        QMap<QString, QList<QVariant> > &values)
 {
-    return false;
+    if(properties.isEmpty())
+    {
+        return;
+    }
+
+    QVector<ChildFile> files;
+    QStringList names = QDir(parentPath).entryList(QDir::Files | QDir::Hidden | QDir::System, QDir::Unsorted);
+    files.reserve(names.size());
+    bool queued = false;
+    foreach(const QString &name, names)
+    {
+        ChildFile file;
+        file.path = parentPath + '/' + name;
+        if(-1 == stat(QFile::encodeName(file.path).constData(), &file.st) || !S_ISREG(file.st.st_mode))
+        {
+            continue;
+        }
+        file.cached = cachedMetadata(file.path, file.st, file.metadata);
+        if(!file.cached && m_extractThreads <= 0)
+        {
+            MetadataExtractor::extract(file.path, file.metadata);
+            cacheMetadata(file.path, file.st, file.metadata);
+            file.cached = true;
+        }
+        else if(!file.cached && !m_extracting.contains(file.path))
+        {
+            // The reads of each file are few and small, so the threads
+            // mostly wait for the storage
+            m_extracting.insert(file.path);
+            m_extractPool.start(new ExtractTask(this, file.path, file.st));
+            queued = true;
+        }
+        files.append(file);
+    }
+
+    // A folder of many files takes long to extract. Give the threads a
+    // moment for the small ones and leave the rest in the background: the
+    // files left out are asked for one by one, by then mostly from the cache.
+    if(queued)
+    {
+        m_extractPool.waitForDone(EXTRACT_WAIT_MSECS);
+    }
+
+    for(int i = 0; i < files.size(); ++i)
+    {
+        ChildFile &file = files[i];
+        if(!file.cached && !cachedMetadata(file.path, file.st, file.metadata))
+        {
+            continue;
+        }
+
+        PropertyValues overrides;
+        overriddenValues(file.path, &file.st, overrides);
+        QList<QVariant> &childValues = values[file.path];
+        foreach(const MtpObjPropDesc *desc, properties)
+        {
+            // Left invalid if the file has no value
+            QVariant value;
+            propertyValue(file.path, file.metadata, overrides, desc->uPropCode, desc->uDataType, value);
+            childValues.append(value);
+        }
+    }
 }
 
+// Fetch the property value for the file at path. Supported properties the
+// file has no value for get the default value of their type.
+bool StorageTracker::getObjectProperty(const QString& path, MTPObjPropertyCode ePropertyCode, MTPDataType type, QVariant& result)
+{
+    if(!supportsProperty(ePropertyCode))
+    {
+        return false;
+    }
 
+    MetadataExtractor::Metadata metadata;
+    PropertyValues overrides;
+    fileValues(path, metadata, overrides);
+    if(!propertyValue(path, metadata, overrides, ePropertyCode, type, result))
+    {
+        QString empty;
+        convertResultByTypeAndCode(path, empty, type, ePropertyCode, result);
+    }
+    return true;
+}
 
-static void trackerQuery(const QString& query, QVector<QStringList> &res)
+// Called for SendObjectPropList, before the file itself is sent.
+void StorageTracker::setPropVals(const QString &filePath, QList<MTPObjPropDescVal> &propValList)
 {
+    PropertyOverrides *overrides = 0;
+    for(QList<MTPObjPropDescVal>::const_iterator i = propValList.constBegin(); i != propValList.constEnd(); ++i)
+    {
+        const MtpObjPropDesc *desc = i->propDesc;
+        if(!supportsProperty(desc->uPropCode) || !i->propVal.isValid())
+        {
+            continue;
+        }
+        if(!overrides)
+        {
+            overrides = &overridesOf(filePath, true);
+        }
+        overrides->values.insert(desc->uPropCode, i->propVal);
+    }
 }
 
-static void trackerUpdateQuery(const QString& query)
+bool StorageTracker::setObjectProperty(const QString& path, MTPObjPropertyCode ePropertyCode, MTPDataType type, const QVariant& propVal)
 {
+    Q_UNUSED(type);
+    if(!supportsProperty(ePropertyCode))
+    {
+        return false;
+    }
+    overridesOf(path, false).values.insert(ePropertyCode, propVal);
+    return true;
 }
 
 static QString generateIriForTracker(const QString& path)
@@ -437,17 +596,22 @@ void StorageTracker::deletePlaylist(const QString &path)
 
 }
 
-static void deletePlaylistByIri(const QString &playlistUri)
-{
-
-}
-
 void StorageTracker::movePlaylist(const QString &fromPath, const QString &toPath)
 {
 }
 
 void StorageTracker::move(const QString &fromPath, const QString &toPath)
 {
+    // Renaming keeps the modification time, and so the cached metadata valid
+    CachedMetadata *cached = m_metadataCache.take(fromPath);
+    if(cached)
+    {
+        m_metadataCache.insert(toPath, cached);
+    }
+    if(m_overrides.contains(fromPath))
+    {
+        m_overrides.insert(toPath, m_overrides.take(fromPath));
+    }
 }
 
 QString StorageTracker::generateIri(const QString &path)
@@ -457,14 +621,18 @@ QString StorageTracker::generateIri(const QString &path)
 
 bool StorageTracker::supportsProperty(MTPObjPropertyCode code) const
 {
-    return false;
+    return m_supportedProperties.contains(code);
 }
 
+// Called before the copy is written, the values set for the original hold
+// for the copy once it is done.
 void StorageTracker::copy(const QString &fromPath, const QString &toPath)
 {
-}
-
-bool StorageTracker::isTrackerPropertySupported(const QString &property)
-{
-    return false;
+    struct stat st;
+    PropertyValues values;
+    overriddenValues(fromPath, 0 == stat(QFile::encodeName(fromPath).constData(), &st) ? &st : 0, values);
+    if(!values.isEmpty())
+    {
+        overridesOf(toPath, true).values = values;
+    }
 }
@@ -34,17 +34,27 @@
 
 #include <QVariant>
 #include <QList>
+#include <QCache>
+#include <QMutex>
+#include <QSet>
+#include <QThreadPool>
 //#include <QDBusInterface>
 //#include <QDBusPendingCallWatcher>
 #include "mtptypes.h"
+#include "metadataextractor.h"
+#include <sys/stat.h>
 
 class QString;
 
-typedef QString (*fpTrackerQueryHandler)(const QString&);
-typedef void (*fpTrackerUpdateQueryHandler)(const QString&, QString&, QStringList&, QString&);
-
 namespace meegomtp1dot0
 {
+/// \brief The StorageTracker class provides the media metadata of the files of a storage.
+///
+/// The metadata is read from the files by MetadataExtractor and cached for as long as the file
+/// is not modified. Mass queries for the children of a folder extract the files that are not
+/// cached on a pool of threads, and leave out the files not done within a short wait rather than
+/// blocking on the whole folder. Values set by the initiator are kept in memory and preferred
+/// over the extracted ones until the file changes.
 class StorageTracker : public QObject
 {
 #ifdef UT_ON
@@ -76,15 +86,43 @@ friend class FSStoragePlugin_test;
         //void ignoreNextUpdateFinished(QDBusPendingCallWatcher *pcw);
 
     private:
-        QHash<MTPObjPropertyCode, fpTrackerQueryHandler> m_handlerTable;
-        QHash<MTPObjPropertyCode, fpTrackerUpdateQueryHandler> m_handlerTableUpdate;
-        QHash<QString, int> m_trackerPropertyTable;
+        class ExtractTask;
+
+        typedef QHash<MTPObjPropertyCode, QVariant> PropertyValues;
+
+        /// Metadata extracted from a file
+        struct CachedMetadata
+        {
+            qint64 mtime;               ///< modification time of the file, in nanoseconds
+            qint64 size;                ///< size of the file
+            MetadataExtractor::Metadata values;
+        };
+
+        /// Values set by the initiator
+        struct PropertyOverrides
+        {
+            bool pending;               ///< the file is still being sent
+            qint64 mtime;
+            qint64 size;
+            PropertyValues values;
+        };
+
+        QSet<MTPObjPropertyCode> m_supportedProperties;
+        QCache<QString, CachedMetadata> m_metadataCache;
+        QHash<QString, PropertyOverrides> m_overrides;
+        QThreadPool m_extractPool;
+        int m_extractThreads;           ///< 0 extracts on the calling thread
+        QSet<QString> m_extracting;     ///< Files queued for extraction
+        QMutex m_extractedLock;         ///< Protects m_extracted
+        QHash<QString, CachedMetadata> m_extracted; ///< Extracted, not cached yet
         void populateFunctionMap();
-        QString buildQuery(const QString &filePath, QList<MTPObjPropDescVal> &propValList);
-        QString buildMassQuery(const QString &path,
-                const QList<const MtpObjPropDesc *> &properties);
-        QString buildUpdateQuery(const QString &filePath, QList<MTPObjPropDescVal> &propValList);
-        bool isTrackerPropertySupported(const QString &property);
+        void fileValues(const QString &path, MetadataExtractor::Metadata &metadata, PropertyValues &overrides);
+        bool cachedMetadata(const QString &path, const struct stat &st, MetadataExtractor::Metadata &metadata);
+        void cacheMetadata(const QString &path, const struct stat &st, const MetadataExtractor::Metadata &metadata);
+        void extracted(const QString &path, const struct stat &st, const MetadataExtractor::Metadata &metadata);
+        void takeExtracted();
+        void overriddenValues(const QString &path, const struct stat *st, PropertyValues &values);
+        PropertyOverrides &overridesOf(const QString &path, bool pending);
         //QDBusInterface m_minerInterface;
 };
 }
@@ -30,8 +30,20 @@
 */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include "fsstorageplugin_test.h"
 #include "fsstorageplugin.h"
+#include "fsinotify.h"
 #include "storageitem.h"
 #include "storagetracker.h"
 #include <QSparqlConnection>
@@ -40,6 +52,7 @@
 #include <QImage>
 #include <QPainter>
 #include <QRadialGradient>
+#include <QSemaphore>
 #include <QSignalSpy>
 
 
@@ -65,12 +78,12 @@ void FSStoragePlugin_test::initTestCase()
         setupPlugin(m_storage);
         QVERIFY( m_storage->m_root != 0 );
         QCOMPARE( m_storage->m_root->m_handle, static_cast<unsigned int>(0) );
-        QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+        QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_itemNamesMap.size() + 1 );
         QCOMPARE( m_storage->m_objectHandlesMap.size(), 12 );
 
         QVector<ObjHandle> references;
         MTPResponseCode response;
-        quint32 handle = m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/fileA"];
+        quint32 handle = handleOf( m_storage, "/tmp/mtptests/subdir2/fileA" );
         response = m_storage->getReferences( handle, references );
         QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
         QCOMPARE( references.size(), 2 );
@@ -249,7 +262,7 @@ void FSStoragePlugin_test::testStorageCreation()
     QVERIFY( m_storage->m_root->m_parent == 0 );
     QVERIFY( m_storage->m_root->m_firstChild != 0 );
     QVERIFY( m_storage->m_root->m_nextSibling == 0 );
-    QCOMPARE( m_storage->m_root->m_path, QString("/tmp/mtptests") );
+    QCOMPARE( m_storage->m_root->path(), QString("/tmp/mtptests") );
 
     // Check whether child items are correctly linked to their parents.
     StorageItem *parentItem =
@@ -260,6 +273,389 @@ void FSStoragePlugin_test::testStorageCreation()
     QCOMPARE( childItem->m_objectInfo->mtpParentObject, parentItem->m_handle );
 }
 
+void FSStoragePlugin_test::testParallelEnumeration()
+{
+    QDir dir( "/tmp/mtptests-scan" );
+    dir.removeRecursively();
+    for( int i = 0; i < 4; i++ )
+    {
+        QString sub = QString("/tmp/mtptests-scan/dir%1/sub").arg(i);
+        dir.mkpath( sub );
+        for( int j = 0; j < 8; j++ )
+        {
+            QFile( QString("%1/file%2").arg(sub).arg(j) ).open( QIODevice::WriteOnly );
+            QFile( QString("%1/../file%2").arg(sub).arg(j) ).open( QIODevice::WriteOnly );
+        }
+    }
+
+    // Handles are assigned in the same order whether the directories
+    // are listed on the main thread or not
+    QHash<QString, ObjHandle> handles[2];
+    for( int threads = 0; threads < 2; threads++ )
+    {
+        qputenv( "MTP_SCAN_THREADS", threads ? "4" : "0" );
+        qputenv( "MTP_TREE_SNAPSHOT", "0" );
+        FSStoragePlugin storage( 3, MTP_STORAGE_TYPE_FixedRAM, "/tmp/mtptests-scan", "scan", "Scan" );
+        setupPlugin(&storage);
+        QCOMPARE( storage.m_objectHandlesMap.size(), storage.m_itemNamesMap.size() + 1 );
+
+        StorageItem *parentItem = storage.findStorageItemByPath( "/tmp/mtptests-scan/dir2/sub" );
+        StorageItem *childItem = storage.findStorageItemByPath( "/tmp/mtptests-scan/dir2/sub/file5" );
+        QVERIFY( parentItem && childItem );
+        QCOMPARE( childItem->m_objectInfo->mtpParentObject, parentItem->m_handle );
+        QVERIFY( parentItem->m_wd != -1 );
+        QCOMPARE( storage.m_watchDescriptorMap.value( parentItem->m_wd ), parentItem->m_handle );
+
+        // The playlists are synced after the scan, and come last
+        handles[threads] = pathNames( &storage );
+        foreach( const QString &path, handles[threads].keys() )
+        {
+            if( path.startsWith( "/tmp/mtptests-scan/Playlists/" ) )
+            {
+                handles[threads].remove( path );
+            }
+        }
+    }
+    qunsetenv( "MTP_SCAN_THREADS" );
+    qunsetenv( "MTP_TREE_SNAPSHOT" );
+
+    QCOMPARE( handles[0].size(), 1 + 4 * (2 + 2 * 8) + 1 );
+    QCOMPARE( handles[1], handles[0] );
+
+    dir.removeRecursively();
+}
+
+// Counts the system calls scan() makes, in a child process traced by
+// this one. Returns -1 if tracing is not permitted.
+template<class Scan>
+static int countSyscalls(Scan scan)
+{
+    pid_t pid = fork();
+    if( pid == 0 )
+    {
+        if( ptrace( PTRACE_TRACEME, 0, 0, 0 ) == -1 )
+        {
+            _exit( 1 );
+        }
+        raise( SIGSTOP );
+        scan();
+        _exit( 0 );
+    }
+
+    int status;
+    if( pid == -1 || waitpid( pid, &status, 0 ) == -1 || !WIFSTOPPED(status) )
+    {
+        return -1;
+    }
+    ptrace( PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD );
+
+    // Each system call stops the child on entry and on exit
+    int stops = 0;
+    for( ;; )
+    {
+        ptrace( PTRACE_SYSCALL, pid, 0, 0 );
+        if( waitpid( pid, &status, 0 ) == -1 || !WIFSTOPPED(status) )
+        {
+            break;
+        }
+        if( WSTOPSIG(status) == (SIGTRAP | 0x80) )
+        {
+            stops++;
+        }
+    }
+    return stops / 2;
+}
+
+void FSStoragePlugin_test::benchmarkScanSyscalls()
+{
+    const int files = 1000;
+    const QString path( "/tmp/mtptests-bench" );
+
+    QDir dir( path );
+    dir.removeRecursively();
+    dir.mkpath( path + "/dir" );
+    for( int i = 0; i < files - 1; i++ )
+    {
+        QFile( QString("%1/file%2.jpg").arg(path).arg(i) ).open( QIODevice::WriteOnly );
+    }
+
+    // scanDirectory() lists the entries with getdents64 and builds each
+    // item, through populateObjectInfo(), from a single fstatat()
+    int calls = countSyscalls( [&]() {
+        StorageScanner::Listing listing;
+        m_storage->scanDirectory( path, listing );
+        qDeleteAll( listing.items );
+    } );
+
+    dir.removeRecursively();
+
+    if( calls < 0 )
+    {
+        QSKIP( "tracing the system calls is not permitted" );
+    }
+    qDebug() << "system calls per file:" << double(calls) / files;
+    QVERIFY( calls < 2 * files );
+    QTest::setBenchmarkResult( double(calls) / files, QTest::Events );
+}
+
+void FSStoragePlugin_test::testTreeSnapshot()
+{
+    const QString path( "/tmp/mtptests-tree" );
+    QDir dir( path );
+    dir.removeRecursively();
+    dir.mkpath( path + "/keep/sub" );
+    dir.mkpath( path + "/gone" );
+    dir.mkpath( path + "/Playlists" );
+    QFile( path + "/keep/a" ).open( QIODevice::WriteOnly );
+    QFile( path + "/keep/sub/b" ).open( QIODevice::WriteOnly );
+    QFile( path + "/gone/c" ).open( QIODevice::WriteOnly );
+
+    // Old enough for the modification times of the directories to be trusted
+    struct timeval times[2] = { { time( 0 ) - 3600, 0 }, { time( 0 ) - 3600, 0 } };
+    foreach( const QString &directory, QStringList() << "" << "/keep" << "/keep/sub" << "/gone" << "/Playlists" )
+    {
+        QVERIFY( utimes( QFile::encodeName( path + directory ).constData(), times ) == 0 );
+    }
+
+    QHash<QString, ObjHandle> handles;
+    QString snapshotPath;
+    {
+        FSStoragePlugin storage( 4, MTP_STORAGE_TYPE_FixedRAM, path, "tree", "Tree" );
+        QFile::remove( storage.m_treeSnapshotPath );
+        setupPlugin(&storage);
+        QVERIFY( storage.m_treeChecks.isEmpty() );
+        handles = pathNames( &storage );
+        snapshotPath = storage.m_treeSnapshotPath;
+    }
+    QVERIFY( QFile::exists( snapshotPath ) );
+
+    // Changed while not running: c removed, d added, a grown in place,
+    // which does not change the modification time of its directory
+    QFile::remove( path + "/gone/c" );
+    QFile( path + "/keep/sub/d" ).open( QIODevice::WriteOnly );
+    QFile a( path + "/keep/a" );
+    QVERIFY( a.open( QIODevice::WriteOnly ) );
+    a.write( "abc" );
+    a.close();
+
+    {
+        FSStoragePlugin storage( 4, MTP_STORAGE_TYPE_FixedRAM, path, "tree", "Tree" );
+        QSignalSpy spy( &storage, SIGNAL(eventGenerated(MTPEventCode, const QVector<quint32>&)) );
+        setupPlugin(&storage);
+
+        // Loaded with the same handles a scan would have assigned
+        QCOMPARE( pathNames( &storage ).value( path + "/keep/a" ), handles.value( path + "/keep/a" ) );
+        QCOMPARE( pathNames( &storage ).value( path + "/keep/sub" ), handles.value( path + "/keep/sub" ) );
+        StorageItem *parentItem = storage.findStorageItemByPath( path + "/keep/sub" );
+        StorageItem *childItem = storage.findStorageItemByPath( path + "/keep/sub/b" );
+        QVERIFY( parentItem && childItem );
+        QCOMPARE( childItem->m_objectInfo->mtpParentObject, parentItem->m_handle );
+        QCOMPARE( storage.m_watchDescriptorMap.value( parentItem->m_wd ), parentItem->m_handle );
+
+        QTRY_VERIFY( storage.m_treeChecks.isEmpty() );
+        QVERIFY( !pathNames( &storage ).contains( path + "/gone/c" ) );
+        QVERIFY( pathNames( &storage ).contains( path + "/gone" ) );
+        QVERIFY( pathNames( &storage ).contains( path + "/keep/sub/d" ) );
+        StorageItem *item = storage.findStorageItemByPath( path + "/keep/a" );
+        QVERIFY( item );
+        QCOMPARE( item->m_objectInfo->mtpObjectCompressedSize, (quint64)3 );
+
+        QHash<MTPEventCode, ObjHandle> events;
+        while( !spy.isEmpty() )
+        {
+            QList<QVariant> arguments = spy.takeFirst();
+            QVector<quint32> params = arguments.at(1).value<QVector<quint32> >();
+            events.insertMulti( arguments.at(0).value<MTPEventCode>(), params.value(0) );
+        }
+        QCOMPARE( events.values( MTP_EV_ObjectRemoved ), QList<ObjHandle>() << handles.value( path + "/gone/c" ) );
+        QCOMPARE( events.values( MTP_EV_ObjectAdded ), QList<ObjHandle>() << pathNames( &storage ).value( path + "/keep/sub/d" ) );
+        QCOMPARE( events.values( MTP_EV_ObjectInfoChanged ), QList<ObjHandle>() << item->m_handle );
+    }
+
+    QFile::remove( snapshotPath );
+    dir.removeRecursively();
+}
+
+// The paths of a storage's objects, the playlists directory's contents excluded
+static QStringList storagePaths( const QHash<QString, ObjHandle> &pathNamesMap, const QString &storagePath )
+{
+    QStringList paths;
+    foreach( const QString &path, pathNamesMap.keys() )
+    {
+        if( !path.startsWith( storagePath + "/Playlists/" ) )
+        {
+            paths.append( path );
+        }
+    }
+    paths.sort();
+    return paths;
+}
+
+void FSStoragePlugin_test::testLazyEnumeration()
+{
+    const QString path( "/tmp/mtptests-lazy" );
+    QDir dir( path );
+    dir.removeRecursively();
+    for( int i = 0; i < 3; i++ )
+    {
+        QString sub = QString("%1/dir%2/sub").arg(path).arg(i);
+        dir.mkpath( sub );
+        for( int j = 0; j < 4; j++ )
+        {
+            QFile( QString("%1/file%2").arg(sub).arg(j) ).open( QIODevice::WriteOnly );
+            QFile( QString("%1/../file%2").arg(sub).arg(j) ).open( QIODevice::WriteOnly );
+        }
+    }
+    qputenv( "MTP_TREE_SNAPSHOT", "0" );
+
+    QStringList paths;
+    {
+        FSStoragePlugin storage( 5, MTP_STORAGE_TYPE_FixedRAM, path, "lazy", "Lazy" );
+        setupPlugin(&storage);
+        paths = storagePaths( pathNames( &storage ), path );
+    }
+    QCOMPARE( paths.size(), 1 + 3 * (2 + 2 * 4) + 1 );
+
+    qputenv( "MTP_LAZY_ENUMERATION", "1" );
+    {
+        FSStoragePlugin storage( 5, MTP_STORAGE_TYPE_FixedRAM, path, "lazy", "Lazy" );
+        setupPlugin(&storage);
+
+        // A directory is listed when its children are asked for
+        ObjHandle parent = pathNames( &storage ).value( path + "/dir1" );
+        QVERIFY( parent );
+        QVector<ObjHandle> handles;
+        QCOMPARE( storage.getObjectHandles( 0, parent, handles ), (MTPResponseCode)MTP_RESP_OK );
+        QCOMPARE( handles.size(), 1 + 4 );
+        QVERIFY( !storage.m_unlistedDirectories.contains( parent ) );
+        StorageItem *parentItem = storage.findStorageItemByPath( path + "/dir1" );
+        QVERIFY( parentItem->m_wd != -1 );
+
+        // Asking for all objects does not wait for the crawler
+        handles.clear();
+        QCOMPARE( storage.getObjectHandles( 0, 0, handles ), (MTPResponseCode)MTP_RESP_OK );
+        QVERIFY( !storage.m_crawling );
+        QCOMPARE( handles.size(), storage.m_objectHandlesMap.size() - 1 );
+        QCOMPARE( storagePaths( pathNames( &storage ), path ), paths );
+    }
+    {
+        FSStoragePlugin storage( 5, MTP_STORAGE_TYPE_FixedRAM, path, "lazy", "Lazy" );
+        setupPlugin(&storage);
+
+        // The crawler gets to the rest on its own
+        QTRY_VERIFY( !storage.m_crawling );
+        QVERIFY( storage.m_unlistedDirectories.isEmpty() );
+        QCOMPARE( storagePaths( pathNames( &storage ), path ), paths );
+        StorageItem *parentItem = storage.findStorageItemByPath( path + "/dir2/sub" );
+        StorageItem *childItem = storage.findStorageItemByPath( path + "/dir2/sub/file3" );
+        QVERIFY( parentItem && childItem );
+        QCOMPARE( childItem->m_objectInfo->mtpParentObject, parentItem->m_handle );
+    }
+    qunsetenv( "MTP_LAZY_ENUMERATION" );
+    qunsetenv( "MTP_TREE_SNAPSHOT" );
+
+    dir.removeRecursively();
+}
+
+static size_t heapInUse()
+{
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#else
+    return mallinfo().uordblks;
+#endif
+}
+
+void FSStoragePlugin_test::benchmarkObjectMemory_data()
+{
+    QTest::addColumn<int>("objects");
+    QTest::newRow("100k") << 100000;
+    QTest::newRow("500k") << 500000;
+    QTest::newRow("1M") << 1000000;
+}
+
+void FSStoragePlugin_test::benchmarkObjectMemory()
+{
+    QFETCH( int, objects );
+    if( objects > 100000 && qgetenv( "MTP_BENCHMARK_LARGE" ).isEmpty() )
+    {
+        QSKIP( "set MTP_BENCHMARK_LARGE to run with this many objects" );
+    }
+
+    // Like a camera roll, a thousand pictures a directory
+    const int perDirectory = 1000;
+    const QString path( "/tmp/mtptests-memory" );
+    QDir dir( path );
+    dir.removeRecursively();
+    for( int i = 0; i < objects; i++ )
+    {
+        QString directory = QString("%1/DCIM/%2").arg(path).arg(i / perDirectory, 4, 10, QChar('0'));
+        if( 0 == i % perDirectory )
+        {
+            dir.mkpath( directory );
+        }
+        QFile( QString("%1/IMG_20240101_%2.jpg").arg(directory).arg(i, 7, 10, QChar('0')) ).open( QIODevice::WriteOnly );
+    }
+
+    // Everything allocated on the main thread, where it is counted
+    qputenv( "MTP_SCAN_THREADS", "0" );
+    qputenv( "MTP_TREE_SNAPSHOT", "0" );
+    QString puoidsDbPath;
+    size_t before = heapInUse();
+    {
+        FSStoragePlugin storage( 6, MTP_STORAGE_TYPE_FixedRAM, path, "memory", "Memory" );
+        setupPlugin(&storage);
+        int count = storage.m_objectHandlesMap.size();
+        QVERIFY( count > objects );
+
+        double perObject = double(heapInUse() - before) / count;
+        qDebug() << count << "objects," << perObject << "bytes each";
+        QTest::setBenchmarkResult( perObject, QTest::BytesAllocated );
+        puoidsDbPath = storage.m_puoidsDbPath;
+    }
+    qunsetenv( "MTP_SCAN_THREADS" );
+    qunsetenv( "MTP_TREE_SNAPSHOT" );
+
+    QFile::remove( puoidsDbPath );
+    dir.removeRecursively();
+}
+
+void FSStoragePlugin_test::testObjectTable()
+{
+    // Only the address is stored
+    StorageItem *item = reinterpret_cast<StorageItem*>( 0x1000 );
+    ObjectTable table;
+
+    // Objects created and removed one after the other, as inotify adds
+    // them, don't make the table grow with the handles issued
+    for( ObjHandle handle = 1; handle <= 100000; ++handle )
+    {
+        table.insert( handle, item );
+        if( handle > 10 )
+        {
+            table.remove( handle - 10 );
+        }
+    }
+    QCOMPARE( table.size(), 10 );
+    QVERIFY( table.m_slots.size() <= 2 * 10 + ObjectTable::COMPACT_MIN + 1 );
+    QVERIFY( !table.contains( 99990 ) );
+    QCOMPARE( table.value( 99991 ), item );
+    QCOMPARE( table.value( 100000 ), item );
+
+    // Handles inserted out of order are walked in ascending order
+    table.insert( 5, item );
+    table.insert( 200000, item );
+    table.insert( 7, item );
+    QVector<ObjHandle> handles = table.keys();
+    QCOMPARE( handles.size(), 13 );
+    QCOMPARE( handles.first(), (ObjHandle)5 );
+    QCOMPARE( handles.at( 1 ), (ObjHandle)7 );
+    QCOMPARE( handles.last(), (ObjHandle)200000 );
+    QVERIFY( std::is_sorted( handles.constBegin(), handles.constEnd() ) );
+    QCOMPARE( table.value( 7 ), item );
+    QCOMPARE( table.value( 99995 ), item );
+}
+
 void FSStoragePlugin_test::testDeleteAll()
 {
     MTPResponseCode response = MTP_RESP_GeneralError;
@@ -270,7 +666,7 @@ void FSStoragePlugin_test::testDeleteAll()
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_PartialDeletion );
 
     QCOMPARE( m_storage->m_objectHandlesMap.size(), 1 );
-    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_itemNamesMap.size() + 1 );
 
     delete m_storage;
     system("rm -rf ~/.local/mtp");
@@ -284,7 +680,7 @@ void FSStoragePlugin_test::testDeleteAll()
 }
 void FSStoragePlugin_test::testObjectHandlesCountAfterCreation()
 {
-    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_itemNamesMap.size() + 1 );
     //QCOMPARE( m_storage->m_objectHandlesMap.size(), totalCount );
     totalCount = m_storage->m_objectHandlesMap.size();
     quint32 noOfObjects;
@@ -300,17 +696,17 @@ void FSStoragePlugin_test::testObjectHandlesCountAfterCreation()
     QCOMPARE( objectHandles.size(), static_cast<qint32>(7) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir1") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(4) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir2") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(3) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir1/subdir3") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(3) );
 }
@@ -328,12 +724,12 @@ void FSStoragePlugin_test::testObjectHandlesAfterCreation()
     QCOMPARE( objectHandles.contains(totalCount - 1), static_cast<bool>(true) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir1/subdir3") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), 3 );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir1") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), 4 );
 
@@ -353,7 +749,7 @@ void FSStoragePlugin_test::testInvalidGetObjectHandle()
 
     //test getObjectHandles with association param that's a valid handle but not an association.
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/file1")],
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir1/file1") ),
                                           objectHandles );
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidParentObject);
     QCOMPARE( objectHandles.size(), static_cast<qint32>(0) );
@@ -365,40 +761,60 @@ void FSStoragePlugin_test::testGetObjectHandleByFormat()
     MTPResponseCode response = m_storage->getObjectHandles( MTP_OBF_FORMAT_Association, 0x00000000, objectHandles );
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_OK);
     QCOMPARE( objectHandles.size(), static_cast<qint32>(5) );
+    QVERIFY( std::is_sorted( objectHandles.constBegin(), objectHandles.constEnd() ) );
+    foreach( ObjHandle handle, objectHandles )
+    {
+        QCOMPARE( m_storage->m_objectHandlesMap.value( handle )->m_objectInfo->mtpObjectFormat, (MTPObjFormatCode)MTP_OBF_FORMAT_Association );
+    }
+
+    quint32 count = 0;
+    response = m_storage->getObjectCount( MTP_OBF_FORMAT_Association, 0x00000000, count );
+    QCOMPARE( response,(MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE( count, static_cast<quint32>(5) );
+
+    response = m_storage->getObjectCount( 0x0000, 0x00000000, count );
+    QCOMPARE( response,(MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE( count, static_cast<quint32>(m_storage->m_objectHandlesMap.size() - 1) );
+
+    response = m_storage->getObjectCount( MTP_OBF_FORMAT_EXIF_JPEG, 0x00000000, count );
+    QCOMPARE( response,(MTPResponseCode) MTP_RESP_OK);
+    objectHandles.clear();
+    m_storage->getObjectHandles( MTP_OBF_FORMAT_EXIF_JPEG, 0x00000000, objectHandles );
+    QCOMPARE( count, static_cast<quint32>(objectHandles.size()) );
 }
 
 void FSStoragePlugin_test::testObjectInfoAfterCreation()
 {
     const MTPObjectInfo *objectInfo = 0;
 
-    MTPResponseCode response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests")], objectInfo );
+    MTPResponseCode response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("mtptests") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectInfo );
+    response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests/subdir1") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("subdir1") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2")], objectInfo );
+    response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests/subdir2") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("subdir2") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/file1")], objectInfo );
+    response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests/subdir1/file1") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("file1") );
     QCOMPARE( objectInfo->mtpObjectCompressedSize, static_cast<quint64>(1));
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2/fileB")], objectInfo );
+    response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests/subdir2/fileB") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("fileB") );
     QCOMPARE( objectInfo->mtpObjectCompressedSize,static_cast<quint64>(6));
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectInfo );
+    response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests/subdir1/subdir3") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("subdir3") );
     QCOMPARE( objectInfo->mtpObjectCompressedSize,static_cast<quint64>(0));
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3/file3")], objectInfo );
+    response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests/subdir1/subdir3/file3") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("file3") );
     QCOMPARE( objectInfo->mtpObjectCompressedSize,static_cast<quint64>(100));
@@ -413,16 +829,16 @@ void FSStoragePlugin_test::testFindByPath()
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests" ) );
     QCOMPARE( storageItem != 0, true );
-    QCOMPARE( storageItem->m_path, QString("/tmp/mtptests") );
+    QCOMPARE( storageItem->path(), QString("/tmp/mtptests") );
     QCOMPARE( storageItem->m_handle, static_cast<quint32>(0) );
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir1/subdir3" ) );
     QCOMPARE( storageItem != 0, true );
-    QCOMPARE( storageItem->m_path, QString("/tmp/mtptests/subdir1/subdir3") );
+    QCOMPARE( storageItem->path(), QString("/tmp/mtptests/subdir1/subdir3") );
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/fileC" ) );
     QCOMPARE( storageItem != 0, true );
-    QCOMPARE( storageItem->m_path, QString("/tmp/mtptests/subdir2/fileC") );
+    QCOMPARE( storageItem->path(), QString("/tmp/mtptests/subdir2/fileC") );
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/NOmtptests/subdir2/fileC" ) );
     QCOMPARE( storageItem == 0, true );
@@ -456,11 +872,11 @@ void FSStoragePlugin_test::testWriteData()
 {
     MTPResponseCode response;
 
-    response = m_storage->writeData( m_storage->m_pathNamesMap["/tmp/mtptests/file2"], "bbb", 3, true, false );
+    response = m_storage->writeData( handleOf( m_storage, "/tmp/mtptests/file2" ), "bbb", 3, true, false );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->writeData( m_storage->m_pathNamesMap["/tmp/mtptests/file2"], "bbb", 3, false, true );
-    m_storage->writeData(m_storage->m_pathNamesMap["/tmp/mtptests/file2"], 0, 0, false, true);
+    response = m_storage->writeData( handleOf( m_storage, "/tmp/mtptests/file2" ), "bbb", 3, false, true );
+    m_storage->writeData(handleOf( m_storage, "/tmp/mtptests/file2" ), 0, 0, false, true);
     QFile file("/tmp/mtptests/file2");
     file.open( QIODevice::ReadOnly);
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
@@ -478,6 +894,114 @@ void FSStoragePlugin_test::testWriteData()
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidObjectHandle);
 }
 
+void FSStoragePlugin_test::testWriteDataTruncated()
+{
+    MTPResponseCode response;
+    ObjHandle handle = handleOf( m_storage, "/tmp/mtptests/file2" );
+
+    response = m_storage->writeData( handle, "cccccc", 6, true, false );
+    QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
+
+    // Data still queued for writing must not reappear after truncation
+    response = m_storage->truncateItem( handle, 0 );
+    QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
+    response = m_storage->writeData( handle, 0, 0, false, true );
+    QCOMPARE( response, (MTPResponseCode)MTP_RESP_GeneralError );
+    QCOMPARE( QFile("/tmp/mtptests/file2").size(), static_cast<long long>(0) );
+
+    response = m_storage->writeData( handle, "bbbbbb", 6, true, true );
+    QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
+    response = m_storage->writeData( handle, 0, 0, false, true );
+    QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( QFile("/tmp/mtptests/file2").size(), static_cast<long long>(6) );
+}
+
+static int countExtents(const QString &path)
+{
+    QFile file( path );
+    if( !file.open( QIODevice::ReadOnly ) )
+    {
+        return -1;
+    }
+    struct fiemap map;
+    memset( &map, 0, sizeof map );
+    map.fm_length = FIEMAP_MAX_OFFSET;
+    map.fm_flags = FIEMAP_FLAG_SYNC;
+    if( -1 == ioctl( file.handle(), FS_IOC_FIEMAP, &map ) )
+    {
+        return -1;
+    }
+    return map.fm_mapped_extents;
+}
+
+void FSStoragePlugin_test::benchmarkSendObject_data()
+{
+    QTest::addColumn<QString>("fsync");
+
+    QTest::newRow("none") << "none";
+    QTest::newRow("close") << "close";
+    QTest::newRow("every 4 MB") << "4";
+}
+
+void FSStoragePlugin_test::benchmarkSendObject()
+{
+    QFETCH( QString, fsync );
+
+    // A video sent in the segments the USB reader hands over
+    const int fileSize = 64 * 1024 * 1024;
+    const int segmentSize = 64 * 1024;
+    const QString path( "/tmp/mtptests-writes" );
+
+    QDir dir( path );
+    dir.removeRecursively();
+    dir.mkpath( path );
+    QByteArray segment( segmentSize, 'v' );
+
+    QString puoidsDbPath;
+    qint64 nsecs = 0;
+    {
+        FSStoragePlugin storage( 8, MTP_STORAGE_TYPE_FixedRAM, path, "writes", "Writes" );
+        setupPlugin(&storage);
+        if( "close" == fsync )
+        {
+            storage.setSyncPolicy( true, 0 );
+        }
+        else if( "none" != fsync )
+        {
+            storage.setSyncPolicy( true, fsync.toULongLong() * 1024 * 1024 );
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+
+        ObjHandle parentHandle = 0;
+        ObjHandle handle = 0;
+        MTPObjectInfo objectInfo;
+        objectInfo.mtpParentObject = 0xFFFFFFFF;
+        objectInfo.mtpFileName = "video.mp4";
+        objectInfo.mtpObjectFormat = MTP_OBF_FORMAT_Undefined;
+        objectInfo.mtpObjectCompressedSize = fileSize;
+        QCOMPARE( storage.addItem( parentHandle, handle, &objectInfo ), (MTPResponseCode)MTP_RESP_OK );
+
+        for( int offset = 0; offset < fileSize; offset += segmentSize )
+        {
+            QCOMPARE( storage.writeData( handle, segment.data(), segmentSize, 0 == offset, false ), (MTPResponseCode)MTP_RESP_OK );
+        }
+        QCOMPARE( storage.writeData( handle, 0, 0, false, true ), (MTPResponseCode)MTP_RESP_OK );
+        nsecs = timer.nsecsElapsed();
+        QCOMPARE( QFileInfo( path + "/video.mp4" ).size(), (qint64)fileSize );
+
+        puoidsDbPath = storage.m_puoidsDbPath;
+    }
+
+    qDebug() << "fsync" << fsync << ":" << fileSize * 1000.0 / nsecs << "MB/s,"
+             << countExtents( path + "/video.mp4" ) << "extents";
+    QTest::setBenchmarkResult( nsecs / 1000000.0, QTest::WalltimeMilliseconds );
+
+    QFile::remove( puoidsDbPath );
+    dir.removeRecursively();
+}
+
 void FSStoragePlugin_test::testReadData()
 {
     char *readBuf = 0;
@@ -485,7 +1009,7 @@ void FSStoragePlugin_test::testReadData()
     MTPResponseCode response;
 
     readBuf = (char*)malloc(readBufLen);
-    response = m_storage->readData( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3/file1"], readBuf, readBufLen, 0 );
+    response = m_storage->readData( handleOf( m_storage, "/tmp/mtptests/subdir1/subdir3/file1" ), readBuf, readBufLen, 0 );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( readBuf != 0, static_cast<bool>(true) );
     QCOMPARE( readBufLen, 1 );
@@ -495,7 +1019,7 @@ void FSStoragePlugin_test::testReadData()
 
     readBufLen = 100;
     readBuf = (char*)malloc(readBufLen);
-    response = m_storage->readData( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3/file3"], readBuf, readBufLen, 0 );
+    response = m_storage->readData( handleOf( m_storage, "/tmp/mtptests/subdir1/subdir3/file3" ), readBuf, readBufLen, 0 );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( readBuf != 0, static_cast<bool>(true) );
     QCOMPARE( readBufLen, 100 );
@@ -508,6 +1032,114 @@ void FSStoragePlugin_test::testReadData()
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidObjectHandle);
 }
 
+void FSStoragePlugin_test::benchmarkPartialReads()
+{
+    // A video streamed with GetPartialObject
+    const int fileSize = 16 * 1024 * 1024;
+    const int chunkSize = 64 * 1024;
+    const int reads = 2000;
+    const QString path( "/tmp/mtptests-reads" );
+
+    QDir dir( path );
+    dir.removeRecursively();
+    dir.mkpath( path );
+    QByteArray contents( fileSize, 0 );
+    for( int i = 0; i < fileSize; i++ )
+    {
+        contents[i] = i % 251;
+    }
+    QFile video( path + "/video.mp4" );
+    QVERIFY( video.open( QIODevice::WriteOnly ) );
+    QCOMPARE( video.write( contents ), (qint64)fileSize );
+    video.close();
+
+    QVector<quint32> offsets;
+    srand( 1 );
+    for( int i = 0; i < reads; i++ )
+    {
+        offsets.append( rand() % ( fileSize - chunkSize ) );
+    }
+    QByteArray buffer( chunkSize, 0 );
+
+    // How a read was done before: open, size, seek, read and close each time
+    QElapsedTimer timer;
+    timer.start();
+    foreach( quint32 offset, offsets )
+    {
+        QFile file( video.fileName() );
+        file.open( QIODevice::ReadOnly );
+        file.size();
+        file.seek( offset );
+        file.read( buffer.data(), chunkSize );
+        file.close();
+    }
+    qint64 before = timer.nsecsElapsed();
+
+    QString puoidsDbPath;
+    qint64 after = 0;
+    {
+        FSStoragePlugin storage( 7, MTP_STORAGE_TYPE_FixedRAM, path, "reads", "Reads" );
+        setupPlugin(&storage);
+        ObjHandle handle = handleOf( &storage, video.fileName() );
+        QVERIFY( handle );
+
+        timer.restart();
+        foreach( quint32 offset, offsets )
+        {
+            qint32 length = chunkSize;
+            QCOMPARE( storage.readData( handle, buffer.data(), length, offset ), (MTPResponseCode)MTP_RESP_OK );
+            QCOMPARE( length, chunkSize );
+        }
+        after = timer.nsecsElapsed();
+        QCOMPARE( buffer, contents.mid( offsets.last(), chunkSize ) );
+        QCOMPARE( storage.m_readFds.size(), 1 );
+        QCOMPARE( storage.m_readFds.first().advice, (int)POSIX_FADV_RANDOM );
+
+        // Streaming from the start is read ahead
+        for( int offset = 0; offset < 4 * chunkSize; offset += chunkSize )
+        {
+            qint32 length = chunkSize;
+            QCOMPARE( storage.readData( handle, buffer.data(), length, offset ), (MTPResponseCode)MTP_RESP_OK );
+        }
+        QCOMPARE( storage.m_readFds.first().advice, (int)POSIX_FADV_SEQUENTIAL );
+        QVERIFY( storage.m_readFds.first().readAhead > (quint64)4 * chunkSize );
+
+        // Past the end of the file
+        qint32 length = chunkSize;
+        QCOMPARE( storage.readData( handle, buffer.data(), length, fileSize - chunkSize / 2 ), (MTPResponseCode)MTP_RESP_GeneralError );
+
+        // Deleting the object closes its file
+        QCOMPARE( storage.deleteItem( handle, MTP_OBF_FORMAT_Undefined ), (MTPResponseCode)MTP_RESP_OK );
+        QCOMPARE( storage.m_readFds.size(), 0 );
+        puoidsDbPath = storage.m_puoidsDbPath;
+    }
+
+    QFile::remove( puoidsDbPath );
+    dir.removeRecursively();
+
+    qDebug() << "microseconds per 64 KB read when opening the file each time:" << before / 1000.0 / reads
+             << "with a cached descriptor:" << after / 1000.0 / reads;
+    QTest::setBenchmarkResult( after / 1000000.0 / reads, QTest::WalltimeMilliseconds );
+}
+
+void FSStoragePlugin_test::testOpenData()
+{
+    int fd = -1;
+    char readBuf[100];
+    MTPResponseCode response;
+
+    response = m_storage->openData( handleOf( m_storage, "/tmp/mtptests/subdir1/subdir3/file3" ), fd );
+    QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( fd != -1, static_cast<bool>(true) );
+    QCOMPARE( pread(fd, readBuf, sizeof readBuf, 0), static_cast<ssize_t>(sizeof readBuf) );
+    QCOMPARE( readBuf[0], 'a' );
+    QCOMPARE( readBuf[99], 'a' );
+    close(fd);
+
+    response = m_storage->openData( 100, fd );
+    QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidObjectHandle);
+}
+
 void FSStoragePlugin_test::testAddFile()
 {
     MTPResponseCode response;
@@ -534,7 +1166,7 @@ void FSStoragePlugin_test::testAddFile()
     QCOMPARE( parentHandle, static_cast<quint32>(0) );
     QCOMPARE( objectInfo.mtpParentObject, static_cast<quint32>(0) );
     QCOMPARE( objectInfo.mtpFileName, QString("addfile" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/addfile"], static_cast<quint32>(handle) );
+    QCOMPARE( handleOf( m_storage, "/tmp/mtptests/addfile" ), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
     QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(0) );
     response = m_storage->writeData( handle, "xxx", 3, true, true );
@@ -561,7 +1193,7 @@ void FSStoragePlugin_test::testAddFile()
     QCOMPARE( parentHandle, static_cast<quint32>(0) );
     QCOMPARE( objectInfo.mtpParentObject, static_cast<quint32>(0) );
     QCOMPARE( objectInfo.mtpFileName, QString("addfile2" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/addfile2"], static_cast<quint32>(handle) );
+    QCOMPARE( handleOf( m_storage, "/tmp/mtptests/addfile2" ), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
     QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(0) );
     response = m_storage->writeData( handle, "xxx", 3, true, true );
@@ -580,17 +1212,17 @@ void FSStoragePlugin_test::testAddFile()
 
     {
     // Add a file to subdir1
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap["/tmp/mtptests/subdir1"];
+    objectInfo.mtpParentObject = handleOf( m_storage, "/tmp/mtptests/subdir1" );
     objectInfo.mtpFileName = "addfile";
     objectInfo.mtpObjectCompressedSize = 3;
     response = m_storage->addItem( parentHandle, handle, &objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
-    QCOMPARE( parentHandle, static_cast<quint32>(m_storage->m_pathNamesMap["/tmp/mtptests/subdir1"]) );
+    QCOMPARE( parentHandle, static_cast<quint32>(handleOf( m_storage, "/tmp/mtptests/subdir1" )) );
     QCOMPARE( objectInfo.mtpFileName, QString("addfile" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/addfile"], static_cast<quint32>(handle) );
+    QCOMPARE( handleOf( m_storage, "/tmp/mtptests/subdir1/addfile" ), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
-    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle,  m_storage->m_pathNamesMap["/tmp/mtptests/subdir1"]);
+    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle,  handleOf( m_storage, "/tmp/mtptests/subdir1" ));
     response = m_storage->writeData( handle, "xxx", 3, true, true );
     m_storage->writeData(handle, 0, 0, false, true);
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
@@ -607,15 +1239,15 @@ void FSStoragePlugin_test::testAddFile()
 
     {
     // Add a file to subdir3
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3"];
+    objectInfo.mtpParentObject = handleOf( m_storage, "/tmp/mtptests/subdir1/subdir3" );
     response = m_storage->addItem( parentHandle, handle, &objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
-    QCOMPARE( parentHandle, static_cast<quint32>(m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3"]) );
+    QCOMPARE( parentHandle, static_cast<quint32>(handleOf( m_storage, "/tmp/mtptests/subdir1/subdir3" )) );
     QCOMPARE( objectInfo.mtpFileName, QString("addfile" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3/addfile"], static_cast<quint32>(handle) );
+    QCOMPARE( handleOf( m_storage, "/tmp/mtptests/subdir1/subdir3/addfile" ), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
-    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3"] );
+    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, handleOf( m_storage, "/tmp/mtptests/subdir1/subdir3" ) );
     response = m_storage->writeData( handle, "xxx", 3, true, true );
     m_storage->writeData(handle, 0, 0, false, true);
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
@@ -642,18 +1274,18 @@ void FSStoragePlugin_test::testAddDir()
     //memset(&objectInfo, 0 , sizeof(MTPObjectInfo));
 
     //add a nested dir to subdir2 : D1, D1->D2, D1->D2->f
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"];
+    objectInfo.mtpParentObject = handleOf( m_storage, "/tmp/mtptests/subdir2" );
     objectInfo.mtpFileName = "D1";
     objectInfo.mtpObjectCompressedSize = 0;
     objectInfo.mtpObjectFormat = MTP_OBF_FORMAT_Association;
     response = m_storage->addItem( parentHandle, handle, &objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
-    QCOMPARE( parentHandle, static_cast<quint32>(m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"]) );
+    QCOMPARE( parentHandle, static_cast<quint32>(handleOf( m_storage, "/tmp/mtptests/subdir2" )) );
     QCOMPARE( objectInfo.mtpFileName, QString("D1" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1"], static_cast<quint32>(handle) );
+    QCOMPARE( handleOf( m_storage, "/tmp/mtptests/subdir2/D1" ), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
-    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"]) );
+    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(handleOf( m_storage, "/tmp/mtptests/subdir2" )) );
 
     objectInfo.mtpParentObject = handle;
     objectInfo.mtpFileName = "D2";
@@ -662,7 +1294,7 @@ void FSStoragePlugin_test::testAddDir()
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
     QCOMPARE( objectInfo.mtpParentObject, static_cast<quint32>(parentHandle) );
     QCOMPARE( objectInfo.mtpFileName, QString("D2" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1/D2"], static_cast<quint32>(handle) );
+    QCOMPARE( handleOf( m_storage, "/tmp/mtptests/subdir2/D1/D2" ), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
     QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(parentHandle) );
     QCOMPARE( m_storage->m_objectHandlesMap[parentHandle]->m_firstChild->m_handle, static_cast<quint32>(handle) );
@@ -675,7 +1307,7 @@ void FSStoragePlugin_test::testAddDir()
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
     QCOMPARE( objectInfo.mtpParentObject, static_cast<quint32>(parentHandle) );
     QCOMPARE( objectInfo.mtpFileName, QString("f1" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1/D2/f1"], static_cast<quint32>(handle) );
+    QCOMPARE( handleOf( m_storage, "/tmp/mtptests/subdir2/D1/D2/f1" ), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
     QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(parentHandle) );
     QCOMPARE( m_storage->m_objectHandlesMap[parentHandle]->m_firstChild->m_handle, static_cast<quint32>(handle) );
@@ -695,7 +1327,7 @@ void FSStoragePlugin_test::testAddDir()
 
 void FSStoragePlugin_test::testObjectHandlesCountAfterAddition()
 {
-    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_itemNamesMap.size() + 1 );
     QCOMPARE( m_storage->m_objectHandlesMap.size(), totalCount + 1 );
     quint32 noOfObjects;
     QVector<ObjHandle> objectHandles;
@@ -710,17 +1342,17 @@ void FSStoragePlugin_test::testObjectHandlesCountAfterAddition()
     QCOMPARE( objectHandles.size(), static_cast<qint32>(9) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir1") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(5) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir2") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(4) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir1/subdir3") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(4) );
 
@@ -743,12 +1375,12 @@ void FSStoragePlugin_test::testObjectHandlesAfterAddition()
     QCOMPARE( objectHandles.contains(totalCount), static_cast<bool>(true) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir1/subdir3") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), 4 );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir1") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), 5 );
 
@@ -762,19 +1394,19 @@ void FSStoragePlugin_test::testObjectInfoAfterAddition()
 {
     const MTPObjectInfo *objectInfo;
 
-    MTPResponseCode response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests")], objectInfo );
+    MTPResponseCode response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("mtptests") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectInfo );
+    response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests/subdir1") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("subdir1") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/addfile")], objectInfo );
+    response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests/subdir1/addfile") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("addfile") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2/D1/D2/f1")], objectInfo );
+    response = m_storage->getObjectInfo( handleOf( m_storage, QString("/tmp/mtptests/subdir2/D1/D2/f1") ), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("f1") );
 
@@ -782,7 +1414,7 @@ void FSStoragePlugin_test::testObjectInfoAfterAddition()
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/D1/D2/f1" ) );
     QCOMPARE( storageItem != 0, true );
-    QCOMPARE( storageItem->m_path, QString("/tmp/mtptests/subdir2/D1/D2/f1") );
+    QCOMPARE( storageItem->path(), QString("/tmp/mtptests/subdir2/D1/D2/f1") );
 
     response = m_storage->getObjectInfo( 100, objectInfo );
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidObjectHandle);
@@ -830,6 +1462,23 @@ void FSStoragePlugin_test::testSetObjectPropertyValue()
     QCOMPARE( filename, QString("file1") );
 }
 
+// Keeps the extracting thread of a tracker busy until released
+class BlockingTask : public QRunnable
+{
+public:
+    BlockingTask(QSemaphore *release) : m_release(release)
+    {
+    }
+
+    void run()
+    {
+        m_release->acquire();
+    }
+
+private:
+    QSemaphore *m_release;
+};
+
 void FSStoragePlugin_test::testGetChildPropertyValues()
 {
     MTPObjectInfo info;
@@ -879,7 +1528,25 @@ void FSStoragePlugin_test::testGetChildPropertyValues()
     properties.append(&descWeDontWantToBeReturned);
     properties.append(&desc);
 
+    // Files still waiting for extraction don't hold up the query. They are
+    // left out, to be asked for one by one, instead of getting no values.
+    StorageTracker *tracker = m_storage->m_tracker;
+    int threads = tracker->m_extractThreads;
+    tracker->m_extractThreads = 1;
+    tracker->m_extractPool.setMaxThreadCount(1);
+    QSemaphore release;
+    tracker->m_extractPool.start(new BlockingTask(&release));
+
     QMap<ObjHandle, QList<QVariant> > values;
+    QCOMPARE(m_storage->getChildPropertyValues(directoryHandle, properties,
+            values), (MTPResponseCode)MTP_RESP_OK);
+    QVERIFY(values.isEmpty());
+
+    release.release();
+    tracker->m_extractPool.waitForDone();
+    tracker->m_extractThreads = threads;
+    tracker->m_extractPool.setMaxThreadCount(qMax(threads, 1));
+
     QCOMPARE(m_storage->getChildPropertyValues(directoryHandle, properties,
             values), (MTPResponseCode)MTP_RESP_OK);
 
@@ -908,7 +1575,7 @@ void FSStoragePlugin_test::testSetReferences()
     response = m_storage->setReferences( 100, references );
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidObjectHandle);
 
-    response = m_storage->setReferences( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/fileA"], references );
+    response = m_storage->setReferences( handleOf( m_storage, "/tmp/mtptests/subdir2/fileA" ), references );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -920,7 +1587,7 @@ void FSStoragePlugin_test::testGetReferences()
     response = m_storage->getReferences( 100, references );
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidObjectHandle);
 
-    response = m_storage->getReferences( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/fileA"], references );
+    response = m_storage->getReferences( handleOf( m_storage, "/tmp/mtptests/subdir2/fileA" ), references );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( references.size(), 3 );
     QCOMPARE( references[0], static_cast<unsigned int>(1) );
@@ -928,17 +1595,91 @@ void FSStoragePlugin_test::testGetReferences()
     QCOMPARE( references[2], static_cast<unsigned int>(16) );
 }
 
+void FSStoragePlugin_test::testReferencesJournal()
+{
+    const QString path( "/tmp/mtptests-references" );
+    QDir dir( path );
+    dir.removeRecursively();
+    dir.mkpath( path );
+    foreach( const QString &name, QStringList() << "a" << "b" << "c" )
+    {
+        QFile( path + "/" + name ).open( QIODevice::WriteOnly );
+    }
+
+    // References are stored by PUOID, so hand out distinct ones
+    MtpInt128 next( 0 );
+    auto assign = [&next]( MtpInt128 &puoid ) { puoid = ++next; };
+
+    qputenv( "MTP_TREE_SNAPSHOT", "0" );
+    QString puoidsDbPath;
+    QString referencesDbPath;
+    {
+        FSStoragePlugin storage( 10, MTP_STORAGE_TYPE_FixedRAM, path, "references", "References" );
+        QObject::connect( &storage, &StoragePlugin::puoid, assign );
+        QFile::remove( storage.m_objectReferencesDbPath );
+        setupPlugin(&storage);
+        puoidsDbPath = storage.m_puoidsDbPath;
+        referencesDbPath = storage.m_objectReferencesDbPath;
+        QTRY_VERIFY( !storage.m_referencesCompacting );
+        qint64 empty = QFileInfo( referencesDbPath ).size();
+
+        ObjHandle a = handleOf( &storage, path + "/a" );
+        ObjHandle b = handleOf( &storage, path + "/b" );
+        ObjHandle c = handleOf( &storage, path + "/c" );
+        QCOMPARE( storage.setReferences( a, QVector<ObjHandle>() << b << c ), (MTPResponseCode)MTP_RESP_OK );
+        storage.flushObjectReferences();
+        qint64 set = QFileInfo( referencesDbPath ).size();
+        QVERIFY( set > empty );
+
+        // Only the new references of a are appended, one PUOID fewer
+        QCOMPARE( storage.deleteItem( c, MTP_OBF_FORMAT_Undefined ), (MTPResponseCode)MTP_RESP_OK );
+        QVector<ObjHandle> references;
+        QCOMPARE( storage.getReferences( c, references ), (MTPResponseCode)MTP_RESP_InvalidObjectHandle );
+        storage.flushObjectReferences();
+        QCOMPARE( QFileInfo( referencesDbPath ).size() - set, set - empty - (qint64)sizeof(MtpInt128) );
+    }
+
+    {
+        FSStoragePlugin storage( 10, MTP_STORAGE_TYPE_FixedRAM, path, "references", "References" );
+        QObject::connect( &storage, &StoragePlugin::puoid, assign );
+        setupPlugin(&storage);
+        QVector<ObjHandle> references;
+        QCOMPARE( storage.getReferences( handleOf( &storage, path + "/a" ), references ), (MTPResponseCode)MTP_RESP_OK );
+        QCOMPARE( references, QVector<ObjHandle>() << handleOf( &storage, path + "/b" ) );
+
+        // The playlist goes, its references go with it
+        QCOMPARE( storage.deleteItem( handleOf( &storage, path + "/a" ), MTP_OBF_FORMAT_Undefined ), (MTPResponseCode)MTP_RESP_OK );
+        storage.flushObjectReferences();
+    }
+
+    // A new file at the same path gets the PUOID back, but no references
+    QFile( path + "/a" ).open( QIODevice::WriteOnly );
+    {
+        FSStoragePlugin storage( 10, MTP_STORAGE_TYPE_FixedRAM, path, "references", "References" );
+        QObject::connect( &storage, &StoragePlugin::puoid, assign );
+        setupPlugin(&storage);
+        QVector<ObjHandle> references;
+        QCOMPARE( storage.getReferences( handleOf( &storage, path + "/a" ), references ), (MTPResponseCode)MTP_RESP_OK );
+        QVERIFY( references.isEmpty() );
+    }
+    qunsetenv( "MTP_TREE_SNAPSHOT" );
+
+    QFile::remove( puoidsDbPath );
+    QFile::remove( referencesDbPath );
+    dir.removeRecursively();
+}
+
 void FSStoragePlugin_test::testDeleteFile()
 {
     MTPResponseCode response;
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/file1"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( handleOf( m_storage, "/tmp/mtptests/subdir1/file1" ),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/file2"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( handleOf( m_storage, "/tmp/mtptests/subdir1/file2" ),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/file3"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( handleOf( m_storage, "/tmp/mtptests/subdir1/file3" ),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
 }
@@ -947,10 +1688,10 @@ void FSStoragePlugin_test::testDeleteDir()
 {
     MTPResponseCode response;
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( handleOf( m_storage, "/tmp/mtptests/subdir1/subdir3" ),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( handleOf( m_storage, "/tmp/mtptests/subdir1" ),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
     totalCount -= 9;
@@ -958,7 +1699,7 @@ void FSStoragePlugin_test::testDeleteDir()
 
 void FSStoragePlugin_test::testObjectHandlesCountAfterDeletion()
 {
-    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_itemNamesMap.size() + 1 );
     QCOMPARE( m_storage->m_objectHandlesMap.size(), totalCount );
     quint32 noOfObjects;
     QVector<ObjHandle> objectHandles;
@@ -973,7 +1714,7 @@ void FSStoragePlugin_test::testObjectHandlesCountAfterDeletion()
     QCOMPARE( objectHandles.size(), static_cast<qint32>(8) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, handleOf( m_storage, QString("/tmp/mtptests/subdir2") ), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(4) );
 
@@ -1001,10 +1742,10 @@ void FSStoragePlugin_test::testFileCopy()
     ObjHandle newHandle;
     QVector<ObjHandle> objectHandles;
 
-    response = m_storage->copyObject( 1, m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"], 0, newHandle );
+    response = m_storage->copyObject( 1, handleOf( m_storage, "/tmp/mtptests/subdir2" ), 0, newHandle );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->copyObject( 3, m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"], 0, newHandle );
+    response = m_storage->copyObject( 3, handleOf( m_storage, "/tmp/mtptests/subdir2" ), 0, newHandle );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -1019,7 +1760,7 @@ void FSStoragePlugin_test::testDirCopy()
     //memset(&objectInfo, 0 , sizeof(MTPObjectInfo));
 
     //add a nested dir to subdir2 : D1, D1->D2, D1->D2->f
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"];
+    objectInfo.mtpParentObject = handleOf( m_storage, "/tmp/mtptests/subdir2" );
     objectInfo.mtpFileName = "D1";
     objectInfo.mtpObjectCompressedSize = 0;
     objectInfo.mtpObjectFormat = MTP_OBF_FORMAT_Association;
@@ -1040,7 +1781,7 @@ void FSStoragePlugin_test::testDirCopy()
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
     // Copy dir D1 from subdir2 to mtptests
-    response = m_storage->copyObject( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1"], m_storage->m_pathNamesMap["/tmp/mtptests"], 0, newHandle );
+    response = m_storage->copyObject( handleOf( m_storage, "/tmp/mtptests/subdir2/D1" ), handleOf( m_storage, "/tmp/mtptests" ), 0, newHandle );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -1048,8 +1789,8 @@ void FSStoragePlugin_test::testFileMove()
 {
     MTPResponseCode response;
 
-    response = m_storage->moveObject( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/fileA"],
-            m_storage->m_pathNamesMap["/tmp/mtptests"], m_storage );
+    response = m_storage->moveObject( handleOf( m_storage, "/tmp/mtptests/subdir2/fileA" ),
+            handleOf( m_storage, "/tmp/mtptests" ), m_storage );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -1085,7 +1826,7 @@ void FSStoragePlugin_test::testFileMoveAcrossStorage()
     MTPObjectInfo originalInfo = *item->m_objectInfo;
 
     QCOMPARE( m_storage->moveObject( originalHandle,
-            secondStorage.m_pathNamesMap["/tmp/mtptests-second/dir1"], &secondStorage ),
+            handleOf( &secondStorage, "/tmp/mtptests-second/dir1" ), &secondStorage ),
             (MTPResponseCode)MTP_RESP_OK);
 
     QVERIFY( !m_storage->checkHandle( originalHandle ) );
@@ -1114,8 +1855,8 @@ void FSStoragePlugin_test::testDirMove()
 {
     MTPResponseCode response;
 
-    response = m_storage->moveObject( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1"],
-            m_storage->m_pathNamesMap["/tmp/mtptests/D1"], m_storage );
+    response = m_storage->moveObject( handleOf( m_storage, "/tmp/mtptests/subdir2/D1" ),
+            handleOf( m_storage, "/tmp/mtptests/D1" ), m_storage );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -1156,7 +1897,7 @@ void FSStoragePlugin_test::testDirMoveAcrossStorage()
     MTPObjectInfo iOrigF1 = *item->m_objectInfo;
 
     QCOMPARE( m_storage->moveObject( hOrigD1,
-            secondStorage.m_pathNamesMap["/tmp/mtptests-second/dir"], &secondStorage ),
+            handleOf( &secondStorage, "/tmp/mtptests-second/dir" ), &secondStorage ),
             (MTPResponseCode)MTP_RESP_OK);
 
     QVERIFY( !m_storage->checkHandle( hOrigD1 ) &&
@@ -1187,10 +1928,57 @@ void FSStoragePlugin_test::testGetLargestPuoid()
     QVERIFY(puoid == zero);
 }
 
+void FSStoragePlugin_test::testPuoidsJournal()
+{
+    const QString path( "/tmp/mtptests-puoids" );
+    QDir dir( path );
+    dir.removeRecursively();
+    dir.mkpath( path + "/sub" );
+    QFile( path + "/sub/a" ).open( QIODevice::WriteOnly );
+
+    qputenv( "MTP_TREE_SNAPSHOT", "0" );
+    MtpInt128 puoid(7);
+    QString puoidsDbPath;
+    qint64 journalSize = 0;
+    {
+        FSStoragePlugin storage( 9, MTP_STORAGE_TYPE_FixedRAM, path, "puoids", "Puoids" );
+        setupPlugin(&storage);
+        puoidsDbPath = storage.m_puoidsDbPath;
+
+        // Recorded as if the file got the PUOID when it was moved there
+        storage.journalPuoid( path + "/sub/a", puoid );
+        storage.flushPuoids();
+        journalSize = QFileInfo( puoidsDbPath ).size();
+    }
+    QCOMPARE( QFileInfo( puoidsDbPath ).size(), journalSize );
+
+    // A record torn by a crash
+    QFile file( puoidsDbPath );
+    QVERIFY( file.open( QIODevice::Append ) );
+    file.write( QByteArray( 12, 'x' ) );
+    file.close();
+
+    {
+        FSStoragePlugin storage( 9, MTP_STORAGE_TYPE_FixedRAM, path, "puoids", "Puoids" );
+        QCOMPARE( QFileInfo( puoidsDbPath ).size(), journalSize );
+        setupPlugin(&storage);
+        StorageItem *item = storage.findStorageItemByPath( path + "/sub/a" );
+        QVERIFY( item );
+        QVERIFY( item->m_puoid == puoid );
+        MtpInt128 largest;
+        storage.getLargestPuoid( largest );
+        QVERIFY( largest == puoid );
+    }
+    qunsetenv( "MTP_TREE_SNAPSHOT" );
+
+    QFile::remove( puoidsDbPath );
+    dir.removeRecursively();
+}
+
 void FSStoragePlugin_test::testTruncateItem()
 {
     MTPResponseCode response;
-    response = m_storage->truncateItem( m_storage->m_pathNamesMap["/tmp/mtptests/file3"], 0 );
+    response = m_storage->truncateItem( handleOf( m_storage, "/tmp/mtptests/file3" ), 0 );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QFile file("/tmp/mtptests/file3");
     QCOMPARE( file.size(), static_cast<qint64>(0));
@@ -1200,7 +1988,7 @@ void FSStoragePlugin_test::testGetPath()
 {
     MTPResponseCode response;
     QString path;
-    response = m_storage->getPath( m_storage->m_pathNamesMap["/tmp/mtptests/file3"], path );
+    response = m_storage->getPath( handleOf( m_storage, "/tmp/mtptests/file3" ), path );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( path, QString("/tmp/mtptests/file3") );
 }
@@ -1209,7 +1997,7 @@ void FSStoragePlugin_test::testGetObjectPropertyValueFromStorage()
 {
     MTPResponseCode response;
     QVariant v;
-    ObjHandle handle = m_storage->m_pathNamesMap["/tmp/mtptests/file3"];
+    ObjHandle handle = handleOf( m_storage, "/tmp/mtptests/file3" );
     response = m_storage->getObjectPropertyValueFromStorage( handle,
                                                              MTP_OBJ_PROP_Association_Desc, v, MTP_DATA_TYPE_UNDEF );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
@@ -1223,7 +2011,7 @@ void FSStoragePlugin_test::testGetObjectPropertyValueFromStorage()
     response = m_storage->getObjectPropertyValueFromStorage( handle,
                                                              MTP_OBJ_PROP_Parent_Obj, v, MTP_DATA_TYPE_UNDEF );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
-    QCOMPARE( v.toUInt(), m_storage->m_pathNamesMap["/tmp/mtptests"] );
+    QCOMPARE( v.toUInt(), handleOf( m_storage, "/tmp/mtptests" ) );
 
     response = m_storage->getObjectPropertyValueFromStorage( handle,
                                                              MTP_OBJ_PROP_Obj_Size, v, MTP_DATA_TYPE_UNDEF );
@@ -1317,7 +2105,7 @@ void FSStoragePlugin_test::testGetObjectPropertyValueFromTracker()
 {
     MTPResponseCode response;
     QVariant v;
-    ObjHandle handle = m_storage->m_pathNamesMap["/tmp/mtptests/file3"];
+    ObjHandle handle = handleOf( m_storage, "/tmp/mtptests/file3" );
 
     response = m_storage->getObjectPropertyValueFromTracker( handle,
                                                              MTP_OBJ_PROP_Date_Created, v, MTP_DATA_TYPE_STR );
@@ -1435,7 +2223,7 @@ void FSStoragePlugin_test::testSetObjectPropertyValueInTracker()
     quint16 uInt16 = 0;
     QString none = "none";
     QString empty = "";
-    ObjHandle handle = m_storage->m_pathNamesMap["/tmp/mtptests/file3"];
+    ObjHandle handle = handleOf( m_storage, "/tmp/mtptests/file3" );
     QList<MTPObjPropDescVal> propValList;
     MTPObjPropDescVal val;
     MtpObjPropDesc desc;
@@ -1593,11 +2381,101 @@ void FSStoragePlugin_test::testSetObjectPropertyValueInTracker()
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
+// An ID3v2.3 frame, of less than 128 bytes
+static QByteArray id3v2Frame( const char *id, const QByteArray &data )
+{
+    QByteArray header( id );
+    header.append( (char)0 ).append( (char)0 ).append( (char)0 ).append( (char)data.size() );
+    header.append( QByteArray( 2, '\0' ) );
+    return header + data;
+}
+
+void FSStoragePlugin_test::testMetadataExtraction()
+{
+    const QString path( "/tmp/mtptests-metadata" );
+    QDir dir( path );
+    dir.removeRecursively();
+    dir.mkpath( path );
+
+    // An ID3v2.3 tagged MP3 of 100 frames of 128 kbit/s at 44.1 kHz
+    QByteArray frames = id3v2Frame( "TIT2", QByteArray( "\0Title", 6 ) ) +
+                        id3v2Frame( "TPE1", QByteArray( "\3Artist", 7 ) ) +
+                        id3v2Frame( "TRCK", QByteArray( "\0" "3/12", 5 ) ) +
+                        id3v2Frame( "TCON", QByteArray( "\0(17)", 5 ) ) +
+                        id3v2Frame( "APIC", QByteArray( 100, 'x' ) );
+    QByteArray tag( "ID3\3\0\0\0\0", 8 );
+    tag.append( (char)( frames.size() >> 7 ) ).append( (char)( frames.size() & 0x7f ) );
+    QByteArray audio;
+    for( int i = 0; i < 100; ++i )
+    {
+        QByteArray mpegFrame( 417, '\0' );
+        mpegFrame[0] = (char)0xff;
+        mpegFrame[1] = (char)0xfb;
+        mpegFrame[2] = (char)0x90;
+        audio += mpegFrame;
+    }
+    QFile song( path + "/song.mp3" );
+    QVERIFY( song.open( QIODevice::WriteOnly ) );
+    song.write( tag + frames + audio );
+    song.close();
+    QFile text( path + "/text" );
+    QVERIFY( text.open( QIODevice::WriteOnly ) );
+    text.write( "abc" );
+    text.close();
+
+    StorageTracker tracker;
+    QVariant v;
+    QVERIFY( tracker.getObjectProperty( song.fileName(), MTP_OBJ_PROP_Name, MTP_DATA_TYPE_STR, v ) );
+    QCOMPARE( v.toString(), QString("Title") );
+    QVERIFY( tracker.getObjectProperty( song.fileName(), MTP_OBJ_PROP_Artist, MTP_DATA_TYPE_STR, v ) );
+    QCOMPARE( v.toString(), QString("Artist") );
+    QVERIFY( tracker.getObjectProperty( song.fileName(), MTP_OBJ_PROP_Track, MTP_DATA_TYPE_UINT16, v ) );
+    QCOMPARE( v.value<quint16>(), (quint16)3 );
+    QVERIFY( tracker.getObjectProperty( song.fileName(), MTP_OBJ_PROP_Duration, MTP_DATA_TYPE_UINT32, v ) );
+    // 41700 bytes of 128 kbit/s, in milliseconds
+    QCOMPARE( v.value<quint32>(), (quint32)2606 );
+    QVERIFY( tracker.getObjectProperty( song.fileName(), MTP_OBJ_PROP_Sample_Rate, MTP_DATA_TYPE_UINT32, v ) );
+    QCOMPARE( v.value<quint32>(), (quint32)44100 );
+    QVERIFY( !tracker.getObjectProperty( song.fileName(), MTP_OBJ_PROP_Obj_Size, MTP_DATA_TYPE_UINT64, v ) );
+
+    // Mass query, files without tags go by their name and have no other values
+    MtpObjPropDesc name, genre;
+    name.uPropCode = MTP_OBJ_PROP_Name;
+    name.uDataType = MTP_DATA_TYPE_STR;
+    genre.uPropCode = MTP_OBJ_PROP_Genre;
+    genre.uDataType = MTP_DATA_TYPE_STR;
+    QList<const MtpObjPropDesc *> properties;
+    properties << &name << &genre;
+    QMap<QString, QList<QVariant> > values;
+    tracker.getChildPropVals( path, properties, values );
+    QCOMPARE( values.size(), 2 );
+    QCOMPARE( values[song.fileName()].size(), 2 );
+    QCOMPARE( values[song.fileName()][0].toString(), QString("Title") );
+    QCOMPARE( values[song.fileName()][1].toString(), QString("Rock") );
+    QCOMPARE( values[text.fileName()][0].toString(), QString("text") );
+    QVERIFY( !values[text.fileName()][1].isValid() );
+
+    // Values set by the initiator hold until the file changes
+    QVERIFY( tracker.setObjectProperty( song.fileName(), MTP_OBJ_PROP_Name, MTP_DATA_TYPE_STR, QString("Renamed") ) );
+    QFile moved( path + "/moved.mp3" );
+    QVERIFY( song.rename( moved.fileName() ) );
+    tracker.move( path + "/song.mp3", moved.fileName() );
+    QVERIFY( tracker.getObjectProperty( moved.fileName(), MTP_OBJ_PROP_Name, MTP_DATA_TYPE_STR, v ) );
+    QCOMPARE( v.toString(), QString("Renamed") );
+    QVERIFY( moved.open( QIODevice::Append ) );
+    moved.write( "x" );
+    moved.close();
+    QVERIFY( tracker.getObjectProperty( moved.fileName(), MTP_OBJ_PROP_Name, MTP_DATA_TYPE_STR, v ) );
+    QCOMPARE( v.toString(), QString("Title") );
+
+    dir.removeRecursively();
+}
+
 void FSStoragePlugin_test::testGetInvalidObjectPropertyValueFromStorage()
 {
     MTPResponseCode response;
     QVariant v;
-    ObjHandle handle = m_storage->m_pathNamesMap["/tmp/mtptests/file3"];
+    ObjHandle handle = handleOf( m_storage, "/tmp/mtptests/file3" );
     response = m_storage->getObjectPropertyValueFromStorage( handle,
                                                              0x0000, v, MTP_DATA_TYPE_UNDEF );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_ObjectProp_Not_Supported );
@@ -1618,7 +2496,7 @@ void FSStoragePlugin_test::testInotifyCreate()
 
     while( loop.processEvents() );
 
-    QVERIFY( m_storage->m_pathNamesMap.contains("/tmp/mtptests/inotifydir/tmpfile") );
+    QVERIFY( m_storage->findStorageItemByPath("/tmp/mtptests/inotifydir/tmpfile") );
 }
 
 void FSStoragePlugin_test::testInotifyModify()
@@ -1666,11 +2544,11 @@ void FSStoragePlugin_test::testInotifyMove()
         ++getOutOfHere;
     }
     QCOMPARE( storageItem != 0, true );
-    //QCOMPARE( storageItem->m_parent->m_handle, m_storage->m_pathNamesMap["/tmp/mtptests/tmpdir"] );
-    QCOMPARE( storageItem->m_parent->m_handle, m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"] );
+    //QCOMPARE( storageItem->m_parent->m_handle, handleOf( m_storage, "/tmp/mtptests/tmpdir" ) );
+    QCOMPARE( storageItem->m_parent->m_handle, handleOf( m_storage, "/tmp/mtptests/subdir2" ) );
     // Fetch the object info once
     const MTPObjectInfo *objInfo;
-    m_storage->getObjectInfo(m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/tmpfile"], objInfo);
+    m_storage->getObjectInfo(handleOf( m_storage, "/tmp/mtptests/subdir2/tmpfile" ), objInfo);
 }
 
 void FSStoragePlugin_test::testInotifyDelete()
@@ -1692,13 +2570,141 @@ void FSStoragePlugin_test::testInotifyDelete()
     QCOMPARE( storageItem == 0, true );
 }
 
+void FSStoragePlugin_test::testInotifyBatch()
+{
+    const QString path( "/tmp/mtptests-batch" );
+    QDir dir( path );
+    dir.removeRecursively();
+    dir.mkpath( path );
+
+    qputenv( "MTP_TREE_SNAPSHOT", "0" );
+    QString puoidsDbPath;
+    {
+        FSStoragePlugin storage( 12, MTP_STORAGE_TYPE_FixedRAM, path, "batch", "Batch" );
+        puoidsDbPath = storage.m_puoidsDbPath;
+        setupPlugin(&storage);
+        QSignalSpy spy( &storage, SIGNAL(eventGenerated(MTPEventCode, const QVector<quint32>&)) );
+        // The passes over the queued events, see processInotifyEvents()
+        QSignalSpy reads( storage.m_inotify, SIGNAL(inotifyEventsReadSignal()) );
+        QSignalSpy continued( storage.m_inotifyTimer, SIGNAL(timeout()) );
+
+        // All queued before the event loop runs again, like a cp -r
+        const int files = 100;
+        for( int i = 0; i < files; ++i )
+        {
+            QFile file( QString("%1/file%2").arg(path).arg(i) );
+            QVERIFY( file.open( QIODevice::WriteOnly ) );
+            file.write( "abc" );
+            file.close();
+            QFile( QString("%1/tmp%2").arg(path).arg(i) ).open( QIODevice::WriteOnly );
+            QVERIFY( QFile::remove( QString("%1/tmp%2").arg(path).arg(i) ) );
+        }
+        QVERIFY( QFile::rename( path + "/file0", path + "/moved" ) );
+
+        QTRY_VERIFY( storage.findStorageItemByPath( QString("%1/file%2").arg(path).arg(files - 1) ) );
+        QTRY_COMPARE( storage.m_inotifyEvents.size(), 0 );
+        QVERIFY( !storage.findStorageItemByPath( path + "/file0" ) );
+        StorageItem *moved = storage.findStorageItemByPath( path + "/moved" );
+        QVERIFY( moved );
+        QCOMPARE( moved->m_objectInfo->mtpObjectCompressedSize, (quint64)3 );
+        QVERIFY( !storage.findStorageItemByPath( path + "/tmp1" ) );
+
+        // Nothing for the temporary files, nor for the writes to the files
+        // added with them, and one StorageInfoChanged per pass at most
+        QHash<MTPEventCode, int> events;
+        while( !spy.isEmpty() )
+        {
+            QList<QVariant> event = spy.takeFirst();
+            MTPEventCode code = event.at(0).value<MTPEventCode>();
+            events[code]++;
+            if( MTP_EV_ObjectInfoChanged == code )
+            {
+                // Only the rename
+                QCOMPARE( event.at(1).value<QVector<quint32> >(), QVector<quint32>() << moved->m_handle );
+            }
+        }
+        QCOMPARE( events.value( MTP_EV_ObjectAdded ), files );
+        QCOMPARE( events.value( MTP_EV_ObjectRemoved ), 0 );
+        QVERIFY( events.value( MTP_EV_StorageInfoChanged ) <= reads.size() + continued.size() );
+    }
+    qunsetenv( "MTP_TREE_SNAPSHOT" );
+
+    QFile::remove( puoidsDbPath );
+    dir.removeRecursively();
+}
+
+void FSStoragePlugin_test::testFanotify()
+{
+    const QString path( "/tmp/mtptests-fanotify" );
+    QDir dir( path );
+    dir.removeRecursively();
+    dir.mkpath( path + "/from/sub" );
+    dir.mkpath( path + "/to" );
+
+    qputenv( "MTP_FANOTIFY", "1" );
+    qputenv( "MTP_TREE_SNAPSHOT", "0" );
+    QString puoidsDbPath;
+    {
+        FSStoragePlugin storage( 11, MTP_STORAGE_TYPE_FixedRAM, path, "fanotify", "Fanotify" );
+        puoidsDbPath = storage.m_puoidsDbPath;
+        if( !storage.m_inotify->isFilesystemWatch() )
+        {
+            qunsetenv( "MTP_FANOTIFY" );
+            qunsetenv( "MTP_TREE_SNAPSHOT" );
+            QSKIP( "Marking a filesystem with fanotify is not permitted" );
+        }
+        setupPlugin(&storage);
+
+        QFile file( path + "/from/sub/a" );
+        QVERIFY( file.open( QIODevice::WriteOnly ) );
+        file.write( "abc" );
+        file.close();
+        QTRY_VERIFY( storage.findStorageItemByPath( path + "/from/sub/a" ) );
+        QCOMPARE( storage.findStorageItemByPath( path + "/from/sub/a" )->m_objectInfo->mtpObjectCompressedSize, (quint64)3 );
+
+        // The watches of the moved directory stay valid
+        QVERIFY( dir.rename( path + "/from/sub", path + "/to/sub" ) );
+        QTRY_VERIFY( storage.findStorageItemByPath( path + "/to/sub/a" ) );
+        QVERIFY( !storage.findStorageItemByPath( path + "/from/sub" ) );
+        QFile( path + "/to/sub/b" ).open( QIODevice::WriteOnly );
+        QTRY_VERIFY( storage.findStorageItemByPath( path + "/to/sub/b" ) );
+
+        QVERIFY( QFile::remove( path + "/to/sub/a" ) );
+        QTRY_VERIFY( !storage.findStorageItemByPath( path + "/to/sub/a" ) );
+
+        // Created and renamed before the events are read, the events on
+        // the old name may be merged
+        QFile created( path + "/to/sub/c" );
+        QVERIFY( created.open( QIODevice::WriteOnly ) );
+        created.write( "abcd" );
+        created.close();
+        QVERIFY( QFile::rename( path + "/to/sub/c", path + "/to/sub/d" ) );
+        QTRY_VERIFY( storage.findStorageItemByPath( path + "/to/sub/d" ) );
+        QTRY_COMPARE( storage.m_inotifyEvents.size(), 0 );
+        QVERIFY( !storage.findStorageItemByPath( path + "/to/sub/c" ) );
+        QCOMPARE( storage.findStorageItemByPath( path + "/to/sub/d" )->m_objectInfo->mtpObjectCompressedSize, (quint64)4 );
+
+        // A rename on its own is a move
+        ObjHandle handle = storage.findStorageItemByPath( path + "/to/sub/d" )->m_handle;
+        QVERIFY( QFile::rename( path + "/to/sub/d", path + "/to/sub/c" ) );
+        QTRY_VERIFY( storage.findStorageItemByPath( path + "/to/sub/c" ) );
+        QCOMPARE( storage.findStorageItemByPath( path + "/to/sub/c" )->m_handle, handle );
+        QVERIFY( !storage.findStorageItemByPath( path + "/to/sub/d" ) );
+    }
+    qunsetenv( "MTP_FANOTIFY" );
+    qunsetenv( "MTP_TREE_SNAPSHOT" );
+
+    QFile::remove( puoidsDbPath );
+    dir.removeRecursively();
+}
+
 void FSStoragePlugin_test::testReadPlaylists()
 {
     // Ensure that the tracker playlists created are present in our storage tree
     // as .pla files
     // Get handle to the playlists directory
     ObjHandle playlistsDirHandle = 0;
-    playlistsDirHandle = m_storage->m_pathNamesMap["/tmp/mtptests/Playlists"];
+    playlistsDirHandle = handleOf( m_storage, "/tmp/mtptests/Playlists" );
     QCOMPARE(playlistsDirHandle != 0, true);
     // Get children of the playlists directory
     QVector<ObjHandle> playlists;
@@ -1760,7 +2766,7 @@ void FSStoragePlugin_test::testDeletePlaylists()
 {
     // Delete one of the existing playlists
     ObjHandle handle = 0;
-    handle = m_storage->m_pathNamesMap["/tmp/mtptests/Playlists/play1.pla"];
+    handle = handleOf( m_storage, "/tmp/mtptests/Playlists/play1.pla" );
     QCOMPARE(handle != 0, true);
 
     MTPResponseCode response = m_storage->deleteItem(handle, MTP_OBF_FORMAT_Undefined);
@@ -1777,7 +2783,7 @@ void FSStoragePlugin_test::testDeletePlaylists()
     delete result;
 
     // Delete the other one too
-    handle = m_storage->m_pathNamesMap["/tmp/mtptests/Playlists/play2.pla"];
+    handle = handleOf( m_storage, "/tmp/mtptests/Playlists/play2.pla" );
     QCOMPARE(handle != 0, true);
 
     response = m_storage->deleteItem(handle, MTP_OBF_FORMAT_Undefined);
@@ -1793,7 +2799,7 @@ void FSStoragePlugin_test::testCreatePlaylists()
     // Create a new abstract audio video playlist and assign references to it
     ObjHandle parentHandle = 0;
     ObjHandle newPlaylistHandle = 0;
-    parentHandle = m_storage->m_pathNamesMap["/tmp/mtptests/Playlists"];
+    parentHandle = handleOf( m_storage, "/tmp/mtptests/Playlists" );
     QCOMPARE(parentHandle == 0, false);
 
     MTPObjectInfo objInfo;
@@ -1807,10 +2813,10 @@ void FSStoragePlugin_test::testCreatePlaylists()
 
     // Set references to all songs under Music into this playlist
     QVector<ObjHandle> allSongs;
-    allSongs.append(m_storage->m_pathNamesMap["/tmp/mtptests/Music/song1.mp3"]);
-    allSongs.append(m_storage->m_pathNamesMap["/tmp/mtptests/Music/song2.mp3"]);
-    allSongs.append(m_storage->m_pathNamesMap["/tmp/mtptests/Music/song3.mp3"]);
-    allSongs.append(m_storage->m_pathNamesMap["/tmp/mtptests/Music/song4.mp3"]);
+    allSongs.append(handleOf( m_storage, "/tmp/mtptests/Music/song1.mp3" ));
+    allSongs.append(handleOf( m_storage, "/tmp/mtptests/Music/song2.mp3" ));
+    allSongs.append(handleOf( m_storage, "/tmp/mtptests/Music/song3.mp3" ));
+    allSongs.append(handleOf( m_storage, "/tmp/mtptests/Music/song4.mp3" ));
     response = m_storage->setReferences(newPlaylistHandle, allSongs);
     QCOMPARE(response, (MTPResponseCode)MTP_RESP_OK);
 }
@@ -1909,7 +2915,7 @@ void FSStoragePlugin_test::testThumbnailer()
     while (!handle && maxtries > 0)
     {
         loop.processEvents();
-        handle = m_storage->m_pathNamesMap["/tmp/mtptests/testpic.png"];
+        handle = handleOf( m_storage, "/tmp/mtptests/testpic.png" );
         --maxtries;
     }
     QVERIFY2(handle != 0, "testpic not registered in storage");
@@ -1976,6 +2982,22 @@ void FSStoragePlugin_test::setupPlugin(StoragePlugin *plugin)
     QVERIFY(readySpy.wait());
 }
 
+ObjHandle FSStoragePlugin_test::handleOf(FSStoragePlugin *storage, const QString &path)
+{
+    StorageItem *item = storage->findStorageItemByPath(path);
+    return item ? item->m_handle : 0;
+}
+
+QHash<QString, ObjHandle> FSStoragePlugin_test::pathNames(FSStoragePlugin *storage)
+{
+    QHash<QString, ObjHandle> names;
+    for( ObjectTable::const_iterator i = storage->m_objectHandlesMap.constBegin(); i != storage->m_objectHandlesMap.constEnd(); ++i )
+    {
+        names.insert(i.value()->path(), i.key());
+    }
+    return names;
+}
+
 void FSStoragePlugin_test::cleanupTestCase()
 {
     delete m_storage;
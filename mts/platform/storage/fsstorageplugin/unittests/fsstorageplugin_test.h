@@ -34,6 +34,7 @@
 
 #include <QtTest/QtTest>
 #include <QObject>
+#include "mtptypes.h"
 
 namespace meegomtp1dot0
 {
@@ -50,6 +51,13 @@ class FSStoragePlugin_test : public QObject
 private slots:
     void initTestCase();
     void testStorageCreation();
+    void testParallelEnumeration();
+    void benchmarkScanSyscalls();
+    void testTreeSnapshot();
+    void testLazyEnumeration();
+    void benchmarkObjectMemory_data();
+    void benchmarkObjectMemory();
+    void testObjectTable();
     void testDeleteAll();
     void testObjectHandlesCountAfterCreation();
     void testObjectHandlesAfterCreation();
@@ -60,7 +68,12 @@ private slots:
     void testObjectHandle();
     void testStorageInfo();
     void testWriteData();
+    void testWriteDataTruncated();
+    void benchmarkSendObject_data();
+    void benchmarkSendObject();
     void testReadData();
+    void benchmarkPartialReads();
+    void testOpenData();
     void testAddFile();
     void testAddDir();
     void testObjectHandlesCountAfterAddition();
@@ -71,6 +84,7 @@ private slots:
     void testGetChildPropertyValues();
     void testSetReferences();
     void testGetReferences();
+    void testReferencesJournal();
     void testDeleteFile();
     void testDeleteDir();
     void testObjectHandlesCountAfterDeletion();
@@ -82,16 +96,20 @@ private slots:
     void testDirMove();
     void testDirMoveAcrossStorage();
     void testGetLargestPuoid();
+    void testPuoidsJournal();
     void testTruncateItem();
     void testGetPath();
     void testGetObjectPropertyValueFromStorage();
     void testGetObjectPropertyValueFromTracker();
     void testSetObjectPropertyValueInTracker();
+    void testMetadataExtraction();
     void testGetInvalidObjectPropertyValueFromStorage();
     void testInotifyCreate();
     void testInotifyModify();
     void testInotifyMove();
     void testInotifyDelete();
+    void testInotifyBatch();
+    void testFanotify();
     void testReadPlaylists();
     void testDeletePlaylists();
     void testCreatePlaylists();
@@ -103,6 +121,8 @@ private:
     FSStoragePlugin *m_storage;
 
     void setupPlugin(StoragePlugin *plugin);
+    static ObjHandle handleOf(FSStoragePlugin *storage, const QString &path);
+    static QHash<QString, ObjHandle> pathNames(FSStoragePlugin *storage);
 };
 }
 #endif
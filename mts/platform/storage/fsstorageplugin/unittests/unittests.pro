@@ -29,6 +29,7 @@ INCLUDEPATH += . \
                ../../../../protocol/extensions \
                ../../../../transport \
                ../../../../transport/dummy \
+               ../../../../transport/loopback \
                ../../../../transport/usb \
                ../../../../platform \
                ../../../../platform/deviceinfo\
@@ -45,6 +46,10 @@ HEADERS += fsstorageplugin_test.h \
            ../storagetracker.h \
            ../../storagefactory.h \
            ../storageitem.h \
+           ../writebehindthread.h \
+           ../storagescanner.h \
+           ../objecttable.h \
+           ../metadataextractor.h \
            mts.h \
            protocol/mtpresponder.h \
            protocol/mtpcontainer.h \
@@ -53,12 +58,16 @@ HEADERS += fsstorageplugin_test.h \
            protocol/mtptxcontainer.h \
            protocol/propertypod.h \
            protocol/objectpropertycache.h \
+           protocol/objectprefetcher.h \
+           common/mtpstats.h \
            protocol/mtpextensionmanager.h \
            protocol/extensions/mtpextension.h \
            transport/mtptransporter.h \
            transport/usb/mtptransporterusb.h \
            transport/usb/threadio.h \
+           transport/usb/aiothreadio.h \
            transport/dummy/mtptransporterdummy.h \
+           transport/loopback/mtptransporterloopback.h \
            platform/deviceinfo/xmlhandler.h \
            platform/deviceinfo/deviceinfoprovider.h \
            platform/deviceinfo/deviceinfo.h
@@ -67,6 +76,9 @@ SOURCES += fsstorageplugin_test.cpp \
            ../fsstorageplugin.cpp \
            ../fsinotify.cpp \
            ../storageitem.cpp \
+           ../writebehindthread.cpp \
+           ../storagescanner.cpp \
+           ../metadataextractor.cpp \
            ../thumbnailer.cpp \
            ../thumbnailerproxy.cpp \
            ../storagetracker.cpp \
@@ -80,11 +92,15 @@ SOURCES += fsstorageplugin_test.cpp \
            protocol/mtptxcontainer.cpp \
            protocol/propertypod.cpp \
            protocol/objectpropertycache.cpp \
+           protocol/objectprefetcher.cpp \
+           common/mtpstats.cpp \
            protocol/mtpextensionmanager.cpp \
            transport/usb/mtptransporterusb.cpp \
            transport/usb/threadio.cpp \
+           transport/usb/aiothreadio.cpp \
            transport/usb/descriptor.c \
            transport/dummy/mtptransporterdummy.cpp \
+           transport/loopback/mtptransporterloopback.cpp \
            platform/deviceinfo/xmlhandler.cpp \
            platform/deviceinfo/deviceinfoprovider.cpp \
            platform/deviceinfo/deviceinfo.cpp
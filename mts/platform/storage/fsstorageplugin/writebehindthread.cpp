@@ -0,0 +1,237 @@
+#include "writebehindthread.h"
+#include "trace.h"
+
+#include <QtCore/QMutexLocker>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+// Queued buffers written with one write at most
+static const int MAX_WRITE_BUFFERS = 64;
+// Bytes written with one write at most, unless a single buffer is larger
+static const qint64 MAX_WRITE_LEN = 4 * 1024 * 1024;
+
+WriteBehindThread::WriteBehindThread(qint64 maxQueued, QObject *parent) :
+    QThread(parent), m_maxQueued(maxQueued), m_queued(0), m_fd(-1),
+    m_offset(0), m_synced(0), m_syncInterval(0), m_dropBehind(false),
+    m_busy(false), m_failed(false), m_exit(false)
+{
+}
+
+WriteBehindThread::~WriteBehindThread()
+{
+    m_lock.lock();
+    m_exit = true;
+    m_wait.wakeAll();
+    m_lock.unlock();
+
+    wait();
+}
+
+void WriteBehindThread::begin(int fd)
+{
+    QMutexLocker locker(&m_lock);
+    // A file that was never finished, e.g. a cancelled transfer
+    m_queue.clear();
+    while( m_busy )
+    {
+        m_wait.wait(&m_lock);
+    }
+    m_queued = 0;
+    m_fd = fd;
+    m_offset = 0;
+    m_synced = 0;
+    m_failed = false;
+}
+
+void WriteBehindThread::setSyncInterval(quint64 interval, bool dropBehind)
+{
+    QMutexLocker locker(&m_lock);
+    m_syncInterval = interval;
+    m_dropBehind = dropBehind;
+}
+
+bool WriteBehindThread::write(const char *data, quint32 len)
+{
+    QMutexLocker locker(&m_lock);
+
+    if( m_maxQueued <= 0 )
+    {
+        if( !m_failed )
+        {
+            struct iovec iov = { const_cast<char*>(data), len };
+            m_failed = !writeAll(m_fd, &iov, 1, m_offset);
+            m_offset += len;
+            if( !m_failed && m_syncInterval && m_offset - m_synced >= m_syncInterval )
+            {
+                m_failed = !sync(m_fd, m_synced, m_offset, m_dropBehind);
+                m_synced = m_offset;
+            }
+        }
+        return !m_failed;
+    }
+
+    // Always accept a buffer if the queue is empty, even if it is larger
+    // than the limit
+    while( !m_failed && m_queued && m_queued + len > m_maxQueued )
+    {
+        m_wait.wait(&m_lock);
+    }
+    if( m_failed )
+    {
+        return false;
+    }
+
+    m_queue.append(QByteArray(data, len));
+    m_queued += len;
+    m_wait.wakeAll();
+
+    if( !isRunning() )
+    {
+        start();
+    }
+    return true;
+}
+
+bool WriteBehindThread::finish(quint64 *written)
+{
+    QMutexLocker locker(&m_lock);
+    while( m_queued )
+    {
+        m_wait.wait(&m_lock);
+    }
+
+    bool result = !m_failed;
+    if( written )
+    {
+        *written = m_offset;
+    }
+    m_fd = -1;
+    m_failed = false;
+    return result;
+}
+
+void WriteBehindThread::discard()
+{
+    QMutexLocker locker(&m_lock);
+    m_queue.clear();
+    while( m_busy )
+    {
+        m_wait.wait(&m_lock);
+    }
+    m_queued = 0;
+    m_offset = 0;
+    m_failed = true;
+}
+
+void WriteBehindThread::run()
+{
+    QMutexLocker locker(&m_lock);
+
+    while( !m_exit )
+    {
+        if( m_queue.isEmpty() )
+        {
+            m_wait.wait(&m_lock);
+            continue;
+        }
+
+        // What queued up during the previous write goes in one write
+        QList<QByteArray> data;
+        struct iovec iov[MAX_WRITE_BUFFERS];
+        qint64 len = 0;
+        do
+        {
+            data.append(m_queue.takeFirst());
+            iov[data.size() - 1].iov_base = const_cast<char*>(data.last().constData());
+            iov[data.size() - 1].iov_len = data.last().size();
+            len += data.last().size();
+        }
+        while( !m_queue.isEmpty() && data.size() < MAX_WRITE_BUFFERS &&
+               len + m_queue.first().size() <= MAX_WRITE_LEN );
+
+        int fd = m_fd;
+        quint64 offset = m_offset;
+        quint64 synced = m_synced;
+        bool syncNow = m_syncInterval && offset + len - synced >= m_syncInterval;
+        bool dropBehind = m_dropBehind;
+        m_busy = true;
+
+        locker.unlock();
+        bool ok = writeAll(fd, iov, data.size(), offset);
+        if( ok && syncNow )
+        {
+            ok = sync(fd, synced, offset + len, dropBehind);
+        }
+        locker.relock();
+
+        m_busy = false;
+        m_queued -= len;
+        if( ok )
+        {
+            m_offset = offset + len;
+            if( syncNow )
+            {
+                m_synced = m_offset;
+            }
+        }
+        else
+        {
+            // Nothing after a hole in the file is worth writing
+            m_failed = true;
+            m_queue.clear();
+            m_queued = 0;
+        }
+        m_wait.wakeAll();
+    }
+}
+
+bool WriteBehindThread::writeAll(int fd, struct iovec *iov, int count, quint64 offset)
+{
+    while( count )
+    {
+        ssize_t written = pwritev(fd, iov, count, offset);
+        if( -1 == written )
+        {
+            if( EINTR == errno )
+            {
+                continue;
+            }
+            MTP_LOG_WARNING("write failed:" << strerror(errno));
+            return false;
+        }
+        offset += written;
+        // Skip over what was written, the rest is written again
+        while( count && static_cast<size_t>(written) >= iov->iov_len )
+        {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if( count )
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+bool WriteBehindThread::sync(int fd, quint64 from, quint64 to, bool dropBehind)
+{
+    if( -1 == fdatasync(fd) )
+    {
+        MTP_LOG_WARNING("sync failed:" << strerror(errno));
+        return false;
+    }
+    // The data is on storage, the pages can go
+    if( dropBehind )
+    {
+        posix_fadvise(fd, from, to - from, POSIX_FADV_DONTNEED);
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+#ifndef WRITEBEHINDTHREAD_H
+#define WRITEBEHINDTHREAD_H
+
+#include <QtCore/QThread>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QList>
+#include <QtCore/QByteArray>
+
+struct iovec;
+
+/// \brief The WriteBehindThread class writes object data to storage on its own thread.
+///
+/// The data received in a SendObject data phase is copied into a queue and written to the
+/// object's file from a separate thread, so that the USB reader doesn't stall when the file
+/// system is slower than the bus. At most maxQueued bytes are kept in the queue; write()
+/// blocks while the queue is full. A failed write is reported by the next call to write()
+/// or finish(), the data queued after it is dropped. Data that has queued up while a write
+/// was in progress is written with a single large write.
+///
+/// With a sync interval set, the data written is flushed to storage every time that many
+/// bytes have been written, and optionally dropped from the page cache afterwards.
+namespace meegomtp1dot0
+{
+class WriteBehindThread : public QThread
+{
+    public:
+        /// Constructor for WriteBehindThread
+        /// \param maxQueued [in] the maximum number of bytes queued, 0 writes synchronously
+        WriteBehindThread(qint64 maxQueued, QObject *parent = 0);
+
+        /// Destructor for WriteBehindThread
+        ~WriteBehindThread();
+
+        /// Starts writing a file from offset zero.
+        /// \param fd [in] the file descriptor to write to; must stay open until finish() returns
+        void begin(int fd);
+
+        /// Sets how often the data written is flushed to storage.
+        /// \param interval [in] the number of bytes after which the data is flushed, 0 for never
+        /// \param dropBehind [in] drops the flushed data from the page cache
+        void setSyncInterval(quint64 interval, bool dropBehind);
+
+        /// Queues data to be written after the data queued before.
+        /// \param data [in] the data, copied before returning
+        /// \param len [in] the length of the data
+        /// \return false if writing the file has failed
+        bool write(const char *data, quint32 len);
+
+        /// Waits until the queued data has been written.
+        /// \param written [out] the number of bytes written to the file
+        /// \return false if writing the file has failed
+        bool finish(quint64 *written = 0);
+
+        /// Drops the queued data and waits for a write in progress. The file is
+        /// considered empty and failed afterwards, finish() reports zero bytes written.
+        void discard();
+
+    protected:
+        void run();
+
+    private:
+        static bool writeAll(int fd, struct iovec *iov, int count, quint64 offset);
+        static bool sync(int fd, quint64 from, quint64 to, bool dropBehind);
+
+        QMutex m_lock;                  ///< Protects the members below
+        QWaitCondition m_wait;          ///< Signals queued and written data
+        const qint64 m_maxQueued;       ///< Maximum number of bytes queued
+        QList<QByteArray> m_queue;      ///< Data waiting to be written
+        qint64 m_queued;                ///< Number of bytes in m_queue and in progress
+        int m_fd;                       ///< The file being written, -1 if none
+        quint64 m_offset;               ///< Offset of the next write
+        quint64 m_synced;               ///< Offset up to which the data was flushed
+        quint64 m_syncInterval;         ///< Bytes written between flushes, 0 for none
+        bool m_dropBehind;              ///< Flushed data is dropped from the page cache
+        bool m_busy;                    ///< A write is in progress
+        bool m_failed;                  ///< A write to the current file has failed
+        bool m_exit;                    ///< The thread should exit
+};
+}
+
+#endif
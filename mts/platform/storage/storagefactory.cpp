@@ -30,6 +30,8 @@
 */
 
 #include <dlfcn.h>
+#include <unistd.h>
+#include <algorithm>
 
 #include <QDir>
 
@@ -322,7 +324,10 @@ MTPResponseCode StorageFactory::getObjectHandles( const quint32& storageId, cons
             {
                 break;
             }
+            // Each storage lists its handles in order, keep them that way
+            int middle = objectHandles.size();
             objectHandles += handles;
+            std::inplace_merge( objectHandles.begin(), objectHandles.begin() + middle, objectHandles.end() );
         }
     }
     else
@@ -339,6 +344,41 @@ MTPResponseCode StorageFactory::getObjectHandles( const quint32& storageId, cons
     return response;
 }
 
+/*******************************************************
+ * MTPResponseCode StorageFactory::getObjectCount
+ ******************************************************/
+MTPResponseCode StorageFactory::getObjectCount( const quint32& storageId, const MTPObjFormatCode& formatCode, const quint32& associationHandle,
+                                                quint32 &count ) const
+{
+    MTPResponseCode response = MTP_RESP_InvalidStorageID;
+    count = 0;
+    // Get the total count across all storages.
+    if( 0xFFFFFFFF == storageId )
+    {
+        QHash<quint32,StoragePlugin*>::const_iterator itr = m_allStorages.constBegin();
+        for( ; itr != m_allStorages.constEnd(); ++itr )
+        {
+            quint32 storageCount = 0;
+            response = itr.value()->getObjectCount( formatCode, associationHandle, storageCount );
+            if( MTP_RESP_OK != response )
+            {
+                break;
+            }
+            count += storageCount;
+        }
+    }
+    else
+    {
+        StoragePlugin *storagePlugin =  m_allStorages.value(storageId);
+        if( storagePlugin )
+        {
+            response = storagePlugin->getObjectCount( formatCode, associationHandle, count );
+        }
+    }
+
+    return response;
+}
+
 /*******************************************************
  * static MTPResponseCode StorageFactory::storageIds
  ******************************************************/
@@ -536,6 +576,33 @@ MTPResponseCode StorageFactory::readData( const ObjHandle &handle, char *readBuf
     return MTP_RESP_InvalidObjectHandle;
 }
 
+/*******************************************************
+ * MTPResponseCode StorageFactory::openData
+ ******************************************************/
+MTPResponseCode StorageFactory::openData( const ObjHandle &handle, int &fd ) const
+{
+    StoragePlugin *storage = storageOfHandle(handle);
+    if (storage) {
+        return storage->openData(handle, fd);
+    }
+
+    return MTP_RESP_InvalidObjectHandle;
+}
+
+/*******************************************************
+ * void StorageFactory::closeData
+ ******************************************************/
+void StorageFactory::closeData( const ObjHandle &handle, int fd ) const
+{
+    StoragePlugin *storage = storageOfHandle(handle);
+    if (storage) {
+        storage->closeData(handle, fd);
+    } else {
+        // The object is gone, the descriptor is still ours to close
+        close(fd);
+    }
+}
+
 MTPResponseCode StorageFactory::getObjectPropertyValue(const ObjHandle &handle,
                                                        QList<MTPObjPropDescVal> &propValList)
 {
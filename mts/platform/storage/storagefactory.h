@@ -108,6 +108,15 @@ public:
     MTPResponseCode getObjectHandles( const quint32& storageId, const MTPObjFormatCode& formatCode,
                                        const quint32& associationHandle, QVector<ObjHandle> &objectHandles ) const;
 
+    /// Counts the objects getObjectHandles() would return.
+    /// \param storageId [in] which storage to look for, 0xFFFFFFFF for all.
+    /// \param formatCode [in] if not zero, counts only objects of a certain format.
+    /// \param associationHandle [in] this optional argument can specify the containing folder.
+    /// \param count [out] no. of objects found.
+    /// \return MTP response.
+    MTPResponseCode getObjectCount( const quint32& storageId, const MTPObjFormatCode& formatCode,
+                                    const quint32& associationHandle, quint32 &count ) const;
+
     /// Gets the id's of all the created storages.
     /// \param storageIds [out] A vector containing the storage id's.
     /// \return MTP response.
@@ -182,6 +191,16 @@ public:
     /// \param readOffset [in] The offset, in bytes, into the object to be read from
     MTPResponseCode readData( const ObjHandle &handle, char *readBuffer, qint32 &readBufferLen, quint32 readOffset ) const;
 
+    /// Opens an object for reading without copying its data.
+    /// \param handle [in] the object handle.
+    /// \param fd [out] a read-only file descriptor of the object's data, to be closed by the caller
+    MTPResponseCode openData( const ObjHandle &handle, int &fd ) const;
+
+    /// Closes a file descriptor returned by openData().
+    /// \param handle [in] the object handle.
+    /// \param fd [in] the file descriptor.
+    void closeData( const ObjHandle &handle, int fd ) const;
+
     /// Truncates an item to a certain size.
     /// \param handle [in] the object handle.
     /// \size [in] the size in bytes.
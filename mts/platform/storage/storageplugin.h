@@ -115,6 +115,16 @@ public:
     virtual MTPResponseCode getObjectHandles( const MTPObjFormatCode& formatCode, const quint32& associationHandle,
                                               QVector<ObjHandle> &objectHandles ) const = 0;
 
+    /// Counts the objects getObjectHandles() would list, without listing them.
+    ///
+    /// \param formatCode [in] if not zero, counts only objects of particular type.
+    /// \param associationHandle [in] the association whose children to count.
+    /// \param count [out] the number of objects.
+    ///
+    /// \return MTP response.
+    virtual MTPResponseCode getObjectCount( const MTPObjFormatCode& formatCode, const quint32& associationHandle,
+                                            quint32 &count ) const = 0;
+
     /// Searches for the given object handle in this storage.
     ///
     /// \param handle [in] the object handle.
@@ -190,6 +200,19 @@ public:
     /// \param readOffset [in] The offset, in bytes, into the object to start reading from
     virtual MTPResponseCode readData( const ObjHandle &handle, char *readBuffer, qint32 &readBufferLen, quint32 readOffset ) = 0;
 
+    /// Opens a storage item for reading, so that its data can be mapped
+    /// or spliced instead of copied through readData().
+    /// \param handle [in] the object handle.
+    /// \param fd [out] a read-only file descriptor of the object's data;
+    ///           the caller must close it.
+    virtual MTPResponseCode openData( const ObjHandle &handle, int &fd ) = 0;
+
+    /// Closes a file descriptor returned by openData(), once the data has
+    /// been sent.
+    /// \param handle [in] the object handle.
+    /// \param fd [in] the file descriptor.
+    virtual void closeData( const ObjHandle &handle, int fd ) = 0;
+
     /// Truncates an item to a certain size.
     /// \param handle [in] the object handle.
     /// \size [in] the size in bytes.
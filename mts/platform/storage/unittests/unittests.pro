@@ -18,6 +18,7 @@ INCLUDEPATH += \
 	../../../protocol/extensions \
 	../../../transport \
 	../../../transport/dummy \
+	../../../transport/loopback \
 	../../../transport/usb \
 
 LIBS += -ldl -lssu
@@ -31,11 +32,15 @@ HEADERS += \
 	../../deviceinfo/xmlhandler.h \
 	../../../protocol/mtpresponder.h \
 	../../../protocol/objectpropertycache.h \
+	../../../protocol/objectprefetcher.h \
+	../../../common/mtpstats.h \
 	../../../protocol/propertypod.h \
 	../../../transport/mtptransporter.h \
 	../../../transport/dummy/mtptransporterdummy.h \
+	../../../transport/loopback/mtptransporterloopback.h \
 	../../../transport/usb/mtptransporterusb.h \
 	../../../transport/usb/threadio.h \
+	../../../transport/usb/aiothreadio.h \
 
 SOURCES += \
 	storagefactory_test.cpp \
@@ -50,11 +55,15 @@ SOURCES += \
 	../../../protocol/mtprxcontainer.cpp \
 	../../../protocol/mtptxcontainer.cpp \
 	../../../protocol/objectpropertycache.cpp \
+	../../../protocol/objectprefetcher.cpp \
+	../../../common/mtpstats.cpp \
 	../../../protocol/propertypod.cpp \
 	../../../transport/dummy/mtptransporterdummy.cpp \
+	../../../transport/loopback/mtptransporterloopback.cpp \
 	../../../transport/usb/descriptor.c \
 	../../../transport/usb/mtptransporterusb.cpp \
 	../../../transport/usb/threadio.cpp \
+	../../../transport/usb/aiothreadio.cpp \
 
 target.path = /opt/tests/buteo-mtp/
 
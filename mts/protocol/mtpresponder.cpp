@@ -33,7 +33,11 @@
 #include <QtCore/QString>
 #include <QtCore/QCoreApplication>
 #include <QtAlgorithms>
+#include <algorithm>
 #include <qglobal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "mtpresponder.h"
 #include "mtpcontainerwrapper.h"
@@ -44,17 +48,40 @@
 #include "deviceinfoprovider.h"
 #include "mtptransporterusb.h"
 #include "mtptransporterdummy.h"
+#include "mtptransporterloopback.h"
 #include "propertypod.h"
 #include "objectpropertycache.h"
 #include "mtpextensionmanager.h"
+#include "objectprefetcher.h"
+#include "mtpstats.h"
 
 using namespace meegomtp1dot0;
 
 // BUFFER_MAX_LEN is based on the max request size in ci13xxx_udc.c,
 // which is four pages of 4k each
 static const quint32 BUFFER_MAX_LEN = 4 * 4096;
+// Number of GetObject segments handed to the transporter ahead of
+// the one being written, so the bulk endpoint never goes idle while
+// the next segment is read from storage
+static const int MAX_SEGMENTS_IN_FLIGHT = 4;
+// Size of the window of an object that is mapped at a time when sending
+// it segmented; the segments are queued straight from the mapping
+static const quint64 OBJECT_MAP_WINDOW_LEN = 1 << 20;
+// Read-ahead of objects sent segmented, in chunks of
+// MTP_PREFETCH_CHUNK_SIZE bytes, up to MTP_PREFETCH_DEPTH chunks
+// ahead of the data on the wire; a depth of 0 disables it
+static const int PREFETCH_DEPTH = 4;
+static const int PREFETCH_CHUNK_SIZE = 128 * 1024;
 MTPResponder* MTPResponder::m_instance = 0;
 
+// Reads a numeric tunable from the environment
+static int tunable(const char *name, int defaultValue)
+{
+    bool ok = false;
+    int value = qgetenv(name).toInt(&ok);
+    return ok ? value : defaultValue;
+}
+
 MTPResponder* MTPResponder::instance()
 {
     MTP_FUNC_TRACE();
@@ -90,6 +117,8 @@ MTPResponder::MTPResponder(): m_storageServer(0),
     m_devInfoProvider(new DeviceInfoProvider),
     m_propertyPod(PropertyPod::instance(m_devInfoProvider, m_extensionManager)),
     m_extensionManager(new MTPExtensionManager),
+    m_prefetcher(new ObjectPrefetcher(tunable("MTP_PREFETCH_DEPTH", PREFETCH_DEPTH),
+                                      tunable("MTP_PREFETCH_CHUNK_SIZE", PREFETCH_CHUNK_SIZE))),
     m_copiedObjHandle(0),
     m_containerToBeResent(false),
     m_isLastPacket(false),
@@ -103,6 +132,8 @@ MTPResponder::MTPResponder(): m_storageServer(0),
 {
     MTP_FUNC_TRACE();
 
+    MTPStats::init();
+
     // command handler idle timer
     m_handler_idle_timer = new QTimer(this);
     m_handler_idle_timer->setInterval(100);
@@ -120,9 +151,16 @@ MTPResponder::MTPResponder(): m_storageServer(0),
 bool MTPResponder::initTransport( TransportType transport )
 {
     bool transportOk = true;
-    if(USB == transport)
+    if(USB == transport || USB_AIO == transport || LOOPBACK == transport)
     {
-        m_transporter = new MTPTransporterUSB();
+        if(LOOPBACK == transport)
+        {
+            m_transporter = new MTPTransporterLoopback(qgetenv("MTP_USB_AIO").toInt());
+        }
+        else
+        {
+            m_transporter = new MTPTransporterUSB(USB_AIO == transport);
+        }
         transportOk = m_transporter->activate();
         if( transportOk )
         {
@@ -226,6 +264,12 @@ MTPResponder::~MTPResponder()
         m_extensionManager = 0;
     }
 
+    if(m_prefetcher)
+    {
+        delete m_prefetcher;
+        m_prefetcher = 0;
+    }
+
     if( m_sendObjectSequencePtr )
     {
         delete m_sendObjectSequencePtr;
@@ -338,9 +382,14 @@ bool MTPResponder::sendContainer(MTPTxContainer &container, bool isLastPacket)
             setResponderState(RESPONDER_IDLE);
         }
         m_transporter->sendData(container.buffer(), container.bufferSize(), isLastPacket);
+        if(MTP_CONTAINER_TYPE_DATA == container.containerType())
+        {
+            MTPStats::dataMoved(container.bufferSize() - MTP_HEADER_SIZE);
+        }
     }
     if(MTP_CONTAINER_TYPE_RESPONSE == container.containerType())
     {
+        MTPStats::endTransaction(code);
         // Restore state to IDLE to get ready to received the next operation
         emit deviceStatusOK();
         deleteStoredRequest();
@@ -407,6 +456,7 @@ void MTPResponder::receiveContainer(quint8* data, quint32 dataLen, bool isFirstP
                 {
                     // Populate our internal request container
                     m_transactionSequence->reqContainer = new MTPRxContainer(data, dataLen);
+                    MTPStats::beginTransaction(m_transactionSequence->reqContainer->code());
                     // Check if the operation has a data phase
                     if(hasDataPhase(m_transactionSequence->reqContainer->code()))
                     {
@@ -447,6 +497,8 @@ void MTPResponder::receiveContainer(quint8* data, quint32 dataLen, bool isFirstP
                 {
                     emit deviceStatusBusy();
                 }
+                // The payload, the first packet starts with the header
+                MTPStats::dataMoved(isFirstPacket && dataLen >= MTP_HEADER_SIZE ? dataLen - MTP_HEADER_SIZE : dataLen);
                 // This must be a data container
                 dataHandler(data, dataLen, isFirstPacket, isLastPacket);
             }
@@ -1067,8 +1119,7 @@ void MTPResponder::getStorageInfoReq()
 void MTPResponder::getNumObjectsReq()
 {
     MTP_FUNC_TRACE();
-    quint32 noOfObjects;
-    QVector<ObjHandle> handles;
+    quint32 noOfObjects = 0;
     MTPResponseCode code = MTP_RESP_OK;
     MTPRxContainer *reqContainer = m_transactionSequence->reqContainer;
     QVector<quint32> params;
@@ -1104,9 +1155,8 @@ void MTPResponder::getNumObjectsReq()
     if( MTP_RESP_OK == code )
     {
         // retrieve the number of objects from storage server
-        code = m_storageServer->getObjectHandles(params[0], static_cast<MTPObjFormatCode>(params[1]), params[2], handles);
+        code = m_storageServer->getObjectCount(params[0], static_cast<MTPObjFormatCode>(params[1]), params[2], noOfObjects);
     }
-    noOfObjects = handles.size() >= 0 ? handles.size() : 0;
 
     sendResponse(code, noOfObjects);
 }
@@ -1161,8 +1211,12 @@ void MTPResponder::getObjectHandlesReq()
     {
         // At least one PTP client (iPhoto) only shows all pictures if
         // the handles are sorted. It's probably related to having parent
-        // folders listed before the objects they contain.
-        qSort(handles);
+        // folders listed before the objects they contain. The storages
+        // normally hand them over sorted already.
+        if( !std::is_sorted(handles.constBegin(), handles.constEnd()) )
+        {
+            std::sort(handles.begin(), handles.end());
+        }
         MTP_LOG_INFO("handle count:" << handles.size());
         // DATA PHASE
         payloadLength = ( handles.size() + 1 ) * sizeof(quint32);
@@ -1227,7 +1281,7 @@ void MTPResponder::getObjectReq()
 
     quint64 payloadLength = 0;
     quint32 startingOffset = 0;
-    quint64 maxBufferSize = BUFFER_MAX_LEN;
+    quint64 maxBufferSize = segmentLen();
     qint32 readLength = 0;
     MTPResponseCode code = MTP_RESP_OK;
     MTPRxContainer *reqContainer = m_transactionSequence->reqContainer;
@@ -1265,12 +1319,31 @@ void MTPResponder::getObjectReq()
             // segmentation needed
             // set the segmentation info
             m_segmentedSender.totalDataLen = startingOffset + payloadLength;
-            m_segmentedSender.payloadLen = BUFFER_MAX_LEN - MTP_HEADER_SIZE;
+            m_segmentedSender.segmentLen = maxBufferSize;
+            m_segmentedSender.payloadLen = maxBufferSize - MTP_HEADER_SIZE;
             m_segmentedSender.objHandle = params[0];
             m_segmentedSender.offset = startingOffset;
             m_segmentedSender.segmentationStarted = true;
             m_segmentedSender.sendResp = false;
             m_segmentedSender.headerSent = false;
+            // Segments after the first one are sent from a mapping of
+            // the object if the storage allows it. The size is checked
+            // here, since touching a mapping beyond the end of the file
+            // would fault instead of failing like readData() does.
+            int fd = -1;
+            struct stat st;
+            if( MTP_RESP_OK == m_storageServer->openData(params[0], fd) )
+            {
+                if( 0 == fstat(fd, &st) && static_cast<quint64>(st.st_size) >= m_segmentedSender.totalDataLen )
+                {
+                    m_segmentedSender.dataFd = fd;
+                    m_prefetcher->startPrefetch(fd, startingOffset, m_segmentedSender.totalDataLen);
+                }
+                else
+                {
+                    m_storageServer->closeData(params[0], fd);
+                }
+            }
             // start segmented sending of the object
             sendObjectSegmented();
             // response will be send from sendObjectSegmented
@@ -2324,8 +2397,13 @@ void MTPResponder::sendObjectData(quint8* data, quint32 dataLen, bool isFirstPac
             }
             m_storageServer->setObjectPropertyValue(handle, propValList, true);
         }
-        // Trigger close file in the storage server... ignore return here
-        m_storageServer->writeData( handle, 0, 0, false, true);
+        // Trigger close file in the storage server. This waits for the data
+        // still being written, so a late write error goes into the response
+        MTPResponseCode closeCode = m_storageServer->writeData( handle, 0, 0, false, true);
+        if( MTP_RESP_OK == code && MTP_RESP_OK != closeCode )
+        {
+            code = closeCode;
+        }
         // create and send container for response
         sendResponse(code);
         // This is moved here intentionally : in case a cancel tx is received before sending the response above
@@ -2714,6 +2792,7 @@ void MTPResponder::closeSession()
     m_transactionSequence->mtpSessionId = MTP_INITIAL_SESSION_ID;
     deleteStoredRequest();
     setResponderState(RESPONDER_IDLE);
+    MTPStats::writeSnapshot();
     if( m_sendObjectSequencePtr )
     {
         delete m_sendObjectSequencePtr;
@@ -2926,6 +3005,8 @@ void MTPResponder::sendObjectSegmented()
         if(reqContainer != m_transactionSequence->reqContainer)
         {
             // Transaction was canceled or session was closed
+            m_transporter->flushData();
+            unmapObject();
             return;
         }
         if(m_segmentedSender.headerSent == false)
@@ -2953,32 +3034,78 @@ void MTPResponder::sendObjectSegmented()
             if( false == sent )
             {
                 MTP_LOG_CRITICAL("Could not send data");
+                unmapObject();
                 return;
             }
             m_segmentedSender.headerSent = true;
         }
         else
         {
-            qint32 bytesRead = segPayloadLength;
-            // The subsequent segments have no header
-            segPtr = new quint8[segPayloadLength];
-            respCode = m_storageServer->readData(m_segmentedSender.objHandle, (char*)segPtr, bytesRead, segDataOffset);
-            if(MTP_RESP_OK != respCode)
+            // Keep a bounded number of segments queued in the transporter.
+            // Before the mapped window is moved on, all the segments queued
+            // from it must have been written.
+            bool remap = -1 != m_segmentedSender.dataFd && !objectSegmentMapped(segDataOffset, segPayloadLength);
+            if( false == m_transporter->waitForQueuedData(remap ? 0 : MAX_SEGMENTS_IN_FLIGHT - 1) )
             {
-                m_segmentedSender.sendResp = true;
-                delete[] (segPtr);
-                break;
+                if( endTruncatedObjectSend() )
+                {
+                    respCode = MTP_RESP_IncompleteTransfer;
+                    m_segmentedSender.sendResp = true;
+                    break;
+                }
+                MTP_LOG_CRITICAL("Could not send data");
+                m_transporter->flushData();
+                unmapObject();
+                return;
+            }
+            if(reqContainer != m_transactionSequence->reqContainer)
+            {
+                // Transaction was canceled or session was closed
+                m_transporter->flushData();
+                unmapObject();
+                return;
+            }
+            bool lastSegment = (m_segmentedSender.totalDataLen - segDataOffset) <= m_segmentedSender.segmentLen;
+            const quint8 *mappedPtr = mapObjectSegment(segDataOffset, segPayloadLength);
+            if( mappedPtr )
+            {
+                m_segmentedSender.bytesSent += segPayloadLength;
+                MTPStats::dataMoved(segPayloadLength);
+                // The segment is written straight from the mapping
+                sent = m_transporter->queueMappedData(mappedPtr, segPayloadLength, lastSegment);
+            }
+            else
+            {
+                qint32 bytesRead = segPayloadLength;
+                // The subsequent segments have no header
+                segPtr = new quint8[segPayloadLength];
+                respCode = m_storageServer->readData(m_segmentedSender.objHandle, (char*)segPtr, bytesRead, segDataOffset);
+                if(MTP_RESP_OK != respCode)
+                {
+                    m_segmentedSender.sendResp = true;
+                    delete[] (segPtr);
+                    break;
+                }
+                m_segmentedSender.bytesSent += segPayloadLength;
+                MTPStats::dataMoved(segPayloadLength);
+                // Directly call the transport method here; the transporter
+                // takes ownership of the segment and frees it once written
+                sent = m_transporter->queueData(segPtr, segPayloadLength, lastSegment);
+            }
+            if( false == sent )
+            {
+                MTP_LOG_CRITICAL("Could not send data");
+                m_transporter->flushData();
+                unmapObject();
+                return;
             }
-            m_segmentedSender.bytesSent += segPayloadLength;
-            // Directly call the transport method here
-            m_transporter->sendData(segPtr, segPayloadLength, (m_segmentedSender.totalDataLen - segDataOffset) <= BUFFER_MAX_LEN);
-            delete[] (segPtr);
         }
         // Prepare for the next segment to be sent
         segDataOffset += segPayloadLength;
-        if ((m_segmentedSender.totalDataLen - segDataOffset) > BUFFER_MAX_LEN )
+        m_prefetcher->consumed(segDataOffset);
+        if ((m_segmentedSender.totalDataLen - segDataOffset) > m_segmentedSender.segmentLen )
         {
-            segPayloadLength = BUFFER_MAX_LEN;
+            segPayloadLength = m_segmentedSender.segmentLen;
         }
         else
         {
@@ -2991,6 +3118,27 @@ void MTPResponder::sendObjectSegmented()
 
     }
 
+    // The response must not overtake the queued data
+    if( false == m_transporter->waitForQueuedData() )
+    {
+        if( endTruncatedObjectSend() )
+        {
+            respCode = MTP_RESP_IncompleteTransfer;
+            m_segmentedSender.sendResp = true;
+        }
+        else
+        {
+            MTP_LOG_CRITICAL("Could not send data");
+            sent = false;
+        }
+    }
+    unmapObject();
+    if(reqContainer != m_transactionSequence->reqContainer)
+    {
+        // Transaction was canceled or session was closed
+        return;
+    }
+
     if(true == m_segmentedSender.sendResp)
     {
         if( true == sent )
@@ -3009,6 +3157,117 @@ void MTPResponder::sendObjectSegmented()
     }
 }
 
+quint32 MTPResponder::segmentLen() const
+{
+    // MTP_BUFFER_MAX_LEN overrides the size the transporter prefers.
+    // Segments stay multiples of the page size and fit in the mapped
+    // window of the object.
+    quint32 len = tunable("MTP_BUFFER_MAX_LEN", m_transporter->preferredSegmentSize());
+    len = qBound(BUFFER_MAX_LEN, len, quint32(OBJECT_MAP_WINDOW_LEN));
+    return len - len % 4096;
+}
+
+bool MTPResponder::objectSegmentMapped(quint64 offset, quint32 len) const
+{
+    return m_segmentedSender.mapData &&
+           offset >= m_segmentedSender.mapOffset &&
+           offset + len <= m_segmentedSender.mapOffset + m_segmentedSender.mapLen;
+}
+
+const quint8* MTPResponder::mapObjectSegment(quint64 offset, quint32 len)
+{
+    if( -1 == m_segmentedSender.dataFd )
+    {
+        return 0;
+    }
+
+    if( !objectSegmentMapped(offset, len) )
+    {
+        if( m_segmentedSender.mapData )
+        {
+            munmap(m_segmentedSender.mapData, m_segmentedSender.mapLen);
+            m_segmentedSender.mapData = 0;
+        }
+
+        // Nothing is in flight from the old window now. Check the size
+        // again, the object may have shrunk since it was opened.
+        struct stat st;
+        if( 0 != fstat(m_segmentedSender.dataFd, &st) ||
+            static_cast<quint64>(st.st_size) < offset + len )
+        {
+            MTP_LOG_WARNING("Object shrank while being sent, copying it instead");
+            unmapObject();
+            return 0;
+        }
+
+        // The window starts at the page holding the segment and covers
+        // many segments, but not more than what is going to be sent
+        quint64 pageSize = sysconf(_SC_PAGESIZE);
+        quint64 start = offset - offset % pageSize;
+        quint64 end = qMin(start + OBJECT_MAP_WINDOW_LEN, m_segmentedSender.totalDataLen);
+        end = qMin(end, static_cast<quint64>(st.st_size));
+        if( end < offset + len )
+        {
+            end = offset + len;
+        }
+
+        void *map = mmap(0, end - start, PROT_READ, MAP_SHARED, m_segmentedSender.dataFd, start);
+        if( MAP_FAILED == map )
+        {
+            // Fall back to reading the rest of the object into buffers
+            MTP_LOG_WARNING("Could not map object, copying it instead");
+            unmapObject();
+            return 0;
+        }
+        // Reading ahead is left to m_prefetcher
+        madvise(map, end - start, MADV_SEQUENTIAL);
+
+        m_segmentedSender.mapData = static_cast<quint8*>(map);
+        m_segmentedSender.mapOffset = start;
+        m_segmentedSender.mapLen = end - start;
+    }
+
+    return m_segmentedSender.mapData + (offset - m_segmentedSender.mapOffset);
+}
+
+void MTPResponder::unmapObject()
+{
+    if( m_segmentedSender.mapData )
+    {
+        munmap(m_segmentedSender.mapData, m_segmentedSender.mapLen);
+        m_segmentedSender.mapData = 0;
+        m_segmentedSender.mapOffset = 0;
+        m_segmentedSender.mapLen = 0;
+    }
+    if( -1 != m_segmentedSender.dataFd )
+    {
+        m_prefetcher->stopPrefetch();
+        m_storageServer->closeData(m_segmentedSender.objHandle, m_segmentedSender.dataFd);
+        m_segmentedSender.dataFd = -1;
+    }
+}
+
+bool MTPResponder::endTruncatedObjectSend()
+{
+    // The mapped pages are only read by the kernel when the segments are
+    // written, so a truncation shows up as a failed (EFAULT) or short write
+    // rather than as a fault in this process
+    struct stat st;
+    if( !m_segmentedSender.mapData ||
+        ( 0 == fstat(m_segmentedSender.dataFd, &st) &&
+          static_cast<quint64>(st.st_size) >= m_segmentedSender.mapOffset + m_segmentedSender.mapLen ) )
+    {
+        return false;
+    }
+
+    MTP_LOG_WARNING("Object was truncated while being sent");
+    // The segments still queued come from the same window. A zero length
+    // packet ends the data phase, the segments are multiples of the packet size.
+    m_transporter->flushData();
+    m_transporter->sendData(0, 0, true);
+    return true;
+}
+
 void MTPResponder::processTransportEvents( bool &txCancelled )
 {
     m_transporter->disableRW();
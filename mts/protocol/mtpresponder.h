@@ -48,6 +48,7 @@ class DeviceInfo;
 class PropertyPod;
 class ObjectPropertyCache;
 class MTPExtensionManager;
+class ObjectPrefetcher;
 class MTPTxContainer;
 class MTPRxContainer;
 typedef void (MTPResponder::*MTPCommandHandler)();
@@ -165,6 +166,7 @@ class MTPResponder : public QObject
         DeviceInfo*                                     m_devInfoProvider;  ///< Pointer to the device info class
         PropertyPod*                                    m_propertyPod;      ///< Pointer to the MTP properties utility class
         MTPExtensionManager*                            m_extensionManager; ///< Pointer to the MTP extension manager class
+        ObjectPrefetcher*                               m_prefetcher;       ///< Reads objects ahead of segmented sends
         ObjHandle                                       m_copiedObjHandle;  ///< Stored in case the copied object needs to be deleted due to cancel tx
         bool                                            m_containerToBeResent;
         bool                                            m_isLastPacket;
@@ -246,15 +248,21 @@ class MTPResponder : public QObject
         {
             quint64 totalDataLen;                                           ///< The total object size
             quint32 payloadLen;                                             ///< The length of the current segment
+            quint32 segmentLen;                                             ///< The length of the segments of this object
             quint32 offset;                                                 ///< Offset into the object (current segment)
             quint32 bytesSent;                                              ///< Bytes of the object transferred so far
             ObjHandle objHandle;                                            ///< The object handle
             bool segmentationStarted;                                       ///< Flag to indicate state of segmentation
             bool headerSent;                                                ///< Flag to indicate if the MTP header has been sent
             bool sendResp;                                                  ///< Flag to indicate if MTP response phase can begin
+            int dataFd;                                                     ///< Descriptor of the object data, -1 if it can't be mapped
+            quint8 *mapData;                                                ///< The currently mapped window of the object
+            quint64 mapOffset;                                              ///< Offset of the mapped window into the object
+            quint64 mapLen;                                                 ///< Length of the mapped window
             
-            SendObjectSegment() : totalDataLen(0), payloadLen(0), offset(0), bytesSent(0), 
-            objHandle(0), segmentationStarted(false), headerSent(false), sendResp(0)
+            SendObjectSegment() : totalDataLen(0), payloadLen(0), segmentLen(0), offset(0), bytesSent(0), 
+            objHandle(0), segmentationStarted(false), headerSent(false), sendResp(0),
+            dataFd(-1), mapData(0), mapOffset(0), mapLen(0)
             {
             }
         }m_segmentedSender;                                                 ///< This structure holds data for segmented getObject operations
@@ -443,6 +451,24 @@ class MTPResponder : public QObject
         /// Sends a large data packet in segments of max data packet size
         void sendObjectSegmented();
 
+        /// Returns the size of the segments GetObject data is sent in
+        quint32 segmentLen() const;
+
+        /// Checks if a segment of the object being sent lies within the mapped window
+        bool objectSegmentMapped(quint64 offset, quint32 len) const;
+
+        /// Returns a pointer to a segment of the object being sent, mapping the object
+        /// as needed. Returns 0 if the object can't be mapped or has been truncated.
+        const quint8* mapObjectSegment(quint64 offset, quint32 len);
+
+        /// Releases the mapping and the descriptor of the object being sent
+        void unmapObject();
+
+        /// Checks if writing the mapped window failed because the object was truncated. If so,
+        /// drops the segments still queued and ends the data phase so the response can follow.
+        /// \return true if the object no longer covers the mapped window
+        bool endTruncatedObjectSend();
+
         /// Constructs and sends a standard MTP response container
         /// It uses the transaction id from m_transactionSequence->reqContainer
         bool sendResponse(MTPResponseCode code);
@@ -0,0 +1,105 @@
+#include "objectprefetcher.h"
+#include "trace.h"
+
+#include <QtCore/QMutexLocker>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+using namespace meegomtp1dot0;
+
+ObjectPrefetcher::ObjectPrefetcher(int depth, quint32 chunkSize, QObject *parent) :
+    QThread(parent), m_depth(depth), m_chunkSize(chunkSize), m_fd(-1),
+    m_next(0), m_consumed(0), m_end(0), m_busy(false), m_exit(false)
+{
+}
+
+ObjectPrefetcher::~ObjectPrefetcher()
+{
+    m_lock.lock();
+    m_exit = true;
+    m_wait.wakeAll();
+    m_lock.unlock();
+
+    wait();
+}
+
+void ObjectPrefetcher::startPrefetch(int fd, quint64 offset, quint64 end)
+{
+    if( m_depth <= 0 || 0 == m_chunkSize )
+    {
+        return;
+    }
+
+    QMutexLocker locker(&m_lock);
+    while( m_busy )
+    {
+        m_wait.wait(&m_lock);
+    }
+    m_fd = fd;
+    m_next = offset;
+    m_consumed = offset;
+    m_end = end;
+    m_wait.wakeAll();
+
+    if( !isRunning() )
+    {
+        start();
+    }
+}
+
+void ObjectPrefetcher::consumed(quint64 offset)
+{
+    QMutexLocker locker(&m_lock);
+    if( -1 != m_fd && offset > m_consumed )
+    {
+        m_consumed = offset;
+        m_wait.wakeAll();
+    }
+}
+
+void ObjectPrefetcher::stopPrefetch()
+{
+    QMutexLocker locker(&m_lock);
+    m_fd = -1;
+    // The caller is about to close the descriptor
+    while( m_busy )
+    {
+        m_wait.wait(&m_lock);
+    }
+}
+
+void ObjectPrefetcher::run()
+{
+    QMutexLocker locker(&m_lock);
+
+    while( !m_exit )
+    {
+        if( -1 == m_fd || m_next >= m_end ||
+            m_next >= m_consumed + quint64(m_depth) * m_chunkSize )
+        {
+            m_wait.wait(&m_lock);
+            continue;
+        }
+
+        int fd = m_fd;
+        quint64 offset = m_next;
+        quint64 len = qMin(quint64(m_chunkSize), m_end - m_next);
+        m_busy = true;
+
+        // readahead() returns once the data is in the page cache, so
+        // the reads of the responder or the bulk writer don't block on
+        // storage anymore
+        locker.unlock();
+        if( -1 == readahead(fd, offset, len) )
+        {
+            MTP_LOG_WARNING("readahead failed:" << strerror(errno));
+            posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+        }
+        locker.relock();
+
+        m_busy = false;
+        m_next = offset + len;
+        m_wait.wakeAll();
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef OBJECTPREFETCHER_H
+#define OBJECTPREFETCHER_H
+
+#include <QtCore/QThread>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+
+/// \brief The ObjectPrefetcher class reads an object ahead of a segmented send.
+///
+/// While the responder is putting one segment of an object on the wire, the prefetcher
+/// pulls the following ones from storage into the page cache on its own thread, so that
+/// storage and bus are busy at the same time. At most depth chunks of chunkSize bytes are
+/// read ahead of the data consumed by the responder.
+namespace meegomtp1dot0
+{
+class ObjectPrefetcher : public QThread
+{
+#ifdef UT_ON
+    friend class MTPResponder_test;
+#endif
+    public:
+        /// Constructor for ObjectPrefetcher
+        /// \param depth [in] the number of chunks to read ahead, 0 disables prefetching
+        /// \param chunkSize [in] the size of the chunks in bytes
+        ObjectPrefetcher(int depth, quint32 chunkSize, QObject *parent = 0);
+
+        /// Destructor for ObjectPrefetcher
+        ~ObjectPrefetcher();
+
+        /// Starts reading ahead an object.
+        /// \param fd [in] the file descriptor of the object data; must stay open until stopPrefetch() returns
+        /// \param offset [in] the offset of the first byte to be sent
+        /// \param end [in] the offset after the last byte to be sent
+        void startPrefetch(int fd, quint64 offset, quint64 end);
+
+        /// Tells the prefetcher that the data before offset has been sent.
+        void consumed(quint64 offset);
+
+        /// Stops reading ahead the current object; returns after any read in progress is done.
+        void stopPrefetch();
+
+    protected:
+        void run();
+
+    private:
+        QMutex m_lock;                  ///< Protects the members below
+        QWaitCondition m_wait;          ///< Wakes up the prefetching thread
+        const int m_depth;              ///< Number of chunks to read ahead
+        const quint32 m_chunkSize;      ///< Size of the chunks to read
+        int m_fd;                       ///< The object being read ahead, -1 if none
+        quint64 m_next;                 ///< Offset of the next chunk to read
+        quint64 m_consumed;             ///< Offset up to which the data has been sent
+        quint64 m_end;                  ///< Offset after the last byte to read
+        bool m_busy;                    ///< A chunk is being read
+        bool m_exit;                    ///< The thread should exit
+};
+}
+
+#endif
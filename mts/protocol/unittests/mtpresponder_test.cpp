@@ -35,7 +35,11 @@
 #include "mtptransporterdummy.h"
 #include "mtptxcontainer.h"
 #include "mtprxcontainer.h"
+#include "objectprefetcher.h"
+#include "mtpstats.h"
 #include <limits>
+#include <signal.h>
+#include <unistd.h>
 
 using namespace meegomtp1dot0;
 
@@ -727,4 +731,148 @@ void MTPResponder_test::testCloseSession()
     QCOMPARE( m_responseCode, (MTPResponseCode)MTP_RESP_OK );
 }
 
+quint64 MTPResponder_test::prefetchedUpTo(ObjectPrefetcher &prefetcher)
+{
+    QMutexLocker locker(&prefetcher.m_lock);
+    return prefetcher.m_busy ? 0 : prefetcher.m_next;
+}
+
+// An object that shrank after its send started is read ahead up to
+// the end of the send, not up to the end of the file
+void MTPResponder_test::testPrefetchPastEof()
+{
+    QTemporaryFile file;
+    QVERIFY( file.open() );
+    QVERIFY( file.write(QByteArray(10000, 'x')) == 10000 );
+    QVERIFY( file.flush() );
+
+    const quint64 end = 10 * 4096 + 123;
+    ObjectPrefetcher prefetcher(4, 4096);
+    prefetcher.startPrefetch(file.handle(), 0, end);
+    QTRY_COMPARE( prefetchedUpTo(prefetcher), quint64(4 * 4096) );
+
+    // The last chunk is cut at the end of the send
+    prefetcher.consumed(end);
+    QTRY_COMPARE( prefetchedUpTo(prefetcher), end );
+    prefetcher.stopPrefetch();
+}
+
+void MTPResponder_test::testPrefetchCancel()
+{
+    QTemporaryFile file;
+    QVERIFY( file.open() );
+    const quint64 size = 64 * 1024;
+    QVERIFY( file.write(QByteArray(size, 'x')) == size );
+    QVERIFY( file.flush() );
+
+    ObjectPrefetcher prefetcher(2, 4096);
+    prefetcher.startPrefetch(file.handle(), 0, size);
+    QTRY_COMPARE( prefetchedUpTo(prefetcher), quint64(2 * 4096) );
+
+    // Once stopped, the descriptor can be closed: the data sent after
+    // that does not wake up the prefetcher
+    prefetcher.stopPrefetch();
+    int fd = dup(file.handle());
+    QVERIFY( fd != -1 );
+    file.close();
+    prefetcher.consumed(size);
+    QTest::qWait(100);
+    QCOMPARE( prefetchedUpTo(prefetcher), quint64(2 * 4096) );
+
+    // The next object starts from its own offset
+    prefetcher.startPrefetch(fd, 8192, 8192 + 3 * 4096);
+    prefetcher.consumed(8192 + 3 * 4096);
+    QTRY_COMPARE( prefetchedUpTo(prefetcher), quint64(8192 + 3 * 4096) );
+    prefetcher.stopPrefetch();
+    close(fd);
+}
+
+// Returns the line of an operation in a statistics snapshot
+static QByteArray statsLine(const QByteArray &snapshot, const QByteArray &op)
+{
+    foreach( const QByteArray &line, snapshot.split('\n') )
+    {
+        if( line.startsWith("op " + op + ' ') )
+        {
+            return line;
+        }
+    }
+    return QByteArray();
+}
+
+// Sums up the latency buckets of an operation
+static int latencyCount(const QByteArray &line)
+{
+    int count = 0;
+    QList<QByteArray> fields = line.mid(line.indexOf(" latency_us") + 11).split(' ');
+    foreach( const QByteArray &bucket, fields )
+    {
+        count += bucket.mid(bucket.indexOf(':') + 1).toInt();
+    }
+    return count;
+}
+
+void MTPResponder_test::testStats()
+{
+    QTemporaryDir dir;
+    QVERIFY( dir.isValid() );
+    QString fileName = dir.path() + "/stats";
+
+    // Nothing is collected until MTP_STATS_FILE is set
+    MTPStats::count(MTPStats::EVENTS_COALESCED);
+    MTPStats::beginTransaction(MTP_OP_GetObject);
+    MTPStats::endTransaction(MTP_RESP_OK);
+    qputenv("MTP_STATS_FILE", QFile::encodeName(fileName));
+    MTPStats::init();
+    QVERIFY( MTPStats::enabled() );
+
+    MTPStats::count(MTPStats::EVENTS_COALESCED, 2);
+    MTPStats::count(MTPStats::WRITER_RETRIES);
+
+    // PTP and MTP operations have a slot each, vendor operations share one
+    MTPStats::beginTransaction(MTP_OP_GetObject);
+    MTPStats::dataMoved(1000);
+    MTPStats::dataMoved(24);
+    MTPStats::endTransaction(MTP_RESP_OK);
+    MTPStats::beginTransaction(MTP_OP_GetObject);
+    MTPStats::endTransaction(MTP_RESP_InvalidObjectHandle);
+    MTPStats::beginTransaction(MTP_OP_GetObjectPropList);
+    MTPStats::endTransaction(MTP_RESP_OK);
+    MTPStats::beginTransaction(0x9101);
+    MTPStats::endTransaction(MTP_RESP_OK);
+    MTPStats::beginTransaction(0x9201);
+    MTPStats::endTransaction(MTP_RESP_OK);
+    // A second response to the same request is not counted
+    MTPStats::endTransaction(MTP_RESP_OK);
+
+    QByteArray snapshot = MTPStats::snapshot();
+    QList<QByteArray> lines = snapshot.split('\n');
+    QVERIFY( lines.first().startsWith("uptime_s ") );
+    QVERIFY( lines.contains("events_coalesced 2") );
+    QVERIFY( lines.contains("writer_retries 1") );
+    QVERIFY( lines.contains("reader_retries 0") );
+
+    QByteArray line = statsLine(snapshot, "0x1009");
+    QVERIFY( line.contains(" count 2 errors 1 ") );
+    QVERIFY( line.contains(" bytes 1024 ") );
+    QCOMPARE( latencyCount(line), 2 );
+    line = statsLine(snapshot, "0x9805");
+    QVERIFY( line.contains(" count 1 errors 0 ") );
+    QVERIFY( line.contains(" bytes 0 ") );
+    QCOMPARE( latencyCount(line), 1 );
+    line = statsLine(snapshot, "other");
+    QVERIFY( line.contains(" count 2 errors 0 ") );
+    QCOMPARE( latencyCount(line), 2 );
+    QVERIFY( statsLine(snapshot, "0x1001").isEmpty() );
+
+    // SIGUSR2 has the main thread write the same snapshot to the file
+    QVERIFY( !QFile::exists(fileName) );
+    raise(SIGUSR2);
+    QTRY_VERIFY( QFile::exists(fileName) );
+    QFile file(fileName);
+    QVERIFY( file.open(QIODevice::ReadOnly) );
+    QList<QByteArray> dumped = file.readAll().split('\n');
+    QCOMPARE( dumped.mid(1), lines.mid(1) );
+}
+
 QTEST_MAIN(MTPResponder_test);
@@ -40,6 +40,7 @@ namespace meegomtp1dot0
 {
 class MTPResponder;
 class MTPTransporterDummy;
+class ObjectPrefetcher;
 class MTPTxContainer;
 }
 
@@ -85,10 +86,14 @@ private slots:
     //void testGetPartialObject();
     void testDeleteObject();
     void testCloseSession();
+    void testPrefetchPastEof();
+    void testPrefetchCancel();
+    void testStats();
     void cleanupTestCase();
 
 private:
     quint32 nextTransactionId();
+    quint64 prefetchedUpTo(ObjectPrefetcher &prefetcher);
     void copyAndSendContainer(MTPTxContainer *container);
 
     MTPResponder *m_responder;
@@ -26,6 +26,7 @@ DEPENDPATH += . \
               ../../platform/deviceinfo \
               ../../transport \
               ../../transport/dummy \
+              ../../transport/loopback \
               ../../transport/usb \
               ../../common
 
@@ -38,6 +39,7 @@ INCLUDEPATH += . \
                ../../platform/deviceinfo \
                ../../transport \
                ../../transport/dummy \
+               ../../transport/loopback \
                ../../transport/usb \
                ../../common  \
                ../../../include
@@ -51,6 +53,8 @@ HEADERS += mtpresponder_test.h \
            ../mtptxcontainer.h \
            ../propertypod.h \
            ../objectpropertycache.h \
+           ../objectprefetcher.h \
+           ../../common/mtpstats.h \
            ../mtpextensionmanager.h \
            ../extensions/mtpextension.h \
            ../extensions/mtpextension.h \
@@ -62,7 +66,9 @@ HEADERS += mtpresponder_test.h \
            ../../transport/mtptransporter.h \
            ../../transport/usb/mtptransporterusb.h \
            ../../transport/usb/threadio.h \
+           ../../transport/usb/aiothreadio.h \
            ../../transport/dummy/mtptransporterdummy.h \
+           ../../transport/loopback/mtptransporterloopback.h \
            ../../mts.h
 
 SOURCES += mtpresponder_test.cpp \
@@ -73,6 +79,8 @@ SOURCES += mtpresponder_test.cpp \
            ../mtptxcontainer.cpp \
            ../propertypod.cpp \
            ../objectpropertycache.cpp \
+           ../objectprefetcher.cpp \
+           ../../common/mtpstats.cpp \
            ../mtpextensionmanager.cpp \
            ../../platform/storage/storagefactory.cpp \
            ../../platform/deviceinfo/xmlhandler.cpp \
@@ -81,7 +89,9 @@ SOURCES += mtpresponder_test.cpp \
            ../../transport/usb/mtptransporterusb.cpp \
            ../../transport/usb/descriptor.c \
            ../../transport/usb/threadio.cpp \
+           ../../transport/usb/aiothreadio.cpp \
            ../../transport/dummy/mtptransporterdummy.cpp \
+           ../../transport/loopback/mtptransporterloopback.cpp \
            ../../mts.cpp
 
 target.path = /opt/tests/buteo-mtp/
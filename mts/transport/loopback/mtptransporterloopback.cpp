@@ -0,0 +1,69 @@
+#include "mtptransporterloopback.h"
+#include "mtp1descriptors.h"
+#include "trace.h"
+
+#include <QList>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+static const char *const endpointPaths[] = {
+    MTP_EP_PATH_CONTROL,
+    MTP_EP_PATH_IN,
+    MTP_EP_PATH_OUT,
+    MTP_EP_PATH_INTERRUPT
+};
+
+MTPTransporterLoopback::MTPTransporterLoopback(bool useAio) : MTPTransporterUSB(useAio)
+{
+    QList<QByteArray> fds = qgetenv("MTP_LOOPBACK_FDS").split(',');
+
+    for( int i = 0; i < ENDPOINT_COUNT; i++ )
+    {
+        bool ok = false;
+        m_endpoints[i] = i < fds.count() ? fds[i].toInt(&ok) : -1;
+        if( !ok || m_endpoints[i] < 0 )
+        {
+            MTP_LOG_CRITICAL("No loopback socket for " << endpointPaths[i]);
+            m_endpoints[i] = -1;
+        }
+    }
+}
+
+MTPTransporterLoopback::~MTPTransporterLoopback()
+{
+    // The threads use duplicates, which MTPTransporterUSB closes
+    for( int i = 0; i < ENDPOINT_COUNT; i++ )
+    {
+        if( -1 != m_endpoints[i] )
+        {
+            close(m_endpoints[i]);
+        }
+    }
+}
+
+bool MTPTransporterLoopback::configured()
+{
+    return !qgetenv("MTP_LOOPBACK_FDS").isEmpty();
+}
+
+int MTPTransporterLoopback::openEndpoint(const char *path)
+{
+    for( int i = 0; i < ENDPOINT_COUNT; i++ )
+    {
+        if( !strcmp(path, endpointPaths[i]) )
+        {
+            if( -1 == m_endpoints[i] )
+            {
+                errno = ENOENT;
+                return -1;
+            }
+            return fcntl(m_endpoints[i], F_DUPFD_CLOEXEC, 0);
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
@@ -0,0 +1,44 @@
+#ifndef MTPTRANSPORTER_LOOPBACK_H
+#define MTPTRANSPORTER_LOOPBACK_H
+
+#include "mtptransporterusb.h"
+
+/// \brief The MTPTransporterLoopback class runs the USB transport over sockets instead of FunctionFS.
+///
+/// The endpoints are SOCK_SEQPACKET sockets set up by an initiator, typically test/initiator.cpp,
+/// which plays the part of the FunctionFS driver and the host: it reads the descriptors written to
+/// ep0, sends the control events and exchanges containers over ep1/ep2/ep3. Each message on a
+/// bulk endpoint is a USB transfer; a message shorter than the maximum packet size, possibly
+/// empty, ends a data phase. The messages sent to ep2 must not be larger than the bulk read size.
+///
+/// The initiator passes the device ends of the sockets in MTP_LOOPBACK_FDS, as a comma separated
+/// list of descriptors for ep0, ep1 (IN), ep2 (OUT) and ep3 (interrupt).
+namespace meegomtp1dot0
+{
+class MTPTransporterLoopback : public MTPTransporterUSB
+{
+    Q_OBJECT
+public:
+    /// Constructor.
+    /// \param useAio [in] Same as for MTPTransporterUSB. Sockets don't support kernel AIO, so the
+    /// bulk threads fall back to blocking I/O, which is still useful for testing the fallback.
+    explicit MTPTransporterLoopback(bool useAio = false);
+
+    /// Destructor.
+    ~MTPTransporterLoopback();
+
+    /// Returns true if MTP_LOOPBACK_FDS is set in the environment.
+    static bool configured();
+
+protected:
+    /// Returns a duplicate of the socket standing in for the endpoint file, so that the
+    /// endpoint can be "opened" again after the transporter closed it.
+    int openEndpoint(const char *path);
+
+private:
+    enum { ENDPOINT_COUNT = 4 };
+    int m_endpoints[ENDPOINT_COUNT];
+};
+}
+
+#endif
@@ -66,6 +66,48 @@ class MTPTransporter : public QObject
         /// \return Must return true if send was a success, else false.
         virtual bool sendData(const quint8* data, quint32 len, bool sendZeroPacket = true) = 0;
 
+        /// Queues data (an MTP data container, or a segment of one) to be sent to the initiator. The function
+        /// returns as soon as the data has been queued, allowing the caller to prepare the next segment while
+        /// the previous ones are being written. Transports that can't pipeline writes fall back to sendData().
+        /// \param data [in] The buffer of data to be sent, allocated with new[]. The transporter takes ownership of it.
+        /// \param len [in] The length of the data buffer in bytes.
+        /// \param sendZeroPacket [in] Same as for sendData().
+        /// \return Returns false if the data could not be queued.
+        virtual bool queueData(quint8* data, quint32 len, bool sendZeroPacket = true)
+        {
+            bool sent = sendData(data, len, sendZeroPacket);
+            delete[] data;
+            return sent;
+        }
+
+        /// Queues data like queueData(), but without taking ownership of the buffer. This allows sending data
+        /// straight out of a memory mapped file.
+        /// \param data [in] The buffer of data to be sent. It must remain valid until waitForQueuedData(0) has returned.
+        /// \param len [in] The length of the data buffer in bytes.
+        /// \param sendZeroPacket [in] Same as for sendData().
+        /// \return Returns false if the data could not be queued.
+        virtual bool queueMappedData(const quint8* data, quint32 len, bool sendZeroPacket = true)
+        {
+            return sendData(data, len, sendZeroPacket);
+        }
+
+        /// Waits until at most maxPending buffers queued with queueData() remain unwritten.
+        /// \param maxPending [in] The number of buffers that may still be in flight when the function returns.
+        /// \return Returns false if writing any of the queued buffers failed since the previous call.
+        virtual bool waitForQueuedData(int maxPending = 0)
+        {
+            Q_UNUSED(maxPending);
+            return true;
+        }
+
+        /// Returns the size of the data buffers the transport handles best, so that segmented data phases can
+        /// be split accordingly.
+        /// \return The preferred buffer size in bytes, or 0 if the transport has no preference.
+        virtual quint32 preferredSegmentSize() const
+        {
+            return 0;
+        }
+
         /// Sends data (an MTP event container) to the initiator. The function must be synchronous.
         /// \param data [in] The buffer of data to be sent. The buffer is assumed to be allocated by the caller, and will not be modified.
         /// \param len [in] The length of the data buffer in bytes.
@@ -0,0 +1,411 @@
+#include "aiothreadio.h"
+#include <QMutexLocker>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "mtpstats.h"
+
+using meegomtp1dot0::MTPStats;
+
+/* The kernel AIO syscalls are used directly instead of through libaio,
+ * FunctionFS only needs the basic submit/getevents functionality. */
+static inline int sys_io_setup(unsigned nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int sys_io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int sys_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                                   struct io_event *events, struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/* How long a read that failed because the endpoint is not enabled waits
+ * before it is queued again */
+static const long AIO_RETRY_NSECS = 1000 * 1000;
+
+AioBulkReaderThread::AioBulkReaderThread(QObject *parent, int bufferSize)
+    : BulkReaderThread(parent, bufferSize), m_probeReadSize(false),
+      m_aioBuffer(0), m_aioBufferSize(0)
+{
+}
+
+AioBulkReaderThread::~AioBulkReaderThread()
+{
+    delete[] m_aioBuffer;
+}
+
+bool AioBulkReaderThread::submitRead(aio_context_t ctx, int slot)
+{
+    struct iocb *iocb = &m_iocb[slot];
+    struct iocb *iocbs[1] = { iocb };
+
+    memset(iocb, 0, sizeof *iocb);
+    iocb->aio_data = slot;
+    iocb->aio_lio_opcode = IOCB_CMD_PREAD;
+    iocb->aio_fildes = m_fd;
+    iocb->aio_buf = (quint64)(quintptr)(m_aioBuffer + slot * m_readSize);
+    iocb->aio_nbytes = m_readSize;
+
+    if (sys_io_submit(ctx, 1, iocbs) != 1) {
+        MTP_LOG_CRITICAL("io_submit(read) failed: " << strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Submits the first read, finding the largest read size the endpoint
+ * accepts if asked to. FunctionFS allocates and queues the request
+ * right in io_submit(), so a size the controller can't handle fails
+ * there and not later. */
+bool AioBulkReaderThread::probeRead(aio_context_t ctx)
+{
+    while (!submitRead(ctx, 0)) {
+        if (!m_probeReadSize || m_readSize / 2 < MAX_DATA_IN_SIZE || m_shouldExit)
+            return false;
+        /* The buffers of the smaller size fit in the current ones */
+        m_readSize /= 2;
+        MTP_LOG_WARNING("AioBulkReaderThread limit reads to: " << m_readSize);
+    }
+    return true;
+}
+
+void AioBulkReaderThread::execute()
+{
+    aio_context_t ctx = 0;
+    struct io_event events[AIO_REQUESTS_QUEUED];
+    int retrySlots[AIO_REQUESTS_QUEUED];
+    int queued = 0;
+    int retries = 0;
+    bool ok = true;
+
+    if (sys_io_setup(AIO_REQUESTS_QUEUED, &ctx) == -1) {
+        MTP_LOG_WARNING("kernel AIO not available, using blocking reads: "
+                        << strerror(errno));
+        BulkReaderThread::execute();
+        return;
+    }
+
+    if (m_aioBufferSize < m_readSize) {
+        delete[] m_aioBuffer;
+        m_aioBufferSize = m_readSize;
+        m_aioBuffer = new char[AIO_REQUESTS_QUEUED * m_aioBufferSize];
+    }
+
+    if (!probeRead(ctx)) {
+        MTP_LOG_WARNING("AIO not supported by endpoint, using blocking reads");
+        sys_io_destroy(ctx);
+        BulkReaderThread::execute();
+        return;
+    }
+    queued = 1;
+    for (int slot = 1; slot < AIO_REQUESTS_QUEUED; slot++) {
+        if (submitRead(ctx, slot))
+            queued++;
+    }
+
+    while (ok && !m_shouldExit && queued + retries > 0) {
+        /* While reads wait to be retried, the completions of the others
+         * are waited for only until it is time to queue them again */
+        struct timespec retryTimeout = { 0, AIO_RETRY_NSECS };
+        int count = sys_io_getevents(ctx, 1, AIO_REQUESTS_QUEUED, events,
+                                     retries ? &retryTimeout : NULL);
+
+        /* Check if thread exit has been requested */
+        if (m_shouldExit)
+            break;
+
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            MTP_LOG_CRITICAL("exit thread due to io_getevents error: " << strerror(errno));
+            break;
+        }
+
+        /* The requests on an endpoint complete in the order they
+         * were queued, so the data arrives here in stream order. */
+        bool completed = false;
+        for (int i = 0; ok && i < count; i++) {
+            int slot = events[i].data;
+            qint64 res = events[i].res;
+
+            queued--;
+
+            if (res < 0) {
+                int err = -res;
+                if (err == EAGAIN || err == ESHUTDOWN) {
+                    /* The endpoint is not enabled yet, a read queued
+                     * right away would fail again at once */
+                    MTPStats::count(MTPStats::READER_RETRIES);
+                    retrySlots[retries++] = slot;
+                    continue;
+                } else if (err != EINTR && err != ECONNRESET) {
+                    /* Abandon thread - this should not happen */
+                    MTP_LOG_CRITICAL("exit thread due to unhandled error: " << strerror(err));
+                    ok = false;
+                    break;
+                }
+            } else if (res > 0) {
+                ok = storeData(m_aioBuffer + slot * m_readSize, res);
+                if (!ok)
+                    break;
+            }
+            completed = completed || res >= 0;
+
+            if (submitRead(ctx, slot))
+                queued++;
+        }
+
+        /* The failed reads are queued again once their wait is over,
+         * or as soon as the endpoint completes reads again */
+        while (ok && retries > 0 && (count == 0 || completed)) {
+            if (submitRead(ctx, retrySlots[--retries]))
+                queued++;
+        }
+    }
+
+    /* Cancels the reads still queued and waits for them to finish */
+    sys_io_destroy(ctx);
+}
+
+AioBulkWriterThread::AioBulkWriterThread(QObject *parent)
+    : BulkWriterThread(parent), m_eventFd(-1)
+{
+    for (int slot = 0; slot < AIO_REQUESTS_QUEUED; slot++)
+        m_slotOwner[slot] = 0;
+}
+
+void AioBulkWriterThread::wakeUp_locked()
+{
+    if (m_eventFd != -1)
+        eventfd_write(m_eventFd, 1);
+}
+
+void AioBulkWriterThread::dataQueued()
+{
+    BulkWriterThread::dataQueued();
+    wakeUp_locked();
+}
+
+void AioBulkWriterThread::interrupt() // Executed in main thread
+{
+    BulkWriterThread::interrupt();
+
+    QMutexLocker locker(&m_lock);
+    wakeUp_locked(); // wake up the thread if it's waiting on the eventfd
+}
+
+bool AioBulkWriterThread::submitWrites_locked(aio_context_t ctx)
+{
+    struct iocb *iocbs[AIO_REQUESTS_QUEUED];
+    int count = 0;
+    int slot = 0;
+
+    while (slot < AIO_REQUESTS_QUEUED) {
+        if (m_slotOwner[slot]) {
+            slot++;
+            continue;
+        }
+
+        /* Continue with the latest buffer or start the next one */
+        AioWrite *write = m_inFlight.isEmpty() ? 0 : m_inFlight.last();
+        if (!write || (write->submitted == write->buffer.dataLen && !write->zeroPacket)) {
+            if (m_buffers.isEmpty())
+                break;
+
+            WriteBuffer buffer = m_buffers.takeFirst();
+            if (buffer.dataLen == 0 && !buffer.terminateTransfer) {
+                releaseBuffer(buffer);
+                emit dataWritten(true);
+                continue;
+            }
+
+            write = new AioWrite;
+            write->buffer = buffer;
+            write->submitted = 0;
+            write->chunks = 0;
+            // See BulkWriterThread::writeBuffer() about short packets
+            write->zeroPacket = buffer.terminateTransfer && buffer.dataLen % PTP_HS_DATA_PKT_SIZE == 0;
+            write->result = true;
+            m_inFlight.append(write);
+            m_inProgress = m_inFlight.count();
+        }
+
+        quint32 len = write->buffer.dataLen - write->submitted;
+        if (len > m_writeMax)
+            len = m_writeMax;
+        if (len == 0)
+            write->zeroPacket = false;
+
+        struct iocb *iocb = &m_iocb[slot];
+        memset(iocb, 0, sizeof *iocb);
+        iocb->aio_data = slot;
+        iocb->aio_lio_opcode = IOCB_CMD_PWRITE;
+        iocb->aio_fildes = m_fd;
+        iocb->aio_buf = (quint64)(quintptr)(write->buffer.data + write->submitted);
+        iocb->aio_nbytes = len;
+        iocb->aio_flags = IOCB_FLAG_RESFD;
+        iocb->aio_resfd = m_eventFd;
+
+        write->submitted += len;
+        write->chunks++;
+        m_slotOwner[slot] = write;
+        iocbs[count++] = iocb;
+        slot++;
+    }
+
+    if (count == 0)
+        return true;
+
+    int rc = sys_io_submit(ctx, count, iocbs);
+    if (rc == count)
+        return true;
+
+    int err = errno;
+    MTP_LOG_CRITICAL("io_submit(write) failed: " << (rc < 0 ? strerror(err) : "partial"));
+
+    /* The requests that didn't make it fail their buffers */
+    for (int i = (rc < 0 ? 0 : rc); i < count; i++) {
+        int failed = iocbs[i]->aio_data;
+        m_slotOwner[failed]->chunks--;
+        m_slotOwner[failed]->result = false;
+        m_slotOwner[failed] = 0;
+    }
+
+    /* Don't go to sleep before the failed buffers are completed */
+    wakeUp_locked();
+
+    return !(rc < 0 && err == EINVAL);
+}
+
+void AioBulkWriterThread::completeWrites_locked(aio_context_t ctx)
+{
+    struct io_event events[AIO_REQUESTS_QUEUED];
+    struct timespec timeout = { 0, 0 };
+
+    int count = sys_io_getevents(ctx, 0, AIO_REQUESTS_QUEUED, events, &timeout);
+    for (int i = 0; i < count; i++) {
+        int slot = events[i].data;
+        qint64 res = events[i].res;
+        AioWrite *write = m_slotOwner[slot];
+
+        if (res < 0 || (quint64)res != m_iocb[slot].aio_nbytes) {
+            // After a shutdown, the host won't expect this data anymore,
+            // so drop it and report failure.
+            MTP_LOG_WARNING("AioBulkWriterThread dropping buffer: "
+                            << (res < 0 ? strerror(-res) : "partial write"));
+            write->result = false;
+        }
+        write->chunks--;
+        m_slotOwner[slot] = 0;
+    }
+
+    /* Buffers are completed in the order they were queued */
+    while (!m_inFlight.isEmpty()) {
+        AioWrite *write = m_inFlight.first();
+        if (write->chunks || write->zeroPacket
+            || write->submitted < write->buffer.dataLen)
+            break;
+
+        m_inFlight.removeFirst();
+        m_inProgress = m_inFlight.count();
+        releaseBuffer(write->buffer);
+        if (!write->result)
+            m_result = false;
+
+        /* Wakes up the transporter if it is waiting for the queue
+         * to drain, and lets it release the interrupt endpoint. */
+        emit dataWritten(write->result);
+        delete write;
+    }
+}
+
+void AioBulkWriterThread::execute()
+{
+    aio_context_t ctx = 0;
+    bool fallback = false;
+
+    int eventFd = eventfd(0, EFD_CLOEXEC);
+    if (eventFd == -1 || sys_io_setup(AIO_REQUESTS_QUEUED, &ctx) == -1) {
+        MTP_LOG_WARNING("kernel AIO not available, using blocking writes: "
+                        << strerror(errno));
+        if (eventFd != -1)
+            close(eventFd);
+        BulkWriterThread::execute();
+        return;
+    }
+
+    /* Lock on entry */
+    m_lock.lock();
+    m_eventFd = eventFd;
+
+    while (!m_shouldExit) {
+        completeWrites_locked(ctx);
+
+        if (!submitWrites_locked(ctx)) {
+            MTP_LOG_WARNING("AIO not supported by endpoint, using blocking writes");
+            fallback = true;
+            break;
+        }
+
+        /* Sleep in unlocked state until a request completes
+         * or more data is queued */
+        m_lock.unlock();
+        eventfd_t value;
+        int rc = eventfd_read(eventFd, &value);
+        int err = errno;
+        m_lock.lock();
+
+        if (rc == -1 && err != EINTR) {
+            MTP_LOG_CRITICAL("exit thread due to eventfd error: " << strerror(err));
+            break;
+        }
+    }
+
+    m_eventFd = -1;
+
+    /* Cancel the requests still in flight and wait for them to finish */
+    m_lock.unlock();
+    sys_io_destroy(ctx);
+    m_lock.lock();
+
+    while (!m_inFlight.isEmpty()) {
+        AioWrite *write = m_inFlight.takeLast();
+        if (fallback && !write->chunks) {
+            /* The endpoint refuses AIO before any of the buffer was
+             * written, so the blocking writes start it over */
+            m_buffers.prepend(write->buffer);
+        } else {
+            releaseBuffer(write->buffer);
+            m_result = false;
+            emit dataWritten(false);
+        }
+        delete write;
+    }
+    m_inProgress = 0;
+    for (int slot = 0; slot < AIO_REQUESTS_QUEUED; slot++)
+        m_slotOwner[slot] = 0;
+
+    /* Unlock before leaving */
+    m_lock.unlock();
+    close(eventFd);
+
+    if (fallback && !m_shouldExit)
+        BulkWriterThread::execute();
+    else
+        flushData(); // nobody is going to write the remaining buffers
+}
@@ -0,0 +1,79 @@
+#ifndef AIOTHREADIO_H
+#define AIOTHREADIO_H
+
+#include "threadio.h"
+
+#include <linux/aio_abi.h>
+
+/* Number of requests kept queued on a bulk endpoint. FunctionFS
+ * turns each of them into a usb_request, so the controller always
+ * has the next transfer at hand when the previous one completes. */
+const int AIO_REQUESTS_QUEUED = 4;
+
+// Bulk OUT reader that keeps several reads queued on the endpoint
+// using the kernel AIO interface supported by FunctionFS. Received
+// data is handed over through the BulkReaderThread buffer. Falls back
+// to blocking reads if kernel AIO is not available.
+class AioBulkReaderThread : public BulkReaderThread {
+    Q_OBJECT
+public:
+    explicit AioBulkReaderThread(QObject *parent = 0,
+                                 int bufferSize = READER_BUFFER_SIZE);
+    ~AioBulkReaderThread();
+
+    // If set, the read size is a maximum: when the endpoint refuses
+    // reads that large, the reader halves the size until it accepts
+    // one, down to MAX_DATA_IN_SIZE, and keeps using that size.
+    void setProbeReadSize(bool probe) { m_probeReadSize = probe; }
+
+protected:
+    virtual void execute();
+
+private:
+    bool submitRead(aio_context_t ctx, int slot);
+    bool probeRead(aio_context_t ctx);
+
+    bool m_probeReadSize;
+    // The AIO reads complete into these, not into the shared buffer,
+    // because a short read would leave a hole in the data stream.
+    char *m_aioBuffer;
+    int m_aioBufferSize;
+    struct iocb m_iocb[AIO_REQUESTS_QUEUED];
+};
+
+// Bulk IN writer that submits queued buffers to the endpoint in
+// advance using the kernel AIO interface supported by FunctionFS.
+// Completions and newly queued buffers are both signalled through
+// an eventfd. Falls back to blocking writes if kernel AIO is not
+// available.
+class AioBulkWriterThread : public BulkWriterThread {
+    Q_OBJECT
+public:
+    explicit AioBulkWriterThread(QObject *parent = 0);
+
+    virtual void interrupt();
+
+protected:
+    virtual void execute();
+    virtual void dataQueued();
+
+private:
+    struct AioWrite {
+        WriteBuffer buffer;
+        quint32 submitted;   // bytes of the buffer submitted so far
+        int chunks;          // requests in flight for this buffer
+        bool zeroPacket;     // a zero length packet is still to be sent
+        bool result;
+    };
+
+    bool submitWrites_locked(aio_context_t ctx);
+    void completeWrites_locked(aio_context_t ctx);
+    void wakeUp_locked();
+
+    int m_eventFd; // protected by m_lock
+    QList<AioWrite *> m_inFlight; // used by the writer thread only
+    struct iocb m_iocb[AIO_REQUESTS_QUEUED];
+    AioWrite *m_slotOwner[AIO_REQUESTS_QUEUED];
+};
+
+#endif
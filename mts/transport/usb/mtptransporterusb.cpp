@@ -42,20 +42,67 @@
 #include <linux/usb/functionfs.h>
 #include "trace.h"
 #include "threadio.h"
+#include "aiothreadio.h"
 #include "mtp1descriptors.h"
+#include "mtpstats.h"
+#include "ptp.h"
 #include <QMutex>
 #include <QCoreApplication>
 
 using namespace meegomtp1dot0;
 
-MTPTransporterUSB::MTPTransporterUSB() : m_ioState(SUSPENDED), m_containerReadLen(0),
+// Size of the buffer for received data, MTP_READER_BUFFER_SIZE overrides.
+// The ring buffer offsets need a power of two, so round up to one.
+static int readerBufferSize()
+{
+    bool ok = false;
+    int size = qgetenv("MTP_READER_BUFFER_SIZE").toInt(&ok);
+    if (!ok || size <= 0)
+        return READER_BUFFER_SIZE;
+
+    int bufferSize = MAX_DATA_IN_SIZE;
+    while (bufferSize < size && bufferSize < MAX_TRANSFER_SIZE * 64)
+        bufferSize *= 2;
+    return bufferSize;
+}
+
+// Size of the bulk transfers, from the environment if set there. The
+// requests must be multiples of the packet size.
+static int transferSize(const char *name, int defaultValue)
+{
+    bool ok = false;
+    int size = qgetenv(name).toInt(&ok);
+    if (!ok || size <= 0)
+        return defaultValue;
+    size = qBound(PTP_HS_DATA_PKT_SIZE, size, MAX_TRANSFER_SIZE);
+    return size - size % PTP_HS_DATA_PKT_SIZE;
+}
+
+MTPTransporterUSB::MTPTransporterUSB(bool useAio) : m_ioState(SUSPENDED), m_containerReadLen(0),
     m_ctrlFd(-1), m_intrFd(-1), m_inFd(-1), m_outFd(-1),
-    m_reader_busy(READER_FREE), m_writer_busy(false), m_events_busy(INTERRUPT_WRITER_IDLE),
+    m_bulkRead(useAio ? new AioBulkReaderThread(this, readerBufferSize())
+                      : new BulkReaderThread(this, readerBufferSize())),
+    m_reader_busy(READER_FREE),
+    m_bulkWrite(useAio ? new AioBulkWriterThread(this) : new BulkWriterThread(this)),
+    m_writer_busy(false), m_writeSize(transferSize("MTP_USB_WRITE_SIZE", MAX_DATA_OUT_SIZE)),
+    m_events_busy(INTERRUPT_WRITER_IDLE),
     m_events_failed(0), m_inSession(false),
     m_storageReady(false),
     m_readerEnabled(false),
     m_responderBusy(true)
 {
+    MTP_LOG_INFO("bulk endpoint I/O using" << (useAio ? "kernel AIO" : "threads"));
+
+    // Probing starts from the largest size allowed, unless one was given
+    bool probe = useAio && !qgetenv("MTP_USB_PROBE").isEmpty();
+    m_bulkRead->setReadSize(transferSize("MTP_USB_READ_SIZE",
+                                         probe ? MAX_TRANSFER_SIZE : MAX_DATA_IN_SIZE));
+    if (probe)
+        static_cast<AioBulkReaderThread*>(m_bulkRead)->setProbeReadSize(true);
+    m_bulkWrite->setWriteSize(m_writeSize);
+    MTP_LOG_INFO("bulk transfers of" << m_bulkRead->readSize() << "/" << m_writeSize
+                 << "bytes" << (probe ? "(probing)" : ""));
+
     // event write cancelation
     m_event_cancel = new QTimer(this);
     m_event_cancel->setInterval(1000);
@@ -69,12 +116,12 @@ MTPTransporterUSB::MTPTransporterUSB() : m_ioState(SUSPENDED), m_containerReadLe
                      Qt::QueuedConnection);
 
     // bulk read data
-    QObject::connect(&m_bulkRead, SIGNAL(dataReady()),
+    QObject::connect(m_bulkRead, SIGNAL(dataReady()),
         this, SLOT(handleDataReady()), Qt::QueuedConnection);
 
-    // bulk write data
-    QObject::connect(&m_bulkWrite, &QThread::finished,
-                     this, &MTPTransporterUSB::handleWriterExit,
+    // bulk write completion
+    QObject::connect(m_bulkWrite, &BulkWriterThread::dataWritten,
+                     this, &MTPTransporterUSB::handleDataWritten,
                      Qt::QueuedConnection);
 
     // event write control
@@ -135,12 +182,17 @@ bool MTPTransporterUSB::writeMtpStrings()
     return false;
 }
 
+int MTPTransporterUSB::openEndpoint(const char *path)
+{
+    return open(path, O_RDWR);
+}
+
 bool MTPTransporterUSB::activate()
 {
     MTP_LOG_CRITICAL("MTPTransporterUSB::activate");
     int success = false;
 
-    m_ctrlFd = open(MTP_EP_PATH_CONTROL, O_RDWR);
+    m_ctrlFd = openEndpoint(MTP_EP_PATH_CONTROL);
     if(-1 == m_ctrlFd)
     {
         MTP_LOG_CRITICAL("Couldn't open control endpoint file " << MTP_EP_PATH_CONTROL);
@@ -186,16 +238,20 @@ bool MTPTransporterUSB::deactivate()
 
 bool MTPTransporterUSB::flushData()
 {
-    bool result = true;
-
     MTP_LOG_CRITICAL("flushData");
 
-    return result;
+    // Drop bulk data that has been queued but not written yet, and
+    // wait for the write in progress (if any) to finish
+    m_bulkWrite->flushData();
+    waitForQueuedData();
+    m_bulkWrite->takeResult();
+
+    return true;
 }
 
 void MTPTransporterUSB::disableRW()
 {
-    m_bulkRead.exitThread();
+    m_bulkRead->exitThread();
 }
 
 void MTPTransporterUSB::enableRW()
@@ -207,15 +263,19 @@ void MTPTransporterUSB::reset()
 {
     MTP_LOG_CRITICAL("reset ...");
 
-    m_bulkRead.exitThread();
-    m_bulkWrite.exitThread();
+    m_bulkRead->exitThread();
+    m_bulkWrite->exitThread();
     m_intrWrite.exitThread();
 
     m_ioState = ACTIVE;
     m_containerReadLen = 0;
-    m_bulkRead.resetData();
+    m_bulkRead->resetData();
+    m_bulkWrite->takeResult();
+    m_bulkWrite->setWriteSize(m_writeSize);
     m_resetCount++;
 
+    if (m_inFd != -1)
+        m_bulkWrite->start();
     m_intrWrite.start();
     startRead();
 
@@ -256,6 +316,26 @@ void MTPTransporterUSB::setEventsBusy(int state)
 
 
 bool MTPTransporterUSB::sendData(const quint8* data, quint32 dataLen, bool isLastPacket)
+{
+    // The buffer belongs to the caller, so it must have been written
+    // out before returning. Anything queued earlier is written first.
+    if (!addBulkData(data, dataLen, isLastPacket, false))
+        return false;
+
+    return waitForQueuedData();
+}
+
+bool MTPTransporterUSB::queueData(quint8* data, quint32 dataLen, bool isLastPacket)
+{
+    return addBulkData(data, dataLen, isLastPacket, true);
+}
+
+bool MTPTransporterUSB::queueMappedData(const quint8* data, quint32 dataLen, bool isLastPacket)
+{
+    return addBulkData(data, dataLen, isLastPacket, false);
+}
+
+bool MTPTransporterUSB::addBulkData(const quint8* data, quint32 dataLen, bool isLastPacket, bool ownBuffer)
 {
     // TODO: can't handle re-entrant calls with the current design.
 
@@ -263,6 +343,8 @@ bool MTPTransporterUSB::sendData(const quint8* data, quint32 dataLen, bool isLas
     {
         // If we get here, packets are be lost and protocol broken
         MTP_LOG_CRITICAL("Refusing recursive bulk write request");
+        if (ownBuffer)
+            delete[] data;
         return false;
     }
     m_writer_busy = true;
@@ -274,6 +356,7 @@ bool MTPTransporterUSB::sendData(const quint8* data, quint32 dataLen, bool isLas
          * especially if the host is not processing intr transfers.
          * Make delays visible in verbose mode to help future tuning. */
         MTP_LOG_INFO("intr writer is busy - wait");
+        qint64 waitStart = MTPStats::enabled() ? MTPStats::now() : 0;
         while (m_events_busy == INTERRUPT_WRITER_BUSY) {
             QCoreApplication::sendPostedEvents();
 
@@ -283,32 +366,55 @@ bool MTPTransporterUSB::sendData(const quint8* data, quint32 dataLen, bool isLas
             QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
         }
         MTP_LOG_INFO("intr writer is idle - continue");
+        if (MTPStats::enabled()) {
+            MTPStats::count(MTPStats::INTERRUPT_WAITS);
+            MTPStats::count(MTPStats::INTERRUPT_WAIT_USECS, MTPStats::now() - waitStart);
+        }
     }
 
-    // Unlike the other IO threads, the bulk writer is only alive
-    // while processing one buffer and then finishes. It all happens
-    // during this call. The reason for the extra thread is to
-    // remain responsive to events while the data is being written.
-    // That's done by calling processEvents while waiting.
+    m_writer_busy = false;
+    MTP_LOG_TRACE("m_writer_busy:" << m_writer_busy);
 
-    m_bulkWrite.setData(data, dataLen, isLastPacket);
-    m_bulkWrite.start();
+    // The bulk writer lives as long as the endpoint is open. If it has
+    // been stopped (e.g. while waiting above), nobody would consume the
+    // buffer and waiting for it would never finish.
+    if (!m_bulkWrite->isRunning())
+    {
+        MTP_LOG_CRITICAL("Bulk writer not running - data dropped");
+        if (ownBuffer)
+            delete[] data;
+        return false;
+    }
 
-    // The bulk writer will make sure that processEvents is woken up
-    // when the result is ready.
-    while(!m_bulkWrite.resultReady()) {
+    m_bulkWrite->addData(data, dataLen, isLastPacket, ownBuffer);
+    return true;
+}
+
+bool MTPTransporterUSB::waitForQueuedData(int maxPending)
+{
+    if(m_writer_busy)
+    {
+        MTP_LOG_CRITICAL("Refusing recursive bulk write wait");
+        return false;
+    }
+    m_writer_busy = true;
+    MTP_LOG_TRACE("m_writer_busy:" << m_writer_busy);
+
+    // The bulk writer emits dataWritten for every buffer it has
+    // consumed, which makes sure that processEvents is woken up.
+    // Waiting this way keeps us responsive to events while the
+    // data is being written.
+    while (m_bulkWrite->pending() > maxPending) {
 
         QCoreApplication::sendPostedEvents();
 
-        if( m_bulkWrite.resultReady() )
+        if (m_bulkWrite->pending() <= maxPending)
             break;
 
         QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
     }
 
-    bool r = m_bulkWrite.getResult();
-
-    m_bulkWrite.wait();
+    bool r = m_bulkWrite->takeResult();
 
     m_writer_busy = false;
     MTP_LOG_TRACE("m_writer_busy:" << m_writer_busy);
@@ -319,6 +425,13 @@ bool MTPTransporterUSB::sendData(const quint8* data, quint32 dataLen, bool isLas
     return r;
 }
 
+quint32 MTPTransporterUSB::preferredSegmentSize() const
+{
+    // Only a write size set for this controller changes the segments,
+    // the responder keeps its own default otherwise
+    return qgetenv("MTP_USB_WRITE_SIZE").isEmpty() ? 0 : m_writeSize;
+}
+
 void MTPTransporterUSB::sessionOpenChanged(bool isOpen)
 {
     if (m_inSession != isOpen) {
@@ -345,6 +458,10 @@ void MTPTransporterUSB::sendQueuedEvent()
     if( m_writer_busy )
         return;
 
+    // Events are interleaved with bulk writes, not mixed into them
+    if( m_bulkWrite->pending() )
+        return;
+
     if( m_responderBusy )
         return;
 
@@ -411,6 +528,7 @@ void MTPTransporterUSB::eventTimeout()
     }
     else {
         ++m_events_failed;
+        MTPStats::count(MTPStats::EVENT_TIMEOUTS);
 
         /* The intr write did not complete in expected time.
          * Log the incident and interrupt the writer thread. */
@@ -472,11 +590,15 @@ void MTPTransporterUSB::eventCompleted(int result)
     }
 }
 
-void MTPTransporterUSB::handleWriterExit()
+void MTPTransporterUSB::handleDataWritten(bool result)
 {
-    /* Nothing to do here. This is just a handler for
-     * dummy signal to get sendData() out of wait loop. */
-    MTP_LOG_TRACE("writer exit");
+    /* Besides getting waitForQueuedData() out of its wait loop,
+     * this gives queued events a chance once the bulk writer
+     * has run out of data. */
+    MTP_LOG_TRACE("bulk write done:" << result);
+
+    if (!m_writer_busy)
+        sendQueuedEvent();
 }
 
 void MTPTransporterUSB::handleDataReady()
@@ -495,7 +617,10 @@ void MTPTransporterUSB::handleDataReady()
 
     do {
         m_reader_busy = READER_BUSY;
-        processReceivedData();
+        // The reader only signals dataReady again after getData has
+        // come back empty, so process everything that has been received.
+        while (processReceivedData())
+            ;
         // Loop because a READER_POSTPONED state means we skipped a dataReady
         // signal, and we have to handle it now.
     } while (m_reader_busy == READER_POSTPONED);
@@ -530,15 +655,18 @@ void MTPTransporterUSB::sendDeviceTxCancelled()
     m_ctrl.setStatus(MTPFS_STATUS_TXCANCEL);
 }
 
-void MTPTransporterUSB::processReceivedData()
+// Returns false if there was no data or the connection was reset
+bool MTPTransporterUSB::processReceivedData()
 {
     char *data;
     int dataLen;
     bool isFirstPacket = false;
     int resetCount = m_resetCount;
 
-    m_bulkRead.getData(&data, &dataLen);
+    m_bulkRead->getData(&data, &dataLen);
     //MTP_LOG_INFO("data=" << (void*)data << "dataLen=" << dataLen);
+    if (dataLen <= 0)
+        return false;
 
     while (dataLen > 0)
     {
@@ -570,14 +698,15 @@ void MTPTransporterUSB::processReceivedData()
         // The connection might have been reset during data handling,
         // which makes the current buffer invalid.
         if (resetCount != m_resetCount)
-            break;
+            return false;
 
         data += chunkLen;
         dataLen -= chunkLen;
         // The dataReceived signal was handled synchronously,
         // so it's safe to release the data now.
-        m_bulkRead.releaseData(chunkLen);
+        m_bulkRead->releaseData(chunkLen);
     }
+    return true;
 }
 
 void MTPTransporterUSB::openDevices()
@@ -585,24 +714,28 @@ void MTPTransporterUSB::openDevices()
     m_ioState = ACTIVE;
     MTP_LOG_INFO("MTP opening endpoint devices");
 
-    m_inFd = open(MTP_EP_PATH_IN, O_RDWR);
+    m_inFd = openEndpoint(MTP_EP_PATH_IN);
     if(-1 == m_inFd)
     {
         MTP_LOG_CRITICAL("Couldn't open IN endpoint file " << MTP_EP_PATH_IN);
     } else {
-        m_bulkWrite.setFd(m_inFd);
+        m_bulkWrite->setFd(m_inFd);
+        m_bulkWrite->takeResult();
+        // Writes may have been limited on the endpoint closed before
+        m_bulkWrite->setWriteSize(m_writeSize);
+        m_bulkWrite->start();
     }
 
-    m_outFd = open(MTP_EP_PATH_OUT, O_RDWR);
+    m_outFd = openEndpoint(MTP_EP_PATH_OUT);
     if(-1 == m_outFd)
     {
         MTP_LOG_CRITICAL("Couldn't open OUT endpoint file " << MTP_EP_PATH_OUT);
     } else {
-        m_bulkRead.setFd(m_outFd);
+        m_bulkRead->setFd(m_outFd);
         startRead();
     }
 
-    m_intrFd = open(MTP_EP_PATH_INTERRUPT, O_RDWR);
+    m_intrFd = openEndpoint(MTP_EP_PATH_INTERRUPT);
     if(-1 == m_intrFd)
     {
         MTP_LOG_CRITICAL("Couldn't open INTR endpoint file " << MTP_EP_PATH_INTERRUPT);
@@ -617,8 +750,8 @@ void MTPTransporterUSB::closeDevices()
     MTP_LOG_INFO("MTP closing endpoint devices");
     m_ioState = SUSPENDED;
 
-    m_bulkRead.exitThread();
-    m_bulkWrite.exitThread();
+    m_bulkRead->exitThread();
+    m_bulkWrite->exitThread();
     m_intrWrite.exitThread();
 
     stopRead();
@@ -626,12 +759,12 @@ void MTPTransporterUSB::closeDevices()
 
     if(m_outFd != -1) {
         close(m_outFd);
-        m_bulkWrite.setFd(-1);
+        m_bulkWrite->setFd(-1);
         m_outFd = -1;
     }
     if(m_inFd != -1) {
         close(m_inFd);
-        m_bulkRead.setFd(-1);
+        m_bulkRead->setFd(-1);
         m_inFd = -1;
     }
     if(m_intrFd != -1) {
@@ -646,7 +779,7 @@ void MTPTransporterUSB::rethinkRead()
     if (m_readerEnabled) {
         if (m_storageReady) {
             MTP_LOG_TRACE("start bulk reader");
-            m_bulkRead.start();
+            m_bulkRead->start();
         } else {
             MTP_LOG_TRACE("delay bulk reader");
         }
@@ -666,7 +799,7 @@ void MTPTransporterUSB::stopRead()
     m_readerEnabled = false;
     emit cleanup();
     m_containerReadLen = 0;
-    m_bulkRead.resetData();
+    m_bulkRead->resetData();
     m_resetCount++;
 }
 
@@ -48,7 +48,12 @@ class MTPTransporterUSB : public MTPTransporter
     Q_OBJECT
     public:
         /// The MTPTransporterUSB constructor
-        MTPTransporterUSB();
+        /// \param useAio [in] If true, the bulk endpoints are served with kernel AIO, keeping several
+        /// requests queued on each of them. Otherwise (or if AIO turns out not to be available) blocking
+        /// I/O threads are used.
+        /// The sizes of the bulk transfers can be set with MTP_USB_READ_SIZE and MTP_USB_WRITE_SIZE. If
+        /// MTP_USB_PROBE is set and AIO is used, the read size is lowered to what the controller accepts.
+        explicit MTPTransporterUSB(bool useAio = false);
 
         /// The MTPTransporterUSB destructor
         ~MTPTransporterUSB();
@@ -61,6 +66,25 @@ class MTPTransporterUSB : public MTPTransporter
         /// \return Returns true if write to the USB FD was a success, else false.
         bool sendData(const quint8* data, quint32 len, bool isLastPacket = true);
 
+        /// Queues data for the bulk writer without waiting for it to be written.
+        /// \param data [in] The buffer of data to be sent, allocated with new[]. The transporter takes ownership of it.
+        /// \param len [in] The length of the data buffer in bytes.
+        /// \param isLastPacket [in] If true, the transfer is terminated with a short packet if needed.
+        /// \return Returns false if the bulk writer is not running.
+        bool queueData(quint8* data, quint32 len, bool isLastPacket = true);
+
+        /// Queues data for the bulk writer without taking ownership of the buffer.
+        /// \param data [in] The buffer of data to be sent. It must remain valid until waitForQueuedData(0) has returned.
+        /// \return Returns false if the bulk writer is not running.
+        bool queueMappedData(const quint8* data, quint32 len, bool isLastPacket = true);
+
+        /// Waits until at most maxPending queued buffers remain unwritten.
+        /// \return Returns false if any write failed since the previous call.
+        bool waitForQueuedData(int maxPending = 0);
+
+        /// Returns the size of the writes to the bulk IN endpoint if MTP_USB_WRITE_SIZE sets it, 0 otherwise.
+        quint32 preferredSegmentSize() const;
+
         /// Sends data (an MTP event container) to the initiator. The function must be synchronous.
         /// \param data [in] The buffer of data to be sent. The buffer is assumed to be allocated by the caller, and will not be modified.
         /// \param len [in] The length of the data buffer in bytes.
@@ -103,11 +127,19 @@ class MTPTransporterUSB : public MTPTransporter
             INTERRUPT_WRITER_DISABLED,
         };
 
+    protected:
+        /// Opens the FunctionFS file of an endpoint.
+        /// \param path [in] One of the MTP_EP_PATH_* paths.
+        /// \return The file descriptor, or -1 on failure.
+        virtual int openEndpoint(const char *path);
+
     private:
-        void processReceivedData();  // Helper function for handleDataReady()
+        bool processReceivedData();  // Helper function for handleDataReady()
         bool writeMtpDescriptors();  // configure the USB endpoints for functionfs
         bool writeMtpStrings();      // step 2 of functionfs configuration
         void sendQueuedEvent();      // Buffering happens at sendEvent()
+        bool addBulkData(const quint8* data, quint32 len,
+                         bool isLastPacket, bool ownBuffer); // Queue for m_bulkWrite
 
         enum IOState{
             ACTIVE,
@@ -133,11 +165,12 @@ class MTPTransporterUSB : public MTPTransporter
 
         ControlReaderThread     m_ctrl;         ///< Threaded IO for Control EP
 
-        BulkReaderThread        m_bulkRead;     ///< Threaded Reader for Bulk Out EP
+        BulkReaderThread       *m_bulkRead;     ///< Threaded Reader for Bulk Out EP
         ReaderBusyState         m_reader_busy;
 
-        BulkWriterThread        m_bulkWrite;    ///< Threaded Writer for Bulk In EP
-        bool                    m_writer_busy;
+        BulkWriterThread       *m_bulkWrite;    ///< Threaded Writer for Bulk In EP
+        bool                    m_writer_busy;  ///< Waiting for the bulk writer
+        quint32                 m_writeSize;    ///< Maximum size of the bulk writes
 
         InterruptWriterThread   m_intrWrite;    ///< Threaded Writer for Interrupt EP
         InterruptWriterState    m_events_busy;
@@ -184,7 +217,7 @@ class MTPTransporterUSB : public MTPTransporter
         void handleDataReady();
 
         // Handle outgoing data from m_bulkWrite
-        void handleWriterExit();
+        void handleDataWritten(bool result);
 
         /// Handle high priority requests from the underlying transport driver.
         void handleHighPriorityData();
@@ -3,12 +3,17 @@
 #include <QMutex>
 #include <QMutexLocker>
 #include <errno.h>
+#include <string.h>
 #include <pthread.h>
 #include <signal.h>
 #include <endian.h>
 #include <unistd.h>
 
 #include "trace.h"
+#include "mtpstats.h"
+#include "mtptypes.h"
+
+using meegomtp1dot0::MTPStats;
 
 #define MTP_READ(fd,buf,len,log_success) ({\
     if( (log_success) ) {\
@@ -45,7 +50,6 @@
     errno = saved, rc;\
 })
 
-const int MAX_DATA_IN_SIZE = 16 * 1024;  // Matches USB transfer size
 const int MAX_CONTROL_IN_SIZE = 64;
 
 /* Maximum number of events to queue for sending via the interrupt
@@ -54,14 +58,11 @@ const int MAX_CONTROL_IN_SIZE = 64;
  * too large value can hamper bulk io throughput if the host side
  * does not purge the queued events fast enough -> assume being able
  * to hold and transfer events resulting from things like deleting
- * few hundred files is enough. */
+ * few hundred files is enough. Repeated events for the same object
+ * are coalesced, and when the queue still fills up, it is replaced
+ * by a single UnreportedStatus event telling the host to refresh. */
 const int MAX_EVENTS_STORED = 512;
 
-// Give BulkReaderThread some space to acquire chunks while the main
-// thread is working, but still small enough for the main thread to
-// process as one event.
-const int READER_BUFFER_SIZE = MAX_DATA_IN_SIZE * 16;
-
 const struct ptp_device_status_data status_data[] = {
 /* OK     */ { htole16(0x0004),
                htole16(PTP_RC_OK), 0, 0 },
@@ -299,11 +300,11 @@ void ControlReaderThread::setupRequest(void *data)
 }
 
 
-BulkReaderThread::BulkReaderThread(QObject *parent)
-    : IOThread(parent)
+BulkReaderThread::BulkReaderThread(QObject *parent, int bufferSize)
+    : IOThread(parent), m_buffer(0), m_bufferSize(0),
+      m_minBufferSize(bufferSize), m_readSize(0)
 {
-    m_buffer = new char[READER_BUFFER_SIZE];
-    resetData();
+    setReadSize(MAX_DATA_IN_SIZE);
 }
 
 BulkReaderThread::~BulkReaderThread()
@@ -311,70 +312,140 @@ BulkReaderThread::~BulkReaderThread()
     delete[] m_buffer;
 }
 
-// Should be called by the receiver thread while the reader is not running
-void BulkReaderThread::resetData()
+void BulkReaderThread::setReadSize(int readSize)
 {
-    m_dataStart = 0;
-    m_dataSize1 = 0;
-    m_dataSize2 = 0;
-}
+    // See the class definition for why this is a power of two. The
+    // read size need not be one, so round up from whichever is larger.
+    int bufferSize = 1;
+    while (bufferSize < 2 * readSize || bufferSize < m_minBufferSize)
+        bufferSize *= 2;
 
-// Find a usable place in m_buffer to read MAX_DATA_IN_SIZE bytes.
-// Return -1 if there's no space.
-int BulkReaderThread::_getOffset_locked()
-{
-    // See the class definition for the story of how m_buffer is handled.
-    if (READER_BUFFER_SIZE - (m_dataStart + m_dataSize1) >= MAX_DATA_IN_SIZE)
-        return m_dataStart + m_dataSize1;
-    if (m_dataStart - m_dataSize2 >= MAX_DATA_IN_SIZE)
-        return m_dataSize2;
-    return -1;
+    m_readSize = readSize;
+    if (bufferSize > m_bufferSize) {
+        delete[] m_buffer;
+        m_bufferSize = bufferSize;
+        m_buffer = new char[m_bufferSize];
+        resetData();
+    }
 }
 
-bool BulkReaderThread::_markNewData(int offset, int size)
+// Used by AioBulkReaderThread, and by the owner to hand back data
+// that was read from the endpoint while the reader was not running.
+bool BulkReaderThread::storeData(const char *data, int size)
 {
-    QMutexLocker locker(&m_bufferLock);
+    while (size > 0) {
+        int chunk = qMin(size, m_readSize);
 
-    // See the class definition for the story of how m_buffer is handled.
-    // If nobody messed up then 'offset' should be pointing to the
-    // end of one of the buffer pieces.
+        /* Wait for a read offset */
+        char *buffer = _acquireSpace();
 
-    if (offset == m_dataStart + m_dataSize1)
-        m_dataSize1 += size;
-    else if (offset == m_dataSize2)
-        m_dataSize2 += size;
-    else
-        return false;
+        /* Check if thread exit has been requested */
+        if (!buffer)
+            return false;
+
+        memcpy(buffer, data, chunk);
+
+        /* Hand the data over to the main thread */
+        _publishData(chunk);
+        data += chunk;
+        size -= chunk;
+    }
     return true;
 }
 
-void BulkReaderThread::execute()
+// Should be called by the receiver thread while the reader is not running
+void BulkReaderThread::resetData()
 {
-    int readSize;
-
-    while (!m_shouldExit) {
-        int offset;
+    m_written.store(0);
+    m_read.store(0);
+    m_wrapOffset = m_bufferSize;
+    m_readerWaiting.store(0);
+    m_wakeAt.store(0);
+    // The main thread has no data yet, so it wants to hear of the first
+    m_notifyData.store(1);
+}
 
-        /* Wait for read offset in locked state */
-        m_bufferLock.lock();
-        offset = _getOffset_locked();
-        while (!m_shouldExit && offset < 0) {
+// Called by the reader thread to find a usable place in m_buffer to
+// read m_readSize bytes. Returns 0 if the thread should exit.
+char *BulkReaderThread::_acquireSpace()
+{
+    // See the class definition for the story of how m_buffer is handled.
+    quint32 written = m_written.load();
+    quint32 offset = written & (m_bufferSize - 1);
+    quint32 needed = m_readSize;
+
+    // Not enough room before the end, skip the rest of the buffer
+    if (m_bufferSize - offset < (quint32)m_readSize)
+        needed += m_bufferSize - offset;
+
+    if (written - quint32(m_read.loadAcquire()) + needed > (quint32)m_bufferSize) {
+        // Wait for room for a few more reads, not just the next one, so
+        // that each piece of data released doesn't wake this thread.
+        quint32 slack = qMin(m_bufferSize / 4, m_bufferSize - (int)needed);
+        quint32 wakeAt = written - (m_bufferSize - needed - slack);
+
+        QMutexLocker locker(&m_bufferLock);
+        m_wakeAt.store(wakeAt);
+        for (;;) {
+            /* Ask for a wakeup before checking again, so that a
+             * releaseData() in between can't be missed */
+            m_readerWaiting.fetchAndStoreOrdered(1);
+            if (m_shouldExit ||
+                qint32(quint32(m_read.fetchAndAddOrdered(0)) - wakeAt) >= 0)
+                break;
             /* Expectation: Waiting should not be required except when
              * transferring large files and file system writes can't
              * keep up with usb transfer speed -> log in verbose mode. */
             MTP_LOG_INFO("waiting ...");
+            MTPStats::count(MTPStats::READER_BUFFER_FULL);
             m_wait.wait(&m_bufferLock);
             MTP_LOG_INFO("woke up");
-            offset = _getOffset_locked();
         }
-        m_bufferLock.unlock();
+        m_readerWaiting.store(0);
+    }
+
+    if (m_shouldExit)
+        return 0;
+
+    if (needed > (quint32)m_readSize) {
+        m_wrapOffset = offset;
+        m_written.fetchAndAddOrdered(m_bufferSize - offset);
+        offset = 0;
+    }
+    return m_buffer + offset;
+}
+
+// Called by the reader thread after reading size bytes into the place
+// returned by _acquireSpace().
+void BulkReaderThread::_publishData(int size)
+{
+    quint32 written = m_written.load();
+
+    // Data that ends exactly at the end of the buffer wraps too
+    if ((written & (m_bufferSize - 1)) + size == (quint32)m_bufferSize)
+        m_wrapOffset = m_bufferSize;
+    m_written.fetchAndAddOrdered(size);
+
+    /* Notify responder about available data, unless it is still busy
+     * with earlier data and will find this data by itself */
+    if (m_notifyData.fetchAndStoreOrdered(0))
+        emit dataReady();
+}
+
+void BulkReaderThread::execute()
+{
+    int readSize;
+
+    while (!m_shouldExit) {
+        /* Wait for a read offset */
+        char *buffer = _acquireSpace();
 
         /* Check if thread exit has been requested */
-        if (m_shouldExit)
+        if (!buffer)
             break;
 
         /* Do a blocking read */
-        readSize = MTP_READ(m_fd, m_buffer + offset, MAX_DATA_IN_SIZE, false);
+        readSize = MTP_READ(m_fd, buffer, m_readSize, false);
 
         /* Check if thread exit has been requested */
         if (m_shouldExit)
@@ -389,6 +460,7 @@ void BulkReaderThread::execute()
             }
 
             if (errno == EAGAIN || errno == ESHUTDOWN) {
+                MTPStats::count(MTPStats::READER_RETRIES);
                 msleep(1);
                 continue;
             }
@@ -398,15 +470,9 @@ void BulkReaderThread::execute()
             break;
         }
 
-        /* Update data availability in locked state */
-        if (!_markNewData(offset, readSize)) {
-            MTP_LOG_CRITICAL("exit thread due to bad offset:" << offset
-                             << m_dataStart << m_dataSize1 << m_dataSize2);
-            break;
-        }
-
-        /* Notify responder about available data */
-        emit dataReady();
+        /* Hand the data over to the main thread */
+        if (readSize > 0)
+            _publishData(readSize);
     }
 }
 
@@ -415,23 +481,37 @@ void BulkReaderThread::execute()
 // released with releaseData().
 void BulkReaderThread::getData(char **bufferp, int *size)
 {
-    QMutexLocker locker(&m_bufferLock);
+    for (;;) {
+        quint32 read = m_read.load();
+        quint32 available = quint32(m_written.loadAcquire()) - read;
 
-    if (m_dataSize1 == 0 && m_dataSize2 > 0) {
-        // The primary data area has been consumed and the reader has
-        // already started filling the secondary data area, which means
-        // it's safe to switch over.
-        m_dataStart = 0;
-        m_dataSize1 = m_dataSize2;
-        m_dataSize2 = 0;
-    }
+        if (available == 0) {
+            // Ask for a dataReady signal, then check again in case the
+            // reader added data before it could see the request.
+            m_notifyData.fetchAndStoreOrdered(1);
+            available = quint32(m_written.fetchAndAddOrdered(0)) - read;
+        }
 
-    if (m_dataSize1 > 0) {
-        *bufferp = m_buffer + m_dataStart;
-        *size = m_dataSize1;
-    } else {
-        *bufferp = 0;
-        *size = 0;
+        if (available == 0) {
+            *bufferp = 0;
+            *size = 0;
+            return;
+        }
+
+        quint32 offset = read & (m_bufferSize - 1);
+        if (available >= m_bufferSize - offset) {
+            // The reader has wrapped around, so the data here ends
+            // where it left off.
+            available = m_wrapOffset - offset;
+            if (available == 0) {
+                releaseData(m_bufferSize - offset);
+                continue;
+            }
+        }
+
+        *bufferp = m_buffer + offset;
+        *size = available;
+        return;
     }
 }
 
@@ -439,57 +519,114 @@ void BulkReaderThread::getData(char **bufferp, int *size)
 // data in m_buffer.
 void BulkReaderThread::releaseData(int size)
 {
-    QMutexLocker locker(&m_bufferLock);
-    m_dataStart += size;
-    m_dataSize1 -= size;
-    if (m_dataSize1 == 0 && m_dataSize2 > 0) {
-        // The primary data area has been consumed and the reader has
-        // already started filling the secondary data area, which means
-        // it's safe to switch over.
-        m_dataStart = 0;
-        m_dataSize1 = m_dataSize2;
-        m_dataSize2 = 0;
+    quint32 read = quint32(m_read.fetchAndAddOrdered(size)) + size;
+
+    // Only wake the reader once it has room to go on
+    if (m_readerWaiting.fetchAndAddOrdered(0) &&
+        qint32(read - quint32(m_wakeAt.load())) >= 0 &&
+        m_readerWaiting.fetchAndStoreOrdered(0)) {
+        QMutexLocker locker(&m_bufferLock);
+        m_wait.wakeAll();
     }
-    m_wait.wakeAll();
 }
 
 void BulkReaderThread::interrupt() // Executed in main thread
 {
     IOThread::interrupt();  // wake up the thread if it's in read()
+
+    QMutexLocker locker(&m_bufferLock);
     m_wait.wakeAll(); // wake up the thread if it's in m_wait.wait()
 }
 
 BulkWriterThread::BulkWriterThread(QObject *parent)
-    : IOThread(parent)
+    : IOThread(parent), m_inProgress(0), m_result(true),
+      m_writeMax(MAX_DATA_OUT_SIZE)
 {
-    // Connect the finished signal (emitted from the writer thread) to
-    // a do-nothing slot (received in the transporter's thread) in order to
-    // make sure that sendData() in the transporter is woken up after the
-    // result is ready. This way sendData doesn't have to poll.
-    connect(this, SIGNAL(finished()), SLOT(quit()), Qt::QueuedConnection);
 }
 
-void BulkWriterThread::setData(const quint8 *buffer, quint32 dataLen, bool terminateTransfer)
+void BulkWriterThread::setWriteSize(quint32 writeSize)
 {
-    // This runs in the main thread. The caller makes sure that the
-    // writer thread is not running yet.
+    // Also forgets a limit found by writeBuffer(), the new size was
+    // presumably chosen for this controller
+    m_writeMax = writeSize;
+}
 
-    m_buffer = buffer;
-    m_dataLen = dataLen;
-    m_terminateTransfer = terminateTransfer;
-    m_result = false;
-    m_result_ready = (0);
+BulkWriterThread::~BulkWriterThread()
+{
+    flushData();
 }
 
-void BulkWriterThread::execute()
+void BulkWriterThread::addData(const quint8 *buffer, quint32 dataLen,
+                               bool terminateTransfer, bool ownBuffer)
+{
+    // This runs in the main thread. The writer thread keeps running
+    // for as long as the endpoint is open and picks up buffers in the
+    // order they were queued, so that the next segment of a transfer
+    // is already waiting when the previous write completes.
+    QMutexLocker locker(&m_lock);
+
+    WriteBuffer item;
+    item.data = buffer;
+    item.dataLen = dataLen;
+    item.terminateTransfer = terminateTransfer;
+    item.ownBuffer = ownBuffer;
+    m_buffers.append(item);
+
+    dataQueued();
+}
+
+void BulkWriterThread::dataQueued()
+{
+    m_wait.wakeAll();
+}
+
+int BulkWriterThread::pending()
+{
+    QMutexLocker locker(&m_lock);
+    return m_buffers.count() + m_inProgress;
+}
+
+void BulkWriterThread::flushData()
 {
-    // Maximum length of individual writes
-    static quint32 writeMax = 64 << 10;
+    QMutexLocker locker(&m_lock);
+    releaseQueued_locked();
+}
 
-    // Call setData before starting the thread.
+void BulkWriterThread::releaseQueued_locked()
+{
+    while (m_buffers.count()) {
+        releaseBuffer(m_buffers.takeFirst());
+        m_result = false;
+    }
+}
 
+bool BulkWriterThread::takeResult()
+{
+    QMutexLocker locker(&m_lock);
+    bool result = m_result;
+    m_result = true;
+    return result;
+}
+
+void BulkWriterThread::releaseBuffer(const WriteBuffer &buffer)
+{
+    if (buffer.ownBuffer)
+        delete[] buffer.data;
+}
+
+void BulkWriterThread::interrupt() // Executed in main thread
+{
+    IOThread::interrupt();  // wake up the thread if it's in write()
+
+    QMutexLocker locker(&m_lock);
+    m_wait.wakeAll(); // wake up the thread if it's in m_wait.wait()
+}
+
+bool BulkWriterThread::writeBuffer(const WriteBuffer &buffer)
+{
     int bytesWritten = 0;
-    char *dataptr = (char*)m_buffer;
+    char *dataptr = (char*)buffer.data;
+    quint32 dataLen = buffer.dataLen;
     // PTP compatibility requires that a transfer is terminated by a
     // "short packet" (a packet of less than maximum length). This
     // happens naturally for most transfers, but if the transfer size
@@ -499,17 +636,19 @@ void BulkWriterThread::execute()
     // packet size, which is generally not a problem because powers
     // of two are used.
     // TODO: Get the real packet size from the kernel
-    bool zeropacket = m_terminateTransfer && m_dataLen % PTP_HS_DATA_PKT_SIZE == 0;
+    bool zeropacket = buffer.terminateTransfer && dataLen % PTP_HS_DATA_PKT_SIZE == 0;
 
-    while ((m_dataLen || zeropacket) && !m_shouldExit) {
-        quint32 writeNow = (m_dataLen < writeMax) ? m_dataLen : writeMax;
+    while ((dataLen || zeropacket) && !m_shouldExit) {
+        quint32 writeNow = (dataLen < m_writeMax) ? dataLen : m_writeMax;
         bytesWritten = MTP_WRITE(m_fd, dataptr, writeNow, false);
         if(bytesWritten == -1)
         {
-            if(errno == EIO && writeMax > PTP_HS_DATA_PKT_SIZE )
+            if(errno == EIO && m_writeMax > PTP_HS_DATA_PKT_SIZE )
             {
-                writeMax >>= 1;
-                MTP_LOG_WARNING("BulkWriterThread limit writes to: " << writeMax);
+                // Maximum length of individual writes
+                m_writeMax >>= 1;
+                MTP_LOG_WARNING("BulkWriterThread limit writes to: " << m_writeMax);
+                MTPStats::count(MTPStats::WRITER_BACKOFFS);
                 continue;
             }
             if(errno == EINTR)
@@ -517,6 +656,7 @@ void BulkWriterThread::execute()
             if(errno == EAGAIN)
             {
                 MTP_LOG_WARNING("BulkWriterThread delaying: errno " << errno);
+                MTPStats::count(MTPStats::WRITER_RETRIES);
                 msleep(1);
                 continue;
             }
@@ -524,35 +664,61 @@ void BulkWriterThread::execute()
             {
                 // After a shutdown, the host won't expect this data anymore,
                 // so drop it and report failure.
-                MTP_LOG_WARNING("BulkWriterThread exiting (endpoint shutdown)");
+                MTP_LOG_WARNING("BulkWriterThread dropping buffer (endpoint shutdown)");
                 break;
             }
-            MTP_LOG_CRITICAL("BulkWriterThread exiting: errno " << errno);
+            MTP_LOG_CRITICAL("BulkWriterThread dropping buffer: errno " << errno);
             break;
         }
-        if (m_dataLen == 0)
+        if (dataLen == 0)
             zeropacket = false;
         dataptr += bytesWritten;
-        m_dataLen -= bytesWritten;
+        dataLen -= bytesWritten;
     }
 
-    m_result = m_dataLen == 0;
-    m_result_ready.fetchAndStoreRelease(1);
+    return dataLen == 0;
 }
 
-bool BulkWriterThread::resultReady()
+void BulkWriterThread::execute()
 {
-    return m_result_ready != 0;
-}
+    /* Lock on entry */
+    m_lock.lock();
 
-bool BulkWriterThread::getResult()
-{
-    // Check resultReady() before calling getResult()
-    return m_result;
+    while (!m_shouldExit) {
+        if (m_buffers.isEmpty()) {
+            /* Waiting happens in locked state, but the lock is
+             * released for the duration of the wait itself. */
+            m_wait.wait(&m_lock);
+            continue;
+        }
+
+        WriteBuffer buffer = m_buffers.takeFirst();
+        m_inProgress = 1;
+
+        /* Do IO in unlocked state */
+        m_lock.unlock();
+        bool result = writeBuffer(buffer);
+        m_lock.lock();
+
+        releaseBuffer(buffer);
+        m_inProgress = 0;
+        if (!result)
+            m_result = false;
+
+        /* Wakes up the transporter if it is waiting for the queue
+         * to drain, and lets it release the interrupt endpoint. */
+        emit dataWritten(result);
+    }
+
+    /* Nobody is going to write the remaining buffers anymore */
+    releaseQueued_locked();
+
+    /* Unlock before leaving */
+    m_lock.unlock();
 }
 
 InterruptWriterThread::InterruptWriterThread(QObject *parent)
-    : IOThread(parent), m_eventBufferFull(false)
+    : IOThread(parent), m_refreshQueued(false)
 {
 }
 
@@ -583,38 +749,143 @@ void InterruptWriterThread::flushData()
         QPair<quint8*,int> pair = m_buffers.takeFirst();
         free(pair.first);
     }
+    m_refreshQueued = false;
+}
+
+/* Event containers are queued as sent: the header is followed by the
+ * parameters, the first one is the object handle or storage id. */
+static quint16 eventCode(const quint8 *data, int dataLen)
+{
+    quint16 code = 0;
+    if(dataLen >= 8) {
+        memcpy(&code, data + 6, sizeof code);
+    }
+    return le16toh(code);
+}
+
+static quint32 eventParam(const quint8 *data, int dataLen, int index)
+{
+    quint32 param = 0;
+    int offset = MTP_HEADER_SIZE + index * sizeof param;
+    if(dataLen >= offset + (int)sizeof param) {
+        memcpy(&param, data + offset, sizeof param);
+    }
+    return le32toh(param);
+}
+
+static bool sameObject(const QPair<quint8*,int> &event, quint32 handle)
+{
+    return eventParam(event.first, event.second, 0) == handle;
 }
 
 void InterruptWriterThread::addData(const quint8 *buffer, quint32 dataLen)
 {
     QMutexLocker locker(&m_lock);
 
-    quint8 *copy = (quint8*)malloc(dataLen);
-    if(copy == NULL) {
-        MTP_LOG_CRITICAL("Couldn't allocate memory for events");
+    /* The host re-reads everything once it gets to a queued refresh,
+     * so whatever happens in the meantime need not be reported. */
+    if(m_refreshQueued) {
+        MTPStats::count(MTPStats::EVENTS_COALESCED);
         return;
     }
-    memcpy(copy, buffer, dataLen);
 
-    // This is here in case the interrupt writing thread cannot keep up
-    // with the events. It removes the oldest events.
+    quint16 code = eventCode(buffer, dataLen);
+    quint32 param = eventParam(buffer, dataLen, 0);
+
+    /* Coalesce with the events still in the queue. The one being
+     * written, if any, has already been taken out of it. */
+    switch(code) {
+    case MTP_EV_ObjectInfoChanged:
+    case MTP_EV_ObjectPropChanged:
+        /* The host fetches the info or property when it gets the first
+         * event, and reads everything for objects it has not seen yet */
+        for(int i = 0; i < m_buffers.count(); i++) {
+            const QPair<quint8*,int> &event = m_buffers.at(i);
+            quint16 queued = eventCode(event.first, event.second);
+            if(!sameObject(event, param)) {
+                continue;
+            }
+            if(queued == MTP_EV_ObjectAdded ||
+               (queued == code && (code == MTP_EV_ObjectInfoChanged ||
+                                   eventParam(event.first, event.second, 1) ==
+                                   eventParam(buffer, dataLen, 1)))) {
+                MTPStats::count(MTPStats::EVENTS_COALESCED);
+                return;
+            }
+        }
+        break;
+    case MTP_EV_StorageInfoChanged:
+        for(int i = 0; i < m_buffers.count(); i++) {
+            const QPair<quint8*,int> &event = m_buffers.at(i);
+            if(eventCode(event.first, event.second) == code && sameObject(event, param)) {
+                MTPStats::count(MTPStats::EVENTS_COALESCED);
+                return;
+            }
+        }
+        break;
+    case MTP_EV_ObjectRemoved: {
+        /* Changes to the object are moot, and if the host has not been
+         * told about it yet, it does not need to know at all. */
+        bool unseen = false;
+        for(int i = m_buffers.count() - 1; i >= 0; i--) {
+            const QPair<quint8*,int> &event = m_buffers.at(i);
+            quint16 queued = eventCode(event.first, event.second);
+            if((queued == MTP_EV_ObjectAdded ||
+                queued == MTP_EV_ObjectInfoChanged ||
+                queued == MTP_EV_ObjectPropChanged) && sameObject(event, param)) {
+                unseen = unseen || queued == MTP_EV_ObjectAdded;
+                free(event.first);
+                m_buffers.removeAt(i);
+                MTPStats::count(MTPStats::EVENTS_COALESCED);
+            }
+        }
+        if(unseen) {
+            MTPStats::count(MTPStats::EVENTS_COALESCED);
+            return;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    /* This is here in case the interrupt writing thread cannot keep up
+     * with the events. Rather than dropping some of them and leaving the
+     * host out of sync, replace them all with a request to refresh. */
     if(m_buffers.count() >= MAX_EVENTS_STORED) {
-        if( !m_eventBufferFull ) {
-            m_eventBufferFull = true;
-            MTP_LOG_CRITICAL("event buffer full - events will be lost");
+        MTP_LOG_WARNING("event buffer full - asking the host to refresh");
+        MTPStats::count(MTPStats::EVENTS_COALESCED, m_buffers.count() + 1);
+        MTPStats::count(MTPStats::EVENT_REFRESHES);
+
+        while(m_buffers.count()) {
+            free(m_buffers.takeFirst().first);
         }
 
-        do {
-            QPair<quint8*,int> pair = m_buffers.takeFirst();
-            free(pair.first);
-        } while(m_buffers.count() >= MAX_EVENTS_STORED);
-    }
-    else {
-        if( m_eventBufferFull ) {
-            m_eventBufferFull = false;
-            MTP_LOG_CRITICAL("event buffer no longer full");
+        quint32 length = htole32(MTP_HEADER_SIZE);
+        quint16 type = htole16(MTP_CONTAINER_TYPE_EVENT);
+        quint16 refresh = htole16(MTP_EV_UnreportedStatus);
+        quint32 transactionId = htole32(MTP_NO_TRANSACTION_ID);
+
+        quint8 *copy = (quint8*)malloc(MTP_HEADER_SIZE);
+        if(copy == NULL) {
+            MTP_LOG_CRITICAL("Couldn't allocate memory for events");
+            return;
         }
+        memcpy(copy, &length, sizeof length);
+        memcpy(copy + 4, &type, sizeof type);
+        memcpy(copy + 6, &refresh, sizeof refresh);
+        memcpy(copy + 8, &transactionId, sizeof transactionId);
+        m_buffers.append(QPair<quint8*,int>(copy, MTP_HEADER_SIZE));
+        m_refreshQueued = true;
+        return;
+    }
+
+    quint8 *copy = (quint8*)malloc(dataLen);
+    if(copy == NULL) {
+        MTP_LOG_CRITICAL("Couldn't allocate memory for events");
+        return;
     }
+    memcpy(copy, buffer, dataLen);
 
     /* Note that we just buffer the event data here, the
      * actual transfer is interleaved with bulk writes. */
@@ -654,6 +925,8 @@ void InterruptWriterThread::execute()
             QPair<quint8*,int> pair = m_buffers.takeFirst();
             dataptr = pair.first;
             dataLen = pair.second;
+            /* A queued refresh is the only event in the queue */
+            m_refreshQueued = false;
         }
 
         if( !dataptr || !dataLen ) {
@@ -717,9 +990,10 @@ void InterruptWriterThread::reset()
 
     QPair<quint8*,int> item;
     foreach(item, m_buffers) {
-        delete item.first;
+        free(item.first);
     }
     m_buffers.clear();
+    m_refreshQueued = false;
 }
 
 void InterruptWriterThread::interrupt()
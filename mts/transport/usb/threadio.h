@@ -9,6 +9,21 @@
 #include <QPair>
 #include <QList>
 #include <QWaitCondition>
+#include <QAtomicInt>
+
+#include <pthread.h>
+
+// Default request sizes of the bulk endpoints. The reads match the
+// maximum request size of ci13xxx_udc.c, which the bulk writer finds
+// out by itself by halving its requests when they fail.
+const int MAX_DATA_IN_SIZE = 16 * 1024;
+const int MAX_DATA_OUT_SIZE = 64 * 1024;
+// Upper limit for configured and probed request sizes
+const int MAX_TRANSFER_SIZE = 1024 * 1024;
+
+// Give BulkReaderThread some space to acquire chunks while the main
+// thread is working.
+const int READER_BUFFER_SIZE = MAX_DATA_IN_SIZE * 64;
 
 enum mtpfs_status {
     MTPFS_STATUS_OK,
@@ -34,7 +49,7 @@ protected:
 
 private:
     QMutex m_handleLock;
-    int m_handle;
+    pthread_t m_handle;
 };
 
 class ControlReaderThread : public IOThread {
@@ -69,9 +84,22 @@ signals:
 class BulkReaderThread : public IOThread {
     Q_OBJECT
 public:
-    explicit BulkReaderThread(QObject *parent = 0);
+    // bufferSize is rounded up to a power of two, at least twice
+    // the read size
+    explicit BulkReaderThread(QObject *parent = 0,
+                              int bufferSize = READER_BUFFER_SIZE);
     ~BulkReaderThread();
 
+    // Sets the size of the reads from the endpoint. Should be called
+    // while the reader is not running; discards the data in the buffer
+    // if it has to grow.
+    void setReadSize(int readSize);
+    int readSize() const { return m_readSize; }
+    // Adds data that was read from the endpoint by other means. Called
+    // by the reader thread, or while the reader is not running.
+    // Returns false if the thread should exit.
+    bool storeData(const char *data, int size);
+
     // Sets *bufferp and *size to received data
     // Sets to NULL and 0 if no data available
     void getData(char **bufferp, int *size);
@@ -82,59 +110,67 @@ public:
 protected:
     virtual void execute();
 
-private:
-    QWaitCondition m_wait;
-    QMutex m_bufferLock;
+    // Used by the reader thread to fill the buffer: wait for room to
+    // read m_readSize bytes into (0 if the thread should exit),
+    // then make the data read there available to the main thread.
+    char *_acquireSpace();
+    void _publishData(int size);
+
     // The buffer logic:
     //
-    // It's similar to a ring buffer
-    // Received data starts at m_buffer[m_dataStart] for m_dataSize1 bytes.
-    // If m_dataStart > 0, then additional data starts at m_buffer[0]
-    // for m_dataSize2 bytes.
-    // These data ranges must never overlap.
-    //
-    // The main thread will consume data by advancing m_dataStart and
-    // reducing m_dataSize1, until m_dataSize1 is 0. Then, if m_dataSize2 > 0,
-    // it will set m_dataStart to 0, move m_dataSize2 to m_dataSize1,
-    // and reset m_dataSize2 to 0.
-    // (Otherwise, it will wait for the next dataReady signal)
-    //
-    // The reader thread will add data after m_dataStart+m_dataSize1
-    // as long as there is enough space there. If it gets to the end
-    // of the buffer, it will try to add data after m_dataSize2.
-    // If there is not enough space there either, it will wait on m_wait
-    // until releaseData() wakes it.
-    //
-    // Both threads will take m_bufferLock while manipulating the m_data*
-    // members, and will then release the lock while working on their
-    // respective parts of the buffer. Since their activity will always
-    // only grow the buffer space available to the other thread, never
-    // shrink it, they can work in m_buffer at the same time.
+    // It's a single producer, single consumer ring buffer. m_written
+    // counts the bytes the reader thread has added, m_read the bytes
+    // the main thread has released. Both grow forever and wrap around;
+    // the offset in m_buffer is the counter modulo m_bufferSize, which
+    // is a power of two so that the offsets stay continuous when the
+    // counters wrap. Each counter is only written by one thread, so
+    // neither thread takes a lock to hand over data.
     //
-    // m_buffer is allocated for the lifetime of this object.
+    // The reader reads into m_buffer after the last data, as long as
+    // there is room for m_readSize bytes before the end of the
+    // buffer. Otherwise it stores the end of the data in m_wrapOffset
+    // and continues at the start of the buffer, counting the bytes it
+    // skipped as written. The main thread skips them the same way.
     //
     // Some diagrams:
     // The buffer some time after reader and main thread have been active:
     //  |--------+++++++++++++++++-----------------|
     //  |        |               |
-    //  0        dataStart       +dataSize1
+    //  0        m_read          m_written
     // Valid data marked by +
     //
     // The buffer after the reader has gotten to the end of the buffer
     // and wrapped around:
-    //  |++++++--------------+++++++++++++++++-----|
+    //  |++++++--------------+++++++++++++++++.....|
     //  |     |              |               |
-    //  0     dataSize2      dataStart       +dataSize1
-    // Note how the reader left some space at the end unused, because
-    // it was smaller than the minimum read size.
+    //  0     m_written      m_read          m_wrapOffset
+    // Note how the reader left some space at the end unused, marked by
+    // dots, because it was smaller than the minimum read size.
+    //
+    // Each thread only blocks when it runs out of work and asks for a
+    // wakeup first: the main thread sets m_notifyData when getData()
+    // finds no data, and only then the reader emits dataReady. The
+    // reader sets m_readerWaiting when the buffer is full and waits on
+    // m_wait, and only then releaseData() takes m_bufferLock to wake it,
+    // once m_read has reached m_wakeAt.
+    //
+    // m_buffer is only reallocated by setReadSize(), while the reader
+    // is not running.
     //
     char *m_buffer;
-    int m_dataStart; // protected by m_bufferLock
-    int m_dataSize1; // protected by m_bufferLock
-    int m_dataSize2; // protected by m_bufferLock
+    int m_bufferSize;
+    int m_minBufferSize; // as requested by the owner
+    int m_readSize; // may be lowered by a running AioBulkReaderThread
+    int m_wrapOffset; // written by the reader before it wraps m_written
+    QAtomicInt m_written;
+    QAtomicInt m_read;
+    QAtomicInt m_notifyData;
+    QAtomicInt m_readerWaiting;
+    QAtomicInt m_wakeAt;
+    QMutex m_bufferLock; // only used with m_wait
+    QWaitCondition m_wait;
 
-    int _getOffset_locked();
-    bool _markNewData(int offset, int size);
+    friend class ThreadIO_bench;
 signals:
     void dataReady();
 };
@@ -143,20 +179,47 @@ class BulkWriterThread : public IOThread {
     Q_OBJECT
 public:
     explicit BulkWriterThread(QObject *parent = 0);
+    ~BulkWriterThread();
+
+    // Queue a buffer for writing. If ownBuffer is set, the writer
+    // takes ownership of the buffer (allocated with new[]) and frees
+    // it once written; otherwise the caller must keep it valid until
+    // pending() says it has been consumed.
+    void addData(const quint8 *buffer, quint32 dataLen,
+                 bool terminateTransfer = false, bool ownBuffer = false);
+    int pending(); // number of buffers queued or being written
+    void flushData(); // drop queued buffers that are not yet being written
+    bool takeResult(); // false if any write failed since the last call
+    virtual void interrupt();
+    // Sets the maximum size of the writes to the endpoint. Should be
+    // called while the writer is not running.
+    void setWriteSize(quint32 writeSize);
 
-    void setData(const quint8 *buffer, quint32 dataLen, bool terminateTransfer = false);
-    bool resultReady();
-    bool getResult();
+signals:
+    void dataWritten(bool result);
 
 protected:
     virtual void execute();
+    // Called with m_lock held after a buffer has been queued
+    virtual void dataQueued();
 
-private:
-    const quint8 *m_buffer;
-    quint32 m_dataLen;
-    QAtomicInt m_result_ready;
+    struct WriteBuffer {
+        const quint8 *data;
+        quint32 dataLen;
+        bool terminateTransfer;
+        bool ownBuffer;
+    };
+
+    bool writeBuffer(const WriteBuffer &buffer);
+    void releaseBuffer(const WriteBuffer &buffer);
+    void releaseQueued_locked(); // drop all queued buffers as failed
+
+    QMutex m_lock; // protects the members below and is used with m_wait
+    QWaitCondition m_wait;
+    QList<WriteBuffer> m_buffers;
+    int m_inProgress;
     bool m_result;
-    bool m_terminateTransfer;
+    quint32 m_writeMax; // halved by the writer thread if writes fail
 };
 
 
@@ -186,6 +249,7 @@ public:
 
     bool hasData();
     void sendOne();
+    /// Queues an event container, coalescing it with the events already queued
     void addData(const quint8 *buffer, quint32 dataLen);
     void flushData();
     void reset();
@@ -198,11 +262,13 @@ protected:
     virtual void execute();
 
 private:
+    friend class ThreadIO_bench;
+
     QMutex m_lock; // protects m_buffers and used with m_wait
     QWaitCondition m_wait;
 
     QList<QPair<quint8 *,int> > m_buffers;
-    bool m_eventBufferFull;
+    bool m_refreshQueued; // the queue holds nothing but an UnreportedStatus event
 };
 
 #endif
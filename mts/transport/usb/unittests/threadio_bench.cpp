@@ -0,0 +1,653 @@
+#include "threadio_bench.h"
+#include "threadio.h"
+#include "aiothreadio.h"
+#include "mtptypes.h"
+
+#include <QFile>
+#include <QMutexLocker>
+#include <QTemporaryDir>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+
+// The two-region buffer BulkReaderThread used before, with the reads
+// from the endpoint replaced by filling in messages.
+class LockedProducer : public QThread
+{
+public:
+    LockedProducer(int count, int size) : m_count(count), m_size(size)
+    {
+        m_buffer = new char[MAX_DATA_IN_SIZE * 16];
+        m_dataStart = m_dataSize1 = m_dataSize2 = 0;
+    }
+
+    ~LockedProducer()
+    {
+        delete[] m_buffer;
+    }
+
+    void getData(char **bufferp, int *size)
+    {
+        QMutexLocker locker(&m_bufferLock);
+        if (m_dataSize1 == 0 && m_dataSize2 > 0) {
+            m_dataStart = 0;
+            m_dataSize1 = m_dataSize2;
+            m_dataSize2 = 0;
+        }
+        *bufferp = m_dataSize1 > 0 ? m_buffer + m_dataStart : 0;
+        *size = m_dataSize1;
+    }
+
+    void releaseData(int size)
+    {
+        QMutexLocker locker(&m_bufferLock);
+        m_dataStart += size;
+        m_dataSize1 -= size;
+        if (m_dataSize1 == 0 && m_dataSize2 > 0) {
+            m_dataStart = 0;
+            m_dataSize1 = m_dataSize2;
+            m_dataSize2 = 0;
+        }
+        m_wait.wakeAll();
+    }
+
+protected:
+    void run()
+    {
+        for (int i = 0; i < m_count; i++) {
+            m_bufferLock.lock();
+            int offset = getOffset_locked();
+            while (offset < 0) {
+                m_wait.wait(&m_bufferLock);
+                offset = getOffset_locked();
+            }
+            m_bufferLock.unlock();
+
+            memset(m_buffer + offset, i, m_size);
+
+            QMutexLocker locker(&m_bufferLock);
+            if (offset == m_dataStart + m_dataSize1)
+                m_dataSize1 += m_size;
+            else
+                m_dataSize2 += m_size;
+        }
+    }
+
+private:
+    int getOffset_locked()
+    {
+        if (MAX_DATA_IN_SIZE * 16 - (m_dataStart + m_dataSize1) >= MAX_DATA_IN_SIZE)
+            return m_dataStart + m_dataSize1;
+        if (m_dataStart - m_dataSize2 >= MAX_DATA_IN_SIZE)
+            return m_dataSize2;
+        return -1;
+    }
+
+    int m_count;
+    int m_size;
+    QMutex m_bufferLock;
+    QWaitCondition m_wait;
+    char *m_buffer;
+    int m_dataStart;
+    int m_dataSize1;
+    int m_dataSize2;
+};
+
+// BulkReaderThread with the reads from the endpoint replaced by
+// filling in messages. With size 0 the messages get varying sizes
+// and carry a running byte counter.
+class RingProducer : public BulkReaderThread
+{
+public:
+    RingProducer(int count, int size, int bufferSize = READER_BUFFER_SIZE)
+        : BulkReaderThread(0, bufferSize), m_count(count), m_size(size)
+    {
+    }
+
+protected:
+    void execute()
+    {
+        quint8 counter = 0;
+
+        for (int i = 0; i < m_count; i++) {
+            char *slot = _acquireSpace();
+            if (!slot)
+                return;
+
+            int size = m_size;
+            if (!size) {
+                size = 1 + (i * 4099) % MAX_DATA_IN_SIZE;
+                for (int j = 0; j < size; j++)
+                    slot[j] = counter++;
+            } else {
+                memset(slot, i, size);
+            }
+            _publishData(size);
+        }
+    }
+
+private:
+    int m_count;
+    int m_size;
+};
+
+// Processes the data like MTPTransporterUSB does, one message at a time
+template<class Buffer>
+static void consume(Buffer *buffer, qint64 total, int size)
+{
+    while (total > 0) {
+        char *data;
+        int dataLen;
+
+        buffer->getData(&data, &dataLen);
+        if (!dataLen) {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+
+        total -= dataLen;
+        while (dataLen > 0) {
+            int chunkLen = qMin(dataLen, size);
+            buffer->releaseData(chunkLen);
+            dataLen -= chunkLen;
+        }
+    }
+}
+
+void ThreadIO_bench::testRingBufferOrder()
+{
+    const int count = 2000;
+
+    // Two slots, so the reader keeps waiting for the consumer and the
+    // ring wraps around all the time
+    RingProducer producer(count, 0, 2 * MAX_DATA_IN_SIZE);
+    producer.start();
+
+    qint64 total = 0;
+    for (int i = 0; i < count; i++)
+        total += 1 + (i * 4099) % MAX_DATA_IN_SIZE;
+
+    quint8 counter = 0;
+    while (total > 0) {
+        char *data;
+        int dataLen;
+
+        producer.getData(&data, &dataLen);
+        if (!dataLen) {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+
+        // Release in odd pieces to move the read offset around in slots
+        int chunkLen = qMin(dataLen, 1000);
+        for (int j = 0; j < chunkLen; j++)
+            QCOMPARE( (quint8)data[j], counter++ );
+        producer.releaseData(chunkLen);
+        total -= chunkLen;
+    }
+
+    QVERIFY( producer.wait(5000) );
+}
+
+void ThreadIO_bench::testOddReadSize_data()
+{
+    QTest::addColumn<int>("readSize");
+    QTest::addColumn<int>("bufferSize");
+
+    QTest::newRow("1536 B") << 1536 << 0;
+    QTest::newRow("48 KB") << 49152 << 0;
+    QTest::newRow("48 KB, 100 KB buffer") << 49152 << 100000;
+}
+
+// Read sizes from MTP_USB_READ_SIZE are only multiples of the packet
+// size, the buffer offsets must still wrap with the counters
+void ThreadIO_bench::testOddReadSize()
+{
+    QFETCH(int, readSize);
+    QFETCH(int, bufferSize);
+
+    BulkReaderThread reader(0, bufferSize);
+    reader.setReadSize(readSize);
+    QCOMPARE( reader.readSize(), readSize );
+    QVERIFY( reader.m_bufferSize >= 2 * readSize );
+    QVERIFY( reader.m_bufferSize >= bufferSize );
+    QCOMPARE( reader.m_bufferSize & (reader.m_bufferSize - 1), 0 );
+
+    // Start the counters just before they wrap around, so that the
+    // buffer offsets have to stay continuous across it
+    quint32 start = 0u - 3 * quint32(reader.m_bufferSize) / 2;
+    reader.m_written.store(start);
+    reader.m_read.store(start);
+
+    QByteArray chunk(readSize - 7, 0);
+    int count = 2 * reader.m_bufferSize / chunk.size() + 2;
+    quint8 in = 0, out = 0;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < chunk.size(); j++)
+            chunk[j] = in++;
+        QVERIFY( reader.storeData(chunk.constData(), chunk.size()) );
+
+        int left = chunk.size();
+        while (left > 0) {
+            char *data;
+            int dataLen;
+
+            reader.getData(&data, &dataLen);
+            QVERIFY( dataLen > 0 && dataLen <= left );
+            for (int j = 0; j < dataLen; j++)
+                QCOMPARE( (quint8)data[j], out++ );
+            reader.releaseData(dataLen);
+            left -= dataLen;
+        }
+    }
+    QVERIFY( quint32(reader.m_written.load()) < start );
+}
+
+void ThreadIO_bench::testWriterOrder_data()
+{
+    QTest::addColumn<bool>("aio");
+
+    QTest::newRow("blocking") << false;
+    QTest::newRow("aio") << true;
+}
+
+// The writer thread writes the queued buffers in order, each in
+// writes of at most the write size. The datagrams show where the
+// writes and the zero length packet went.
+void ThreadIO_bench::testWriterOrder()
+{
+    QFETCH(bool, aio);
+    int fds[2];
+    QCOMPARE( socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0 );
+
+    QScopedPointer<BulkWriterThread> thread(aio ? new AioBulkWriterThread : new BulkWriterThread);
+    BulkWriterThread &writer = *thread;
+    writer.setFd(fds[0]);
+    writer.setWriteSize(4096);
+    writer.start();
+
+    // Half of the buffers are owned by the writer
+    QByteArray expected;
+    QList<QByteArray> kept;
+    for (int i = 0; i < 50; i++) {
+        int size = 1 + (i * 3001) % 10000;
+        QByteArray data(size, char(i));
+        expected += data;
+        if (i % 2) {
+            quint8 *copy = new quint8[size];
+            memcpy(copy, data.constData(), size);
+            writer.addData(copy, size, false, true);
+        } else {
+            kept.append(data);
+            writer.addData((const quint8 *)kept.last().constData(), size);
+        }
+    }
+    // Ends the transfer with a full packet
+    QByteArray last(2 * PTP_HS_DATA_PKT_SIZE, 'z');
+    expected += last;
+    writer.addData((const quint8 *)last.constData(), last.size(), true);
+
+    QByteArray received;
+    while (received.size() < expected.size()) {
+        char buffer[8192];
+        ssize_t len = recv(fds[1], buffer, sizeof buffer, 0);
+        QVERIFY( len > 0 && len <= 4096 );
+        received.append(buffer, len);
+    }
+    QVERIFY( received == expected );
+    char zero;
+    QCOMPARE( recv(fds[1], &zero, sizeof zero, 0), (ssize_t)0 );
+    QTRY_COMPARE( writer.pending(), 0 );
+    QVERIFY( writer.takeResult() );
+
+    writer.exitThread();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// A failed write is reported by the next takeResult() only
+void ThreadIO_bench::testWriterResult()
+{
+    static const quint8 data[100] = { 0 };
+    int fds[2];
+    QCOMPARE( pipe(fds), 0 );
+
+    // Writes to the read end fail
+    BulkWriterThread writer;
+    writer.setFd(fds[0]);
+    writer.start();
+    writer.addData(data, sizeof data);
+    writer.addData(data, sizeof data);
+    QTRY_COMPARE( writer.pending(), 0 );
+    QVERIFY( !writer.takeResult() );
+    QVERIFY( writer.takeResult() );
+    writer.exitThread();
+
+    writer.setFd(fds[1]);
+    writer.start();
+    writer.addData(data, sizeof data);
+    QTRY_COMPARE( writer.pending(), 0 );
+    QVERIFY( writer.takeResult() );
+    char buffer[sizeof data];
+    QCOMPARE( read(fds[0], buffer, sizeof buffer), (ssize_t)sizeof data );
+
+    writer.exitThread();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Like MTPTransporterUSB::reset(), stops the writer while it is
+// blocked in a write with more buffers queued
+void ThreadIO_bench::testWriterReset()
+{
+    static char data[MAX_DATA_OUT_SIZE];
+    int fds[2];
+    QCOMPARE( pipe(fds), 0 );
+
+    BulkWriterThread writer;
+    writer.setFd(fds[1]);
+    writer.start();
+
+    // The first buffer fills the pipe, the second one blocks
+    for (int i = 0; i < 4; i++) {
+        quint8 *copy = new quint8[sizeof data];
+        writer.addData(copy, sizeof data, false, true);
+    }
+    QTRY_COMPARE( writer.pending(), 3 );
+
+    writer.exitThread();
+    QCOMPARE( writer.pending(), 0 );
+    QVERIFY( !writer.takeResult() );
+
+    int left = sizeof data;
+    while (left > 0) {
+        ssize_t len = read(fds[0], data, left);
+        QVERIFY( len > 0 );
+        left -= len;
+    }
+
+    // Restarted, it writes what is queued next
+    writer.start();
+    writer.addData((const quint8 *)data, 100);
+    QTRY_COMPARE( writer.pending(), 0 );
+    QVERIFY( writer.takeResult() );
+    QCOMPARE( read(fds[0], data, sizeof data), (ssize_t)100 );
+
+    writer.exitThread();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Writes byte counter values to a pipe in varying sizes
+class PipeProducer : public QThread
+{
+public:
+    PipeProducer(int fd, qint64 total) : m_fd(fd), m_total(total)
+    {
+    }
+
+protected:
+    void run()
+    {
+        quint8 counter = 0;
+        char buffer[MAX_DATA_IN_SIZE];
+
+        for (int i = 0; m_total > 0; i++) {
+            int size = qMin<qint64>(1 + (i * 4099) % MAX_DATA_IN_SIZE, m_total);
+            for (int j = 0; j < size; j++)
+                buffer[j] = counter++;
+            for (int done = 0; done < size; ) {
+                ssize_t len = write(m_fd, buffer + done, size - done);
+                if (len <= 0)
+                    return;
+                done += len;
+            }
+            m_total -= size;
+        }
+        // AIO on a pipe runs inside io_submit(), so the reader sits in
+        // it until the end of the stream arrives
+        close(m_fd);
+    }
+
+private:
+    int m_fd;
+    qint64 m_total;
+};
+
+// The AIO reads complete in the order they were queued, so the data
+// comes out in stream order
+void ThreadIO_bench::testAioReaderOrder()
+{
+    const qint64 total = 8 * 1024 * 1024;
+    int fds[2];
+    QCOMPARE( pipe(fds), 0 );
+
+    AioBulkReaderThread reader(0, 4 * MAX_DATA_IN_SIZE);
+    reader.setFd(fds[0]);
+    reader.start();
+    PipeProducer producer(fds[1], total);
+    producer.start();
+
+    quint8 counter = 0;
+    qint64 left = total;
+    while (left > 0) {
+        char *data;
+        int dataLen;
+
+        reader.getData(&data, &dataLen);
+        if (!dataLen) {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+        for (int j = 0; j < dataLen; j++)
+            QCOMPARE( (quint8)data[j], counter++ );
+        reader.releaseData(dataLen);
+        left -= dataLen;
+    }
+
+    QVERIFY( producer.wait(5000) );
+    reader.exitThread();
+    close(fds[0]);
+}
+
+// inotify descriptors support read() but not AIO, so the reader has
+// to probe down to the smallest read size and then fall back
+void ThreadIO_bench::testAioReaderFallback()
+{
+    QTemporaryDir dir;
+    QVERIFY( dir.isValid() );
+    int fd = inotify_init1(IN_CLOEXEC);
+    QVERIFY( fd != -1 );
+    QVERIFY( inotify_add_watch(fd, QFile::encodeName(dir.path()).constData(), IN_CREATE) != -1 );
+
+    AioBulkReaderThread reader;
+    reader.setReadSize(4 * MAX_DATA_IN_SIZE);
+    reader.setProbeReadSize(true);
+    reader.setFd(fd);
+    reader.start();
+    QFile file(dir.path() + "/created");
+    QVERIFY( file.open(QIODevice::WriteOnly) );
+
+    char *data = 0;
+    int dataLen = 0;
+    QTRY_VERIFY( (reader.getData(&data, &dataLen), dataLen > 0) );
+    QVERIFY( dataLen >= (int)sizeof(struct inotify_event) );
+    QCOMPARE( QByteArray(((struct inotify_event *)data)->name), QByteArray("created") );
+    QCOMPARE( reader.readSize(), MAX_DATA_IN_SIZE );
+    reader.releaseData(dataLen);
+
+    reader.exitThread();
+    close(fd);
+}
+
+// When io_submit() takes only some of the requests, the buffers of the
+// rest fail and the writer goes on with the next buffers
+void ThreadIO_bench::testAioWriterPartialSubmit()
+{
+    static const quint8 a[100] = { 'a' }, b[100] = { 'b' }, d[100] = { 'd' }, e[100] = { 'e' };
+    // The kernel refuses the request for a buffer it can't access
+    const quint8 *bad = (const quint8 *)(quintptr)-4096;
+    int fds[2];
+    QCOMPARE( socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0 );
+
+    // Queued first, so that they are all submitted at once
+    AioBulkWriterThread writer;
+    writer.setFd(fds[0]);
+    writer.addData(a, sizeof a);
+    writer.addData(b, sizeof b);
+    writer.addData(bad, 100);
+    writer.addData(d, sizeof d);
+    writer.start();
+    QTRY_COMPARE( writer.pending(), 0 );
+    QVERIFY( !writer.takeResult() );
+
+    writer.addData(e, sizeof e);
+    QTRY_COMPARE( writer.pending(), 0 );
+    QVERIFY( writer.takeResult() );
+
+    const quint8 *expected[] = { a, b, e };
+    for (int i = 0; i < 3; i++) {
+        quint8 buffer[200];
+        QCOMPARE( recv(fds[1], buffer, sizeof buffer, MSG_DONTWAIT), (ssize_t)100 );
+        QCOMPARE( buffer[0], expected[i][0] );
+    }
+    char extra;
+    QCOMPARE( recv(fds[1], &extra, sizeof extra, MSG_DONTWAIT), (ssize_t)-1 );
+
+    writer.exitThread();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// io_submit() fails with EINVAL on descriptors without AIO support,
+// like eventfds, and the queued buffers go out with blocking writes
+void ThreadIO_bench::testAioWriterFallback()
+{
+    static const quint64 values[] = { 1, 2, 3 };
+    int fd = eventfd(0, EFD_CLOEXEC);
+    QVERIFY( fd != -1 );
+
+    AioBulkWriterThread writer;
+    writer.setFd(fd);
+    for (int i = 0; i < 3; i++)
+        writer.addData((const quint8 *)&values[i], sizeof values[i]);
+    writer.start();
+    QTRY_COMPARE( writer.pending(), 0 );
+    QVERIFY( writer.takeResult() );
+
+    writer.addData((const quint8 *)&values[2], sizeof values[2]);
+    QTRY_COMPARE( writer.pending(), 0 );
+    QVERIFY( writer.takeResult() );
+
+    eventfd_t sum = 0;
+    QCOMPARE( eventfd_read(fd, &sum), 0 );
+    QCOMPARE( sum, (eventfd_t)9 );
+
+    writer.exitThread();
+    close(fd);
+}
+
+static void addEvent(InterruptWriterThread &writer, quint16 code,
+                     quint32 param1, quint32 param2 = 0)
+{
+    quint32 data[5];
+    quint32 length = MTP_HEADER_SIZE + 2 * sizeof(quint32);
+    quint16 type = MTP_CONTAINER_TYPE_EVENT;
+
+    data[0] = htole32(length);
+    data[1] = htole32(type | code << 16);
+    data[2] = htole32(MTP_NO_TRANSACTION_ID);
+    data[3] = htole32(param1);
+    data[4] = htole32(param2);
+    writer.addData((const quint8 *)data, length);
+}
+
+quint16 ThreadIO_bench::queuedEvent(InterruptWriterThread &writer, int index)
+{
+    quint16 code;
+    memcpy(&code, writer.m_buffers.at(index).first + 6, sizeof code);
+    return le16toh(code);
+}
+
+void ThreadIO_bench::testEventCoalescing()
+{
+    InterruptWriterThread writer;
+
+    // Repeated changes to the same object or storage
+    addEvent(writer, MTP_EV_ObjectInfoChanged, 5);
+    addEvent(writer, MTP_EV_ObjectInfoChanged, 5);
+    addEvent(writer, MTP_EV_ObjectPropChanged, 5, MTP_OBJ_PROP_Obj_File_Name);
+    addEvent(writer, MTP_EV_ObjectPropChanged, 5, MTP_OBJ_PROP_Obj_File_Name);
+    addEvent(writer, MTP_EV_ObjectPropChanged, 5, MTP_OBJ_PROP_Date_Modified);
+    addEvent(writer, MTP_EV_StorageInfoChanged, 0x10001);
+    addEvent(writer, MTP_EV_StorageInfoChanged, 0x10001);
+    QCOMPARE( writer.m_buffers.count(), 4 );
+
+    // An object removed before the host heard of it
+    addEvent(writer, MTP_EV_ObjectAdded, 9);
+    addEvent(writer, MTP_EV_ObjectInfoChanged, 9);
+    addEvent(writer, MTP_EV_ObjectRemoved, 9);
+    QCOMPARE( writer.m_buffers.count(), 4 );
+
+    // Changes to an object that is removed
+    addEvent(writer, MTP_EV_ObjectRemoved, 5);
+    QCOMPARE( writer.m_buffers.count(), 2 );
+    QCOMPARE( queuedEvent(writer, 0), (quint16)MTP_EV_StorageInfoChanged );
+    QCOMPARE( queuedEvent(writer, 1), (quint16)MTP_EV_ObjectRemoved );
+
+    // A storm that does not fit in the queue
+    for (int i = 0; i < 1000; i++)
+        addEvent(writer, MTP_EV_ObjectAdded, 100 + i);
+    QCOMPARE( writer.m_buffers.count(), 1 );
+    QCOMPARE( queuedEvent(writer, 0), (quint16)MTP_EV_UnreportedStatus );
+
+    writer.flushData();
+    addEvent(writer, MTP_EV_ObjectAdded, 1);
+    QCOMPARE( writer.m_buffers.count(), 1 );
+    QCOMPARE( queuedEvent(writer, 0), (quint16)MTP_EV_ObjectAdded );
+}
+
+void ThreadIO_bench::benchmarkLockedBuffer_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<int>("size");
+
+    QTest::newRow("64 B") << 100000 << 64;
+    QTest::newRow("512 B") << 100000 << 512;
+    QTest::newRow("16 KB") << 20000 << MAX_DATA_IN_SIZE;
+}
+
+void ThreadIO_bench::benchmarkLockedBuffer()
+{
+    QFETCH(int, count);
+    QFETCH(int, size);
+
+    QBENCHMARK {
+        LockedProducer producer(count, size);
+        producer.start();
+        consume(&producer, qint64(count) * size, size);
+        producer.wait();
+    }
+}
+
+void ThreadIO_bench::benchmarkRingBuffer_data()
+{
+    benchmarkLockedBuffer_data();
+}
+
+void ThreadIO_bench::benchmarkRingBuffer()
+{
+    QFETCH(int, count);
+    QFETCH(int, size);
+
+    QBENCHMARK {
+        RingProducer producer(count, size);
+        producer.start();
+        consume(&producer, qint64(count) * size, size);
+        producer.wait();
+    }
+}
+
+QTEST_MAIN(ThreadIO_bench);
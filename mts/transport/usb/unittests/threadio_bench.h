@@ -0,0 +1,42 @@
+#ifndef THREADIO_BENCH_H
+#define THREADIO_BENCH_H
+
+#include <QtTest/QtTest>
+#include <QObject>
+
+class InterruptWriterThread;
+
+// Compares the lock-free BulkReaderThread buffer with the mutex
+// protected buffer it replaced, handing over many small messages from
+// a producer thread to the main thread. Also checks the handover
+// with read sizes that are not a power of two, the queue of the bulk
+// writer, the AIO reader and writer on pipes, sockets and descriptors
+// without AIO support, and the coalescing of queued events.
+class ThreadIO_bench : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void testRingBufferOrder();
+    void testOddReadSize_data();
+    void testOddReadSize();
+    void testWriterOrder_data();
+    void testWriterOrder();
+    void testWriterResult();
+    void testWriterReset();
+    void testAioReaderOrder();
+    void testAioReaderFallback();
+    void testAioWriterPartialSubmit();
+    void testAioWriterFallback();
+    void testEventCoalescing();
+    void benchmarkLockedBuffer_data();
+    void benchmarkLockedBuffer();
+    void benchmarkRingBuffer_data();
+    void benchmarkRingBuffer();
+
+private:
+    // The queue of InterruptWriterThread is only visible to this class
+    static quint16 queuedEvent(InterruptWriterThread &writer, int index);
+};
+
+#endif
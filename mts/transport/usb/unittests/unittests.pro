@@ -0,0 +1,34 @@
+include(../../../common.pri)
+
+QT += testlib
+QT -= gui
+CONFIG += warn_off debug_and_release
+
+TEMPLATE = app
+TARGET = threadio-bench
+DEFINES += UT_ON
+
+DEPENDPATH += . \
+              .. \
+              ../../../common
+
+INCLUDEPATH += . \
+               .. \
+               ../../../common
+
+# Input
+HEADERS += threadio_bench.h \
+           ../threadio.h \
+           ../aiothreadio.h \
+           ../../../common/mtpstats.h
+
+SOURCES += threadio_bench.cpp \
+           ../threadio.cpp \
+           ../aiothreadio.cpp \
+           ../../../common/mtpstats.cpp
+
+target.path = /opt/tests/buteo-mtp/
+INSTALLS += target
+
+#clean
+QMAKE_CLEAN += $(TARGET)
@@ -0,0 +1,443 @@
+// Loopback MTP initiator for benchmarking the responder without USB
+// hardware. The responder runs in a child process with the loopback
+// transporter, and this process plays the host and the FunctionFS
+// driver on the other end of the sockets. See MTPTransporterLoopback
+// for how the endpoints are emulated.
+
+#include <QCoreApplication>
+#include <QByteArray>
+#include <QVector>
+#include <QtEndian>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/usb/functionfs.h>
+
+#include "mts.h"
+#include "mtptypes.h"
+#include "threadio.h"
+#include "ptp.h"
+
+using namespace meegomtp1dot0;
+
+// Time allowed for the responder to start up and to answer
+static const int RESPONSE_TIMEOUT_MS = 60 * 1000;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void responderSignalHandler(int /*signum*/)
+{
+    Mts::destroyInstance();
+    _exit(0);
+}
+
+// Runs the responder over the device ends of the sockets; never returns
+static void runResponder(const int fds[4], int argc, char **argv)
+{
+    QByteArray list = QByteArray::number(fds[0]);
+    for (int i = 1; i < 4; i++)
+        list += ',' + QByteArray::number(fds[i]);
+    setenv("MTP_LOOPBACK_FDS", list.constData(), 1);
+
+    QCoreApplication app(argc, argv);
+    signal(SIGTERM, &responderSignalHandler);
+    signal(SIGINT, &responderSignalHandler);
+
+    if (Mts::getInstance()->activate())
+        app.exec();
+    Mts::destroyInstance();
+    _exit(1);
+}
+
+class Initiator
+{
+public:
+    Initiator(int ctrl, int in, int out, int intr)
+        : m_ctrl(ctrl), m_in(in), m_out(out), m_intr(intr),
+          m_chunkSize(MAX_DATA_IN_SIZE), m_transactionId(0), m_events(0),
+          m_buffer(MAX_TRANSFER_SIZE + 1, 0)
+    {
+        // Messages to the device must not be larger than its reads
+        int readSize = qgetenv("MTP_USB_READ_SIZE").toInt();
+        if (readSize >= PTP_HS_DATA_PKT_SIZE)
+            m_chunkSize = qMin(readSize - readSize % PTP_HS_DATA_PKT_SIZE, MAX_TRANSFER_SIZE);
+        m_filler = QByteArray(m_chunkSize, 'x');
+    }
+
+    // Consumes the descriptors and strings, then binds and enables the
+    // function like the host does when it configures the device
+    bool enable()
+    {
+        for (int i = 0; i < 2; i++) {
+            if (receive(m_ctrl, m_buffer.data(), m_buffer.size()) < 0) {
+                fprintf(stderr, "no descriptors from the responder\n");
+                return false;
+            }
+        }
+        return sendEvent(FUNCTIONFS_BIND) && sendEvent(FUNCTIONFS_ENABLE);
+    }
+
+    // Runs a transaction. Data is sent if dataOut is given, with
+    // outLen bytes of filler if dataOut is empty. Received data is
+    // stored in dataIn if given and counted in inLen.
+    quint16 transaction(quint16 code, const QVector<quint32> &params,
+                        const QByteArray *dataOut = 0, quint64 outLen = 0,
+                        QByteArray *dataIn = 0, quint64 *inLen = 0,
+                        QVector<quint32> *respParams = 0)
+    {
+        quint32 transactionId = ++m_transactionId;
+
+        QByteArray command = header(12 + 4 * params.count(),
+                                    MTP_CONTAINER_TYPE_COMMAND, code, transactionId);
+        for (int i = 0; i < params.count(); i++)
+            append32(command, params[i]);
+        if (!send(command.constData(), command.size()))
+            return 0;
+
+        if (dataOut && !sendData(code, transactionId, *dataOut,
+                                 dataOut->isEmpty() ? outLen : dataOut->size()))
+            return 0;
+
+        for (;;) {
+            bool first = true;
+            quint64 received = 0;
+            quint16 type = 0, respCode = 0;
+            int len;
+
+            // A transfer ends with a message that isn't a multiple
+            // of the packet size, like a short packet would on USB
+            do {
+                len = receive(m_in, m_buffer.data(), m_buffer.size());
+                if (len < 0)
+                    return 0;
+                const char *payload = m_buffer.constData();
+                int payloadLen = len;
+                if (first && len) {
+                    if (len < 12) {
+                        fprintf(stderr, "short container header\n");
+                        return 0;
+                    }
+                    type = get16(payload + 4);
+                    respCode = get16(payload + 6);
+                    if (respParams && type == MTP_CONTAINER_TYPE_RESPONSE) {
+                        respParams->clear();
+                        for (int i = 12; i + 4 <= len; i += 4)
+                            respParams->append(get32(payload + i));
+                    }
+                    payload += 12;
+                    payloadLen -= 12;
+                    first = false;
+                }
+                if (type == MTP_CONTAINER_TYPE_DATA) {
+                    received += payloadLen;
+                    if (dataIn)
+                        dataIn->append(payload, payloadLen);
+                }
+            } while (len && len % PTP_HS_DATA_PKT_SIZE == 0);
+
+            if (first)
+                continue; // a zero length packet between transfers
+            if (type == MTP_CONTAINER_TYPE_DATA) {
+                if (inLen)
+                    *inLen = received;
+                continue;
+            }
+            return respCode;
+        }
+    }
+
+    int events() const { return m_events; }
+
+private:
+    QByteArray header(quint32 length, quint16 type, quint16 code, quint32 transactionId)
+    {
+        QByteArray container;
+        append32(container, length);
+        append16(container, type);
+        append16(container, code);
+        append32(container, transactionId);
+        return container;
+    }
+
+    bool sendData(quint16 code, quint32 transactionId, const QByteArray &data, quint64 len)
+    {
+        quint64 total = len + MTP_HEADER_SIZE;
+        QByteArray chunk = header(total > 0xFFFFFFFFULL ? 0xFFFFFFFF : total,
+                                  MTP_CONTAINER_TYPE_DATA, code, transactionId);
+        quint64 offset = 0;
+
+        for (;;) {
+            int fill = qMin(quint64(m_chunkSize - chunk.size()), len - offset);
+            if (data.isEmpty())
+                chunk.append(m_filler.constData(), fill);
+            else
+                chunk.append(data.constData() + offset, fill);
+            offset += fill;
+            if (!send(chunk.constData(), chunk.size()))
+                return false;
+            if (offset == len)
+                break;
+            chunk.clear();
+        }
+        // Terminate the transfer if it ended on a packet boundary
+        return total % PTP_HS_DATA_PKT_SIZE || send(0, 0);
+    }
+
+    bool sendEvent(int type)
+    {
+        struct usb_functionfs_event event;
+        memset(&event, 0, sizeof event);
+        event.type = type;
+        return write(m_ctrl, &event, sizeof event) == sizeof event;
+    }
+
+    bool send(const char *data, int len)
+    {
+        if (write(m_out, data, len) == len)
+            return true;
+        fprintf(stderr, "write to OUT endpoint failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Reads a message from fd, draining the interrupt endpoint while
+    // waiting. Returns -1 on timeout or error.
+    int receive(int fd, char *buffer, int size)
+    {
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { m_intr, POLLIN, 0 } };
+
+        for (;;) {
+            int rc = poll(fds, 2, RESPONSE_TIMEOUT_MS);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc <= 0) {
+                fprintf(stderr, "no response from the responder\n");
+                return -1;
+            }
+            if (fds[1].revents & POLLIN) {
+                char event[64];
+                if (read(m_intr, event, sizeof event) > 0)
+                    m_events++;
+            }
+            if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                int len = read(fd, buffer, size);
+                if (len < 0)
+                    fprintf(stderr, "read failed: %s\n", strerror(errno));
+                return len;
+            }
+        }
+    }
+
+    static quint16 get16(const char *p) { return qFromLittleEndian<quint16>((const uchar *)p); }
+    static quint32 get32(const char *p) { return qFromLittleEndian<quint32>((const uchar *)p); }
+    static void append16(QByteArray &a, quint16 v) { v = qToLittleEndian(v); a.append((const char *)&v, 2); }
+    static void append32(QByteArray &a, quint32 v) { v = qToLittleEndian(v); a.append((const char *)&v, 4); }
+
+    int m_ctrl, m_in, m_out, m_intr;
+    int m_chunkSize;
+    quint32 m_transactionId;
+    int m_events;
+    QByteArray m_buffer;
+    QByteArray m_filler;
+};
+
+// An MTP string: length including the terminator, then UTF-16LE
+static void appendString(QByteArray &a, const QString &s)
+{
+    if (s.isEmpty()) {
+        a.append(char(0));
+        return;
+    }
+    a.append(char(s.length() + 1));
+    for (int i = 0; i <= s.length(); i++) {
+        quint16 c = qToLittleEndian<quint16>(i < s.length() ? s.at(i).unicode() : 0);
+        a.append((const char *)&c, 2);
+    }
+}
+
+static QByteArray objectInfo(quint32 storageId, quint64 size, const QString &name)
+{
+    QByteArray info;
+    quint32 v32;
+    quint16 v16;
+#define PUT32(x) (v32 = qToLittleEndian<quint32>(x), info.append((const char *)&v32, 4))
+#define PUT16(x) (v16 = qToLittleEndian<quint16>(x), info.append((const char *)&v16, 2))
+    PUT32(storageId);
+    PUT16(MTP_OBF_FORMAT_Undefined);
+    PUT16(0);                                   // ProtectionStatus
+    PUT32(size > 0xFFFFFFFFULL ? 0xFFFFFFFF : size);
+    PUT16(MTP_OBF_FORMAT_Undefined);            // ThumbFormat
+    for (int i = 0; i < 6; i++)
+        PUT32(0);                               // Thumb and image sizes
+    PUT32(0xFFFFFFFF);                          // ParentObject: root
+    PUT16(0);                                   // AssociationType
+    PUT32(0);                                   // AssociationDesc
+    PUT32(0);                                   // SequenceNumber
+#undef PUT32
+#undef PUT16
+    appendString(info, name);
+    appendString(info, QString());              // DateCreated
+    appendString(info, QString());              // DateModified
+    appendString(info, QString());              // Keywords
+    return info;
+}
+
+static void report(const char *what, quint64 bytes, double seconds)
+{
+    printf("%s: %llu bytes in %.3f s, %.1f MB/s\n", what, (unsigned long long)bytes,
+           seconds, seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0);
+}
+
+static int usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-l iterations] [-s megabytes] [-o handle] [-k]\n"
+            "  -l  GetDeviceInfo round trips to time (default 1000)\n"
+            "  -s  size of the object sent and read back (default 64, below 4096)\n"
+            "  -o  also read back an existing object, e.g. a multi-GB file\n"
+            "  -k  keep the object that was sent\n", name);
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 1000;
+    quint64 sendSize = 64ULL << 20;
+    quint32 getHandle = 0;
+    bool keep = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:s:o:k")) != -1) {
+        switch (opt) {
+        case 'l': iterations = atoi(optarg); break;
+        case 's': sendSize = strtoull(optarg, 0, 0) << 20; break;
+        case 'o': getHandle = strtoul(optarg, 0, 0); break;
+        case 'k': keep = true; break;
+        default: return usage(argv[0]);
+        }
+    }
+    if (sendSize >= (4096ULL << 20))
+        return usage(argv[0]);
+
+    // Endpoint sockets: ep0, ep1 (IN), ep2 (OUT), ep3 (interrupt)
+    int host[4], device[4];
+    for (int i = 0; i < 4; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+            perror("socketpair");
+            return 1;
+        }
+        host[i] = pair[0];
+        device[i] = pair[1];
+    }
+
+    pid_t responder = fork();
+    if (responder == -1) {
+        perror("fork");
+        return 1;
+    }
+    if (responder == 0) {
+        for (int i = 0; i < 4; i++)
+            close(host[i]);
+        runResponder(device, argc, argv);
+    }
+    for (int i = 0; i < 4; i++)
+        close(device[i]);
+
+    Initiator initiator(host[0], host[1], host[2], host[3]);
+    bool ok = initiator.enable();
+    quint16 code = MTP_RESP_OK;
+    QVector<quint32> params, resp;
+
+    if (ok)
+        code = initiator.transaction(MTP_OP_OpenSession, QVector<quint32>() << 1);
+    ok = ok && code == MTP_RESP_OK;
+
+    // Command latency: round trips with a small data phase
+    if (ok && iterations > 0) {
+        double total = 0, worst = 0;
+        for (int i = 0; ok && i < iterations; i++) {
+            QByteArray info;
+            double start = now();
+            ok = initiator.transaction(MTP_OP_GetDeviceInfo, params, 0, 0, &info) == MTP_RESP_OK;
+            double elapsed = now() - start;
+            total += elapsed;
+            worst = qMax(worst, elapsed);
+        }
+        if (ok)
+            printf("GetDeviceInfo: %d round trips, average %.1f us, worst %.1f us\n",
+                   iterations, total / iterations * 1e6, worst * 1e6);
+    }
+
+    QByteArray storages;
+    quint32 storageId = 0;
+    if (ok)
+        ok = initiator.transaction(MTP_OP_GetStorageIDs, params, 0, 0, &storages) == MTP_RESP_OK;
+    if (ok && storages.size() >= 8)
+        storageId = qFromLittleEndian<quint32>((const uchar *)storages.constData() + 4);
+    ok = ok && storageId;
+
+    // SendObject stream of filler data, then GetObject of the same object
+    quint32 sentHandle = 0;
+    if (ok && sendSize) {
+        QByteArray info = objectInfo(storageId, sendSize,
+                                     QString("loopback-%1.bin").arg(getpid()));
+        code = initiator.transaction(MTP_OP_SendObjectInfo,
+                                     QVector<quint32>() << storageId << 0xFFFFFFFF,
+                                     &info, 0, 0, 0, &resp);
+        ok = code == MTP_RESP_OK && resp.count() >= 3;
+        if (ok) {
+            sentHandle = resp[2];
+            QByteArray filler;
+            double start = now();
+            code = initiator.transaction(MTP_OP_SendObject, params, &filler, sendSize);
+            ok = code == MTP_RESP_OK;
+            if (ok)
+                report("SendObject", sendSize, now() - start);
+        }
+        if (ok) {
+            quint64 received = 0;
+            double start = now();
+            code = initiator.transaction(MTP_OP_GetObject, QVector<quint32>() << sentHandle,
+                                         0, 0, 0, &received);
+            ok = code == MTP_RESP_OK && received == sendSize;
+            if (ok)
+                report("GetObject", received, now() - start);
+        }
+    }
+
+    if (ok && getHandle) {
+        quint64 received = 0;
+        double start = now();
+        code = initiator.transaction(MTP_OP_GetObject, QVector<quint32>() << getHandle,
+                                     0, 0, 0, &received);
+        ok = code == MTP_RESP_OK;
+        if (ok)
+            report("GetObject (existing)", received, now() - start);
+    }
+
+    if (ok && sentHandle && !keep)
+        initiator.transaction(MTP_OP_DeleteObject, QVector<quint32>() << sentHandle);
+    if (ok)
+        initiator.transaction(MTP_OP_CloseSession, params);
+
+    printf("events received: %d\n", initiator.events());
+    if (!ok)
+        fprintf(stderr, "failed, last response 0x%04x\n", code);
+
+    kill(responder, SIGTERM);
+    waitpid(responder, 0, 0);
+    return ok ? 0 : 1;
+}
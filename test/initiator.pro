@@ -0,0 +1,17 @@
+TEMPLATE = app
+TARGET = mtp_initiator
+DEPENDPATH += .
+INCLUDEPATH += . ../mts ../mts/common ../mts/transport/usb
+LIBS += -L../mts -lmeegomtp -lssu
+CONFIG += debug_and_release
+QT -= gui
+# Input
+
+SOURCES += initiator.cpp
+
+#install
+target.path += /opt/tests/buteo-mtp/
+INSTALLS += target
+
+#clean
+QMAKE_CLEAN += $(TARGET)